@@ -13,15 +13,26 @@
 
 /*
  * Abstract socket utility, handles adding SSL if necessary.
+ *
+ * Once connected the socket doesn't block. What's sent is queued and written
+ * as the socket takes it, so poll for ab_events and call ab_flush when it's
+ * writable. ab_recv fails with EAGAIN when there's nothing to read yet.
  */
 
 struct absocket {
 	int basefd;
 	bool use_ssl;
+	char *host, *port; // For SNI and for finding the TLS session to resume
+	char *out; // Queued to be written, from out_start to out_end
+	size_t out_start, out_end, out_size;
+	int error; // Of the write that failed, once the connection is done for
 #ifdef USE_OPENSSL
 	SSL *ssl;
-	SSL_CTX *ctx;
 	X509 *cert;
+	bool resumed; // The TLS session was resumed
+	long handshake_ms;
+	size_t retry; // SSL_write has to be given this much again
+	bool read_wants_write; // SSL_read can't go on until the socket's writable
 #endif
 };
 typedef struct absocket absocket_t;
@@ -30,7 +41,14 @@ void abs_init();
 absocket_t *absocket_new(const struct uri *uri, bool use_ssl);
 void absocket_free(absocket_t *socket);
 ssize_t ab_recv(absocket_t *socket, void *buffer, size_t len);
-ssize_t ab_send(absocket_t *socket, void *buffer, size_t len);
+/* Queues buffer and writes what it can. Returns -1 if the socket failed. */
+ssize_t ab_send(absocket_t *socket, const void *buffer, size_t len);
+/* Writes what it can of the queue. Returns how much is left, or -1. */
+ssize_t ab_flush(absocket_t *socket);
+/* The poll events to wait for */
+short ab_events(absocket_t *socket);
+/* True if there's data read off the socket that ab_recv hasn't returned */
+bool ab_pending(absocket_t *socket);
 #ifdef USE_OPENSSL
 bool ab_enable_ssl(absocket_t *socket);
 #endif
@@ -0,0 +1,62 @@
+#ifndef _BODY_CACHE_H
+#define _BODY_CACHE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A decoded message part. Bodies are refcounted and immutable, so the worker
+ * and the UI can share one, and the cache can let go of one the UI is still
+ * showing.
+ */
+struct body {
+	atomic_int refs;
+	size_t size;
+	uint8_t *data;
+};
+
+/* Takes ownership of data, which must have been malloc'd */
+struct body *body_new(uint8_t *data, size_t size);
+struct body *body_ref(struct body *body);
+void body_unref(struct body *body);
+
+/*
+ * The bodies the worker has fetched, by mailbox, UID and part, holding at most
+ * budget bytes of them. The least recently used are evicted first, and the
+ * evicted callback is told so the message can be published without it.
+ */
+struct body_cache;
+
+struct body_cache_stats {
+	size_t hits, misses, evictions;
+	size_t entries, bytes;
+};
+
+typedef void (*body_evicted_t)(void *data, const char *mailbox,
+		uint32_t uid, uint32_t part);
+
+struct body_cache *body_cache_create(size_t budget);
+void body_cache_free(struct body_cache *cache);
+void body_cache_set_budget(struct body_cache *cache, size_t budget);
+void body_cache_on_evict(struct body_cache *cache,
+		body_evicted_t evicted, void *data);
+
+/*
+ * Adds a body, taking a reference to it. The body just added is never evicted
+ * to make room, even if it is bigger than the budget on its own.
+ */
+void body_cache_put(struct body_cache *cache, const char *mailbox,
+		uint32_t uid, uint32_t part, struct body *body);
+/* Returns a new reference to a body and marks it used, counting a hit or miss */
+struct body *body_cache_get(struct body_cache *cache, const char *mailbox,
+		uint32_t uid, uint32_t part);
+/* As body_cache_get, but doesn't count as a use. Does not take a reference. */
+struct body *body_cache_peek(struct body_cache *cache, const char *mailbox,
+		uint32_t uid, uint32_t part);
+/* Drops every body in a mailbox, e.g. when its UIDVALIDITY changed */
+void body_cache_drop_mailbox(struct body_cache *cache, const char *mailbox);
+const struct body_cache_stats *body_cache_stats(struct body_cache *cache);
+
+#endif
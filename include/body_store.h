@@ -0,0 +1,58 @@
+#ifndef _BODY_STORE_H
+#define _BODY_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "body_cache.h"
+
+/*
+ * The bodies the worker has fetched, kept on disk so that they survive a
+ * restart and can be read offline.
+ *
+ * Bodies are compressed with zlib and stored once each under a hash of their
+ * contents, so a part that's in several mailboxes (or several times in one) is
+ * only stored once. An index journal maps each mailbox, UIDVALIDITY, UID and
+ * part to a body. The store holds at most budget bytes of compressed bodies,
+ * evicting the least recently used first, and the journal is compacted when
+ * most of it no longer applies.
+ */
+struct body_store;
+
+struct body_store_stats {
+	size_t entries, objects;
+	size_t bytes; // Compressed, on disk
+	size_t journal; // Records in the journal
+};
+
+/* path is the directory to keep the store in, which is created if need be */
+struct body_store *body_store_open(const char *path, size_t budget);
+void body_store_close(struct body_store *store);
+void body_store_set_budget(struct body_store *store, size_t budget);
+
+/* Stores a copy of data. Returns false if it couldn't be written. */
+bool body_store_put(struct body_store *store, const char *mailbox,
+		uint32_t uidvalidity, uint32_t uid, uint32_t part,
+		const uint8_t *data, size_t size);
+/* Reads a body back and marks it used, or returns NULL if it isn't stored */
+struct body *body_store_get(struct body_store *store, const char *mailbox,
+		uint32_t uidvalidity, uint32_t uid, uint32_t part);
+/*
+ * Stores what's stored for a part under another mailbox, UIDVALIDITY and UID as
+ * well, without reading it back. Returns false if it isn't stored.
+ */
+bool body_store_link(struct body_store *store, const char *mailbox,
+		uint32_t uidvalidity, uint32_t uid, uint32_t part,
+		const char *to_mailbox, uint32_t to_uidvalidity, uint32_t to_uid);
+bool body_store_contains(struct body_store *store, const char *mailbox,
+		uint32_t uidvalidity, uint32_t uid, uint32_t part);
+
+/*
+ * Rewrites the journal if most of it is dead, and removes any bodies it doesn't
+ * refer to. Returns true if it did anything.
+ */
+bool body_store_maintain(struct body_store *store);
+const struct body_store_stats *body_store_stats(struct body_store *store);
+
+#endif
@@ -12,6 +12,7 @@ struct account_config_extra {
 struct account_config {
 	char *name;
 	char *source;
+	char *outgoing; // Where mail's sent, or NULL
 	list_t *folders;
 	list_t *extras;
 };
@@ -36,7 +37,14 @@ struct aerc_config {
 		int sidebar_width;
 		int preview_height;
 		char *empty_message;
+		int prefetch_messages;
+		int prefetch_budget; // KiB
 	} ui;
+	struct {
+		int max_memory; // MiB
+		int max_disk; // MiB
+		int background_connections;
+	} cache;
 	struct {
 		list_t *mime_handlers;
 		list_t *alternatives;
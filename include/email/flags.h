@@ -0,0 +1,33 @@
+#ifndef _EMAIL_FLAGS_H
+#define _EMAIL_FLAGS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "util/list.h"
+
+/*
+ * The system flags defined by RFC 3501 are kept as a bitmask on each message.
+ * Anything else (keywords) is kept in a separate list, interned if it's one
+ * of the well-known ones and copied if not.
+ */
+enum message_flag {
+	FLAG_SEEN = 1 << 0,
+	FLAG_ANSWERED = 1 << 1,
+	FLAG_FLAGGED = 1 << 2,
+	FLAG_DELETED = 1 << 3,
+	FLAG_DRAFT = 1 << 4,
+	FLAG_RECENT = 1 << 5,
+};
+
+/* Returns the bit for a system flag, or 0 if name is not a system flag */
+uint32_t parse_flag(const char *name);
+const char *flag_name(enum message_flag flag);
+
+const char *keyword_new(const char *name);
+list_t *keywords_dup(const list_t *keywords);
+void keywords_free(list_t *keywords);
+/* Keywords are compared without regard to case */
+bool has_keyword(const list_t *keywords, const char *name);
+
+#endif
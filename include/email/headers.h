@@ -1,13 +1,42 @@
 #ifndef _EMAIL_HEADERS_H
 #define _EMAIL_HEADERS_H
 
-#include "util/list.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
+/*
+ * A parsed header block is a single allocation: this struct, followed by the
+ * index of headers, followed by a copy of the raw header text. Keys and values
+ * are NUL-terminated and unfolded in place within the raw copy. Well-known
+ * keys are interned (see util/intern.h), any others point into the copy, and
+ * values are stored as offsets into it.
+ *
+ * RFC 1342 encoded words are not decoded until the value is first requested,
+ * at which point the decoded string is cached in the index. headers_dup decodes
+ * them all up front instead, so that a copy can be shared between threads:
+ * reading it never writes to it.
+ */
 struct email_header {
-	char *key, *value;
+	const char *key;
+	uint32_t value;
+	bool encoded;
+	char *decoded;
 };
 
-int parse_headers(const char *headers, list_t *output);
-void free_headers(list_t *headers);
+struct email_headers {
+	size_t length;
+	size_t size;
+	char *raw;
+	struct email_header items[];
+};
+
+struct email_headers *parse_headers(const char *headers);
+struct email_headers *headers_dup(const struct email_headers *headers);
+void free_headers(struct email_headers *headers);
+
+const char *header_key(const struct email_headers *headers, size_t index);
+const char *header_value(struct email_headers *headers, size_t index);
+const char *get_header(struct email_headers *headers, const char *key);
 
 #endif
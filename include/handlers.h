@@ -8,6 +8,10 @@ void handle_worker_connect_done(struct account_state *account,
 		struct worker_message *message);
 void handle_worker_connect_error(struct account_state *account,
 		struct worker_message *message);
+void handle_worker_connection_lost(struct account_state *account,
+		struct worker_message *message);
+void handle_worker_reconnected(struct account_state *account,
+		struct worker_message *message);
 void handle_worker_select_done(struct account_state *account,
 		struct worker_message *message);
 void handle_worker_select_error(struct account_state *account,
@@ -24,8 +28,28 @@ void handle_worker_message_updated(struct account_state *account,
 		struct worker_message *message);
 void handle_worker_message_deleted(struct account_state *account,
 		struct worker_message *message);
+void handle_worker_sort_done(struct account_state *account,
+		struct worker_message *message);
+void handle_worker_sort_error(struct account_state *account,
+		struct worker_message *message);
+void handle_worker_search_done(struct account_state *account,
+		struct worker_message *message);
+void handle_worker_search_error(struct account_state *account,
+		struct worker_message *message);
+void handle_worker_move_done(struct account_state *account,
+		struct worker_message *message);
+void handle_worker_move_error(struct account_state *account,
+		struct worker_message *message);
+void handle_worker_mailbox_status(struct account_state *account,
+		struct worker_message *message);
+void handle_worker_mailbox_table_updated(struct account_state *account,
+		struct worker_message *message);
 void handle_worker_mailbox_deleted(struct account_state *account,
 		struct worker_message *message);
+void handle_worker_send_done(struct account_state *account,
+		struct worker_message *message);
+void handle_worker_send_error(struct account_state *account,
+		struct worker_message *message);
 
 void load_message_viewer(struct account_state *account);
 
@@ -5,11 +5,20 @@
 
 #include <poll.h>
 #include <stdbool.h>
+#include <stdio.h>
 
 #include "absocket.h"
+#include "body_cache.h"
+#include "body_store.h"
+#include "email/flags.h"
+#include "email/headers.h"
+#include "message_table.h"
+#include "message_view.h"
+#include "search_index.h"
 #include "urlparse.h"
 #include "util/hashtable.h"
 #include "util/list.h"
+#include "util/uid_set.h"
 #include "util/time.h"
 
 // TODO: Refactor these into the internal header:
@@ -24,6 +33,17 @@ struct imap_capabilities {
 	bool auth_login;
 	bool idle;
 	bool sasl_ir;
+	bool sort;
+	bool thread_references;
+	bool thread_orderedsubject;
+	bool esearch;
+	bool list_status;
+	bool notify;
+	bool move;
+	bool uidplus;
+	bool literal_plus; // RFC 7888, any literal without waiting for "+"
+	bool literal_minus; // Only those up to 4096 bytes
+	bool multiappend; // RFC 3502
 };
 
 enum imap_status {
@@ -34,16 +54,47 @@ enum imap_status {
 enum recv_mode {
 	RECV_WAIT,
 	RECV_LINE,
-	RECV_IDLE,
 };
 
+/*
+ * IDLE is entered as soon as the last command has completed, and left with
+ * one DONE ahead of whatever's sent next. Commands sent before the server has
+ * said it's idling are held until it has, since DONE can't go first.
+ */
+enum idle_state {
+	IDLE_NONE,
+	IDLE_STARTING, // IDLE sent, waiting on the server's continuation
+	IDLE_IDLING,
+	IDLE_LEAVING, // DONE sent, waiting on IDLE to complete
+};
+
+#define IDLE_REFRESH_DEFAULT (29 * 60) // Seconds, as RFC 2177 suggests
+
 struct imap_connection;
 
 typedef void (*imap_callback_t)(struct imap_connection *imap,
 		void *data, enum imap_status status, const char *args);
 
+struct aerc_message;
+
+/*
+ * Where COPY or MOVE put each message, from the COPYUID response code of a
+ * server with UIDPLUS (RFC 4315). source[i] became destination[i].
+ */
+struct uid_map {
+	uint32_t uidvalidity; // Of the destination
+	size_t length, capacity;
+	uint32_t *source, *destination;
+};
+
+void uid_map_finish(struct uid_map *map);
+/* Orders the map by source UID, which uid_map_find needs */
+void uid_map_sort(struct uid_map *map);
+/* Where source went, or 0 if it isn't in the map */
+uint32_t uid_map_find(const struct uid_map *map, uint32_t source);
+
 struct mailbox_flag {
-	char *name;
+	const char *name; // Interned
 	bool permanent;
 };
 
@@ -51,62 +102,111 @@ struct message_parameter {
 	char *key, *value;
 };
 
+/*
+ * type, subtype and body_encoding are interned if well-known, copied if not,
+ * see intern_known. Free them with intern_release.
+ */
 struct message_part {
-	char *type;
-	char *subtype;
+	const char *type;
+	const char *subtype;
 	list_t *parameters;
 	char *body_id;
 	char *body_description;
-	char *body_encoding;
-	long size;
-	uint8_t *content;
+	const char *body_encoding;
+	long size; // Encoded, as the server sends it
+	struct body *fetched; // Until handle_imap_fetch adds it to the cache
 };
 
 struct mailbox_message {
 	bool fetching, populated;
 	int index;
 	long uid;
-	list_t *flags, *headers;
+	uint32_t flags; // enum message_flag
+	list_t *keywords; // Other flags, see keywords_free
+	struct email_headers *headers;
 	struct tm *internal_date;
-	char *multipart_type;
+	long size;
+	const char *multipart_type; // See intern_known
 	list_t *parts;
+	struct aerc_message *snapshot; // Cached by the worker, see serialize_message
 };
 
 struct mailbox {
 	list_t *flags;
 	list_t *messages;
+	struct message_table *table;
+	bool table_dirty; // Changed since it was last published
 	char *name;
 	long exists, recent, unseen;
 	long nextuid; // Predicted, not definite
+	long uidvalidity; // UIDs from another UIDVALIDITY are different messages
+	struct {
+		long messages, unseen, recent; // -1 if unknown
+	} status; // From STATUS, which we only ask for when it isn't selected
 	bool read_write;
 	bool selected;
 };
 
+/* Until the worker is told otherwise, see WORKER_CONFIGURE */
+#define BODY_CACHE_DEFAULT (64 * 1024 * 1024)
+#define BODY_STORE_DEFAULT (1024 * 1024 * 1024)
+
 struct imap_connection {
 	struct {
 		void (*mailbox_updated)(struct imap_connection *, struct mailbox *mbox);
 		void (*mailbox_deleted)(struct imap_connection *, const char *name);
 		void (*message_updated)(struct imap_connection *, struct mailbox_message *);
 		void (*message_deleted)(struct imap_connection *, struct mailbox_message *);
+		void (*mailbox_status)(struct imap_connection *, struct mailbox *mbox);
+		// Before the capabilities are forgotten
+		void (*disconnected)(struct imap_connection *, const char *reason);
 	} events;
 
 	void *data;
 	bool logged_in;
+	bool background; // One of the worker's pool, see imap/worker/pool.c
+	enum idle_state idle;
 	struct timespec idle_start;
+	int idle_refresh; // Seconds before IDLE is left and entered again
+	char *held; // Sent while IDLE was starting, see enum idle_state
+	size_t held_length;
+	char *literal; // The rest of a command, waiting on the server's "+"
+	size_t literal_length;
+	size_t literal_size; // Of the literal it starts with
+	char *literal_tag; // Of the command it's in
+	list_t *appends; // Waiting to go out, the first maybe partway, see imap/append.c
 	struct timespec last_network;
 	absocket_t *socket;
 	enum recv_mode mode;
 	char *line;
 	int line_index, line_size;
+	struct uid_map copyuid; // Collected for the COPY or MOVE in flight
 	struct pollfd poll[1];
 	int next_tag;
 	hashtable_t *pending;
+	int outstanding; // Tagged commands awaiting completion
 	struct imap_capabilities *cap;
 	struct imap_state *state;
 	struct uri *uri;
 	list_t *mailboxes;
 	char *selected;
 	list_t *select_queue;
+	list_t *views; // Of the SORT and THREAD commands in flight, in order
+	list_t *searches; // Of the SEARCH commands in flight, in order
+	struct body_cache *bodies; // Decoded message parts
+	struct body_store *store; // Owned by the worker, see imap/worker/cache.c
+	struct search_index *search; // Owned by the worker, see imap/worker/search.c
+	struct prefetch_queue *prefetch; // Owned by the worker, see imap/worker/prefetch.c
+	struct flag_queue *flag_queue; // Owned by the worker, see imap/worker/flags.c
+	struct worker_journal *journal; // Owned by the worker, see imap/worker/journal.c
+	struct reconnect *reconnect; // Owned by the worker, see imap/worker/reconnect.c
+	struct imap_pool *pool; // Owned by the worker, see imap/worker/pool.c
+	struct {
+		struct timespec last; // When we last asked after every mailbox
+		size_t pending; // STATUS commands we're waiting on
+		char *selected; // What was selected when we last looked
+		bool notify_tried, notify; // The server tells us instead
+	} status_poll; // See imap/worker/status.c
 };
 
 enum imap_type {
@@ -133,7 +233,15 @@ void imap_arg_free(imap_arg_t *args);
 
 bool imap_connect(struct imap_connection *imap, const struct uri *uri,
 		bool use_ssl, imap_callback_t callback, void *data);
+bool imap_reconnect(struct imap_connection *imap, const struct uri *uri,
+		bool use_ssl, imap_callback_t callback, void *data);
+/* As imap_connect, but takes over a socket that's been opened elsewhere */
+void imap_connect_socket(struct imap_connection *imap, absocket_t *socket,
+		imap_callback_t callback, void *data);
+void imap_disconnect(struct imap_connection *imap, const char *reason);
 int imap_receive(struct imap_connection *imap);
+/* Tagged commands we're waiting on, not counting IDLE */
+int imap_busy(struct imap_connection *imap);
 void imap_send(struct imap_connection *imap, imap_callback_t callback,
 		void *data, const char *fmt, ...);
 void imap_close(struct imap_connection *imap);
@@ -144,6 +252,11 @@ void imap_capability(struct imap_connection *imap, imap_callback_t callback,
 		void *data);
 void imap_select(struct imap_connection *imap, imap_callback_t callback,
 		void *data, const char *mailbox);
+void imap_examine(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *mailbox);
+void imap_cancel_selects(struct imap_connection *imap);
+void imap_resync(struct imap_connection *imap, imap_callback_t callback,
+		void *data);
 void imap_fetch(struct imap_connection *imap, imap_callback_t callback,
 		void *data, size_t min, size_t max, const char *what);
 void imap_delete(struct imap_connection *imap, imap_callback_t callback,
@@ -154,6 +267,26 @@ void imap_expunge(struct imap_connection *imap, imap_callback_t callback,
 		void *data);
 void imap_copy(struct imap_connection *imap, imap_callback_t callback,
 		void *data, long index, const char *destination);
+/*
+ * The server's order is appended to view, which stays the caller's and has to
+ * last until the callback.
+ */
+void imap_sort(struct imap_connection *imap, imap_callback_t callback,
+		void *data, struct message_view *view, const char *criteria);
+void imap_thread(struct imap_connection *imap, imap_callback_t callback,
+		void *data, struct message_view *view, const char *algorithm);
+/*
+ * The UIDs found are added to results, which stays the caller's and has to
+ * last until the callback.
+ */
+void imap_search(struct imap_connection *imap, imap_callback_t callback,
+		void *data, struct uid_set *results, const char *criteria);
+void imap_status(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *mailbox);
+void imap_list_status(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *refname, const char *boxname);
+void imap_notify(struct imap_connection *imap, imap_callback_t callback,
+		void *data);
 
 enum imap_store_mode {
 	STORE_FLAGS_SET,
@@ -165,4 +298,44 @@ void imap_store(struct imap_connection *imap, imap_callback_t callback,
 		void *data, size_t min, size_t max, enum imap_store_mode mode,
 		const char *flags);
 
+/*
+ * Each sends as many commands as it takes and calls back once. map, if not
+ * NULL, gets whatever COPYUID responses the server sent.
+ */
+void imap_uid_store(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const struct uid_set *uids, enum imap_store_mode mode,
+		const char *flags);
+void imap_uid_copy(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const struct uid_set *uids, const char *destination,
+		struct uid_map *map);
+void imap_uid_move(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const struct uid_set *uids, const char *destination,
+		struct uid_map *map);
+void imap_uid_expunge(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const struct uid_set *uids);
+
+/*
+ * A message to APPEND: size bytes from offset in file, or from data if file is
+ * NULL. Either stays the caller's, and has to last until the callback.
+ */
+struct imap_append_message {
+	FILE *file;
+	long offset;
+	const char *data;
+	size_t size;
+	uint32_t flags; // enum message_flag
+};
+
+/*
+ * Appends messages to mailbox, as one command if the server has MULTIAPPEND
+ * and one each if not, and calls back once they're all done with the first
+ * failure, if any. They're read as the socket takes them, and don't wait on
+ * the server's go-ahead if it has LITERAL+ or LITERAL-, so a batch goes out
+ * as fast as the link allows. Other commands wait while a message is partway
+ * out.
+ */
+void imap_append(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *mailbox,
+		const struct imap_append_message *messages, size_t count);
+
 #endif
@@ -4,9 +4,16 @@
 #include "imap/imap.h"
 #include "worker.h"
 
+/* What we fetch to show a message in the list */
+#define FETCH_MESSAGE_ITEMS "UID FLAGS INTERNALDATE RFC822.SIZE BODYSTRUCTURE " \
+	"BODY.PEEK[HEADER.FIELDS (DATE FROM SUBJECT TO CC MESSAGE-ID REFERENCES " \
+	"CONTENT-TYPE IN-REPLY-TO REPLY-TO)]"
+
 void *imap_worker(void *_pipe);
-struct aerc_mailbox *serialize_mailbox(struct mailbox *source);
-struct aerc_message *serialize_message(struct mailbox_message *source);
+struct aerc_mailbox *serialize_mailbox(struct imap_connection *imap,
+		struct mailbox *source);
+struct aerc_message *serialize_message(struct imap_connection *imap,
+		const char *mailbox, struct mailbox_message *source);
 // Worker handlers
 void handle_worker_connect(struct worker_pipe *pipe, struct worker_message *message);
 void handle_worker_cert_okay(struct worker_pipe *pipe, struct worker_message *message);
@@ -15,9 +22,72 @@ void handle_worker_select_mailbox(struct worker_pipe *pipe, struct worker_messag
 void handle_worker_create_mailbox(struct worker_pipe *pipe, struct worker_message *message);
 void handle_worker_fetch_messages(struct worker_pipe *pipe, struct worker_message *message);
 void handle_worker_fetch_message_part(struct worker_pipe *pipe, struct worker_message *message);
+void handle_worker_prefetch(struct worker_pipe *pipe, struct worker_message *message);
+void handle_worker_store_flags(struct worker_pipe *pipe, struct worker_message *message);
+void handle_worker_configure(struct worker_pipe *pipe, struct worker_message *message);
+bool batch_selected(struct imap_connection *imap, const char *mailbox);
+void publish_message(struct imap_connection *imap, struct mailbox *mbox,
+		struct mailbox_message *msg);
+// Flag changes, written behind
+bool flush_flags(struct imap_connection *imap, bool now);
+uint32_t queued_flags(struct imap_connection *imap, const char *mailbox,
+		uint32_t uid, uint32_t flags);
+void flag_queue_free(struct imap_connection *imap);
+// Body cache
+void handle_body_evicted(void *data, const char *mailbox, uint32_t uid,
+		uint32_t part);
 void handle_worker_delete_mailbox(struct worker_pipe *pipe, struct worker_message *message);
 void handle_worker_delete_message(struct worker_pipe *pipe, struct worker_message *message);
 void handle_worker_copy_message(struct worker_pipe *pipe, struct worker_message *message);
 void handle_worker_move_message(struct worker_pipe *pipe, struct worker_message *message);
+void start_move(struct imap_connection *imap, struct aerc_message_move *move,
+		bool copy, uint64_t replaying);
+void start_delete(struct imap_connection *imap, struct aerc_message_move *move,
+		uint64_t replaying);
+void handle_worker_sort(struct worker_pipe *pipe, struct worker_message *message);
+void handle_worker_search(struct worker_pipe *pipe, struct worker_message *message);
+// Caches kept between runs
+char *cache_path(const struct uri *uri, const char *name);
+void open_body_store(struct imap_connection *imap, const struct uri *uri);
+void open_tls_sessions(const struct uri *uri);
+bool restore_body(struct imap_connection *imap, struct mailbox *mbox,
+		struct mailbox_message *msg, uint32_t part);
+// Changes that the server has yet to answer
+struct op;
+void open_journal(struct imap_connection *imap, const struct uri *uri);
+void journal_free(struct imap_connection *imap);
+uint64_t journal_op(struct imap_connection *imap, const struct op *op);
+void journal_done(struct imap_connection *imap, uint64_t id,
+		enum imap_status status);
+void journal_abandon(struct imap_connection *imap, uint64_t id);
+bool journal_maintain(struct imap_connection *imap);
+void replay_journal(struct imap_connection *imap);
+// Search index
+void open_search_index(struct imap_connection *imap, const struct uri *uri);
+void index_message(struct imap_connection *imap, struct mailbox_message *msg);
+void index_snapshot(struct imap_connection *imap, struct aerc_message *msg,
+		const char *mailbox, uint32_t uidvalidity, uint32_t uid);
+// Background connections
+struct imap_pool *pool_create(struct imap_connection *imap, char *source,
+		bool ssl);
+void pool_free(struct imap_pool *pool);
+void pool_configure(struct imap_pool *pool, size_t size);
+void pool_approve(struct imap_pool *pool);
+void pool_connected(struct imap_connection *background, bool ok);
+bool pool_run(struct imap_pool *pool, bool idle);
+// Getting the connection back
+void reconnect_init(struct imap_connection *imap, const char *source,
+		bool ssl);
+void reconnect_free(struct imap_connection *imap);
+void handle_disconnected(struct imap_connection *imap, const char *reason);
+bool reconnect_run(struct imap_connection *imap);
+bool reconnect_logged_in(struct imap_connection *imap, bool ok);
+// Counts of the mailboxes that aren't selected
+bool poll_status(struct imap_connection *imap);
+// Prefetching
+bool prefetch_next(struct imap_connection *imap);
+void cancel_prefetch(struct imap_connection *imap);
+void prefetch_free(struct imap_connection *imap);
+void prefetch_request_free(struct prefetch_request *request);
 
 #endif
@@ -1,16 +1,33 @@
 #ifndef _INTERNAL_IMAP_H
 #define _INTERNAL_IMAP_H
 
+#include <stdbool.h>
 #include <stdio.h>
 
 #include "imap/imap.h"
 
+#define LITERAL_MINUS_MAX 4096 // The biggest literal LITERAL- lets us send unasked
+
 struct imap_pending_callback {
 	imap_callback_t callback;
 	void *data;
 };
 
 int handle_line(struct imap_connection *imap, imap_arg_t *arg);
+void imap_send_raw(struct imap_connection *imap, const char *buf, size_t len);
+void imap_send_command(struct imap_connection *imap, const char *cmd,
+		size_t len);
+void imap_send_held(struct imap_connection *imap);
+char *imap_new_tag(struct imap_connection *imap, imap_callback_t callback,
+		void *data);
+void leave_idle(struct imap_connection *imap);
+
+/* See imap/append.c */
+int append_run(struct imap_connection *imap);
+bool append_continue(struct imap_connection *imap);
+bool append_in_command(struct imap_connection *imap);
+void append_fail(struct imap_connection *imap, const char *reason);
+void append_free(struct imap_connection *imap);
 
 void init_status_handlers();
 void handle_imap_status(struct imap_connection *imap, const char *token,
@@ -25,12 +42,26 @@ void handle_imap_existsunseenrecent(struct imap_connection *imap,
 		const char *token, const char *cmd, imap_arg_t *args);
 void handle_imap_uidnext(struct imap_connection *imap, const char *token,
 		const char *cmd, imap_arg_t *args);
+void handle_imap_uidvalidity(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args);
 void handle_imap_readwrite(struct imap_connection *imap, const char *token,
 		const char *cmd, imap_arg_t *args);
 void handle_imap_fetch(struct imap_connection *imap, const char *token,
 		const char *cmd, imap_arg_t *args);
 void handle_imap_expunge(struct imap_connection *imap, const char *token,
 		const char *cmd, imap_arg_t *args);
+void handle_imap_sort(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args);
+void handle_imap_thread(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args);
+void handle_imap_search(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args);
+void handle_imap_mailbox_status(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args);
+void handle_imap_esearch(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args);
+void handle_imap_copyuid(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args);
 
 /* Parses an IMAP argument string and sets "remaining" the number of characters
  * necessary to complete parsing (if the string doesn't represent a complete
@@ -44,7 +75,10 @@ char *serialize_args(const imap_arg_t *args);
  * Utility functions
  */
 struct imap_pending_callback *make_callback(imap_callback_t callback, void *data);
+char *imap_quote(struct imap_connection *imap, const char *str);
 struct mailbox *get_mailbox(struct imap_connection *imap, const char *name);
+void mailbox_expunge(struct imap_connection *imap, struct mailbox *mbox,
+		long index);
 struct mailbox *get_or_make_mailbox(struct imap_connection *imap,
 		const char *name);
 struct mailbox_flag *mailbox_get_flag(struct imap_connection *imap,
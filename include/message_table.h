@@ -0,0 +1,65 @@
+#ifndef _MESSAGE_TABLE_H
+#define _MESSAGE_TABLE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "email/flags.h"
+#include "email/headers.h"
+
+/*
+ * A columnar index of the messages in a mailbox, one row per sequence number.
+ * Scans over a single column (e.g. counting unread messages) touch one
+ * contiguous array instead of chasing a pointer per message.
+ *
+ * Subjects and senders are stored in a string pool and referenced by offset,
+ * offset 0 being the empty string.
+ *
+ * Tables are refcounted. The worker publishes its table to the UI by handing
+ * out a reference, and a shared table must not be modified: writers call
+ * message_table_cow first to get a private copy if anyone else holds it.
+ */
+struct message_table {
+	atomic_int refs;
+	size_t length, capacity;
+	uint32_t *uids;
+	uint32_t *flags; // enum message_flag, plus TABLE_ROW_FETCHED
+	time_t *dates;
+	uint32_t *subjects, *senders;
+	struct {
+		char *data;
+		size_t length, size;
+		size_t garbage;
+	} strings;
+};
+
+/* Set on rows whose columns have been filled in */
+#define TABLE_ROW_FETCHED (1u << 31)
+
+struct message_table *message_table_create();
+struct message_table *message_table_dup(const struct message_table *table);
+struct message_table *message_table_ref(struct message_table *table);
+void message_table_unref(struct message_table *table);
+/* Ensures *table is not shared, replacing it with a copy if it is */
+void message_table_cow(struct message_table **table);
+
+/* Grows or shrinks the table to length rows, new rows are zeroed */
+void message_table_resize(struct message_table *table, size_t length);
+void message_table_remove(struct message_table *table, size_t row);
+void message_table_update(struct message_table *table, size_t row, long uid,
+		uint32_t flags, const struct tm *date, struct email_headers *headers);
+
+/* Counts the rows where (flags & mask) == value */
+size_t message_table_count(const struct message_table *table,
+		uint32_t mask, uint32_t value);
+size_t message_table_unread(const struct message_table *table);
+
+const char *message_table_subject(const struct message_table *table,
+		size_t row);
+const char *message_table_sender(const struct message_table *table,
+		size_t row);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef _MESSAGE_VIEW_H
+#define _MESSAGE_VIEW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util/list.h"
+
+/*
+ * The order in which the message list is displayed, from the top down, and the
+ * thread depth of each row.
+ *
+ * A view is either computed by the server (SORT/THREAD, see imap/sort.c) and
+ * handed to us whole, or computed locally from the messages we have fetched.
+ * Local views are maintained incrementally: messages are inserted as they
+ * arrive or are fetched rather than re-sorting the whole mailbox.
+ */
+enum view_sort {
+	SORT_NONE, // Sequence order, newest first
+	SORT_DATE, // Internal date, newest first
+	SORT_FROM,
+	SORT_SUBJECT,
+	SORT_SIZE, // Largest first
+};
+
+enum view_thread {
+	THREAD_NONE,
+	THREAD_REFERENCES,
+	THREAD_ORDEREDSUBJECT,
+};
+
+struct thread_node;
+
+struct message_view {
+	enum view_sort sort;
+	enum view_thread thread;
+	bool reverse;
+	bool server; // Computed by the server, not maintained locally
+	size_t count; // Messages covered by the view
+	size_t length, capacity;
+	int *index; // Message index shown on each row
+	int *depth; // Thread depth of each row
+
+	/* Local threading state, see message_view.c */
+	bool dirty;
+	struct thread_node **nodes; // By message index
+	struct thread_node *roots;
+	struct thread_node *all;
+	struct {
+		struct thread_node **items;
+		size_t length, capacity;
+	} ids;
+};
+
+struct message_view *message_view_create(enum view_sort sort,
+		enum view_thread thread, bool reverse);
+void message_view_free(struct message_view *view);
+void message_view_append(struct message_view *view, int index, int depth);
+
+/* Builds a local view over a list of aerc_messages */
+void message_view_build(struct message_view *view, list_t *messages);
+/*
+ * Brings the view up to date after the mailbox was replaced with a new list:
+ * messages whose snapshot changed are repositioned and new ones are added.
+ */
+void message_view_refresh(struct message_view *view, list_t *old,
+		list_t *messages);
+/* Repositions a message after it was fetched or updated */
+void message_view_update(struct message_view *view, list_t *messages,
+		int index);
+/* Removes an expunged message, shifting the indices after it */
+void message_view_remove(struct message_view *view, int index);
+/*
+ * Returns a flat view of only the given messages (indices in ascending order)
+ * in the order view shows them, for showing search results.
+ */
+struct message_view *message_view_filter(struct message_view *view,
+		size_t length, const int *indices, size_t count);
+
+/*
+ * Maps between message indices and rows. view may be NULL, in which case rows
+ * are in sequence order with the newest message on top.
+ */
+int message_view_index(struct message_view *view, size_t length, size_t row);
+int message_view_depth(struct message_view *view, size_t row);
+size_t message_view_row(struct message_view *view, size_t length, int index);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef _NET_H
+#define _NET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+/*
+ * Connecting to servers without waiting on the ones that won't answer. Each
+ * address is tried in turn, IPv6 and IPv4 alternating, but without waiting
+ * for one attempt to fail before starting the next (RFC 8305). Whichever
+ * connects first is used and the rest are dropped.
+ */
+
+struct net_address {
+	struct sockaddr_storage addr;
+	socklen_t length;
+};
+
+/*
+ * Looks host up, or remembers what it was if it was looked up recently.
+ * Returns NULL and sets error if it can't be found. Free the result.
+ */
+struct net_address *net_resolve(const char *host, const char *port,
+		size_t *count, const char **error);
+/* Drops host from the cache, if the addresses we had for it didn't work */
+void net_forget(const char *host, const char *port);
+
+/*
+ * Races connections to addrs in the order given. Returns the first to connect,
+ * in blocking mode, or -1 with errno set once they've all failed or timeout
+ * milliseconds have passed.
+ */
+int net_connect_any(const struct net_address *addrs, size_t count,
+		int timeout);
+/* Resolves host and races connections to it. Returns -1 and sets error. */
+int net_connect(const char *host, const char *port, const char **error);
+bool net_set_blocking(int fd, bool blocking);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef _OP_JOURNAL_H
+#define _OP_JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/list.h"
+#include "util/uid_set.h"
+
+/*
+ * The changes the user has made that the server hasn't confirmed yet, kept on
+ * disk so that none are lost if the connection or aerc goes away before it
+ * answers. Each is written before it's sent and marked done once the server
+ * has answered, and the ones left over are sent again later. They must be
+ * safe to send twice.
+ *
+ * The journal is append-only, and is rewritten with only the ops that are
+ * still pending once most of it no longer applies.
+ */
+struct op_journal;
+
+enum op_type {
+	OP_STORE_FLAGS = 1,
+	OP_COPY,
+	OP_MOVE,
+	OP_DELETE,
+	OP_CREATE_MAILBOX,
+	OP_DELETE_MAILBOX,
+};
+
+struct op {
+	uint64_t id;
+	enum op_type type;
+	char *mailbox; // The one it acts on, or the one to create or delete
+	uint32_t uidvalidity; // Of mailbox when it was made, the UIDs need it
+	struct uid_set *uids; // NULL for mailbox ops
+	uint32_t flags; // enum message_flag, for OP_STORE_FLAGS
+	bool add;
+	char *destination; // For OP_COPY and OP_MOVE
+};
+
+void op_free(struct op *op);
+struct op *op_dup(const struct op *op);
+
+/* path is the file to keep it in, or NULL to keep it in memory */
+struct op_journal *op_journal_open(const char *path);
+void op_journal_close(struct op_journal *journal);
+
+/*
+ * Records a copy of op, flushed to disk before it returns. Returns its id, or
+ * 0 if it couldn't be written, in which case it's only kept in memory.
+ */
+uint64_t op_journal_append(struct op_journal *journal, const struct op *op);
+void op_journal_done(struct op_journal *journal, uint64_t id);
+/* The ops that aren't done, oldest first. Don't modify them. */
+const list_t *op_journal_pending(struct op_journal *journal);
+const struct op *op_journal_get(struct op_journal *journal, uint64_t id);
+/* Rewrites the journal if most of it is done. Returns true if it did. */
+bool op_journal_maintain(struct op_journal *journal);
+
+#endif
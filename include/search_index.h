@@ -0,0 +1,56 @@
+#ifndef _SEARCH_INDEX_H
+#define _SEARCH_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A local full-text index of message headers and bodies, for offline search.
+ *
+ * Each indexed text (the headers of a message, or one of its body parts) is a
+ * document, identified by mailbox, UIDVALIDITY, UID and part. Documents are numbered in the order they are added, and each term
+ * maps to the sorted list of documents it occurs in, stored as varint-encoded
+ * deltas. New documents collect in memory and are flushed to immutable segment
+ * files which are mmap'd; adjacent segments are merged in the background so
+ * that there are only ever a logarithmic number of them.
+ *
+ * Terms are runs of ASCII letters and digits, lowercased, or of non-ASCII
+ * (UTF-8) bytes, of at least two bytes.
+ */
+struct search_index;
+
+struct search_hit {
+	const char *mailbox; // See intern_mailbox
+	uint32_t uidvalidity; // Hits for any other than the mailbox's are stale
+	uint32_t uid;
+};
+
+/* path is the directory to keep segments in, or NULL to keep them in memory */
+struct search_index *search_index_open(const char *path);
+void search_index_close(struct search_index *index);
+
+/*
+ * Adds a document. part 0 is the message headers and part n is body part n.
+ * Returns false if this part of this message was already indexed.
+ */
+bool search_index_add(struct search_index *index, const char *mailbox,
+		uint32_t uidvalidity, uint32_t uid, uint32_t part,
+		const char *text, size_t length, bool html);
+/* Writes the documents added since the last flush to a new segment */
+bool search_index_flush(struct search_index *index);
+/*
+ * Flushes documents once no more have arrived for a while, or else merges a
+ * pair of segments. Returns true if it did anything.
+ */
+bool search_index_maintain(struct search_index *index);
+
+/*
+ * Finds the messages containing every term in the query. Returns the number of
+ * hits, sorted by mailbox, UIDVALIDITY and UID, and stores them in *hits
+ * (free it).
+ */
+size_t search_index_query(struct search_index *index, const char *query,
+		struct search_hit **hits);
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef _SMTP_H
+#define _SMTP_H
+
+// Implements RFC 6409 (Message Submission), on top of RFC 5321 (SMTP)
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "absocket.h"
+#include "urlparse.h"
+#include "util/list.h"
+
+/*
+ * Messages are queued with smtp_submit and sent one after another on the same
+ * connection, which is kept open for a while in between in case there are
+ * more. Nothing blocks once connected: smtp_receive sends and reads what it
+ * can, and is to be called whenever the socket is ready for ab_events.
+ */
+
+#define SMTP_KEEP_OPEN 120 // Seconds to keep a connection with nothing to send
+#define SMTP_TIMEOUT (5 * 60) // Seconds to wait on the server to answer
+
+struct smtp_capabilities {
+	bool pipelining; // RFC 2920
+	bool chunking; // RFC 3030, BDAT
+	bool eightbitmime; // RFC 6152
+	bool starttls; // RFC 3207
+	bool auth_plain;
+	long size; // RFC 1870, the most it takes, 0 if no limit, -1 if it won't say
+};
+
+enum smtp_security {
+	SMTP_TLS, // smtps://, TLS from the start
+	SMTP_STARTTLS, // smtp://, which fails if the server doesn't offer it
+	SMTP_INSECURE, // smtp+insecure://, STARTTLS if offered, else plaintext
+};
+
+enum smtp_state {
+	SMTP_DISCONNECTED,
+	SMTP_CONNECTING, // Until we've said EHLO, logged in and so on
+	SMTP_READY, // Nothing going on, another message can be started
+	SMTP_ENVELOPE, // MAIL and RCPT sent, waiting to hear which were taken
+	SMTP_BODY, // Sending the message
+	SMTP_FINISHING, // All sent, waiting on the server to take it
+	SMTP_QUITTING,
+};
+
+struct smtp_connection;
+
+/*
+ * A message on its way to the server. It's read from disk a chunk at a time as
+ * the socket takes it, so even a big one only needs a chunk or two in memory.
+ */
+struct smtp_message {
+	char *from;
+	list_t *recipients;
+	FILE *file;
+	long size; // With every line ending in CRLF, as it's sent
+	bool eightbit;
+	char last; // The last byte sent, so lines can be fixed across chunks
+	bool eof;
+	int attempts;
+	bool answered; // The server has said something about it
+	void *data; // Whatever the caller likes
+};
+
+/* Called with the server's reply once it's sent, or NULL if it wasn't */
+typedef void (*smtp_sent_t)(struct smtp_connection *smtp,
+		struct smtp_message *msg, bool ok, const char *reply);
+typedef void (*smtp_callback_t)(struct smtp_connection *smtp, void *data,
+		int code, const char *text);
+
+struct smtp_connection {
+	absocket_t *socket;
+	struct pollfd poll[1];
+	struct uri *uri;
+	enum smtp_security security;
+	enum smtp_state state;
+	struct smtp_capabilities cap;
+	char *line; // What we've read and haven't handled yet
+	size_t line_index, line_size;
+	size_t line_next; // Where the line being handled ends, see handle_lines
+	char *reply; // The lines of a multiline reply so far
+	list_t *awaiting; // The callbacks of the commands sent, in order
+	list_t *held; // Commands waiting on the last to be answered
+	list_t *queue; // Messages to send, the first of which is being sent
+	char *error; // Why the message being sent failed
+	char *chunk; // Room for a chunk of the message, and for it made canonical
+	struct timespec last_network;
+	smtp_sent_t sent;
+	void *data;
+};
+
+/* Takes uri, and connects to it once there's something to send */
+struct smtp_connection *smtp_new(struct uri *uri, enum smtp_security security,
+		smtp_sent_t sent, void *data);
+void smtp_free(struct smtp_connection *smtp);
+/*
+ * Queues a message to be sent, connecting first if need be. The message is
+ * handed back to the sent callback either way, to be freed by the caller.
+ */
+void smtp_submit(struct smtp_connection *smtp, struct smtp_message *msg);
+/* Returns nonzero if it did anything */
+int smtp_receive(struct smtp_connection *smtp);
+/* Says goodbye, once nothing's left to send */
+void smtp_quit(struct smtp_connection *smtp);
+
+/*
+ * Opens the message at path, and checks how big it'll be on the wire. Returns
+ * NULL and sets errno if it can't be read.
+ */
+struct smtp_message *smtp_message_open(const char *path, const char *from,
+		list_t *recipients);
+void smtp_message_free(struct smtp_message *msg);
+
+#endif
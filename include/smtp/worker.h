@@ -0,0 +1,10 @@
+#ifndef _SMTP_WORKER_H
+#define _SMTP_WORKER_H
+
+/*
+ * Takes WORKER_CONNECT, with the account's outgoing server, and then
+ * WORKER_SEND_MESSAGE. See struct send_request.
+ */
+void *smtp_worker(void *_pipe);
+
+#endif
@@ -37,6 +37,10 @@ struct account_state {
 		struct worker_pipe *pipe;
 		pthread_t thread;
 	} worker;
+	struct {
+		struct worker_pipe *pipe; // NULL if there's nowhere to send mail
+		pthread_t thread;
+	} sender;
 
 	struct {
 		char *text;
@@ -48,6 +52,25 @@ struct account_state {
 		size_t selected_message;
 		size_t list_offset;
 		list_t *fetch_requests;
+		bool selecting; // Until the worker has switched mailboxes
+		struct sort_request order; // As requested by the user
+		struct message_view *view; // NULL when in sequence order
+		struct message_view *filtered; // Search results, less those moving
+		struct uid_set *moving; // Hidden until the server has moved them
+		struct {
+			bool active;
+			int *indices; // Matching messages, ascending
+			size_t length;
+			struct uid_set *uids; // All matches, once the server answers
+		} search;
+		struct {
+			size_t last_row;
+			int direction; // Which way the user is moving through the list
+		} prefetch;
+		struct {
+			struct uid_set *uids; // NULL when nothing is marked
+			uint32_t anchor; // The last one marked, where ranges start
+		} marks;
 	} ui;
 	
 	struct {
@@ -96,10 +119,26 @@ void set_status(struct account_state *account, enum account_status state,
 struct aerc_mailbox *get_aerc_mailbox(struct account_state *account,
 		const char *name);
 void free_aerc_mailbox(struct aerc_mailbox *mbox);
-void free_aerc_message(struct aerc_message *msg);
+struct message_view *displayed_view(struct account_state *account);
+size_t displayed_rows(struct account_state *account, struct aerc_mailbox *mbox);
+int get_index_at_row(struct account_state *account,
+		struct aerc_mailbox *mbox, size_t row);
+struct aerc_message *get_message_at_row(struct account_state *account,
+		struct aerc_mailbox *mbox, size_t row);
+void configure_worker(struct account_state *account);
+void request_select(struct account_state *account, char *mailbox);
+void request_sort(struct account_state *account);
+void request_prefetch(struct account_state *account);
+void update_filter(struct account_state *account);
+void clear_search(struct account_state *account);
+void clear_marks(struct account_state *account);
+struct uid_set *take_targets(struct account_state *account,
+		struct aerc_mailbox *mbox, size_t row);
+void change_flags(struct account_state *account, struct aerc_mailbox *mbox,
+		struct uid_set *uids, uint32_t flags, bool add);
 const char *get_message_header(struct aerc_message *msg, char *key);
-bool get_message_flag(struct aerc_message *msg, char *flag);
-bool get_mailbox_flag(struct aerc_mailbox *mbox, char *flag);
+bool get_message_flag(struct aerc_message *msg, const char *flag);
+bool get_mailbox_flag(struct aerc_mailbox *mbox, const char *flag);
 struct account_config *config_for_account(const char *name);
 
 #endif
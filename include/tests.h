@@ -13,13 +13,34 @@
 /* Wrappers */
 void *__wrap_hashtable_get(hashtable_t *table, const void *key);
 int __wrap_poll(struct pollfd fds[], nfds_t nfds, int timeout);
+extern bool real_poll; // For tests on real sockets, ab_recv isn't mocked either
 void set_ab_recv_result(void *buffer, size_t size);
 int __wrap_ab_recv(absocket_t *socket, void *buffer, size_t len);
 
 /* Tests */
 int run_tests_urlparse();
+int run_tests_net();
+int run_tests_absocket();
+int run_tests_smtp();
 int run_tests_imap();
+int run_tests_imap_search();
+int run_tests_imap_notify();
+int run_tests_imap_uid();
+int run_tests_imap_flags();
+int run_tests_imap_sort();
+int run_tests_imap_select();
+int run_tests_imap_append();
 int run_tests_headers();
+int run_tests_flags();
+int run_tests_message_table();
+int run_tests_message_view();
+int run_tests_search_index();
+int run_tests_uid_set();
+int run_tests_hashtable();
+int run_tests_body_cache();
+int run_tests_body_store();
+int run_tests_op_journal();
+int run_tests_worker();
 int run_tests_bind();
 int run_tests_subprocess();
 
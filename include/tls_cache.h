@@ -0,0 +1,24 @@
+#ifndef _TLS_CACHE_H
+#define _TLS_CACHE_H
+
+#ifdef USE_OPENSSL
+
+#include <stdbool.h>
+#include <openssl/ssl.h>
+
+/*
+ * One SSL_CTX for the whole process, and the last TLS session with each
+ * server, so that connecting again (after losing the connection, or for
+ * another connection in the pool) resumes it instead of doing the whole
+ * handshake over. Sessions are kept on disk too, so they outlive aerc.
+ */
+
+SSL_CTX *tls_context();
+/* Loads the session for host:port kept at path, and keeps new ones there */
+void tls_cache_open(const char *host, const char *port, const char *path);
+/* Offers the last session with host:port on ssl. Returns false if none. */
+bool tls_cache_resume(SSL *ssl, const char *host, const char *port);
+
+#endif
+
+#endif
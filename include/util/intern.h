@@ -0,0 +1,37 @@
+#ifndef _UTIL_INTERN_H
+#define _UTIL_INTERN_H
+
+/*
+ * Process-wide string interning. Interned strings are compared without regard
+ * to case (the first spelling seen wins) and live until the process exits, so
+ * callers may keep the pointers forever and compare them with ==.
+ *
+ * Safe to call from any thread.
+ */
+const char *intern(const char *str);
+
+/*
+ * Returns the interned copy of str, or NULL if it has never been interned.
+ */
+const char *intern_find(const char *str);
+
+/*
+ * Interns str only if it's one of known (NULL-terminated, in the spelling to
+ * keep), and copies it otherwise, since whoever sent it could send any number
+ * of others. Either way, let go of it with intern_release.
+ */
+const char *intern_known(const char *str, const char *const *known);
+/* Copies str unless it's interned, for another owner */
+const char *intern_copy(const char *str);
+/* Frees str unless it's interned */
+void intern_release(const char *str);
+
+/*
+ * Mailbox names are case-sensitive, except for INBOX (RFC 3501 5.1), so
+ * they're interned apart from the rest: "Foo" and "foo" are different, and
+ * any case of INBOX is "INBOX".
+ */
+const char *intern_mailbox(const char *name);
+const char *intern_mailbox_find(const char *name);
+
+#endif
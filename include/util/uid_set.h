@@ -0,0 +1,33 @@
+#ifndef _UID_SET_H
+#define _UID_SET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A set of message UIDs (or sequence numbers) stored as sorted, disjoint,
+ * non-adjacent ranges, which is how IMAP writes them: 1:5,7,10:12
+ */
+struct uid_range {
+	uint32_t min, max;
+};
+
+struct uid_set {
+	size_t length, capacity;
+	struct uid_range *ranges;
+};
+
+struct uid_set *uid_set_create(void);
+void uid_set_free(struct uid_set *set);
+void uid_set_add(struct uid_set *set, uint32_t uid);
+void uid_set_add_range(struct uid_set *set, uint32_t min, uint32_t max);
+void uid_set_remove(struct uid_set *set, uint32_t uid);
+bool uid_set_contains(const struct uid_set *set, uint32_t uid);
+size_t uid_set_count(const struct uid_set *set);
+/* Parses an IMAP sequence-set without "*" into set, returns false if invalid */
+bool uid_set_parse(struct uid_set *set, const char *str);
+/* Formats count ranges starting at first, so long sets can be sent in parts */
+char *uid_set_format(const struct uid_set *set, size_t first, size_t count);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef _WORKER_H
 #define _WORKER_H
 
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -8,8 +9,14 @@
 #include <openssl/ossl_typ.h>
 #endif
 
+#include "body_cache.h"
+#include "email/flags.h"
+#include "email/headers.h"
+#include "message_table.h"
+#include "message_view.h"
 #include "util/aqueue.h"
 #include "util/list.h"
+#include "util/uid_set.h"
 
 /* worker.h
  *
@@ -28,10 +35,13 @@ enum worker_message_type {
 	WORKER_UNSUPPORTED,
 	WORKER_CONFIGURE,
 	WORKER_ERROR,
+	WORKER_CANCEL,
 	/* Connection */
 	WORKER_CONNECT,
 	WORKER_CONNECT_DONE,
 	WORKER_CONNECT_ERROR,
+	WORKER_CONNECTION_LOST,
+	WORKER_RECONNECTED,
 #ifdef USE_OPENSSL
 	WORKER_CONNECT_CERT_CHECK,
 	WORKER_CONNECT_CERT_OKAY,
@@ -48,14 +58,30 @@ enum worker_message_type {
 	WORKER_CREATE_MAILBOX,
 	WORKER_MAILBOX_DELETED,
 	WORKER_MAILBOX_UPDATED,
+	WORKER_MAILBOX_TABLE_UPDATED,
+	WORKER_MAILBOX_STATUS,
 	/* Messages */
 	WORKER_FETCH_MESSAGES,
 	WORKER_FETCH_MESSAGE_PART,
+	WORKER_PREFETCH,
+	WORKER_STORE_FLAGS,
 	WORKER_MESSAGE_UPDATED,
 	WORKER_DELETE_MESSAGE,
 	WORKER_MESSAGE_DELETED,
 	WORKER_MOVE_MESSAGE,
+	WORKER_MOVE_MESSAGE_DONE,
+	WORKER_MOVE_MESSAGE_ERROR,
 	WORKER_COPY_MESSAGE,
+	WORKER_SORT,
+	WORKER_SORT_DONE,
+	WORKER_SORT_ERROR,
+	WORKER_SEARCH,
+	WORKER_SEARCH_DONE,
+	WORKER_SEARCH_ERROR,
+	/* Sending */
+	WORKER_SEND_MESSAGE,
+	WORKER_SEND_MESSAGE_DONE,
+	WORKER_SEND_MESSAGE_ERROR,
 };
 
 struct worker_pipe {
@@ -63,21 +89,101 @@ struct worker_pipe {
 	aqueue_t *actions;
 	/* Messages from worker->master */
 	aqueue_t *messages;
+	/*
+	 * The master moves on to a new generation whenever it leaves a view,
+	 * such as a mailbox, and the worker stamps its messages with the
+	 * generation of the view their results belong to. Each side only ever
+	 * touches its own counter.
+	 */
+	unsigned long generation; // The master's
+	unsigned long worker_generation; // The worker's
+	unsigned long next_id; // For actions, the master's
+	/* Written to with each action, so the worker can sleep until there is one */
+	int wake[2];
 	/* Arbitrary worker-specific data */
 	void *data;
 };
 
+/*
+ * Actions are handled most urgent first, and in the order they were posted
+ * within each priority. See struct worker_scheduler.
+ */
+enum worker_priority {
+	PRIORITY_INTERACTIVE, // The user is waiting on it
+	PRIORITY_PREFETCH, // The user will probably want it soon
+	PRIORITY_BACKGROUND, // Bulk work, such as filling in the message list
+	PRIORITY_COUNT,
+};
+
 struct worker_message {
 	enum worker_message_type type;
+	enum worker_priority priority; // Only meaningful for actions
+	unsigned long id; // Actions are numbered in the order they were posted
+	unsigned long generation;
 	struct worker_message *in_response_to;
 	void *data;
 };
 
+/*
+ * WORKER_CANCEL carries nothing. The worker drops the fetches, sorts and
+ * searches still queued from generations before its own, and stops
+ * prefetching.
+ */
+
+/*
+ * WORKER_CONFIGURE carries the settings from the config file that the worker
+ * needs, and is sent again when it's reloaded.
+ */
+struct worker_config {
+	size_t body_cache_size;
+	size_t body_store_size;
+	size_t background_connections;
+	int idle_refresh; // Seconds, or 0 for IDLE_REFRESH_DEFAULT
+};
+
+/*
+ * WORKER_CONNECTION_LOST and WORKER_RECONNECTED carry the connection's
+ * struct connection_stats as they were at the time. The worker tries again
+ * by itself until it's back, and the mailbox that was selected is selected
+ * again before WORKER_RECONNECTED.
+ */
+struct connection_stats {
+	size_t disconnects, attempts, reconnects;
+	long retry_in; // Milliseconds until the next attempt
+	long outage; // Milliseconds the last outage lasted
+	long total_outage, longest_outage;
+	char *reason; // Why it was lost, for WORKER_CONNECTION_LOST
+};
+
 struct fetch_part_request {
 	int index;
 	int part;
 };
 
+/*
+ * WORKER_PREFETCH carries the messages the user is likely to open next, most
+ * likely first. The worker fetches their text parts while the connection is
+ * otherwise idle, up to budget bytes, without marking them seen. Each request
+ * replaces the last.
+ */
+struct prefetch_request {
+	char *mailbox;
+	int *indices;
+	size_t length;
+	size_t budget;
+};
+
+/*
+ * WORKER_STORE_FLAGS adds or removes flags (enum message_flag) on every
+ * message in a set of UIDs
+ */
+struct store_flags_request {
+	char *mailbox; // Which they're in, ignored if it's no longer selected
+	struct uid_set *uids;
+	uint32_t flags;
+	bool add;
+};
+
 struct message_range {
 	int min, max;
 };
@@ -91,27 +197,98 @@ struct aerc_message_delete {
 	int index;
 };
 
+/*
+ * WORKER_SORT_DONE carries the struct message_view computed by the server, or
+ * NULL if the server can't do it and the view must be built locally.
+ */
+struct sort_request {
+	enum view_sort sort;
+	enum view_thread thread;
+	bool reverse;
+};
+
+/*
+ * WORKER_SEARCH carries the query string, WORKER_SEARCH_DONE the indices of
+ * the matching messages in the selected mailbox, in ascending order. Results
+ * from the local index come first, marked partial if the server is still
+ * searching. The server's results carry the UIDs of every match, including
+ * those of messages whose UIDs we don't know yet.
+ */
+struct aerc_search_results {
+	char *mailbox;
+	int *indices;
+	size_t length;
+	struct uid_set *uids;
+	bool partial;
+};
+
+struct aerc_table_update {
+	char *mailbox;
+	struct message_table *table; // A reference, owned by the recipient
+};
+
+/* The counts of a mailbox that isn't selected changed */
+struct aerc_mailbox_status {
+	char *mailbox;
+	long messages, unseen, recent; // -1 if unknown
+};
+
+/*
+ * WORKER_DELETE_MESSAGE, WORKER_COPY_MESSAGE and WORKER_MOVE_MESSAGE act on
+ * every message in a set of UIDs with as few commands as the server allows.
+ * WORKER_MOVE_MESSAGE_DONE and _ERROR hand a move or delete back once it's
+ * over, so the UI can stop hiding the messages or put them back.
+ */
 struct aerc_message_move {
-	int index;
-	char *destination;
+	char *mailbox; // Which they're in, ignored if it's no longer selected
+	struct uid_set *uids;
+	char *destination; // NULL for WORKER_DELETE_MESSAGE
+};
+
+/*
+ * WORKER_SEND_MESSAGE goes to the SMTP worker, with a message on disk to send
+ * and the envelope to send it with. The message is read as it's sent, so it
+ * may be as big as the server allows. WORKER_SEND_MESSAGE_DONE and _ERROR
+ * hand the request back once the server has taken it or turned it down.
+ */
+struct send_request {
+	char *path; // The whole message, headers and all
+	char *from;
+	list_t *recipients;
+	char *error; // Why it wasn't sent, for WORKER_SEND_MESSAGE_ERROR
 };
 
+/*
+ * type, subtype and body_encoding are interned if well-known, copied if not,
+ * see intern_known. Free them with intern_release.
+ */
 struct aerc_message_part {
-	char *type;
-	char *subtype;
+	const char *type;
+	const char *subtype;
 	char *body_id;
 	char *body_description;
-	char *body_encoding;
+	const char *body_encoding;
 	long size;
-	uint8_t *content; // Note: do not free this, you don't own it
+	struct body *content; // A reference, or NULL if we don't have it
 };
 
+/*
+ * Messages are refcounted snapshots. The worker caches the snapshot it last
+ * built for each message and hands out references to it, so apart from the
+ * index and fetching fields (which belong to the UI once published) they must
+ * not be modified.
+ */
 struct aerc_message {
+	atomic_int refs;
 	bool fetching, fetched;
 	int index;
 	long uid;
-	list_t *flags, *headers, *parts;
+	uint32_t flags; // enum message_flag
+	list_t *keywords; // Other flags, see keywords_free
+	list_t *parts;
+	struct email_headers *headers;
 	struct tm *internal_date;
+	long size;
 };
 
 struct aerc_mailbox {
@@ -119,8 +296,21 @@ struct aerc_mailbox {
 	bool read_write;
 	bool selected;
 	long exists, recent, unseen;
-	list_t *flags;
+	struct {
+		long messages, unseen, recent; // -1 if unknown
+	} status; // For when it isn't selected
+	list_t *flags; // Interned strings
 	list_t *messages;
+	struct message_table *table;
+};
+
+/*
+ * Keeps the actions a worker has taken off its pipe in one queue per priority,
+ * so that it can hold back the bulk work while the user is waiting on
+ * something, and drop what has gone stale before it ever reaches the server.
+ */
+struct worker_scheduler {
+	list_t *queues[PRIORITY_COUNT];
 };
 
 #ifdef USE_OPENSSL
@@ -140,10 +330,49 @@ void worker_post_message(struct worker_pipe *pipe,
 		enum worker_message_type type,
 		struct worker_message *in_response_to,
 		void *data);
+void worker_post_message_generation(struct worker_pipe *pipe,
+		enum worker_message_type type,
+		struct worker_message *in_response_to,
+		void *data, unsigned long generation);
 void worker_post_action(struct worker_pipe *pipe,
 		enum worker_message_type type,
 		struct worker_message *in_response_to,
 		void *data);
+void worker_post_action_priority(struct worker_pipe *pipe,
+		enum worker_message_type type,
+		struct worker_message *in_response_to,
+		void *data, enum worker_priority priority);
 void worker_message_free(struct worker_message *msg);
+unsigned long worker_pipe_advance(struct worker_pipe *pipe);
+/*
+ * Sleeps for up to timeout milliseconds, or until there's an action or the
+ * given events on fd (which may be -1).
+ */
+void worker_wait(struct worker_pipe *pipe, int fd, short events, int timeout);
+
+struct worker_scheduler *worker_scheduler_new();
+void worker_scheduler_free(struct worker_scheduler *sched,
+		void (*free_action)(struct worker_message *message));
+void worker_scheduler_add(struct worker_scheduler *sched,
+		struct worker_message *message);
+void worker_scheduler_requeue(struct worker_scheduler *sched,
+		struct worker_message *message);
+bool worker_scheduler_next(struct worker_scheduler *sched,
+		enum worker_priority lowest, struct worker_message **message);
+size_t worker_scheduler_pending(struct worker_scheduler *sched,
+		enum worker_priority priority);
+size_t worker_scheduler_cancel(struct worker_scheduler *sched,
+		enum worker_message_type type, unsigned long before,
+		void (*free_data)(void *data));
+
+void aerc_message_move_free(struct aerc_message_move *move);
+void store_flags_request_free(struct store_flags_request *request);
+void send_request_free(struct send_request *req);
+
+struct aerc_message *aerc_message_new();
+struct aerc_message *aerc_message_ref(struct aerc_message *msg);
+struct aerc_message *aerc_message_with_flags(const struct aerc_message *msg,
+		uint32_t flags);
+void aerc_message_unref(struct aerc_message *msg);
 
 #endif
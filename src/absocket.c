@@ -6,7 +6,9 @@
 #define _POSIX_C_SOURCE 201112LL
 
 #include <errno.h>
-#include <netdb.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,9 +25,14 @@
 
 #include "log.h"
 #include "absocket.h"
+#include "net.h"
+#include "tls_cache.h"
+#include "util/time.h"
 #include "urlparse.h"
 
 void abs_init() {
+	// A connection that's gone away shows up as EPIPE rather than killing us
+	signal(SIGPIPE, SIG_IGN);
 #ifdef USE_OPENSSL
 	SSL_load_error_strings();
 	SSL_library_init();
@@ -34,13 +41,38 @@ void abs_init() {
 
 #ifdef USE_OPENSSL
 
+#define HANDSHAKE_TIMEOUT (30 * 1000)
+
+static long elapsed_ms(const struct timespec *since) {
+	struct timespec now;
+	get_nanoseconds(&now);
+	return (now.tv_sec - since->tv_sec) * 1000
+		+ (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/*
+ * The socket is non-blocking, so we wait for it ourselves between the steps of
+ * the handshake, and give up on a server that's stopped answering once
+ * HANDSHAKE_TIMEOUT is up.
+ */
 static bool ab_ssl_negotiate(absocket_t *abs) {
-	SSL_set_mode(abs->ssl, SSL_MODE_AUTO_RETRY);
+	SSL_set_mode(abs->ssl, SSL_MODE_AUTO_RETRY | SSL_MODE_ENABLE_PARTIAL_WRITE
+			| SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
 	int err;
-	if ((err = SSL_connect(abs->ssl)) != 1) {
-		const char *errmsg;
+	struct timespec start;
+	get_nanoseconds(&start);
+	ERR_clear_error();
+	while ((err = SSL_connect(abs->ssl)) != 1) {
+		const char *errmsg = NULL;
+		struct pollfd pfd = { .fd = abs->basefd };
 		switch (SSL_get_error(abs->ssl, err))
 		{
+		case SSL_ERROR_WANT_READ:
+			pfd.events = POLLIN;
+			break;
+		case SSL_ERROR_WANT_WRITE:
+			pfd.events = POLLOUT;
+			break;
 		case SSL_ERROR_SYSCALL:
 			errmsg = "I/O error";
 			break;
@@ -51,109 +83,92 @@ static bool ab_ssl_negotiate(absocket_t *abs) {
 			errmsg = "Unknown error";
 			break;
 		}
-		worker_log(L_ERROR, "SSL error %s", errmsg);
-		return false;
+		long left = HANDSHAKE_TIMEOUT - elapsed_ms(&start);
+		int ready = 0;
+		while (!errmsg && left > 0
+				&& (ready = poll(&pfd, 1, left)) < 0 && errno == EINTR) {
+			left = HANDSHAKE_TIMEOUT - elapsed_ms(&start);
+		}
+		if (!errmsg && ready < 0) {
+			errmsg = strerror(errno);
+		} else if (!errmsg && ready == 0) {
+			errmsg = "handshake timed out";
+		}
+		if (errmsg) {
+			worker_log(L_ERROR, "SSL error %s", errmsg);
+			return false;
+		}
+		ERR_clear_error();
 	}
+	abs->handshake_ms = elapsed_ms(&start);
+	abs->resumed = SSL_session_reused(abs->ssl);
 	/*
 	 * Grabs the certificate because presumably the consumer of this function
-	 * will want it. We don't use it for anything here
+	 * will want it. We don't use it for anything here. A resumed session
+	 * still has the one from the first handshake.
 	 */
 	abs->cert = SSL_get_peer_certificate(abs->ssl);
 	if (!abs->cert) {
 		worker_log(L_ERROR, "Unable to get peer certificate");
 		return false;
 	}
-	worker_log(L_DEBUG, "%s connection established using %s (%s)",
+	worker_log(L_DEBUG, "%s connection established using %s (%s), "
+			"%s handshake in %ld ms",
 			SSL_get_version(abs->ssl),
 			SSL_get_cipher_version(abs->ssl),
-			SSL_get_cipher_name(abs->ssl));
+			SSL_get_cipher_name(abs->ssl),
+			abs->resumed ? "resumed" : "full", abs->handshake_ms);
 	return true;
 }
 
 bool ab_enable_ssl(absocket_t *abs) {
 	/*
 	 * This function assumes that the connection has already been established,
-	 * it just does the SSL stuff.
+	 * it just does the SSL stuff. The SSL_CTX is shared by every connection,
+	 * so that they can resume each other's sessions.
 	 */
-	long ssl_options = 0;
-	abs->ctx = SSL_CTX_new(SSLv23_client_method());
-	if (!abs->ctx) {
-		worker_log(L_ERROR, "Unable to allocate SSL context");
-		goto bail_abs;
-	}
-	// TODO: Make ssl_options customizable
-	ssl_options |= SSL_OP_NO_SSLv3 | SSL_OP_NO_SSLv2;
-	if (!SSL_CTX_set_options(abs->ctx, ssl_options)) {
-		worker_log(L_ERROR, "Unable to set SSL options");
-		goto bail_sslctx;
-	}
-	// TODO: client certificates
-	//SSL_CTX_set_cipher_list(abs->ctx, ""); // TODO: configurable
-	abs->ssl = SSL_new(abs->ctx);
+	SSL_CTX *ctx = tls_context();
+	if (!ctx) {
+		return false;
+	}
+	abs->ssl = SSL_new(ctx);
 	if (!abs->ssl) {
 		worker_log(L_ERROR, "Unable to allocate SSL");
-		goto bail_sslctx;
+		return false;
 	}
 	if (SSL_set_fd(abs->ssl, abs->basefd) != 1) {
 		worker_log(L_ERROR, "Unable to set SSL fd");
-		goto bail_ssl;
+		SSL_free(abs->ssl);
+		abs->ssl = NULL;
+		return false;
 	}
-	if (!ab_ssl_negotiate(abs)) {
-		goto bail_ssl;
+	if (abs->host) {
+		SSL_set_tlsext_host_name(abs->ssl, abs->host);
+		tls_cache_resume(abs->ssl, abs->host, abs->port);
 	}
+	if (!net_set_blocking(abs->basefd, false) || !ab_ssl_negotiate(abs)) {
+		SSL_free(abs->ssl);
+		abs->ssl = NULL;
+		return false;
+	}
+	abs->use_ssl = true;
 	return true;
-bail_ssl:
-	free(abs->ctx);
-bail_sslctx:
-	free(abs->ssl);
-bail_abs:
-	absocket_free(abs);
-	return false;
 }
 
 #endif
 
 absocket_t *absocket_new(const struct uri *uri, bool use_ssl) {
-	absocket_t *abs = calloc(1, sizeof(absocket_t));
-
-	struct addrinfo hints;
-	memset(&hints, 0, sizeof(struct addrinfo));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
-	hints.ai_flags = 0;
-	hints.ai_protocol = 0;
-
-	struct addrinfo *result, *rp;
-	int s;
-	if ((s = getaddrinfo(uri->hostname, uri->port, &hints, &result))) {
-		worker_log(L_ERROR, "Connection failed: %s", gai_strerror(s));
-		absocket_free(abs);
-		// This might fail becuase i.e. you screwed up the name of the server
+	const char *error;
+	// This might fail becuase i.e. you screwed up the name of the server
+	int fd = net_connect(uri->hostname, uri->port, &error);
+	if (fd < 0) {
+		worker_log(L_ERROR, "Connection failed: %s", error);
 		return NULL;
 	}
-
-	int err = -1;
-	for (rp = result; rp != NULL; rp = rp->ai_next) {
-		abs->basefd = socket(rp->ai_family, rp->ai_socktype,
-				rp->ai_protocol);
-		if (abs->basefd == -1) {
-			// This might fail because i.e. you don't support ipv6
-			continue;
-		}
-		if (connect(abs->basefd, rp->ai_addr, rp->ai_addrlen) != -1) {
-			// This might fail because i.e. the server is dead
-			break;
-		}
-		err = errno;
-		close(abs->basefd);
-	}
-	if (rp == NULL) {
-		freeaddrinfo(result);
-		worker_log(L_ERROR, "Connection failed: %s", strerror(err));
-		return NULL;
-	}
-	freeaddrinfo(result);
-	abs->use_ssl = use_ssl;
+	absocket_t *abs = calloc(1, sizeof(absocket_t));
+	abs->basefd = fd;
+	abs->host = strdup(uri->hostname);
+	abs->port = strdup(uri->port);
 	if (use_ssl) {
 #ifndef USE_OPENSSL
 		worker_log(L_ERROR, "aerc was compiled without SSL support");
@@ -166,6 +181,10 @@ absocket_t *absocket_new(const struct uri *uri, bool use_ssl) {
 		}
 #endif
 	}
+	if (!net_set_blocking(abs->basefd, false)) {
+		absocket_free(abs);
+		return NULL;
+	}
 	return abs;
 }
 
@@ -173,37 +192,176 @@ void absocket_free(absocket_t *socket) {
 	if (!socket) return;
 	if (socket->use_ssl) {
 #ifdef USE_OPENSSL
+		// Without it OpenSSL won't resume the session again
 		SSL_shutdown(socket->ssl);
 		SSL_free(socket->ssl);
-		SSL_CTX_free(socket->ctx);
 #endif
 	}
 	close(socket->basefd);
+	free(socket->out);
+	free(socket->host);
+	free(socket->port);
 	free(socket);
 }
 
 ssize_t ab_recv(absocket_t *socket, void *buffer, size_t len) {
-	if (socket->use_ssl) {
+	if (!socket->use_ssl) {
+		return recv(socket->basefd, buffer, len, 0);
+	}
 #ifdef USE_OPENSSL
-		return SSL_read(socket->ssl, buffer, len);
-#else
-		assert(false);
+	socket->read_wants_write = false;
+	ERR_clear_error();
+	int amt = SSL_read(socket->ssl, buffer, len > INT_MAX ? INT_MAX : len);
+	if (amt > 0) {
+		return amt;
+	}
+	switch (SSL_get_error(socket->ssl, amt)) {
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	case SSL_ERROR_WANT_WRITE:
+		socket->read_wants_write = true;
+		// fallthrough
+	case SSL_ERROR_WANT_READ:
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_SYSCALL:
+		if (!errno) {
+			// The server hung up without closing the TLS session
+			return 0;
+		}
 		return -1;
+	default:
+		errno = EPROTO;
+		return -1;
+	}
+#else
+	assert(false);
+	return -1;
 #endif
-	} else {
-		return recv(socket->basefd, buffer, len, 0);
+}
+
+#ifdef USE_OPENSSL
+/*
+ * Once SSL_write has asked to be called again it has to be given the same
+ * bytes, so what it was given is kept in retry until it's taken them.
+ */
+static ssize_t write_ssl(absocket_t *socket, const char *data, size_t len) {
+	if (socket->retry) {
+		len = socket->retry;
+	}
+	ERR_clear_error();
+	int amt = SSL_write(socket->ssl, data, len > INT_MAX ? INT_MAX : len);
+	if (amt > 0) {
+		socket->retry = 0;
+		return amt;
+	}
+	switch (SSL_get_error(socket->ssl, amt)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		// POLLIN is always waited for, so either way it's called again
+		socket->retry = len;
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_SYSCALL:
+		if (!errno) {
+			errno = EPIPE;
+		}
+		return -1;
+	default:
+		errno = EPROTO;
+		return -1;
 	}
 }
+#endif
 
-ssize_t ab_send(absocket_t *socket, void *buffer, size_t len) {
-	if (socket->use_ssl) {
+/*
+ * Everything queued is one buffer, so however many commands were sent since
+ * the socket last took any, they go out in as few writes (and TLS records) as
+ * it'll accept.
+ */
+ssize_t ab_flush(absocket_t *socket) {
+	if (socket->error) {
+		errno = socket->error;
+		return -1;
+	}
+	while (socket->out_start < socket->out_end) {
+		const char *data = socket->out + socket->out_start;
+		size_t len = socket->out_end - socket->out_start;
+		ssize_t amt;
+		if (socket->use_ssl) {
 #ifdef USE_OPENSSL
-		return SSL_write(socket->ssl, buffer, len);
+			amt = write_ssl(socket, data, len);
 #else
-		assert(false);
-		return -1;
+			assert(false);
+			amt = -1;
 #endif
-	} else {
-		return send(socket->basefd, buffer, len, 0);
+		} else {
+			amt = send(socket->basefd, data, len, MSG_NOSIGNAL);
+		}
+		if (amt < 0 && errno == EINTR) {
+			continue;
+		}
+		if (amt < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
+		if (amt <= 0) {
+			socket->error = amt < 0 ? errno : EPIPE;
+			errno = socket->error;
+			return -1;
+		}
+		socket->out_start += amt;
 	}
+	if (socket->out_start == socket->out_end) {
+		socket->out_start = socket->out_end = 0;
+	}
+	return socket->out_end - socket->out_start;
+}
+
+ssize_t ab_send(absocket_t *socket, const void *buffer, size_t len) {
+	if (socket->error) {
+		errno = socket->error;
+		return -1;
+	}
+	if (socket->out_end + len > socket->out_size && socket->out_start) {
+		// SSL_write is fine with this, see SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+		memmove(socket->out, socket->out + socket->out_start,
+				socket->out_end - socket->out_start);
+		socket->out_end -= socket->out_start;
+		socket->out_start = 0;
+	}
+	if (socket->out_end + len > socket->out_size) {
+		size_t size = socket->out_size ? socket->out_size : 4096;
+		while (size < socket->out_end + len) {
+			size *= 2;
+		}
+		socket->out = realloc(socket->out, size);
+		socket->out_size = size;
+	}
+	memcpy(socket->out + socket->out_end, buffer, len);
+	socket->out_end += len;
+	if (ab_flush(socket) < 0) {
+		return -1;
+	}
+	return len;
+}
+
+short ab_events(absocket_t *socket) {
+	short events = POLLIN;
+	if (socket->out_start < socket->out_end) {
+		events |= POLLOUT;
+	}
+#ifdef USE_OPENSSL
+	if (socket->read_wants_write) {
+		events |= POLLOUT;
+	}
+#endif
+	return events;
+}
+
+bool ab_pending(absocket_t *socket) {
+#ifdef USE_OPENSSL
+	return socket->use_ssl && SSL_pending(socket->ssl) > 0;
+#else
+	return false;
+#endif
 }
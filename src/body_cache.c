@@ -0,0 +1,248 @@
+/*
+ * body_cache.c - refcounted message bodies and an LRU cache of them
+ */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "body_cache.h"
+#include "util/intern.h"
+
+struct body *body_new(uint8_t *data, size_t size) {
+	struct body *body = malloc(sizeof(struct body));
+	if (!body) {
+		free(data);
+		return NULL;
+	}
+	atomic_init(&body->refs, 1);
+	body->size = size;
+	body->data = data;
+	return body;
+}
+
+struct body *body_ref(struct body *body) {
+	if (body) {
+		atomic_fetch_add(&body->refs, 1);
+	}
+	return body;
+}
+
+void body_unref(struct body *body) {
+	if (!body || atomic_fetch_sub(&body->refs, 1) != 1) {
+		return;
+	}
+	free(body->data);
+	free(body);
+}
+
+struct cache_entry {
+	const char *mailbox; // Interned
+	uint32_t uid, part;
+	struct body *body;
+	struct cache_entry *bucket_next;
+	struct cache_entry *prev, *next; // Most recently used first
+};
+
+struct body_cache {
+	size_t budget;
+	size_t bucket_count; // A power of two
+	struct cache_entry **buckets;
+	struct cache_entry *head, *tail;
+	struct body_cache_stats stats;
+	body_evicted_t evicted;
+	void *data;
+};
+
+static size_t hash_key(const char *mailbox, uint32_t uid, uint32_t part) {
+	size_t hash = (uintptr_t)mailbox >> 4;
+	hash = hash * 31 + uid * 2654435761u;
+	hash = hash * 31 + part;
+	return hash ^ (hash >> 16);
+}
+
+struct body_cache *body_cache_create(size_t budget) {
+	struct body_cache *cache = calloc(1, sizeof(struct body_cache));
+	cache->budget = budget;
+	cache->bucket_count = 64;
+	cache->buckets = calloc(cache->bucket_count, sizeof(struct cache_entry *));
+	return cache;
+}
+
+void body_cache_free(struct body_cache *cache) {
+	if (!cache) {
+		return;
+	}
+	struct cache_entry *entry = cache->head;
+	while (entry) {
+		struct cache_entry *next = entry->next;
+		body_unref(entry->body);
+		free(entry);
+		entry = next;
+	}
+	free(cache->buckets);
+	free(cache);
+}
+
+void body_cache_on_evict(struct body_cache *cache,
+		body_evicted_t evicted, void *data) {
+	cache->evicted = evicted;
+	cache->data = data;
+}
+
+static struct cache_entry **find_slot(struct body_cache *cache,
+		const char *mailbox, uint32_t uid, uint32_t part) {
+	size_t i = hash_key(mailbox, uid, part) & (cache->bucket_count - 1);
+	struct cache_entry **slot = &cache->buckets[i];
+	while (*slot && ((*slot)->mailbox != mailbox
+				|| (*slot)->uid != uid || (*slot)->part != part)) {
+		slot = &(*slot)->bucket_next;
+	}
+	return slot;
+}
+
+static void lru_unlink(struct body_cache *cache, struct cache_entry *entry) {
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+}
+
+static void lru_push(struct body_cache *cache, struct cache_entry *entry) {
+	entry->next = cache->head;
+	if (cache->head) {
+		cache->head->prev = entry;
+	} else {
+		cache->tail = entry;
+	}
+	cache->head = entry;
+}
+
+static void remove_entry(struct body_cache *cache, struct cache_entry *entry) {
+	struct cache_entry **slot = find_slot(cache,
+			entry->mailbox, entry->uid, entry->part);
+	*slot = entry->bucket_next;
+	lru_unlink(cache, entry);
+	cache->stats.bytes -= entry->body->size;
+	--cache->stats.entries;
+}
+
+static void evict(struct body_cache *cache, struct cache_entry *keep) {
+	while (cache->stats.bytes > cache->budget
+			&& cache->tail && cache->tail != keep) {
+		struct cache_entry *entry = cache->tail;
+		remove_entry(cache, entry);
+		++cache->stats.evictions;
+		// Let go of our reference before the UI lets go of its own
+		body_unref(entry->body);
+		if (cache->evicted) {
+			cache->evicted(cache->data, entry->mailbox, entry->uid, entry->part);
+		}
+		free(entry);
+	}
+}
+
+void body_cache_set_budget(struct body_cache *cache, size_t budget) {
+	cache->budget = budget;
+	evict(cache, NULL);
+}
+
+static void grow(struct body_cache *cache) {
+	size_t count = cache->bucket_count * 2;
+	struct cache_entry **buckets = calloc(count, sizeof(struct cache_entry *));
+	for (size_t i = 0; i < cache->bucket_count; ++i) {
+		struct cache_entry *entry = cache->buckets[i];
+		while (entry) {
+			struct cache_entry *next = entry->bucket_next;
+			size_t j = hash_key(entry->mailbox, entry->uid, entry->part)
+				& (count - 1);
+			entry->bucket_next = buckets[j];
+			buckets[j] = entry;
+			entry = next;
+		}
+	}
+	free(cache->buckets);
+	cache->buckets = buckets;
+	cache->bucket_count = count;
+}
+
+void body_cache_put(struct body_cache *cache, const char *mailbox,
+		uint32_t uid, uint32_t part, struct body *body) {
+	mailbox = intern_mailbox(mailbox);
+	struct cache_entry **slot = find_slot(cache, mailbox, uid, part);
+	struct cache_entry *entry = *slot;
+	if (entry) {
+		// Fetched again, e.g. after it was evicted from the UI's copy
+		lru_unlink(cache, entry);
+		cache->stats.bytes -= entry->body->size;
+		body_unref(entry->body);
+	} else {
+		if (cache->stats.entries >= cache->bucket_count) {
+			grow(cache);
+			slot = find_slot(cache, mailbox, uid, part);
+		}
+		entry = calloc(1, sizeof(struct cache_entry));
+		entry->mailbox = mailbox;
+		entry->uid = uid;
+		entry->part = part;
+		*slot = entry;
+		++cache->stats.entries;
+	}
+	entry->body = body_ref(body);
+	cache->stats.bytes += body->size;
+	lru_push(cache, entry);
+	evict(cache, entry);
+}
+
+struct body *body_cache_peek(struct body_cache *cache, const char *mailbox,
+		uint32_t uid, uint32_t part) {
+	mailbox = intern_mailbox_find(mailbox);
+	if (!mailbox) {
+		return NULL;
+	}
+	struct cache_entry *entry = *find_slot(cache, mailbox, uid, part);
+	return entry ? entry->body : NULL;
+}
+
+struct body *body_cache_get(struct body_cache *cache, const char *mailbox,
+		uint32_t uid, uint32_t part) {
+	mailbox = intern_mailbox_find(mailbox);
+	struct cache_entry *entry = mailbox ?
+		*find_slot(cache, mailbox, uid, part) : NULL;
+	if (!entry) {
+		++cache->stats.misses;
+		return NULL;
+	}
+	++cache->stats.hits;
+	lru_unlink(cache, entry);
+	lru_push(cache, entry);
+	return body_ref(entry->body);
+}
+
+void body_cache_drop_mailbox(struct body_cache *cache, const char *mailbox) {
+	mailbox = intern_mailbox_find(mailbox);
+	if (!mailbox) {
+		return;
+	}
+	struct cache_entry *entry = cache->head;
+	while (entry) {
+		struct cache_entry *next = entry->next;
+		if (entry->mailbox == mailbox) {
+			remove_entry(cache, entry);
+			body_unref(entry->body);
+			free(entry);
+		}
+		entry = next;
+	}
+}
+
+const struct body_cache_stats *body_cache_stats(struct body_cache *cache) {
+	return &cache->stats;
+}
@@ -0,0 +1,752 @@
+/*
+ * body_store.c - compressed, content-addressed on-disk store of message bodies
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "body_store.h"
+#include "log.h"
+#include "util/intern.h"
+
+/*
+ * The store directory holds objects/xx/<hash>, one compressed body per file,
+ * and the journal, which is the journal header followed by records. Replaying
+ * the records in order rebuilds the index and the order the bodies were last
+ * used in. Like the search index, it's a cache, so it's in host byte order.
+ */
+static const char object_magic[4] = { 'A', 'Z', 'B', '1' };
+static const char journal_magic[4] = { 'A', 'B', 'J', '1' };
+
+#define JOURNAL_VERSION 1
+#define MAX_MAILBOX 4096
+#define COMPACT_SLACK 1024 // Dead records we put up with regardless
+
+struct object_header {
+	char magic[4];
+	uint32_t size; // Decompressed, the zlib stream follows
+};
+
+struct journal_header {
+	char magic[4];
+	uint32_t version;
+};
+
+enum record_type {
+	RECORD_PUT = 1,
+	RECORD_TOUCH,
+	RECORD_DROP,
+};
+
+struct record {
+	uint8_t type;
+	uint8_t reserved;
+	uint16_t mailbox_length; // The mailbox name follows
+	uint32_t uidvalidity, uid, part;
+	uint32_t size, stored;
+	uint64_t hash[2];
+};
+
+_Static_assert(sizeof(struct record) == 40, "journal record layout");
+
+struct object {
+	uint64_t hash[2];
+	uint32_t size, stored;
+	size_t refs;
+	struct object *bucket_next;
+};
+
+struct store_entry {
+	const char *mailbox; // Interned
+	uint32_t uidvalidity, uid, part;
+	struct object *object;
+	struct store_entry *bucket_next;
+	struct store_entry *prev, *next; // Most recently used first
+};
+
+struct body_store {
+	char *path;
+	size_t budget;
+	int journal;
+	bool loading, swept;
+	size_t entry_buckets, object_buckets; // Powers of two
+	struct store_entry **entries;
+	struct object **objects;
+	struct store_entry *head, *tail;
+	struct body_store_stats stats;
+};
+
+static uint64_t mix(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	return x ^ (x >> 33);
+}
+
+static void hash_body(const uint8_t *data, size_t size, uint64_t hash[2]) {
+	uint64_t a = 0xcbf29ce484222325ull, b = mix(size);
+	for (size_t i = 0; i < size; ++i) {
+		a = (a ^ data[i]) * 0x100000001b3ull;
+		b = (b + data[i]) * 0x9e3779b97f4a7c15ull;
+		b ^= b >> 29;
+	}
+	hash[0] = mix(a);
+	hash[1] = mix(b ^ hash[0]);
+}
+
+static size_t hash_key(const char *mailbox, uint32_t uidvalidity,
+		uint32_t uid, uint32_t part) {
+	size_t hash = (uintptr_t)mailbox >> 4;
+	hash = hash * 31 + uidvalidity;
+	hash = hash * 31 + uid * 2654435761u;
+	hash = hash * 31 + part;
+	return hash ^ (hash >> 16);
+}
+
+static struct store_entry **find_entry(struct body_store *store,
+		const char *mailbox, uint32_t uidvalidity, uint32_t uid, uint32_t part) {
+	size_t i = hash_key(mailbox, uidvalidity, uid, part)
+		& (store->entry_buckets - 1);
+	struct store_entry **slot = &store->entries[i];
+	while (*slot && ((*slot)->mailbox != mailbox
+				|| (*slot)->uidvalidity != uidvalidity
+				|| (*slot)->uid != uid || (*slot)->part != part)) {
+		slot = &(*slot)->bucket_next;
+	}
+	return slot;
+}
+
+static struct object **find_object(struct body_store *store,
+		const uint64_t hash[2]) {
+	struct object **slot =
+		&store->objects[hash[0] & (store->object_buckets - 1)];
+	while (*slot && ((*slot)->hash[0] != hash[0]
+				|| (*slot)->hash[1] != hash[1])) {
+		slot = &(*slot)->bucket_next;
+	}
+	return slot;
+}
+
+static void grow_entries(struct body_store *store) {
+	size_t count = store->entry_buckets * 2;
+	struct store_entry **buckets = calloc(count, sizeof(struct store_entry *));
+	for (size_t i = 0; i < store->entry_buckets; ++i) {
+		struct store_entry *entry = store->entries[i];
+		while (entry) {
+			struct store_entry *next = entry->bucket_next;
+			size_t j = hash_key(entry->mailbox, entry->uidvalidity,
+					entry->uid, entry->part) & (count - 1);
+			entry->bucket_next = buckets[j];
+			buckets[j] = entry;
+			entry = next;
+		}
+	}
+	free(store->entries);
+	store->entries = buckets;
+	store->entry_buckets = count;
+}
+
+static void grow_objects(struct body_store *store) {
+	size_t count = store->object_buckets * 2;
+	struct object **buckets = calloc(count, sizeof(struct object *));
+	for (size_t i = 0; i < store->object_buckets; ++i) {
+		struct object *object = store->objects[i];
+		while (object) {
+			struct object *next = object->bucket_next;
+			size_t j = object->hash[0] & (count - 1);
+			object->bucket_next = buckets[j];
+			buckets[j] = object;
+			object = next;
+		}
+	}
+	free(store->objects);
+	store->objects = buckets;
+	store->object_buckets = count;
+}
+
+static void lru_unlink(struct body_store *store, struct store_entry *entry) {
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		store->head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		store->tail = entry->prev;
+	}
+	entry->prev = entry->next = NULL;
+}
+
+static void lru_push(struct body_store *store, struct store_entry *entry) {
+	entry->next = store->head;
+	if (store->head) {
+		store->head->prev = entry;
+	} else {
+		store->tail = entry;
+	}
+	store->head = entry;
+}
+
+/* Room for objects/xx/<32 hex digits>.tmp after the store's path */
+static char *object_path(struct body_store *store, const uint64_t hash[2],
+		bool tmp) {
+	size_t size = strlen(store->path) + sizeof("/objects/xx/.tmp") + 32;
+	char *path = malloc(size);
+	snprintf(path, size, "%s/objects/%02x/%016" PRIx64 "%016" PRIx64 "%s",
+			store->path, (unsigned)(hash[0] >> 56), hash[0], hash[1],
+			tmp ? ".tmp" : "");
+	return path;
+}
+
+static void append_record(struct body_store *store, enum record_type type,
+		struct store_entry *entry) {
+	if (store->loading || store->journal < 0) {
+		return;
+	}
+	++store->stats.journal;
+	size_t len = strlen(entry->mailbox);
+	uint8_t *buf = malloc(sizeof(struct record) + len);
+	struct record rec = {
+		.type = type,
+		.mailbox_length = len,
+		.uidvalidity = entry->uidvalidity,
+		.uid = entry->uid,
+		.part = entry->part,
+		.size = entry->object->size,
+		.stored = entry->object->stored,
+		.hash = { entry->object->hash[0], entry->object->hash[1] },
+	};
+	memcpy(buf, &rec, sizeof(rec));
+	memcpy(buf + sizeof(rec), entry->mailbox, len);
+	if (write(store->journal, buf, sizeof(rec) + len)
+			!= (ssize_t)(sizeof(rec) + len)) {
+		worker_log(L_ERROR, "Unable to write to the body store journal: %s",
+				strerror(errno));
+	}
+	free(buf);
+}
+
+static struct object *add_object(struct body_store *store,
+		const uint64_t hash[2], uint32_t size, uint32_t stored) {
+	if (store->stats.objects >= store->object_buckets) {
+		grow_objects(store);
+	}
+	struct object **slot = find_object(store, hash);
+	struct object *object = calloc(1, sizeof(struct object));
+	object->hash[0] = hash[0];
+	object->hash[1] = hash[1];
+	object->size = size;
+	object->stored = stored;
+	*slot = object;
+	++store->stats.objects;
+	store->stats.bytes += stored;
+	return object;
+}
+
+static void release_object(struct body_store *store, struct object *object) {
+	if (--object->refs) {
+		return;
+	}
+	if (!store->loading) {
+		// While replaying, a later record may have written it again
+		char *path = object_path(store, object->hash, false);
+		unlink(path);
+		free(path);
+	}
+	struct object **slot = find_object(store, object->hash);
+	*slot = object->bucket_next;
+	--store->stats.objects;
+	store->stats.bytes -= object->stored;
+	free(object);
+}
+
+static struct store_entry *add_entry(struct body_store *store,
+		const char *mailbox, uint32_t uidvalidity, uint32_t uid, uint32_t part) {
+	if (store->stats.entries >= store->entry_buckets) {
+		grow_entries(store);
+	}
+	struct store_entry **slot = find_entry(store, mailbox, uidvalidity, uid, part);
+	struct store_entry *entry = calloc(1, sizeof(struct store_entry));
+	entry->mailbox = mailbox;
+	entry->uidvalidity = uidvalidity;
+	entry->uid = uid;
+	entry->part = part;
+	*slot = entry;
+	++store->stats.entries;
+	return entry;
+}
+
+static void drop_entry(struct body_store *store, struct store_entry *entry) {
+	append_record(store, RECORD_DROP, entry);
+	struct store_entry **slot = find_entry(store, entry->mailbox,
+			entry->uidvalidity, entry->uid, entry->part);
+	*slot = entry->bucket_next;
+	lru_unlink(store, entry);
+	--store->stats.entries;
+	release_object(store, entry->object);
+	free(entry);
+}
+
+static void evict(struct body_store *store, struct store_entry *keep) {
+	while (store->stats.bytes > store->budget
+			&& store->tail && store->tail != keep) {
+		drop_entry(store, store->tail);
+	}
+}
+
+/* Points entry at object, letting go of the one it pointed at before */
+static void set_object(struct body_store *store, struct store_entry *entry,
+		struct object *object) {
+	++object->refs;
+	if (entry->object) {
+		release_object(store, entry->object);
+	}
+	entry->object = object;
+}
+
+static void replay(struct body_store *store, const struct record *rec,
+		const char *mailbox) {
+	struct store_entry *entry = *find_entry(store, mailbox,
+			rec->uidvalidity, rec->uid, rec->part);
+	switch (rec->type) {
+	case RECORD_PUT:;
+		struct object *object = *find_object(store, rec->hash);
+		if (!object) {
+			object = add_object(store, rec->hash, rec->size, rec->stored);
+		}
+		if (entry) {
+			lru_unlink(store, entry);
+		} else {
+			entry = add_entry(store, mailbox,
+					rec->uidvalidity, rec->uid, rec->part);
+		}
+		set_object(store, entry, object);
+		lru_push(store, entry);
+		break;
+	case RECORD_TOUCH:
+		if (entry) {
+			lru_unlink(store, entry);
+			lru_push(store, entry);
+		}
+		break;
+	case RECORD_DROP:
+		if (entry) {
+			drop_entry(store, entry);
+		}
+		break;
+	}
+}
+
+static char *journal_path(struct body_store *store, const char *name) {
+	char *path = malloc(strlen(store->path) + strlen(name) + 2);
+	sprintf(path, "%s/%s", store->path, name);
+	return path;
+}
+
+/*
+ * Replays the journal and opens it for appending. A record cut short by a
+ * crash is truncated away, and a journal we don't understand is started over.
+ */
+static void load_journal(struct body_store *store) {
+	char *path = journal_path(store, "journal");
+	int fd = open(path, O_RDWR | O_CREAT, 0600);
+	free(path);
+	if (fd < 0) {
+		worker_log(L_ERROR, "Unable to open the body store journal: %s",
+				strerror(errno));
+		return;
+	}
+	struct stat st;
+	uint8_t *map = NULL;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			map = NULL;
+		}
+	}
+	off_t end = 0;
+	struct journal_header header;
+	if (map && (size_t)st.st_size >= sizeof(header)) {
+		memcpy(&header, map, sizeof(header));
+		if (memcmp(header.magic, journal_magic, sizeof(journal_magic)) == 0
+				&& header.version == JOURNAL_VERSION) {
+			end = sizeof(header);
+		}
+	}
+	store->loading = true;
+	char mailbox[MAX_MAILBOX + 1];
+	while (end && (size_t)(st.st_size - end) >= sizeof(struct record)) {
+		struct record rec;
+		memcpy(&rec, map + end, sizeof(rec));
+		if (rec.type < RECORD_PUT || rec.type > RECORD_DROP
+				|| rec.mailbox_length > MAX_MAILBOX
+				|| (size_t)(st.st_size - end)
+					< sizeof(rec) + rec.mailbox_length) {
+			break;
+		}
+		memcpy(mailbox, map + end + sizeof(rec), rec.mailbox_length);
+		mailbox[rec.mailbox_length] = '\0';
+		replay(store, &rec, intern_mailbox(mailbox));
+		++store->stats.journal;
+		end += sizeof(rec) + rec.mailbox_length;
+	}
+	store->loading = false;
+	if (map) {
+		munmap(map, st.st_size);
+	}
+	if (!end) {
+		memcpy(header.magic, journal_magic, sizeof(journal_magic));
+		header.version = JOURNAL_VERSION;
+		if (ftruncate(fd, 0) != 0
+				|| write(fd, &header, sizeof(header)) != sizeof(header)) {
+			close(fd);
+			return;
+		}
+		end = sizeof(header);
+	} else if (end != st.st_size && ftruncate(fd, end) != 0) {
+		close(fd);
+		return;
+	}
+	if (lseek(fd, end, SEEK_SET) < 0) {
+		close(fd);
+		return;
+	}
+	store->journal = fd;
+}
+
+struct body_store *body_store_open(const char *path, size_t budget) {
+	struct body_store *store = calloc(1, sizeof(struct body_store));
+	store->path = strdup(path);
+	store->budget = budget;
+	store->journal = -1;
+	store->entry_buckets = store->object_buckets = 64;
+	store->entries = calloc(store->entry_buckets, sizeof(struct store_entry *));
+	store->objects = calloc(store->object_buckets, sizeof(struct object *));
+	char *objects = journal_path(store, "objects");
+	if ((mkdir(path, 0700) != 0 && errno != EEXIST)
+			|| (mkdir(objects, 0700) != 0 && errno != EEXIST)) {
+		worker_log(L_ERROR, "Unable to create %s: %s", objects, strerror(errno));
+	}
+	free(objects);
+	load_journal(store);
+	evict(store, NULL);
+	worker_log(L_DEBUG, "Body store has %zu bodies, %zu bytes",
+			store->stats.entries, store->stats.bytes);
+	return store;
+}
+
+void body_store_close(struct body_store *store) {
+	if (!store) {
+		return;
+	}
+	struct store_entry *entry = store->head;
+	while (entry) {
+		struct store_entry *next = entry->next;
+		free(entry);
+		entry = next;
+	}
+	for (size_t i = 0; i < store->object_buckets; ++i) {
+		struct object *object = store->objects[i];
+		while (object) {
+			struct object *next = object->bucket_next;
+			free(object);
+			object = next;
+		}
+	}
+	if (store->journal >= 0) {
+		close(store->journal);
+	}
+	free(store->entries);
+	free(store->objects);
+	free(store->path);
+	free(store);
+}
+
+void body_store_set_budget(struct body_store *store, size_t budget) {
+	store->budget = budget;
+	evict(store, NULL);
+}
+
+static bool write_object(struct body_store *store, const uint64_t hash[2],
+		const uint8_t *data, size_t size, uint32_t *stored) {
+	uLongf length = compressBound(size);
+	uint8_t *buf = malloc(sizeof(struct object_header) + length);
+	struct object_header header;
+	memcpy(header.magic, object_magic, sizeof(object_magic));
+	header.size = size;
+	memcpy(buf, &header, sizeof(header));
+	if (compress2(buf + sizeof(header), &length, data, size,
+				Z_DEFAULT_COMPRESSION) != Z_OK) {
+		free(buf);
+		return false;
+	}
+	length += sizeof(header);
+
+	char *tmp = object_path(store, hash, true);
+	// objects/xx
+	char *slash = strrchr(tmp, '/');
+	*slash = '\0';
+	mkdir(tmp, 0700);
+	*slash = '/';
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	bool ok = fd >= 0 && write(fd, buf, length) == (ssize_t)length;
+	if (fd >= 0) {
+		ok = close(fd) == 0 && ok;
+	}
+	char *path = object_path(store, hash, false);
+	if (!ok || rename(tmp, path) != 0) {
+		worker_log(L_ERROR, "Unable to write %s: %s", path, strerror(errno));
+		unlink(tmp);
+		ok = false;
+	}
+	free(path);
+	free(tmp);
+	free(buf);
+	*stored = length;
+	return ok;
+}
+
+bool body_store_put(struct body_store *store, const char *mailbox,
+		uint32_t uidvalidity, uint32_t uid, uint32_t part,
+		const uint8_t *data, size_t size) {
+	if (size > UINT32_MAX) {
+		return false;
+	}
+	mailbox = intern_mailbox(mailbox);
+	uint64_t hash[2];
+	hash_body(data, size, hash);
+	struct object *object = *find_object(store, hash);
+	if (!object) {
+		uint32_t stored;
+		if (!write_object(store, hash, data, size, &stored)) {
+			return false;
+		}
+		object = add_object(store, hash, size, stored);
+	}
+	struct store_entry *entry = *find_entry(store,
+			mailbox, uidvalidity, uid, part);
+	if (entry) {
+		lru_unlink(store, entry);
+	} else {
+		entry = add_entry(store, mailbox, uidvalidity, uid, part);
+	}
+	set_object(store, entry, object);
+	lru_push(store, entry);
+	append_record(store, RECORD_PUT, entry);
+	evict(store, entry);
+	return true;
+}
+
+bool body_store_link(struct body_store *store, const char *mailbox,
+		uint32_t uidvalidity, uint32_t uid, uint32_t part,
+		const char *to_mailbox, uint32_t to_uidvalidity, uint32_t to_uid) {
+	mailbox = intern_mailbox_find(mailbox);
+	struct store_entry *from = mailbox ?
+		*find_entry(store, mailbox, uidvalidity, uid, part) : NULL;
+	if (!from) {
+		return false;
+	}
+	to_mailbox = intern_mailbox(to_mailbox);
+	struct store_entry *entry = *find_entry(store,
+			to_mailbox, to_uidvalidity, to_uid, part);
+	if (entry == from) {
+		return true;
+	} else if (entry) {
+		lru_unlink(store, entry);
+	} else {
+		entry = add_entry(store, to_mailbox, to_uidvalidity, to_uid, part);
+	}
+	// Holds the object, so evicting from can't take it out from under us
+	set_object(store, entry, from->object);
+	lru_push(store, entry);
+	append_record(store, RECORD_PUT, entry);
+	evict(store, entry);
+	return true;
+}
+
+bool body_store_contains(struct body_store *store, const char *mailbox,
+		uint32_t uidvalidity, uint32_t uid, uint32_t part) {
+	mailbox = intern_mailbox_find(mailbox);
+	return mailbox && *find_entry(store, mailbox, uidvalidity, uid, part);
+}
+
+static uint8_t *read_object(struct body_store *store, struct object *object) {
+	char *path = object_path(store, object->hash, false);
+	int fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct object_header header;
+	struct stat st;
+	uint8_t *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(header)) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+	uint8_t *data = NULL;
+	memcpy(&header, map, sizeof(header));
+	if (memcmp(header.magic, object_magic, sizeof(object_magic)) == 0
+			&& header.size == object->size) {
+		uLongf length = object->size;
+		// malloc(0) may return NULL
+		data = malloc(length ? length : 1);
+		if (uncompress(data, &length, map + sizeof(header),
+					st.st_size - sizeof(header)) != Z_OK
+				|| length != object->size) {
+			free(data);
+			data = NULL;
+		}
+	}
+	munmap(map, st.st_size);
+	return data;
+}
+
+struct body *body_store_get(struct body_store *store, const char *mailbox,
+		uint32_t uidvalidity, uint32_t uid, uint32_t part) {
+	mailbox = intern_mailbox_find(mailbox);
+	struct store_entry *entry = mailbox ?
+		*find_entry(store, mailbox, uidvalidity, uid, part) : NULL;
+	if (!entry) {
+		return NULL;
+	}
+	uint8_t *data = read_object(store, entry->object);
+	if (!data) {
+		worker_log(L_DEBUG, "Body store lost %s %" PRIu32 " part %" PRIu32,
+				mailbox, uid, part);
+		drop_entry(store, entry);
+		return NULL;
+	}
+	lru_unlink(store, entry);
+	lru_push(store, entry);
+	append_record(store, RECORD_TOUCH, entry);
+	return body_new(data, entry->object->size);
+}
+
+/* Removes the objects no entry refers to, e.g. after a crash */
+static void sweep(struct body_store *store) {
+	char *objects = journal_path(store, "objects");
+	DIR *top = opendir(objects);
+	size_t removed = 0;
+	struct dirent *dent;
+	while (top && (dent = readdir(top))) {
+		if (dent->d_name[0] == '.') {
+			continue;
+		}
+		size_t size = strlen(objects) + strlen(dent->d_name) + 2;
+		char *subdir = malloc(size);
+		snprintf(subdir, size, "%s/%s", objects, dent->d_name);
+		DIR *dir = opendir(subdir);
+		struct dirent *oent;
+		while (dir && (oent = readdir(dir))) {
+			uint64_t hash[2];
+			char hi[17] = { 0 }, lo[17] = { 0 };
+			if (oent->d_name[0] == '.') {
+				continue;
+			}
+			if (strlen(oent->d_name) == 32) {
+				memcpy(hi, oent->d_name, 16);
+				memcpy(lo, oent->d_name + 16, 16);
+				hash[0] = strtoull(hi, NULL, 16);
+				hash[1] = strtoull(lo, NULL, 16);
+				if (*find_object(store, hash)) {
+					continue;
+				}
+			}
+			size_t len = strlen(subdir) + strlen(oent->d_name) + 2;
+			char *file = malloc(len);
+			snprintf(file, len, "%s/%s", subdir, oent->d_name);
+			if (unlink(file) == 0) {
+				++removed;
+			}
+			free(file);
+		}
+		if (dir) {
+			closedir(dir);
+		}
+		free(subdir);
+	}
+	if (top) {
+		closedir(top);
+	}
+	free(objects);
+	if (removed) {
+		worker_log(L_DEBUG, "Removed %zu stray bodies from the store", removed);
+	}
+}
+
+/*
+ * Writes a journal with one PUT per entry, least recently used first so that
+ * replaying it puts them back in the same order.
+ */
+static bool compact(struct body_store *store) {
+	char *tmp = journal_path(store, "journal.tmp");
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		free(tmp);
+		return false;
+	}
+	struct journal_header header;
+	memcpy(header.magic, journal_magic, sizeof(journal_magic));
+	header.version = JOURNAL_VERSION;
+	bool ok = write(fd, &header, sizeof(header)) == sizeof(header);
+	int old = store->journal;
+	store->journal = fd;
+	store->stats.journal = 0;
+	for (struct store_entry *entry = store->tail; entry; entry = entry->prev) {
+		append_record(store, RECORD_PUT, entry);
+	}
+	ok = ok && fsync(fd) == 0;
+	char *path = journal_path(store, "journal");
+	if (!ok || rename(tmp, path) != 0) {
+		worker_log(L_ERROR, "Unable to compact the body store journal");
+		close(fd);
+		unlink(tmp);
+		store->journal = old;
+		// Make sure we try again later rather than straight away
+		store->stats.journal = store->stats.entries * 2 + COMPACT_SLACK;
+		ok = false;
+	} else {
+		close(old);
+	}
+	free(path);
+	free(tmp);
+	return ok;
+}
+
+bool body_store_maintain(struct body_store *store) {
+	if (!store->swept) {
+		sweep(store);
+		store->swept = true;
+		return true;
+	}
+	if (store->journal >= 0 && store->stats.journal
+			> store->stats.entries * 2 + COMPACT_SLACK) {
+		worker_log(L_DEBUG, "Compacting body store journal, %zu records for "
+				"%zu bodies", store->stats.journal, store->stats.entries);
+		compact(store);
+		return true;
+	}
+	return false;
+}
+
+const struct body_store_stats *body_store_stats(struct body_store *store) {
+	return &store->stats;
+}
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include "email/flags.h"
 #include "util/stringop.h"
 #include "handlers.h"
 #include "commands.h"
@@ -27,6 +28,9 @@ static void handle_quit(int argc, char **argv) {
 
 static void handle_reload() {
 	load_main_config(NULL);
+	for (size_t i = 0; i < state->accounts->length; ++i) {
+		configure_worker(state->accounts->items[i]);
+	}
 }
 
 static void handle_message_seek(char *cmd, int mul, int argc, char **argv) {
@@ -63,12 +67,14 @@ static void handle_message_seek(char *cmd, int mul, int argc, char **argv) {
 	}
 	int new = (int)account->ui.selected_message + amt;
 	if (new < 0) amt -= new;
-	if (new >= (int)mbox->messages->length) amt -= new - mbox->messages->length + 1;
+	int rows = displayed_rows(account, mbox);
+	if (new >= rows) amt -= new - rows + 1;
 	if (scroll) {
 		account->ui.list_offset += amt;
 	}
 	account->ui.selected_message += amt;
 	scroll_selected_into_view();
+	request_prefetch(account);
 	request_rerender(PANEL_MESSAGE_LIST);
 }
 
@@ -98,15 +104,17 @@ static void handle_select_message(int argc, char **argv) {
 	if (!mbox) {
 		return;
 	}
+	int rows = displayed_rows(account, mbox);
 	if (requested < 0) {
-		requested = mbox->messages->length + requested;
+		requested = rows + requested;
 	}
-	if (requested > (int)mbox->messages->length) {
+	if (requested > rows) {
 		set_status(account, ACCOUNT_ERROR, "Requested message is out of range.");
 		return;
 	}
 	account->ui.selected_message = requested;
 	scroll_selected_into_view();
+	request_prefetch(account);
 	request_rerender(PANEL_MESSAGE_LIST);
 }
 
@@ -155,8 +163,7 @@ static void handle_next_folder(int argc, char **argv) {
 			next = account->mailboxes->items[i];
 		}
 	}
-	worker_post_action(account->worker.pipe, WORKER_SELECT_MAILBOX,
-			NULL, strdup(next->name));
+	request_select(account, strdup(next->name));
 	request_rerender(PANEL_SIDEBAR | PANEL_MESSAGE_LIST);
 }
 
@@ -193,8 +200,7 @@ static void handle_previous_folder(int argc, char **argv) {
 			next = account->mailboxes->items[i];
 		}
 	}
-	worker_post_action(account->worker.pipe, WORKER_SELECT_MAILBOX,
-			NULL, strdup(next->name));
+	request_select(account, strdup(next->name));
 	request_rerender(PANEL_SIDEBAR | PANEL_MESSAGE_LIST);
 }
 
@@ -203,8 +209,7 @@ static void handle_cd(int argc, char **argv) {
 		state->accounts->items[state->selected_account];
 	close_message(account);
 	char *joined = join_args(argv, argc);
-	worker_post_action(account->worker.pipe, WORKER_SELECT_MAILBOX,
-			NULL, joined);
+	request_select(account, joined);
 	request_rerender(PANEL_SIDEBAR | PANEL_MESSAGE_LIST);
 }
 
@@ -267,12 +272,16 @@ static void handle_view_message(int argc, char **argv) {
 		set_status(account, ACCOUNT_ERROR, "Failed to read mailbox");
 		return;
 	}
-	if (!mbox->messages->length) {
+	if (!displayed_rows(account, mbox)) {
 		set_status(account, ACCOUNT_ERROR, "Failed to read empty message");
 		return;
 	}
-	account->viewer.msg = mbox->messages->items[
-		mbox->messages->length - account->ui.selected_message - 1];
+	account->viewer.msg = get_message_at_row(account, mbox,
+			account->ui.selected_message);
+	if (!account->viewer.msg) {
+		set_status(account, ACCOUNT_ERROR, "Requested message is out of range.");
+		return;
+	}
 	load_message_viewer(account);
 	request_rerender(PANEL_MESSAGE_VIEW);
 }
@@ -313,6 +322,23 @@ static void handle_close_message(int argc, char **argv) {
 	close_message(account);
 }
 
+/* Out of sight straight away, see handle_worker_move_error */
+static void hide_messages(struct account_state *account,
+		struct aerc_mailbox *mbox, const struct uid_set *uids) {
+	if (!account->ui.moving) {
+		account->ui.moving = uid_set_create();
+	}
+	for (size_t i = 0; i < uids->length; ++i) {
+		uid_set_add_range(account->ui.moving,
+				uids->ranges[i].min, uids->ranges[i].max);
+	}
+	update_filter(account);
+	size_t rows = displayed_rows(account, mbox);
+	if (rows && account->ui.selected_message >= rows) {
+		account->ui.selected_message = rows - 1;
+	}
+}
+
 static void handle_delete_message(int argc, char **argv) {
 	struct account_state *account =
 		state->accounts->items[state->selected_account];
@@ -334,67 +360,328 @@ static void handle_delete_message(int argc, char **argv) {
 	if (!mbox) {
 		return;
 	}
-	if (requested > mbox->messages->length) {
+	struct uid_set *uids = take_targets(account, mbox, requested);
+	if (!uids) {
 		set_status(account, ACCOUNT_ERROR, "Requested message is out of range.");
 		return;
 	}
-	requested = mbox->messages->length - requested - 1;
-	size_t *req = malloc(sizeof(size_t));
-	memcpy(req, &requested, sizeof(size_t));
+	struct aerc_message_move *req = calloc(1, sizeof(struct aerc_message_move));
+	req->mailbox = strdup(account->selected);
+	req->uids = uids;
+	hide_messages(account, mbox, uids);
 	worker_post_action(account->worker.pipe, WORKER_DELETE_MESSAGE, NULL, req);
-	handle_command("next-message");
 	request_rerender(PANEL_MESSAGE_LIST);
 }
 
-static void handle_copy_message(int argc, char **argv) {
+static void copy_or_move(const char *cmd, enum worker_message_type type,
+		int argc, char **argv) {
 	struct account_state *account =
 		state->accounts->items[state->selected_account];
 	if (argc < 1) {
-		set_status(account, ACCOUNT_ERROR, "Usage: copy-message [destination]");
+		set_status(account, ACCOUNT_ERROR, "Usage: %s [destination]", cmd);
 		return;
 	}
-	size_t requested = account->ui.selected_message;
 	struct aerc_mailbox *mbox = get_aerc_mailbox(account, account->selected);
 	if (!mbox) {
 		return;
 	}
-	if (requested > mbox->messages->length) {
+	struct uid_set *uids = take_targets(account, mbox,
+			account->ui.selected_message);
+	if (!uids) {
 		set_status(account, ACCOUNT_ERROR, "Requested message is out of range.");
 		return;
 	}
-	requested = mbox->messages->length - requested - 1;
-	struct aerc_message_move *req = malloc(sizeof(struct aerc_message_move));
-	req->index = requested;
+	struct aerc_message_move *req = calloc(1, sizeof(struct aerc_message_move));
+	req->mailbox = strdup(account->selected);
+	req->uids = uids;
 	req->destination = join_args(argv, argc);
-	set_status(account, ACCOUNT_OKAY, "Copying message to %s", req->destination);
-	worker_post_action(account->worker.pipe, WORKER_COPY_MESSAGE, NULL, req);
+	size_t count = uid_set_count(uids);
+	set_status(account, ACCOUNT_OKAY, "%s %zu message%s to %s",
+			type == WORKER_MOVE_MESSAGE ? "Moving" : "Copying",
+			count, count == 1 ? "" : "s", req->destination);
+	if (type == WORKER_MOVE_MESSAGE) {
+		hide_messages(account, mbox, uids);
+	}
+	worker_post_action(account->worker.pipe, type, NULL, req);
 	request_rerender(PANEL_MESSAGE_LIST);
 }
 
+static void handle_copy_message(int argc, char **argv) {
+	copy_or_move("copy-message", WORKER_COPY_MESSAGE, argc, argv);
+}
+
 static void handle_move_message(int argc, char **argv) {
+	copy_or_move("move-message", WORKER_MOVE_MESSAGE, argc, argv);
+}
+
+static void mark_row(struct account_state *account, struct aerc_mailbox *mbox,
+		size_t row, bool mark) {
+	struct aerc_message *msg = get_message_at_row(account, mbox, row);
+	if (!msg || !msg->uid) {
+		// We don't know its UID until it's loaded
+		return;
+	}
+	if (!account->ui.marks.uids) {
+		account->ui.marks.uids = uid_set_create();
+	}
+	if (mark) {
+		uid_set_add(account->ui.marks.uids, msg->uid);
+	} else {
+		uid_set_remove(account->ui.marks.uids, msg->uid);
+	}
+}
+
+/*
+ * Marks the selected message, or with -t toggles it, with -a marks everything
+ * shown and with -r everything between the last one marked and this one.
+ * delete-message, copy-message and move-message act on the marked messages
+ * if there are any.
+ */
+static void handle_mark(int argc, char **argv) {
 	struct account_state *account =
 		state->accounts->items[state->selected_account];
-	if (argc < 1) {
-		set_status(account, ACCOUNT_ERROR, "Usage: move-message [destination]");
+	char mode = argc == 1 && argv[0][0] == '-' && argv[0][1]
+		&& !argv[0][2] ? argv[0][1] : '\0';
+	if (argc > 1 || (argc == 1 && (!mode || !strchr("art", mode)))) {
+		set_status(account, ACCOUNT_ERROR, "Usage: mark [-a|-r|-t]");
+		return;
+	}
+	struct aerc_mailbox *mbox = get_aerc_mailbox(account, account->selected);
+	if (!mbox) {
+		return;
+	}
+	size_t selected = account->ui.selected_message;
+	size_t rows = displayed_rows(account, mbox);
+	struct aerc_message *msg = get_message_at_row(account, mbox, selected);
+	switch (mode) {
+	case 'a':
+		for (size_t row = 0; row < rows; ++row) {
+			mark_row(account, mbox, row, true);
+		}
+		break;
+	case 'r':;
+		size_t first = selected;
+		for (size_t row = 0; account->ui.marks.anchor && row < rows; ++row) {
+			struct aerc_message *anchor = get_message_at_row(account, mbox, row);
+			if (anchor && anchor->uid == account->ui.marks.anchor) {
+				first = row;
+				break;
+			}
+		}
+		for (size_t row = first < selected ? first : selected;
+				row <= (first < selected ? selected : first); ++row) {
+			mark_row(account, mbox, row, true);
+		}
+		break;
+	case 't':
+		mark_row(account, mbox, selected, !(msg && account->ui.marks.uids
+				&& uid_set_contains(account->ui.marks.uids, msg->uid)));
+		break;
+	default:
+		mark_row(account, mbox, selected, true);
+		break;
+	}
+	if (msg && msg->uid) {
+		account->ui.marks.anchor = msg->uid;
+	}
+	size_t count = account->ui.marks.uids ?
+		uid_set_count(account->ui.marks.uids) : 0;
+	set_status(account, ACCOUNT_OKAY, "%zu marked", count);
+	request_rerender(PANEL_MESSAGE_LIST);
+}
+
+static void handle_unmark(int argc, char **argv) {
+	struct account_state *account =
+		state->accounts->items[state->selected_account];
+	if (argc > 1 || (argc == 1 && strcmp(argv[0], "-a") != 0)) {
+		set_status(account, ACCOUNT_ERROR, "Usage: unmark [-a]");
+		return;
+	}
+	struct aerc_mailbox *mbox = get_aerc_mailbox(account, account->selected);
+	if (argc == 1 || !mbox) {
+		clear_marks(account);
+	} else {
+		mark_row(account, mbox, account->ui.selected_message, false);
+	}
+	request_rerender(PANEL_MESSAGE_LIST);
+}
+
+/*
+ * Sets or clears a flag on the marked messages or the selected one. With -t it
+ * clears it if they all have it and sets it otherwise.
+ */
+static void flag_command(const char *cmd, uint32_t flag, bool add, bool toggle,
+		int argc, char **argv) {
+	struct account_state *account =
+		state->accounts->items[state->selected_account];
+	if (argc > 1 || (argc == 1 && (!toggle || strcmp(argv[0], "-t") != 0))) {
+		set_status(account, ACCOUNT_ERROR, toggle ?
+				"Usage: %s [-t]" : "Usage: %s", cmd);
 		return;
 	}
-	size_t requested = account->ui.selected_message;
 	struct aerc_mailbox *mbox = get_aerc_mailbox(account, account->selected);
 	if (!mbox) {
 		return;
 	}
-	if (requested > mbox->messages->length) {
+	struct uid_set *uids = take_targets(account, mbox,
+			account->ui.selected_message);
+	if (!uids) {
 		set_status(account, ACCOUNT_ERROR, "Requested message is out of range.");
 		return;
 	}
-	requested = mbox->messages->length - requested - 1;
-	struct aerc_message_move *req = malloc(sizeof(struct aerc_message_move));
-	req->index = requested;
-	req->destination = join_args(argv, argc);
-	set_status(account, ACCOUNT_OKAY, "Moving message to %s", req->destination);
-	worker_post_action(account->worker.pipe, WORKER_MOVE_MESSAGE, NULL, req);
-	handle_command("next-message");
+	if (argc == 1) {
+		add = false;
+		for (size_t i = 0; i < mbox->messages->length && !add; ++i) {
+			struct aerc_message *msg = mbox->messages->items[i];
+			add = msg->uid && uid_set_contains(uids, msg->uid)
+				&& !(msg->flags & flag);
+		}
+	}
+	change_flags(account, mbox, uids, flag, add);
+}
+
+static void handle_read(int argc, char **argv) {
+	flag_command("read", FLAG_SEEN, true, true, argc, argv);
+}
+
+static void handle_unread(int argc, char **argv) {
+	flag_command("unread", FLAG_SEEN, false, false, argc, argv);
+}
+
+static void handle_flag(int argc, char **argv) {
+	flag_command("flag", FLAG_FLAGGED, true, true, argc, argv);
+}
+
+static void handle_unflag(int argc, char **argv) {
+	flag_command("unflag", FLAG_FLAGGED, false, false, argc, argv);
+}
+
+static void handle_sort(int argc, char **argv) {
+	struct account_state *account =
+		state->accounts->items[state->selected_account];
+	bool reverse = false;
+	if (argc > 0 && strcmp(argv[0], "-r") == 0) {
+		reverse = true;
+		--argc; ++argv;
+	}
+	if (argc != 1) {
+		set_status(account, ACCOUNT_ERROR,
+				"Usage: sort [-r] none|date|from|subject|size");
+		return;
+	}
+	static const char *names[] = {
+		[SORT_NONE] = "none",
+		[SORT_DATE] = "date",
+		[SORT_FROM] = "from",
+		[SORT_SUBJECT] = "subject",
+		[SORT_SIZE] = "size",
+	};
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		if (strcasecmp(argv[0], names[i]) == 0) {
+			account->ui.order.sort = i;
+			account->ui.order.reverse = reverse;
+			request_sort(account);
+			request_rerender(PANEL_MESSAGE_LIST);
+			return;
+		}
+	}
+	set_status(account, ACCOUNT_ERROR,
+			"Usage: sort [-r] none|date|from|subject|size");
+}
+
+static void handle_thread(int argc, char **argv) {
+	struct account_state *account =
+		state->accounts->items[state->selected_account];
+	if (argc != 1) {
+		set_status(account, ACCOUNT_ERROR,
+				"Usage: thread none|references|orderedsubject");
+		return;
+	}
+	static const char *names[] = {
+		[THREAD_NONE] = "none",
+		[THREAD_REFERENCES] = "references",
+		[THREAD_ORDEREDSUBJECT] = "orderedsubject",
+	};
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		if (strcasecmp(argv[0], names[i]) == 0) {
+			account->ui.order.thread = i;
+			request_sort(account);
+			request_rerender(PANEL_MESSAGE_LIST);
+			return;
+		}
+	}
+	set_status(account, ACCOUNT_ERROR,
+			"Usage: thread none|references|orderedsubject");
+}
+
+static void handle_search(int argc, char **argv) {
+	struct account_state *account =
+		state->accounts->items[state->selected_account];
+	struct aerc_mailbox *mbox = get_aerc_mailbox(account, account->selected);
+	if (mbox && account->ui.filtered) {
+		// Keep the selected message selected in the whole list
+		int index = get_index_at_row(account, mbox,
+				account->ui.selected_message);
+		clear_search(account);
+		if (index >= 0) {
+			account->ui.selected_message = message_view_row(
+					account->ui.view, mbox->messages->length, index);
+			scroll_selected_into_view();
+		}
+	} else {
+		clear_search(account);
+	}
 	request_rerender(PANEL_MESSAGE_LIST);
+	if (argc == 0) {
+		return;
+	}
+	set_status(account, ACCOUNT_OKAY, "Searching...");
+	worker_post_action(account->worker.pipe, WORKER_SEARCH,
+			NULL, join_args(argv, argc));
+}
+
+static int compare_indices(const void *_a, const void *_b) {
+	int a = *(const int *)_a, b = *(const int *)_b;
+	return (a > b) - (a < b);
+}
+
+static void handle_result_seek(char *cmd, int dir, int argc, char **argv) {
+	struct account_state *account =
+		state->accounts->items[state->selected_account];
+	if (argc != 0) {
+		set_status(account, ACCOUNT_ERROR, "Usage: %s", cmd);
+		return;
+	}
+	struct aerc_mailbox *mbox = get_aerc_mailbox(account, account->selected);
+	if (!mbox || !account->ui.search.length) {
+		set_status(account, ACCOUNT_ERROR, "No search results");
+		return;
+	}
+	size_t length = displayed_rows(account, mbox);
+	for (size_t n = 1; n <= length; ++n) {
+		// Wraps around, ending up back at the selected message
+		size_t row = (account->ui.selected_message +
+				(dir > 0 ? n : length - n)) % length;
+		int index = get_index_at_row(account, mbox, row);
+		if (index >= 0 && bsearch(&index, account->ui.search.indices,
+					account->ui.search.length, sizeof(int),
+					compare_indices)) {
+			close_message(account);
+			account->ui.selected_message = row;
+			scroll_selected_into_view();
+			request_prefetch(account);
+			request_rerender(PANEL_MESSAGE_LIST);
+			return;
+		}
+	}
+}
+
+static void handle_next_result(int argc, char **argv) {
+	handle_result_seek("next-result", 1, argc, argv);
+}
+
+static void handle_previous_result(int argc, char **argv) {
+	handle_result_seek("previous-result", -1, argc, argv);
 }
 
 struct cmd_handler {
@@ -414,21 +701,32 @@ struct cmd_handler cmd_handlers[] = {
 	{ "delete-mailbox", handle_delete_mailbox },
 	{ "delete-message", handle_delete_message },
 	{ "exit", handle_quit },
+	{ "flag", handle_flag },
+	{ "mark", handle_mark },
 	{ "mkdir", handle_create_mailbox },
 	{ "move-message", handle_move_message },
 	{ "mv", handle_move_message },
 	{ "next-account", handle_next_account },
 	{ "next-folder", handle_next_folder },
 	{ "next-message", handle_next_message },
+	{ "next-result", handle_next_result },
 	{ "previous-account", handle_previous_account },
 	{ "previous-folder", handle_previous_folder },
 	{ "previous-message", handle_previous_message },
+	{ "previous-result", handle_previous_result },
 	{ "q", handle_quit },
 	{ "quit", handle_quit },
+	{ "read", handle_read },
 	{ "reload", handle_reload },
+	{ "search", handle_search },
 	{ "select-message", handle_select_message },
 	{ "set", handle_set },
+	{ "sort", handle_sort },
 	{ "term-exec", handle_term_exec },
+	{ "thread", handle_thread },
+	{ "unflag", handle_unflag },
+	{ "unmark", handle_unmark },
+	{ "unread", handle_unread },
 	{ "view-message", handle_view_message },
 };
 
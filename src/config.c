@@ -157,7 +157,13 @@ int handle_config_option(void *_config, const char *section,
 	};
 	struct { const char *section; const char *key; int *value; } integers[] = {
 		{ "ui", "sidebar-width", &config->ui.sidebar_width },
-		{ "ui", "preview-height", &config->ui.preview_height }
+		{ "ui", "preview-height", &config->ui.preview_height },
+		{ "ui", "prefetch-messages", &config->ui.prefetch_messages },
+		{ "ui", "prefetch-budget", &config->ui.prefetch_budget },
+		{ "cache", "max-memory", &config->cache.max_memory },
+		{ "cache", "max-disk", &config->cache.max_disk },
+		{ "cache", "background-connections",
+			&config->cache.background_connections }
 	};
 	struct {
 		const char *section;
@@ -290,6 +296,9 @@ static int handle_account_option(void *_config, const char *section,
 
 	if (strcmp(key, "source") == 0) {
 		account->source = strdup(value);
+	} else if (strcmp(key, "outgoing") == 0) {
+		free(account->outgoing);
+		account->outgoing = strdup(value);
 	} else if (strcmp(key, "folders") == 0 && *value) {
 		if (account->folders) {
 			free_flat_list(account->folders);
@@ -342,6 +351,11 @@ static void config_defaults(struct aerc_config *config) {
 	config->ui.sidebar_width = 20;
 	config->ui.preview_height = 12;
 	config->ui.empty_message = strdup("(no messages)");
+	config->ui.prefetch_messages = 2;
+	config->ui.prefetch_budget = 1024;
+	config->cache.max_memory = 64;
+	config->cache.max_disk = 1024;
+	config->cache.background_connections = 2;
 
 	config->viewer.pager = strdup("less -r");
 	config->viewer.alternatives = create_list();
@@ -355,6 +369,7 @@ void free_config(struct aerc_config *config) {
 		struct account_config *account = config->accounts->items[i];
 		free(account->name);
 		free(account->source);
+		free(account->outgoing);
 		for (size_t j = 0; j < account->extras->length; ++j) {
 			struct account_config_extra *extra = account->extras->items[i];
 			free(extra->key);
@@ -0,0 +1,81 @@
+/*
+ * email/flags.c - maps IMAP system flags to and from a bitmask, and keeps
+ * track of keywords
+ */
+#include <stddef.h>
+#include <strings.h>
+
+#include "email/flags.h"
+#include "util/intern.h"
+#include "util/list.h"
+
+static const struct {
+	enum message_flag flag;
+	const char *name;
+} system_flags[] = {
+	{ FLAG_SEEN, "\\Seen" },
+	{ FLAG_ANSWERED, "\\Answered" },
+	{ FLAG_FLAGGED, "\\Flagged" },
+	{ FLAG_DELETED, "\\Deleted" },
+	{ FLAG_DRAFT, "\\Draft" },
+	{ FLAG_RECENT, "\\Recent" },
+};
+
+uint32_t parse_flag(const char *name) {
+	if (!name || name[0] != '\\') {
+		return 0;
+	}
+	for (size_t i = 0; i < sizeof(system_flags) / sizeof(system_flags[0]); ++i) {
+		if (strcasecmp(system_flags[i].name, name) == 0) {
+			return system_flags[i].flag;
+		}
+	}
+	return 0;
+}
+
+const char *flag_name(enum message_flag flag) {
+	for (size_t i = 0; i < sizeof(system_flags) / sizeof(system_flags[0]); ++i) {
+		if (system_flags[i].flag == flag) {
+			return system_flags[i].name;
+		}
+	}
+	return NULL;
+}
+
+/* RFC 5788's registry, and what the common clients set */
+static const char *const known_keywords[] = {
+	"$Forwarded", "$MDNSent", "$Junk", "$NotJunk", "$Phishing",
+	"$Important", "$Submitted", "$SubmitPending", "$Label1", "$Label2",
+	"$Label3", "$Label4", "$Label5", "Junk", "NonJunk", NULL,
+};
+
+const char *keyword_new(const char *name) {
+	return intern_known(name, known_keywords);
+}
+
+list_t *keywords_dup(const list_t *keywords) {
+	if (!keywords) {
+		return NULL;
+	}
+	list_t *copy = create_list();
+	for (size_t i = 0; i < keywords->length; ++i) {
+		list_add(copy, (void *)intern_copy(keywords->items[i]));
+	}
+	return copy;
+}
+
+void keywords_free(list_t *keywords) {
+	for (size_t i = 0; keywords && i < keywords->length; ++i) {
+		intern_release(keywords->items[i]);
+	}
+	list_free(keywords);
+}
+
+bool has_keyword(const list_t *keywords, const char *name) {
+	for (size_t i = 0; keywords && i < keywords->length; ++i) {
+		if (strcasecmp(keywords->items[i], name) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
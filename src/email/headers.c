@@ -8,45 +8,65 @@
 #include "email/encodings.h"
 #include "email/headers.h"
 #include "log.h"
-#include "util/list.h"
 #include "util/base64.h"
 #include "util/iconv.h"
+#include "util/intern.h"
 
-static void strapp(char **stringp, char *str, size_t n) {
-	if (!str || !*str || !stringp)
+struct strbuf {
+	char *data;
+	size_t len, size;
+};
+
+static void strbuf_append(struct strbuf *buf, const char *str, size_t n) {
+	if (!str || !n) {
 		return;
-	size_t m = *stringp ? strlen(*stringp) : 0;
-	*stringp = realloc(*stringp, m + n + 1);
-	memcpy(*stringp + m, str, n);
-	(*stringp)[m + n] = 0;
+	}
+	if (buf->len + n + 1 > buf->size) {
+		size_t size = buf->size ? buf->size : 64;
+		while (buf->len + n + 1 > size) {
+			size *= 2;
+		}
+		buf->data = realloc(buf->data, size);
+		buf->size = size;
+	}
+	memcpy(buf->data + buf->len, str, n);
+	buf->len += n;
+	buf->data[buf->len] = '\0';
 }
 
-static char *decode_rfc1342(char *input) {
-	char *res = NULL, *p, *cur;
+static char *decode_rfc1342(const char *input) {
+	/*
+	 * Decoded text is usually shorter than the encoded words it came from, so
+	 * sizing the buffer to the input means we rarely have to grow it.
+	 */
+	size_t inlen = strlen(input);
+	struct strbuf res = { .data = malloc(inlen + 1), .size = inlen + 1 };
+	res.data[0] = '\0';
+	const char *p, *cur;
 	for (cur = input; *cur;) {
 		p = strstr(cur, "=?");
 		if (!p) {
-			strapp(&res, cur, strlen(cur));
+			strbuf_append(&res, cur, strlen(cur));
 			break;
 		} else if (p == cur) {
-			char *start = cur;
-			char *charset = start + 2;
-			char *encoding = strchr(charset, '?');
+			const char *start = cur;
+			const char *charset = start + 2;
+			const char *encoding = strchr(charset, '?');
 			if (!encoding) {
-				strapp(&res, cur, charset - cur);
+				strbuf_append(&res, cur, charset - cur);
 				cur = charset;
 				continue;
 			}
 			encoding++;
 			if (encoding[1] != '?') {
-				strapp(&res, cur, encoding - cur);
+				strbuf_append(&res, cur, encoding - cur);
 				cur = encoding;
 				continue;
 			}
-			char *data = encoding + 2;
-			char *end = strstr(data, "?=");
+			const char *data = encoding + 2;
+			const char *end = strstr(data, "?=");
 			if (!end) {
-				strapp(&res, cur, strlen(cur));
+				strbuf_append(&res, cur, strlen(cur));
 				break;
 			}
 			char *buf;
@@ -59,110 +79,212 @@ static char *decode_rfc1342(char *input) {
 				len = quoted_printable_decode(buf, end - data, QP_HEADERS);
 				buf[len] = 0;
 			} else {
-				strapp(&res, cur, end + 2 - cur);
+				strbuf_append(&res, cur, end + 2 - cur);
 				cur = end + 2;
 				continue;
 			}
-			*(encoding - 1) = 0;
-			if (!strcasecmp(charset, "utf-8") || !strcasecmp(charset, "us-ascii")) {
+			// Copied rather than cut off in place, the input may be shared
+			char *name = strndup(charset, encoding - 1 - charset);
+			if (!strcasecmp(name, "utf-8") || !strcasecmp(name, "us-ascii")) {
 				// everything's fine
 			} else {
 				char *new;
-				if (!(new = (char *)iconv_convert(buf, charset))) {
-					*(encoding - 1) = '?';
+				if (!(new = (char *)iconv_convert(buf, name))) {
 					// leave the header as is, if an unknown encoding is encountered
+					free(name);
 					free(buf);
-					strapp(&res, cur, end + 2 - cur);
+					strbuf_append(&res, cur, end + 2 - cur);
 					cur = end + 2;
 					continue;
 				}
+				free(buf);
 				buf = new;
 				len = strlen(buf);
 			}
-			*(encoding - 1) = '?';
-			strapp(&res, buf, len);
+			free(name);
+			strbuf_append(&res, buf, len);
+			free(buf);
 			cur = end + 2;
 		} else {
-			strapp(&res, cur, p - cur);
+			strbuf_append(&res, cur, p - cur);
 			cur = p;
 		}
 	}
-	return res;
+	return res.data;
 }
 
-int parse_headers(const char *headers, list_t *output) {
-	while (*headers && strstr(headers, "\r\n") == headers) {
-		headers += 2;
-	}
-	while (*headers) {
-		char *crlf = strstr(headers, "\r\n");
-		char *null = strchr(headers, '\0');
-		char *eol = crlf == NULL ? null : crlf;
-		int eol_i = eol - headers;
-
-		if (isspace(*headers)) {
-			while (isspace(*++headers));
-			if (output->length != 0) {
-				/* Concat with previous line */
-				struct email_header *h = output->items[output->length - 1];
-				char *prev = h->value;
-				char *new = malloc(strlen(prev) + eol_i + 2);
-				strcpy(new, prev);
-				strcat(new, " ");
-				strncat(new, headers, eol_i);
-				new[eol_i + strlen(prev)] = '\0';
-				h->value = new;
-				free(prev);
-				headers = eol;
-				if (*headers) headers += 2;
-				continue;
+
+/*
+ * Only these keys are interned. Mail can have any header it likes, and
+ * interned strings are never freed, so the rest are kept with the message.
+ */
+static const char *known_headers[] = {
+	"Authentication-Results", "Bcc", "Cc", "Content-Description",
+	"Content-Disposition", "Content-ID", "Content-Transfer-Encoding",
+	"Content-Type", "Date", "Delivered-To", "DKIM-Signature", "From",
+	"In-Reply-To", "List-Archive", "List-Help", "List-ID", "List-Post",
+	"List-Subscribe", "List-Unsubscribe", "Message-ID", "MIME-Version",
+	"Received", "References", "Reply-To", "Return-Path", "Sender", "Subject",
+	"To", "User-Agent", "X-Mailer",
+};
+
+/* Returns the interned key if it's one we know, NULL if not */
+static const char *known_header(const char *key) {
+	for (size_t i = 0; i < sizeof(known_headers) / sizeof(known_headers[0]); ++i) {
+		if (strcasecmp(known_headers[i], key) == 0) {
+			return intern(known_headers[i]);
+		}
+	}
+	return NULL;
+}
+
+static bool is_folding_space(char c) {
+	return c == ' ' || c == '\t';
+}
+
+static const char *next_line(const char *str) {
+	const char *eol = strchr(str, '\n');
+	return eol ? eol + 1 : str + strlen(str);
+}
+
+static char *unfold_value(char *value) {
+	/*
+	 * Copies the value over itself, joining continuation lines with a single
+	 * space, and NUL-terminates it. Returns the start of the next header.
+	 */
+	char *r = value, *w = value;
+	while (*r) {
+		if (*r == '\r' && r[1] == '\n') {
+			++r;
+		}
+		if (*r == '\n') {
+			++r;
+			if (!is_folding_space(*r)) {
+				break;
+			}
+			while (is_folding_space(*r)) ++r;
+			if (w != value) {
+				*w++ = ' ';
 			}
+			continue;
 		}
+		*w++ = *r++;
+	}
+	*w = '\0';
+	return r;
+}
 
-		char *colon = strchr(headers, ':');
-		if (!colon) {
-			headers = eol;
-			if (*headers) headers += 2;
+struct email_headers *parse_headers(const char *headers) {
+	while (*headers == '\r' || *headers == '\n') {
+		++headers;
+	}
+	/*
+	 * Every header starts on a line that doesn't begin with whitespace, so
+	 * counting those gives us an upper bound for the size of the index.
+	 */
+	size_t count = 0;
+	for (const char *line = headers; *line; line = next_line(line)) {
+		if (!is_folding_space(*line) && *line != '\r' && *line != '\n') {
+			++count;
 		}
-		int colon_i = colon - headers;
-		char *key = malloc(colon_i + 1);
-		strncpy(key, headers, colon_i);
-		key[colon_i] = '\0';
-		if (strstr(colon + 1, "\r\n") != colon + 1) {
-			colon_i += 2;
+	}
+	size_t rawlen = strlen(headers);
+	size_t size = sizeof(struct email_headers)
+		+ count * sizeof(struct email_header) + rawlen + 1;
+	struct email_headers *result = malloc(size);
+	if (!result) {
+		return NULL;
+	}
+	result->length = 0;
+	result->size = size;
+	result->raw = (char *)&result->items[count];
+	memcpy(result->raw, headers, rawlen + 1);
+
+	char *cur = result->raw;
+	while (*cur) {
+		char *eol = (char *)next_line(cur);
+		char *colon = memchr(cur, ':', eol - cur);
+		if (is_folding_space(*cur) || !colon) {
+			// Stray continuation or garbage line, skip it
+			cur = eol;
+			continue;
 		}
-		char *value = malloc(eol_i - colon_i + 1);
-		strncpy(value, headers + colon_i, eol_i - colon_i);
-		value[eol_i - colon_i] = '\0';
-		headers = eol;
-		if (*headers) headers += 2;
-		struct email_header *header = calloc(1, sizeof(struct email_header));
-		header->key = key;
-		header->value = value;
-		list_add(output, header);
-	}
-	// Extra decoding here if necessary
-	for (size_t i = 0; i < output->length; ++i) {
-		struct email_header *header = output->items[i];
-		char *new, *old = header->value;
-		if ((new = decode_rfc1342(header->value))) {
-			header->value = new;
-			free(old);
+		*colon = '\0';
+		char *value = colon + 1;
+		while (is_folding_space(*value)) ++value;
+		struct email_header *header = &result->items[result->length++];
+		const char *known = known_header(cur);
+		header->key = known ? known : cur;
+		header->value = value - result->raw;
+		header->decoded = NULL;
+		cur = unfold_value(value);
+		header->encoded = strstr(value, "=?") != NULL;
+		worker_log(L_DEBUG, "Parsed header: %s: %s",
+				header->key, value);
+	}
+	return result;
+}
+
+struct email_headers *headers_dup(const struct email_headers *headers) {
+	if (!headers) {
+		return NULL;
+	}
+	struct email_headers *copy = malloc(headers->size);
+	if (!copy) {
+		return NULL;
+	}
+	memcpy(copy, headers, headers->size);
+	copy->raw = (char *)copy + (headers->raw - (char *)headers);
+	const char *end = (const char *)headers + headers->size;
+	for (size_t i = 0; i < copy->length; ++i) {
+		const struct email_header *header = &headers->items[i];
+		const char *key = header->key;
+		if (key >= headers->raw && key < end) {
+			copy->items[i].key = copy->raw + (key - headers->raw);
 		}
-		worker_log(L_DEBUG, "Parsed header: %s: %s", header->key, header->value);
+		// Copies get shared, so they're decoded up front and never written to
+		copy->items[i].decoded = !header->encoded ? NULL
+			: header->decoded ? strdup(header->decoded)
+			: decode_rfc1342(copy->raw + header->value);
 	}
-	return 0;
+	return copy;
 }
 
-void free_headers(list_t *headers) {
+void free_headers(struct email_headers *headers) {
 	if (!headers) return;
 	for (size_t i = 0; i < headers->length; ++i) {
-		struct email_header *header = headers->items[i];
-		if (header) {
-			free(header->key);
-			free(header->value);
-			free(header);
+		free(headers->items[i].decoded);
+	}
+	free(headers);
+}
+
+const char *header_key(const struct email_headers *headers, size_t index) {
+	return headers->items[index].key;
+}
+
+const char *header_value(struct email_headers *headers, size_t index) {
+	struct email_header *header = &headers->items[index];
+	char *value = headers->raw + header->value;
+	if (!header->encoded) {
+		return value;
+	}
+	if (!header->decoded) {
+		header->decoded = decode_rfc1342(value);
+	}
+	return header->decoded;
+}
+
+const char *get_header(struct email_headers *headers, const char *key) {
+	if (!headers) {
+		return NULL;
+	}
+	// Known keys are always interned, so they compare by pointer
+	const char *known = known_header(key);
+	for (size_t i = 0; i < headers->length; ++i) {
+		const char *k = headers->items[i].key;
+		if (known ? k == known : strcasecmp(k, key) == 0) {
+			return header_value(headers, i);
 		}
 	}
-	list_free(headers);
+	return NULL;
 }
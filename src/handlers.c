@@ -31,16 +31,66 @@ void handle_worker_connect_error(struct account_state *account,
 	set_status(account, ACCOUNT_ERROR, (char *)message->data);
 }
 
+void handle_worker_connection_lost(struct account_state *account,
+		struct worker_message *message) {
+	struct connection_stats *stats = message->data;
+	set_status(account, ACCOUNT_ERROR, "Connection lost (%s), "
+			"trying again in %lds...", stats->reason ? stats->reason : "?",
+			(stats->retry_in + 999) / 1000);
+	free(stats->reason);
+	free(stats);
+}
+
+void handle_worker_reconnected(struct account_state *account,
+		struct worker_message *message) {
+	struct connection_stats *stats = message->data;
+	worker_log(L_DEBUG, "Reconnected after %ld ms: %zu disconnects, "
+			"%zu attempts, %ld ms offline in all, %ld ms at most",
+			stats->outage, stats->disconnects, stats->attempts,
+			stats->total_outage, stats->longest_outage);
+	set_status(account, ACCOUNT_OKAY, "Reconnected after %ld.%lds.",
+			stats->outage / 1000, stats->outage % 1000 / 100);
+	free(stats->reason);
+	free(stats);
+}
+
+/* Results for a view the user has since left */
+static bool is_stale(struct account_state *account,
+		struct worker_message *message) {
+	return message->generation != account->worker.pipe->generation;
+}
+
 void handle_worker_select_done(struct account_state *account,
 		struct worker_message *message) {
+	if (is_stale(account, message)) {
+		worker_log(L_DEBUG, "Ignoring stale selection of %s",
+				(char *)message->data);
+		free(message->data);
+		return;
+	}
+	account->ui.selecting = false;
 	set_status(account, ACCOUNT_OKAY, "Connected.");
 	account->ui.list_offset = 0;
-	account->selected = strdup((char *)message->data);
+	account->ui.prefetch.last_row = 0;
+	account->ui.prefetch.direction = 0;
+	free(account->selected);
+	account->selected = message->data;
+	message_view_free(account->ui.view);
+	account->ui.view = NULL;
+	clear_search(account);
+	clear_marks(account);
+	uid_set_free(account->ui.moving);
+	account->ui.moving = NULL;
+	request_sort(account);
 	request_rerender(PANEL_MESSAGE_LIST);
 }
 
 void handle_worker_select_error(struct account_state *account,
 		struct worker_message *message) {
+	if (is_stale(account, message)) {
+		return;
+	}
+	account->ui.selecting = false;
 	set_status(account, ACCOUNT_ERROR, "Unable to select that mailbox.");
 }
 
@@ -66,8 +116,7 @@ void handle_worker_list_done(struct account_state *account,
 	if (have_wanted) {
 		free(account->selected);
 		account->selected = strdup(wanted);
-		worker_post_action(account->worker.pipe, WORKER_SELECT_MAILBOX,
-				NULL, strdup(wanted));
+		request_select(account, strdup(wanted));
 	}
 	request_rerender(PANEL_MESSAGE_LIST | PANEL_SIDEBAR);
 }
@@ -103,6 +152,17 @@ void handle_worker_mailbox_updated(struct account_state *account,
 			break;
 		}
 	}
+	struct message_view *view = account->ui.view;
+	if (view && account->selected && strcmp(new->name, account->selected) == 0) {
+		message_view_refresh(view, old->messages, new->messages);
+		if (view->server && new->exists != old->exists) {
+			// Ask the server again, new messages are on top until then
+			request_sort(account);
+		}
+	}
+	if (account->selected && strcmp(new->name, account->selected) == 0) {
+		update_filter(account);
+	}
 	char buf[64];
 	sprintf(buf, "select-message %ld", new->exists - old->exists);
 	handle_command(buf);
@@ -147,31 +207,82 @@ void load_message_viewer(struct account_state *account) {
 	}
 	if (account->viewer.processes->length == 0) {
 		worker_log(L_DEBUG, "Message downloaded, calling processes");
+		struct aerc_mailbox *mbox =
+			get_aerc_mailbox(account, account->selected);
+		if (!(msg->flags & FLAG_SEEN) && mbox) {
+			// It may have been prefetched, which leaves it unseen
+			struct uid_set *uids = uid_set_create();
+			uid_set_add(uids, msg->uid);
+			change_flags(account, mbox, uids, FLAG_SEEN, true);
+			msg = account->viewer.msg;
+		}
 		spawn_email_handler(account, msg);
 	} else {
 		worker_log(L_DEBUG, "Subprocess complete");
 	}
 }
 
+/*
+ * The server tells us the UIDs of all of the matches, but we only learn which
+ * messages those are as their UIDs are fetched.
+ */
+static bool add_search_result(struct account_state *account,
+		struct aerc_message *msg) {
+	struct uid_set *uids = account->ui.search.uids;
+	if (!uids || !msg->uid || !uid_set_contains(uids, msg->uid)) {
+		return false;
+	}
+	int *indices = account->ui.search.indices;
+	size_t length = account->ui.search.length, i = length;
+	while (i > 0 && indices[i - 1] > msg->index) {
+		--i;
+	}
+	if (i > 0 && indices[i - 1] == msg->index) {
+		return false;
+	}
+	indices = realloc(indices, (length + 1) * sizeof(int));
+	memmove(&indices[i + 1], &indices[i], (length - i) * sizeof(int));
+	indices[i] = msg->index;
+	account->ui.search.indices = indices;
+	account->ui.search.length = length + 1;
+	return true;
+}
+
 void handle_worker_message_updated(struct account_state *account,
 		struct worker_message *message) {
 	worker_log(L_DEBUG, "Updated message on UI thread");
 	struct aerc_message_update *update = message->data;
 	struct aerc_message *new = update->message;
 	struct aerc_mailbox *mbox = get_aerc_mailbox(account, update->mailbox);
-	for (size_t i = 0; i < mbox->messages->length; ++i) {
+	for (size_t i = 0; mbox && i < mbox->messages->length; ++i) {
 		struct aerc_message *old = mbox->messages->items[i];
 		if (old->index == new->index) {
-			free_aerc_message(mbox->messages->items[i]);
+			aerc_message_unref(mbox->messages->items[i]);
 			mbox->messages->items[i] = new;
-			rerender_item(i);
+			bool selected = strcmp(update->mailbox, account->selected) == 0;
+			bool matched = selected && add_search_result(account, new);
+			if (account->ui.view && selected) {
+				message_view_update(account->ui.view, mbox->messages, i);
+				update_filter(account);
+				request_rerender(PANEL_MESSAGE_LIST);
+			} else if (matched) {
+				update_filter(account);
+				request_rerender(PANEL_MESSAGE_LIST);
+			} else {
+				rerender_item(i);
+			}
 			if (account->viewer.msg == old) {
 				account->viewer.msg = new;
 				load_message_viewer(account);
 			}
 		}
 	}
+	if (!mbox) {
+		// Gone from under us
+		aerc_message_unref(new);
+	}
 	free(update->mailbox);
+	free(update);
 }
 
 void handle_worker_message_deleted(struct account_state *account,
@@ -187,11 +298,24 @@ void handle_worker_message_deleted(struct account_state *account,
 		} else if (_msg->index == delete->index) {
 			msg = _msg;
 			list_del(mbox->messages, i);
+			if (account->ui.view) {
+				message_view_remove(account->ui.view, delete->index);
+			}
 			--i;
 		}
 	}
+	size_t n = 0;
+	for (size_t i = 0; i < account->ui.search.length; ++i) {
+		int index = account->ui.search.indices[i];
+		if (index != delete->index) {
+			account->ui.search.indices[n++] =
+				index > delete->index ? index - 1 : index;
+		}
+	}
+	account->ui.search.length = n;
+	update_filter(account);
 	if (msg) {
-		free_aerc_message(msg);
+		aerc_message_unref(msg);
 		// Note: we need to be careful not to reference the viewer's message
 		// because it could have been freed here
 		if (account->viewer.msg && account->viewer.msg->index == msg->index) {
@@ -202,6 +326,121 @@ void handle_worker_message_deleted(struct account_state *account,
 	request_rerender(PANEL_MESSAGE_LIST);
 }
 
+static void build_local_view(struct account_state *account) {
+	struct aerc_mailbox *mbox = get_aerc_mailbox(account, account->selected);
+	if (!mbox) {
+		return;
+	}
+	struct sort_request *order = &account->ui.order;
+	message_view_free(account->ui.view);
+	account->ui.view = message_view_create(
+			order->sort, order->thread, order->reverse);
+	message_view_build(account->ui.view, mbox->messages);
+	// Only from what we've already fetched; the rest fall into place as the
+	// message list fetches them
+	update_filter(account);
+}
+
+void handle_worker_sort_done(struct account_state *account,
+		struct worker_message *message) {
+	struct message_view *view = message->data;
+	if (is_stale(account, message)) {
+		// Sorted the mailbox we've just left
+		message_view_free(view);
+		return;
+	}
+	if (view) {
+		message_view_free(account->ui.view);
+		account->ui.view = view;
+		update_filter(account);
+	} else {
+		build_local_view(account);
+	}
+	request_rerender(PANEL_MESSAGE_LIST);
+}
+
+void handle_worker_sort_error(struct account_state *account,
+		struct worker_message *message) {
+	if (is_stale(account, message)) {
+		return;
+	}
+	build_local_view(account);
+	request_rerender(PANEL_MESSAGE_LIST);
+}
+
+void handle_worker_search_done(struct account_state *account,
+		struct worker_message *message) {
+	struct aerc_search_results *results = message->data;
+	if (!account->selected || strcmp(results->mailbox, account->selected)) {
+		// The user moved on to another mailbox
+		free(results->indices);
+		uid_set_free(results->uids);
+	} else {
+		bool refining = account->ui.search.active;
+		clear_search(account);
+		account->ui.search.active = true;
+		account->ui.search.indices = results->indices;
+		account->ui.search.length = results->length;
+		account->ui.search.uids = results->uids;
+		update_filter(account);
+		size_t rows = account->ui.filtered ? account->ui.filtered->length : 0;
+		if (!refining) {
+			account->ui.selected_message = account->ui.list_offset = 0;
+		} else if (rows && account->ui.selected_message >= rows) {
+			// The server found fewer than we did
+			account->ui.selected_message = rows - 1;
+			scroll_selected_into_view();
+		}
+		size_t total = results->uids ?
+			uid_set_count(results->uids) : results->length;
+		if (results->partial) {
+			set_status(account, ACCOUNT_OKAY,
+					"%zu matching messages, searching server...", total);
+		} else if (total) {
+			set_status(account, ACCOUNT_OKAY, "%zu matching messages", total);
+		} else {
+			set_status(account, ACCOUNT_ERROR, "No matching messages");
+		}
+	}
+	free(results->mailbox);
+	free(results);
+	request_rerender(PANEL_MESSAGE_LIST);
+}
+
+void handle_worker_search_error(struct account_state *account,
+		struct worker_message *message) {
+	set_status(account, ACCOUNT_ERROR, "Search is unavailable");
+}
+
+void handle_worker_mailbox_table_updated(struct account_state *account,
+		struct worker_message *message) {
+	struct aerc_table_update *update = message->data;
+	struct aerc_mailbox *mbox = get_aerc_mailbox(account, update->mailbox);
+	if (mbox) {
+		message_table_unref(mbox->table);
+		mbox->table = update->table;
+	} else {
+		message_table_unref(update->table);
+	}
+	free(update->mailbox);
+	free(update);
+	request_rerender(PANEL_SIDEBAR);
+}
+
+void handle_worker_mailbox_status(struct account_state *account,
+		struct worker_message *message) {
+	struct aerc_mailbox_status *status = message->data;
+	struct aerc_mailbox *mbox = get_aerc_mailbox(account, status->mailbox);
+	if (mbox) {
+		mbox->status.messages = status->messages;
+		mbox->status.unseen = status->unseen;
+		mbox->status.recent = status->recent;
+		request_rerender(PANEL_SIDEBAR);
+	}
+	free(status->mailbox);
+	free(status);
+}
+
 void handle_worker_mailbox_deleted(struct account_state *account,
 		struct worker_message *message) {
 	worker_log(L_DEBUG, "Deleting mailbox on UI thread");
@@ -214,3 +453,64 @@ void handle_worker_mailbox_deleted(struct account_state *account,
 	free_aerc_mailbox(mbox);
 	request_rerender(PANEL_MESSAGE_LIST | PANEL_SIDEBAR);
 }
+
+/* Shows the messages of a finished move again, if the server hasn't expunged them */
+static void stop_moving(struct account_state *account,
+		struct aerc_message_move *move) {
+	struct uid_set *moving = account->ui.moving;
+	if (moving && account->selected
+			&& strcmp(move->mailbox, account->selected) == 0) {
+		for (size_t i = 0; i < move->uids->length; ++i) {
+			struct uid_range *range = &move->uids->ranges[i];
+			for (uint32_t uid = range->min; ; ++uid) {
+				uid_set_remove(moving, uid);
+				if (uid == range->max) {
+					break;
+				}
+			}
+		}
+		update_filter(account);
+		request_rerender(PANEL_MESSAGE_LIST);
+	}
+	aerc_message_move_free(move);
+}
+
+void handle_worker_move_done(struct account_state *account,
+		struct worker_message *message) {
+	struct aerc_message_move *move = message->data;
+	size_t count = uid_set_count(move->uids);
+	if (move->destination) {
+		set_status(account, ACCOUNT_OKAY, "Moved %zu message%s to %s",
+				count, count == 1 ? "" : "s", move->destination);
+	} else {
+		set_status(account, ACCOUNT_OKAY, "Deleted %zu message%s",
+				count, count == 1 ? "" : "s");
+	}
+	stop_moving(account, move);
+}
+
+void handle_worker_move_error(struct account_state *account,
+		struct worker_message *message) {
+	// They're still where they were, so they come back into view
+	struct aerc_message_move *move = message->data;
+	if (move->destination) {
+		set_status(account, ACCOUNT_ERROR, "Unable to move messages.");
+	} else {
+		set_status(account, ACCOUNT_ERROR, "Unable to delete messages.");
+	}
+	stop_moving(account, move);
+}
+
+void handle_worker_send_done(struct account_state *account,
+		struct worker_message *message) {
+	set_status(account, ACCOUNT_OKAY, "Message sent.");
+	send_request_free(message->data);
+}
+
+void handle_worker_send_error(struct account_state *account,
+		struct worker_message *message) {
+	struct send_request *req = message->data;
+	set_status(account, ACCOUNT_ERROR, "Unable to send message: %s",
+			req->error);
+	send_request_free(req);
+}
@@ -0,0 +1,281 @@
+/*
+ * imap/append.c - issues IMAP APPEND commands, streaming the messages
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "email/flags.h"
+#include "imap/imap.h"
+#include "internal/imap.h"
+#include "log.h"
+#include "util/list.h"
+
+#define CHUNK_SIZE (64 * 1024) // Of a message, read and queued at a time
+
+struct imap_append {
+	char *mailbox;
+	struct imap_append_message *messages;
+	size_t count;
+	size_t next; // The message whose literal is being (or is next to be) sent
+	size_t sent; // Of the next message's literal
+	bool in_command; // The tag's out, the final CRLF isn't
+	bool streaming; // The next message's literal header is out
+	bool waiting; // For the server's "+" before sending the literal
+	size_t end; // One past the last message of the command partway out
+	struct append_command *current; // That command, until it's answered
+	int commands; // Sent and not yet answered
+	enum imap_status status;
+	char *text; // The first failure, or the last OK
+	char *chunk;
+	imap_callback_t callback;
+	void *data;
+};
+
+struct append_command {
+	struct imap_append *append;
+};
+
+/* The one with a command partway out, or the next to start one */
+static struct imap_append *sending(struct imap_connection *imap) {
+	for (size_t i = 0; i < imap->appends->length; ++i) {
+		struct imap_append *ap = imap->appends->items[i];
+		if (ap->in_command || ap->next < ap->count) {
+			return ap;
+		}
+	}
+	return NULL;
+}
+
+static void append_free_one(struct imap_append *ap) {
+	free(ap->mailbox);
+	free(ap->messages);
+	free(ap->text);
+	free(ap->chunk);
+	free(ap);
+}
+
+static void finish(struct imap_connection *imap, struct imap_append *ap) {
+	for (size_t i = 0; i < imap->appends->length; ++i) {
+		if (imap->appends->items[i] == ap) {
+			list_del(imap->appends, i);
+			break;
+		}
+	}
+	if (ap->callback) {
+		ap->callback(imap, ap->data, ap->status, ap->text);
+	}
+	append_free_one(ap);
+}
+
+static void append_done(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	struct append_command *cmd = data;
+	struct imap_append *ap = cmd->append;
+	--ap->commands;
+	if (ap->status == STATUS_OK) {
+		ap->status = status;
+		free(ap->text);
+		ap->text = args ? strdup(args) : NULL;
+	}
+	if (ap->current == cmd) {
+		if (ap->in_command && (ap->waiting || !ap->streaming)) {
+			// Turned down before the literal went out, so the rest of this
+			// command won't either
+			worker_log(L_DEBUG, "APPEND turned down: %s", args);
+			ap->waiting = ap->streaming = ap->in_command = false;
+			ap->next = ap->end;
+			imap_send_held(imap);
+		}
+		ap->current = NULL;
+	}
+	free(cmd);
+	if (!ap->in_command && ap->next == ap->count && !ap->commands) {
+		finish(imap, ap);
+	}
+}
+
+static void send_literal_header(struct imap_connection *imap,
+		struct imap_append *ap) {
+	struct imap_append_message *msg = &ap->messages[ap->next];
+	char buf[128];
+	int len = 0;
+	if (msg->flags) {
+		len += snprintf(buf + len, sizeof(buf) - len, " (");
+		for (uint32_t bit = FLAG_SEEN; bit <= FLAG_DRAFT; bit <<= 1) {
+			if (msg->flags & bit) {
+				len += snprintf(buf + len, sizeof(buf) - len, "%s%s",
+						buf[len - 1] == '(' ? "" : " ", flag_name(bit));
+			}
+		}
+		len += snprintf(buf + len, sizeof(buf) - len, ")");
+	}
+	bool sync = !imap->cap || !(imap->cap->literal_plus
+			|| (imap->cap->literal_minus && msg->size <= LITERAL_MINUS_MAX));
+	len += snprintf(buf + len, sizeof(buf) - len, " {%zu%s}\r\n",
+			msg->size, sync ? "" : "+");
+	imap_send_raw(imap, buf, len);
+	ap->streaming = true;
+	ap->waiting = sync;
+	ap->sent = 0;
+	if (msg->file) {
+		fseek(msg->file, msg->offset, SEEK_SET);
+	}
+}
+
+static void start_command(struct imap_connection *imap, struct imap_append *ap) {
+	struct append_command *cmd = malloc(sizeof(struct append_command));
+	cmd->append = ap;
+	bool multi = imap->cap && imap->cap->multiappend;
+	ap->end = multi ? ap->count : ap->next + 1;
+	char *tag = imap_new_tag(imap, append_done, cmd);
+	worker_log(L_DEBUG, "-> %s APPEND \"%s\" (%zu messages)",
+			tag, ap->mailbox, ap->end - ap->next);
+	char *mailbox = imap_quote(imap, ap->mailbox);
+	int len = snprintf(NULL, 0, "%s APPEND %s", tag, mailbox);
+	char *buf = malloc(len + 1);
+	snprintf(buf, len + 1, "%s APPEND %s", tag, mailbox);
+	// Stops short if the name has to wait for the server's "+"
+	imap_send_command(imap, buf, len);
+	free(buf);
+	free(mailbox);
+	free(tag);
+	ap->current = cmd;
+	ap->in_command = true;
+	++ap->commands;
+}
+
+/*
+ * Sends as much as the socket will queue without piling up more than a chunk
+ * or so. Returns nonzero if it sent anything.
+ */
+int append_run(struct imap_connection *imap) {
+	int did = 0;
+	struct imap_append *ap;
+	while (imap->socket && (ap = sending(imap))) {
+		if (!ap->in_command) {
+			if (imap->idle == IDLE_IDLING) {
+				leave_idle(imap);
+			}
+			if (imap->idle == IDLE_STARTING || imap->literal) {
+				// Not in the middle of another command
+				return did;
+			}
+			start_command(imap, ap);
+			did = 1;
+		}
+		if (imap->literal) {
+			return did;
+		}
+		if (!ap->streaming) {
+			send_literal_header(imap, ap);
+			did = 1;
+		}
+		if (ap->waiting) {
+			return did;
+		}
+		struct imap_append_message *msg = &ap->messages[ap->next];
+		while (ap->sent < msg->size) {
+			ssize_t queued = ab_flush(imap->socket);
+			if (queued < 0) {
+				imap_disconnect(imap, strerror(errno));
+				return 1;
+			}
+			if (queued >= CHUNK_SIZE) {
+				return did;
+			}
+			size_t amt = msg->size - ap->sent;
+			if (amt > CHUNK_SIZE) {
+				amt = CHUNK_SIZE;
+			}
+			if (msg->file) {
+				if (!ap->chunk) {
+					ap->chunk = malloc(CHUNK_SIZE);
+				}
+				if (fread(ap->chunk, 1, amt, msg->file) != amt) {
+					// The server's expecting the rest, and we can't say otherwise
+					imap_disconnect(imap, "A message to append was cut short");
+					return 1;
+				}
+				imap_send_raw(imap, ap->chunk, amt);
+			} else {
+				imap_send_raw(imap, msg->data + ap->sent, amt);
+			}
+			ap->sent += amt;
+			did = 1;
+		}
+		ap->streaming = false;
+		++ap->next;
+		if (ap->next < ap->end) {
+			continue;
+		}
+		imap_send_raw(imap, "\r\n", 2);
+		ap->in_command = false;
+		imap_send_held(imap);
+	}
+	return did;
+}
+
+bool append_continue(struct imap_connection *imap) {
+	struct imap_append *ap = sending(imap);
+	if (!ap || !ap->waiting) {
+		return false;
+	}
+	ap->waiting = false;
+	return true;
+}
+
+bool append_in_command(struct imap_connection *imap) {
+	struct imap_append *ap = sending(imap);
+	return ap && ap->in_command;
+}
+
+/* Fails every append still going, after their commands have been failed */
+void append_fail(struct imap_connection *imap, const char *reason) {
+	list_t *appends = imap->appends;
+	imap->appends = create_list();
+	for (size_t i = 0; i < appends->length; ++i) {
+		struct imap_append *ap = appends->items[i];
+		if (ap->status == STATUS_OK) {
+			ap->status = STATUS_PRE_ERROR;
+			free(ap->text);
+			ap->text = strdup(reason);
+		}
+		if (ap->callback) {
+			ap->callback(imap, ap->data, ap->status, ap->text);
+		}
+		append_free_one(ap);
+	}
+	list_free(appends);
+}
+
+void append_free(struct imap_connection *imap) {
+	for (size_t i = 0; i < imap->appends->length; ++i) {
+		append_free_one(imap->appends->items[i]);
+	}
+	list_free(imap->appends);
+	imap->appends = NULL;
+}
+
+void imap_append(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *mailbox,
+		const struct imap_append_message *messages, size_t count) {
+	struct imap_append *ap = calloc(1, sizeof(struct imap_append));
+	ap->mailbox = strdup(mailbox);
+	ap->messages = malloc(count * sizeof(struct imap_append_message) + 1);
+	memcpy(ap->messages, messages, count * sizeof(struct imap_append_message));
+	ap->count = count;
+	ap->status = STATUS_OK;
+	ap->callback = callback;
+	ap->data = data;
+	list_add(imap->appends, ap);
+	if (!count) {
+		finish(imap, ap);
+		return;
+	}
+	append_run(imap);
+}
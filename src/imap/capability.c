@@ -31,7 +31,18 @@ void handle_imap_capability(struct imap_connection *imap, const char *token,
 		{ "AUTH=PLAIN", &cap->auth_plain },
 		{ "AUTH=LOGIN", &cap->auth_login },
 		{ "IDLE", &cap->idle },
-		{ "SASL-IR", &cap->sasl_ir }
+		{ "SASL-IR", &cap->sasl_ir },
+		{ "SORT", &cap->sort },
+		{ "THREAD=REFERENCES", &cap->thread_references },
+		{ "THREAD=ORDEREDSUBJECT", &cap->thread_orderedsubject },
+		{ "ESEARCH", &cap->esearch },
+		{ "LIST-STATUS", &cap->list_status },
+		{ "NOTIFY", &cap->notify },
+		{ "MOVE", &cap->move },
+		{ "UIDPLUS", &cap->uidplus },
+		{ "LITERAL+", &cap->literal_plus },
+		{ "LITERAL-", &cap->literal_minus },
+		{ "MULTIAPPEND", &cap->multiappend },
 	};
 
 	while (args) {
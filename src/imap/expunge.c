@@ -15,11 +15,9 @@ void imap_expunge(struct imap_connection *imap, imap_callback_t callback,
 	imap_send(imap, callback, data, "EXPUNGE");
 }
 
-void handle_imap_expunge(struct imap_connection *imap, const char *token,
-		const char *cmd, imap_arg_t *args) {
-	assert(args && args->type == IMAP_NUMBER);
-	long i = args->num - 1;
-	struct mailbox *mbox = get_mailbox(imap, imap->selected);
+/* Removes the message at index (from 0), as the server has */
+void mailbox_expunge(struct imap_connection *imap, struct mailbox *mbox,
+		long i) {
 	struct mailbox_message *msg = NULL;
 	worker_log(L_DEBUG, "Deleting message %d", (int)i);
 	for (size_t j = 0; j < mbox->messages->length; ++j) {
@@ -29,6 +27,9 @@ void handle_imap_expunge(struct imap_connection *imap, const char *token,
 		} else if (_msg->index == i) {
 			msg = _msg;
 			list_del(mbox->messages, j);
+			message_table_cow(&mbox->table);
+			message_table_remove(mbox->table, i);
+			mbox->table_dirty = true;
 			--mbox->exists;
 			--j;
 		}
@@ -36,4 +37,13 @@ void handle_imap_expunge(struct imap_connection *imap, const char *token,
 	if (msg && imap->events.message_deleted) {
 		imap->events.message_deleted(imap, msg);
 	}
+	if (msg) {
+		mailbox_message_free(msg);
+	}
+}
+
+void handle_imap_expunge(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args) {
+	assert(args && args->type == IMAP_NUMBER);
+	mailbox_expunge(imap, get_mailbox(imap, imap->selected), args->num - 1);
 }
@@ -21,6 +21,7 @@
 #include "util/stringop.h"
 #include "util/base64.h"
 #include "util/iconv.h"
+#include "util/intern.h"
 
 void imap_fetch(struct imap_connection *imap, imap_callback_t callback,
 		void *data, size_t min, size_t max, const char *what) {
@@ -54,17 +55,32 @@ void imap_fetch(struct imap_connection *imap, imap_callback_t callback,
 
 static int handle_flags(struct mailbox_message *msg, imap_arg_t *args) {
 	args = args->list;
-	free_flat_list(msg->flags);
-	msg->flags = create_list();
+	msg->flags = 0;
+	keywords_free(msg->keywords);
+	msg->keywords = NULL;
 	while (args) {
 		assert(args->type == IMAP_ATOM);
-		list_add(msg->flags, strdup(args->str));
+		uint32_t flag = parse_flag(args->str);
+		if (flag) {
+			msg->flags |= flag;
+		} else {
+			if (!msg->keywords) {
+				msg->keywords = create_list();
+			}
+			list_add(msg->keywords, (void *)keyword_new(args->str));
+		}
 		worker_log(L_DEBUG, "Set flag for message: %s", args->str);
 		args = args->next;
 	}
 	return 0;
 }
 
+static int handle_size(struct mailbox_message *msg, imap_arg_t *args) {
+	assert(args->type == IMAP_NUMBER);
+	msg->size = args->num;
+	return 0;
+}
+
 static int handle_uid(struct mailbox_message *msg, imap_arg_t *args) {
 	assert(args->type == IMAP_NUMBER);
 	worker_log(L_DEBUG, "Message UID: %ld", args->num);
@@ -88,9 +104,10 @@ static int handle_internaldate(struct mailbox_message *msg, imap_arg_t *args) {
 }
 
 static void handle_body_content(struct message_part *part, imap_arg_t *args) {
-	free(part->content);
-	part->content = malloc(part->size);
-	memcpy(part->content, args->str, part->size);
+	// part->size stays the encoded size, so that fetching it again works
+	size_t size = part->size;
+	uint8_t *content = malloc(size);
+	memcpy(content, args->str, size);
 	worker_log(L_DEBUG, "Received message body");
 	if (part->body_encoding) {
 		if (strcasecmp(part->body_encoding, "7bit") == 0 ||
@@ -98,19 +115,20 @@ static void handle_body_content(struct message_part *part, imap_arg_t *args) {
 			strcasecmp(part->body_encoding, "binary") == 0) {
 			// no further action necessary
 		} else if (strcasecmp(part->body_encoding, "quoted-printable") == 0) {
-			int len = quoted_printable_decode((char *)part->content, part->size, QP_BODY);
-			part->size = len;
+			int len = quoted_printable_decode((char *)content, size, QP_BODY);
+			size = len;
 		} else if (strcasecmp(part->body_encoding, "base64") == 0) {
 			size_t len;
-			char *b64 = (char *)part->content;
-			unsigned char *plain = b64_decode(b64, part->size, &len);
+			char *b64 = (char *)content;
+			unsigned char *plain = b64_decode(b64, size, &len);
 			if (!plain) {
 				worker_log(L_ERROR, "Invalid base64 data in message.");
+				free(content);
 				return;
 			}
-			free(part->content);
-			part->content = plain;
-			part->size = strlen((char *)plain);
+			free(content);
+			content = plain;
+			size = strlen((char *)plain);
 		} else {
 			worker_log(L_ERROR, "Unknown encoding %s. Please report this.", part->body_encoding);
 		}
@@ -121,28 +139,24 @@ static void handle_body_content(struct message_part *part, imap_arg_t *args) {
 			if (strcasecmp(param->value, "UTF-8") == 0) {
 				// no further action necessary
 			} else if (strcasecmp(param->value, "iso-8859-1") == 0) {
-				int len = iso_8859_1_to_utf8(&part->content, part->size);
-				part->size = len;
+				int len = iso_8859_1_to_utf8(&content, size);
+				size = len;
 			} else if (strcasecmp(param->value, "us-ascii") == 0) {
 				// no further action necessary
 			} else {
-				unsigned char *old = part->content, *new;
+				unsigned char *old = content, *new;
 				size_t news;
 				worker_log(L_DEBUG, "Converting message encoding from %s", param->value);
-				if (!(new = iconv_convert4((char *)part->content, param->value, part->size, &news))) {
+				if (!(new = iconv_convert4((char *)content, param->value, size, &news))) {
 					continue;
 				}
 				free(old);
-				part->content = new, part->size = news;
+				content = new, size = news;
 			}
 		}
 	}
-}
-
-static int flag_cmp(const void *_item, const void *_flag) {
-	const char *item = _item;
-	const char *flag = _flag;
-	return strcmp(item, flag);
+	body_unref(part->fetched);
+	part->fetched = body_new(content, size);
 }
 
 static int handle_body(struct mailbox_message *msg, imap_arg_t *args) {
@@ -157,10 +171,8 @@ static int handle_body(struct mailbox_message *msg, imap_arg_t *args) {
 	switch (resp->type) {
 	case IMAP_ATOM:
 		if (strcmp(resp->str, "HEADER.FIELDS") == 0) {
-			list_t *headers = create_list();
-			parse_headers(args->str, headers);
 			free_headers(msg->headers);
-			msg->headers = headers;
+			msg->headers = parse_headers(args->str);
 			worker_log(L_DEBUG, "Received message headers");
 		}
 		break;
@@ -168,10 +180,8 @@ static int handle_body(struct mailbox_message *msg, imap_arg_t *args) {
 		size_t i = resp->num - 1;
 		assert(msg->parts);
 		assert(i < msg->parts->length);
-		int seen = list_seq_find(msg->flags, flag_cmp, "\\Seen");
-		if (seen != -1) {
-			list_add(msg->flags, strdup("\\Seen"));
-		}
+		// BODY.PEEK answers look the same, so \Seen is left to the FLAGS
+		// the server sends with it if it set it
 		struct message_part *part = msg->parts->items[i];
 		handle_body_content(part, args);
 		break;
@@ -191,14 +201,42 @@ static char *get_str(imap_arg_t *args) {
 	return strdup(args->str);
 }
 
+/*
+ * These come from the server, so only the values we expect to see a lot of are
+ * interned. Anything else is copied and freed with the message.
+ */
+static const char *const known_types[] = {
+	"text", "multipart", "message", "application", "image", "audio",
+	"video", "font", "model", NULL,
+};
+
+static const char *const known_subtypes[] = {
+	"plain", "html", "enriched", "calendar", "x-vcard", "vcard", "mixed",
+	"alternative", "related", "signed", "encrypted", "report", "digest",
+	"rfc822", "delivery-status", "octet-stream", "pdf", "pgp-signature",
+	"pgp-encrypted", "pkcs7-signature", "pkcs7-mime", "ics", "zip", "json",
+	"png", "jpeg", "gif", "webp", "svg+xml", NULL,
+};
+
+static const char *const known_encodings[] = {
+	"7bit", "8bit", "binary", "quoted-printable", "base64", NULL,
+};
+
+static const char *get_atom(imap_arg_t *args, const char *const *known) {
+	if (!args->str || strcmp(args->str, "NIL") == 0) {
+		return NULL;
+	}
+	return intern_known(args->str, known);
+}
+
 static struct message_part *handle_message_part(imap_arg_t *args) {
 	struct message_part *part = calloc(sizeof(struct message_part), 1);
 	assert(part);
 	assert(args);
-	part->type = get_str(args);
+	part->type = get_atom(args, known_types);
 	args = args->next;
 
-	part->subtype = get_str(args);
+	part->subtype = get_atom(args, known_subtypes);
 	args = args->next;
 
 	imap_arg_t *param = args->list;
@@ -222,7 +260,7 @@ static struct message_part *handle_message_part(imap_arg_t *args) {
 	part->body_description = get_str(args);
 	args = args->next;
 
-	part->body_encoding = get_str(args);
+	part->body_encoding = get_atom(args, known_encodings);
 	args = args->next;
 
 	part->size = args->num;
@@ -241,7 +279,8 @@ static void extract_parts(struct mailbox_message *msg, imap_arg_t *args) {
 			extract_parts(msg, args);
 			args = args->next;
 			if (args->type == IMAP_STRING) {
-				msg->multipart_type = get_str(args);
+				intern_release(msg->multipart_type);
+				msg->multipart_type = get_atom(args, known_subtypes);
 				break;
 			}
 		}
@@ -286,6 +325,7 @@ void handle_imap_fetch(struct imap_connection *imap, const char *token,
 		int (*handler)(struct mailbox_message *, imap_arg_t *);
 	} handlers[] = {
 		{ "UID", IMAP_NUMBER, handle_uid },
+		{ "RFC822.SIZE", IMAP_NUMBER, handle_size },
 		{ "FLAGS", IMAP_LIST, handle_flags },
 		{ "INTERNALDATE", IMAP_STRING, handle_internaldate },
 		{ "BODY", IMAP_RESPONSE, handle_body },
@@ -313,6 +353,21 @@ void handle_imap_fetch(struct imap_connection *imap, const char *token,
 	}
 	msg->fetching = false;
 
+	for (size_t i = 0; msg->parts && i < msg->parts->length; ++i) {
+		struct message_part *part = msg->parts->items[i];
+		if (part->fetched) {
+			if (imap->store && msg->uid) {
+				body_store_put(imap->store, selected, mbox->uidvalidity,
+						msg->uid, i + 1, part->fetched->data,
+						part->fetched->size);
+			}
+			body_cache_put(imap->bodies, selected, msg->uid, i + 1,
+					part->fetched);
+			body_unref(part->fetched);
+			part->fetched = NULL;
+		}
+	}
+
 	// A partial FETCH message for an unpopulated message doesn't populate it
 	// but it doesn't depopulate an already populated message -- e.g. fetching
 	// the BODY of a message
@@ -324,6 +379,12 @@ void handle_imap_fetch(struct imap_connection *imap, const char *token,
 			msg->populated &= handled[i];
 		}
 	}
+	if (msg->populated) {
+		message_table_cow(&mbox->table);
+		message_table_update(mbox->table, msg->index, msg->uid, msg->flags,
+				msg->internal_date, msg->headers);
+		mbox->table_dirty = true;
+	}
 
 	if (imap->events.message_updated) {
 		imap->events.message_updated(imap, msg);
@@ -4,6 +4,8 @@
 #define _POSIX_C_SOURCE 201112LL
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
 #include <poll.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -42,7 +44,230 @@ struct imap_pending_callback *make_callback(imap_callback_t callback, void *data
 	return cb;
 }
 
+void imap_send_raw(struct imap_connection *imap, const char *buf, size_t len) {
+	ab_send(imap->socket, buf, len);
+#ifndef NDEBUG
+	if (raw) {
+		fwrite(buf, 1, len, raw);
+		fflush(raw);
+	}
+#endif
+}
+
+/*
+ * Returns just past the next CRLF in cmd from i on, or len if there's none.
+ * If it ends a literal's {N} or {N+}, *size is set to N and *sync to whether
+ * it has to wait for the server; if it ends a command, *size is -1.
+ */
+static size_t line_end(const char *cmd, size_t len, size_t i, long *size,
+		bool *sync) {
+	*size = -1;
+	for (; i + 1 < len; ++i) {
+		if (cmd[i] == '\r' && cmd[i + 1] == '\n') {
+			break;
+		}
+	}
+	if (i + 1 >= len) {
+		return len;
+	}
+	size_t end = i;
+	if (end > 0 && cmd[end - 1] == '}') {
+		--end;
+		*sync = !(end > 0 && cmd[end - 1] == '+');
+		if (!*sync) {
+			--end;
+		}
+		size_t start = end;
+		while (start > 0 && isdigit((unsigned char)cmd[start - 1])) {
+			--start;
+		}
+		if (start < end && start > 0 && cmd[start - 1] == '{') {
+			*size = strtol(cmd + start, NULL, 10);
+		}
+	}
+	return i + 2;
+}
+
+/*
+ * Where commands have to stop and wait for the server's "+": just past the
+ * first synchronizing literal's {N}, or len if there isn't one. *command is
+ * set to the start of the command it's in. Literals are skipped over, since
+ * they can hold anything.
+ */
+static size_t literal_split(const char *cmd, size_t len, size_t *command,
+		long *size) {
+	size_t i = 0;
+	*command = 0;
+	while (i < len) {
+		bool sync = false;
+		size_t next = line_end(cmd, len, i, size, &sync);
+		if (*size < 0) {
+			*command = i = next;
+		} else if (sync) {
+			return next;
+		} else {
+			i = next + *size;
+		}
+	}
+	return len;
+}
+
+/*
+ * Sends one or more whole commands, up to the first synchronizing literal, and
+ * keeps the rest until the server asks for it.
+ */
+void imap_send_command(struct imap_connection *imap, const char *cmd,
+		size_t len) {
+	size_t command;
+	long size;
+	size_t split = literal_split(cmd, len, &command, &size);
+	if (!imap->socket) {
+		return;
+	}
+	imap_send_raw(imap, cmd, split);
+	if (split < len) {
+		imap->literal = malloc(len - split);
+		memcpy(imap->literal, cmd + split, len - split);
+		imap->literal_length = len - split;
+		imap->literal_size = size;
+		imap->literal_tag = strndup(cmd + command,
+				strcspn(cmd + command, " "));
+	}
+}
+
+static void clear_literal(struct imap_connection *imap) {
+	free(imap->literal);
+	free(imap->literal_tag);
+	imap->literal = imap->literal_tag = NULL;
+	imap->literal_length = imap->literal_size = 0;
+}
+
+/* Sends what imap_send held back, once it can go out */
+void imap_send_held(struct imap_connection *imap) {
+	if (imap->literal) {
+		// Still in the middle of a command
+		return;
+	}
+	char *held = imap->held;
+	size_t len = imap->held_length;
+	imap->held = NULL;
+	imap->held_length = 0;
+	if (len) {
+		imap_send_command(imap, held, len);
+	}
+	free(held);
+}
+
+static void continue_literal(struct imap_connection *imap) {
+	char *rest = imap->literal;
+	size_t len = imap->literal_length;
+	imap->literal = NULL;
+	clear_literal(imap);
+	imap_send_command(imap, rest, len);
+	free(rest);
+	if (!append_in_command(imap)) {
+		imap_send_held(imap);
+	}
+}
+
+/*
+ * The server turned the command down instead of asking for its literal, so
+ * the rest of it is dropped and whatever came after goes ahead.
+ */
+static void abandon_literal(struct imap_connection *imap) {
+	const char *rest = imap->literal + imap->literal_size;
+	size_t len = imap->literal_length - imap->literal_size;
+	size_t i = 0;
+	while (i < len) {
+		long size;
+		bool sync;
+		size_t next = line_end(rest, len, i, &size, &sync);
+		i = size < 0 ? next : next + size;
+		if (size < 0) {
+			break;
+		}
+	}
+	if (i < len) {
+		char *held = malloc(len - i + imap->held_length);
+		memcpy(held, rest + i, len - i);
+		if (imap->held_length) {
+			memcpy(held + len - i, imap->held, imap->held_length);
+		}
+		free(imap->held);
+		imap->held = held;
+		imap->held_length += len - i;
+	}
+	clear_literal(imap);
+	if (!append_in_command(imap)) {
+		imap_send_held(imap);
+	}
+}
+
+/* DONE, then whatever was held back while IDLE was starting */
+void leave_idle(struct imap_connection *imap) {
+	worker_log(L_DEBUG, "Leaving IDLE");
+	imap->idle = IDLE_LEAVING;
+	if (imap->socket) {
+		imap_send_raw(imap, "DONE\r\n", 6);
+	}
+	imap_send_held(imap);
+}
+
+static void handle_continuation(struct imap_connection *imap) {
+	if (imap->literal) {
+		continue_literal(imap);
+		return;
+	}
+	if (imap->idle != IDLE_STARTING) {
+		if (!append_continue(imap)) {
+			worker_log(L_DEBUG, "Ignoring a continuation we didn't ask for");
+		}
+		return;
+	}
+	imap->idle = IDLE_IDLING;
+	if (imap->held_length) {
+		leave_idle(imap);
+	}
+}
+
+static void idle_done(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	if (status != STATUS_OK && status != STATUS_PRE_ERROR) {
+		worker_log(L_ERROR, "IDLE failed: %s", args);
+	}
+	if (imap->idle == IDLE_STARTING) {
+		// Refused outright, so there's nothing to leave
+		imap_send_held(imap);
+	}
+	imap->idle = IDLE_NONE;
+}
+
+int imap_busy(struct imap_connection *imap) {
+	return imap->outstanding - (imap->idle != IDLE_NONE ? 1 : 0);
+}
+
+/*
+ * Once nothing's left to complete, so the server tells us of changes. Not on
+ * background connections, which only EXAMINE mailboxes in passing, and would
+ * have every command wait on a DONE.
+ */
+static void enter_idle(struct imap_connection *imap) {
+	if (imap->background || !imap->socket || !imap->logged_in || !imap->cap || !imap->cap->idle
+			|| imap->mode != RECV_LINE || imap->idle != IDLE_NONE
+			|| imap->outstanding || imap->appends->length) {
+		return;
+	}
+	worker_log(L_DEBUG, "Entering IDLE mode");
+	imap_send(imap, idle_done, NULL, "IDLE");
+	imap->idle = IDLE_STARTING;
+	get_nanoseconds(&imap->idle_start);
+}
+
 int handle_line(struct imap_connection *imap, imap_arg_t *arg) {
+	if (arg && arg->str && strcmp(arg->str, "+") == 0) {
+		handle_continuation(imap);
+		return 0;
+	}
 	assert(arg && arg->next); // We expect at least a tag and command
 	/*
 	 * IMAP commands are formatted like this:
@@ -72,6 +297,9 @@ int handle_line(struct imap_connection *imap, imap_arg_t *arg) {
 	}
 	assert(arg->type == IMAP_ATOM);
 	assert(arg->next->type == IMAP_ATOM);
+	if (imap->literal_tag && strcmp(arg->str, imap->literal_tag) == 0) {
+		abandon_literal(imap);
+	}
 	imap_handler_t handler = hashtable_get(internal_handlers, arg->next->str);
 	if (handler) {
 		handler(imap, arg->str, arg->next->str, arg->next->next);
@@ -81,19 +309,21 @@ int handle_line(struct imap_connection *imap, imap_arg_t *arg) {
 	return 0;
 }
 
+/* Registers callback for the next tag, and returns the tag. Free it. */
+char *imap_new_tag(struct imap_connection *imap, imap_callback_t callback,
+		void *data) {
+	int len = snprintf(NULL, 0, "a%04d", imap->next_tag);
+	char *tag = malloc(len + 1);
+	snprintf(tag, len + 1, "a%04d", imap->next_tag++);
+	hashtable_set(imap->pending, tag, make_callback(callback, data));
+	++imap->outstanding;
+	return tag;
+}
+
 void imap_send(struct imap_connection *imap, imap_callback_t callback,
 		void *data, const char *fmt, ...) {
-	if (imap->mode == RECV_IDLE) {
-		worker_log(L_DEBUG, "Leaving IDLE");
-		imap->mode = RECV_LINE;
-		char *done = "DONE\r\n";
-		ab_send(imap->socket, done, strlen(done));
-#ifndef NDEBUG
-		if (raw) {
-			fwrite(done, 1, strlen(done), raw);
-			fflush(raw);
-		}
-#endif
+	if (imap->idle == IDLE_IDLING) {
+		leave_idle(imap);
 	}
 
 	va_list args;
@@ -106,22 +336,23 @@ void imap_send(struct imap_connection *imap, imap_callback_t callback,
 	vsnprintf(buf, len + 1, fmt, args);
 	va_end(args);
 
-	len = snprintf(NULL, 0, "a%04d", imap->next_tag);
-	char *tag = malloc(len + 1);
-	snprintf(tag, len + 1, "a%04d", imap->next_tag++);
+	char *tag = imap_new_tag(imap, callback, data);
 
 	len = snprintf(NULL, 0, "%s %s\r\n", tag, buf);
 	char *cmd = malloc(len + 1);
 	snprintf(cmd, len + 1, "%s %s\r\n", tag, buf);
 
-	ab_send(imap->socket, cmd, len);
-#ifndef NDEBUG
-	if (raw) {
-		fwrite(cmd, 1, len, raw);
-		fflush(raw);
+	if (imap->idle == IDLE_STARTING || imap->literal
+			|| append_in_command(imap)) {
+		// It goes with the DONE, once the server's ready for that, or once
+		// the command before it is all out
+		imap->held = realloc(imap->held, imap->held_length + len);
+		memcpy(imap->held + imap->held_length, cmd, len);
+		imap->held_length += len;
+	} else {
+		// If the write fails, the next imap_receive fails it
+		imap_send_command(imap, cmd, len);
 	}
-#endif
-	hashtable_set(imap->pending, tag, make_callback(callback, data));
 
 	if (strncmp("LOGIN ", buf, 6) == 0) {
 		worker_log(L_DEBUG, "-> %s LOGIN *****", tag);
@@ -141,16 +372,109 @@ void imap_send(struct imap_connection *imap, imap_callback_t callback,
 	free(tag);
 }
 
+/*
+ * Tells the callbacks of the commands we're waiting on that they won't hear
+ * back. They may send more, which wait for the next call.
+ */
+static void fail_pending(struct imap_connection *imap, const char *reason) {
+	list_t *callbacks = create_list();
+	hashtable_t *pending = imap->pending;
+	for (size_t i = 0; i < pending->bucket_count; ++i) {
+		for (hashtable_entry_t *entry = pending->buckets[i];
+				entry; entry = entry->next) {
+			list_add(callbacks, entry->value);
+		}
+	}
+	free_hashtable(pending);
+	imap->pending = create_hashtable(128, hash_string);
+	imap->outstanding = 0;
+	for (size_t i = 0; i < callbacks->length; ++i) {
+		struct imap_pending_callback *cb = callbacks->items[i];
+		if (cb->callback) {
+			cb->callback(imap, cb->data, STATUS_PRE_ERROR, reason);
+		}
+		free(cb);
+	}
+	list_free(callbacks);
+}
+
+/*
+ * Drops the connection, failing everything that was sent on it. The mailboxes
+ * and their messages are kept, for imap_resync to compare against once the
+ * connection is back.
+ */
+void imap_disconnect(struct imap_connection *imap, const char *reason) {
+	if (!imap->socket) {
+		return;
+	}
+	worker_log(L_ERROR, "Lost the connection to the server: %s", reason);
+	absocket_free(imap->socket);
+	imap->socket = NULL;
+	imap->poll[0].fd = -1;
+	imap->mode = RECV_WAIT;
+	imap->line_index = 0;
+	memset(imap->line, 0, imap->line_size + 1);
+	// Held commands are failed with the rest
+	free(imap->held);
+	imap->held = NULL;
+	imap->held_length = 0;
+	clear_literal(imap);
+	imap_cancel_selects(imap);
+	fail_pending(imap, reason);
+	append_fail(imap, reason);
+	if (imap->events.disconnected) {
+		imap->events.disconnected(imap, reason);
+	}
+	imap->logged_in = false;
+	free(imap->cap);
+	imap->cap = NULL;
+	/* imap->selected is left alone: it's still the one the user is in, and
+	 * what's done to it in the meantime waits in the journal for it to be
+	 * selected again. */
+}
+
 int imap_receive(struct imap_connection *imap) {
+	if (!imap->socket) {
+		if (imap->outstanding || imap->appends->length) {
+			fail_pending(imap, "Not connected");
+			append_fail(imap, "Not connected");
+			return 1;
+		}
+		return 0;
+	}
+	// Whatever the socket wouldn't take before
+	if (ab_flush(imap->socket) < 0) {
+		imap_disconnect(imap, strerror(errno));
+		return 1;
+	}
+	int sent = append_run(imap);
+	if (!imap->socket) {
+		return 1;
+	}
+	imap->poll[0].events = ab_events(imap->socket);
 	poll(imap->poll, 1, 0);
-	if (imap->poll[0].revents & POLLIN) {
+	if (ab_pending(imap->socket)) {
+		imap->poll[0].revents |= POLLIN;
+	}
+	if (imap->poll[0].revents & (POLLIN | POLLHUP | POLLERR)) {
 		get_nanoseconds(&imap->last_network);
 		if (imap->mode == RECV_WAIT) {
 			/* The mode may be RECV_WAIT if we are waiting on the user to verify
 			 * the SSL certificate, for example. */
+			if (!(imap->poll[0].revents & POLLIN)) {
+				imap_disconnect(imap, "Connection closed");
+			}
 		} else {
 			ssize_t amt = ab_recv(imap->socket, imap->line + imap->line_index,
 					imap->line_size - imap->line_index);
+			if (amt < 0 && (errno == EINTR || errno == EAGAIN)) {
+				return sent;
+			}
+			if (amt <= 0) {
+				imap_disconnect(imap, amt == 0 ? "Connection closed"
+						: strerror(errno));
+				return 1;
+			}
 			imap->line_index += amt;
 			if (imap->line_index == imap->line_size) {
 				imap->line = realloc(imap->line,
@@ -184,31 +508,24 @@ int imap_receive(struct imap_connection *imap) {
 					memset(imap->line + imap->line_index, 0, imap->line_size - imap->line_index);
 				}
 			}
+			if (imap->socket) {
+				// A continuation may have let it go on
+				append_run(imap);
+			}
+			enter_idle(imap);
 			return amt;
 		}
-	} else {
-		// Nothing being received, we wait 3 seconds and then start IDLE
+	} else if (imap->idle == IDLE_IDLING) {
+		// Before the server gives up on us; it's entered again once it's done
 		struct timespec ts;
 		get_nanoseconds(&ts);
-		if (imap->logged_in && imap->cap->idle && imap->mode != RECV_IDLE) {
-			if (ts.tv_sec - imap->last_network.tv_sec > 3) {
-				worker_log(L_DEBUG, "Entering IDLE mode");
-				imap_send(imap, NULL, NULL, "IDLE");
-				imap->mode = RECV_IDLE;
-				get_nanoseconds(&imap->idle_start);
-			}
-		}
-		if (imap->mode == RECV_IDLE) {
-			if (ts.tv_sec - imap->idle_start.tv_sec > 20 * 60) {
-				// TODO: Customize the idle refresh timeout
-				worker_log(L_DEBUG, "Refreshing IDLE mode");
-				imap_send(imap, NULL, NULL, "IDLE");
-				imap->mode = RECV_IDLE;
-				get_nanoseconds(&imap->idle_start);
-			}
+		if (ts.tv_sec - imap->idle_start.tv_sec >= imap->idle_refresh) {
+			worker_log(L_DEBUG, "Refreshing IDLE mode");
+			leave_idle(imap);
 		}
 	}
-	return 0;
+	enter_idle(imap);
+	return sent;
 }
 
 void handle_noop(struct imap_connection *imap, const char *token,
@@ -218,6 +535,18 @@ void handle_noop(struct imap_connection *imap, const char *token,
 
 void imap_init(struct imap_connection *imap) {
 	imap->mode = RECV_WAIT;
+	imap->socket = NULL;
+	imap->cap = NULL;
+	imap->logged_in = false;
+	imap->outstanding = 0;
+	imap->selected = NULL;
+	imap->idle = IDLE_NONE;
+	imap->idle_refresh = IDLE_REFRESH_DEFAULT;
+	imap->held = NULL;
+	imap->held_length = 0;
+	imap->literal = imap->literal_tag = NULL;
+	imap->literal_length = imap->literal_size = 0;
+	imap->appends = create_list();
 	imap->line = calloc(1, BUFFER_SIZE + 1);
 	imap->line_index = 0;
 	imap->line_size = BUFFER_SIZE;
@@ -225,6 +554,19 @@ void imap_init(struct imap_connection *imap) {
 	imap->pending = create_hashtable(128, hash_string);
 	imap->mailboxes = create_list();
 	imap->select_queue = create_list();
+	imap->views = create_list();
+	imap->searches = create_list();
+	imap->bodies = body_cache_create(BODY_CACHE_DEFAULT);
+	imap->store = NULL;
+	imap->search = NULL;
+	imap->prefetch = NULL;
+	imap->flag_queue = NULL;
+	imap->journal = NULL;
+	imap->reconnect = NULL;
+	imap->pool = NULL;
+	memset(&imap->copyuid, 0, sizeof(imap->copyuid));
+	memset(&imap->status_poll, 0, sizeof(imap->status_poll));
+	imap->background = false;
 	if (internal_handlers == NULL) {
 		internal_handlers = create_hashtable(128, hash_string);
 		hashtable_set(internal_handlers, "OK", handle_imap_status);
@@ -241,16 +583,31 @@ void imap_init(struct imap_connection *imap) {
 		hashtable_set(internal_handlers, "RECENT", handle_imap_existsunseenrecent);
 		hashtable_set(internal_handlers, "UIDNEXT", handle_imap_uidnext);
 		hashtable_set(internal_handlers, "READ-WRITE", handle_imap_readwrite);
-		hashtable_set(internal_handlers, "UIDVALIDITY", handle_noop);
+		hashtable_set(internal_handlers, "UIDVALIDITY", handle_imap_uidvalidity);
 		hashtable_set(internal_handlers, "HIGHESTMODSET", handle_noop); // RFC 4551
 		hashtable_set(internal_handlers, "FETCH", handle_imap_fetch);
 		hashtable_set(internal_handlers, "EXPUNGE", handle_imap_expunge);
+		hashtable_set(internal_handlers, "SORT", handle_imap_sort);
+		hashtable_set(internal_handlers, "THREAD", handle_imap_thread);
+		hashtable_set(internal_handlers, "SEARCH", handle_imap_search);
+		hashtable_set(internal_handlers, "ESEARCH", handle_imap_esearch);
+		hashtable_set(internal_handlers, "STATUS", handle_imap_mailbox_status);
+		hashtable_set(internal_handlers, "COPYUID", handle_imap_copyuid); // RFC 4315
+		hashtable_set(internal_handlers, "APPENDUID", handle_noop);
 	}
 }
 
 void imap_close(struct imap_connection *imap) {
 	absocket_free(imap->socket);
 	free(imap->line);
+	free(imap->held);
+	clear_literal(imap);
+	append_free(imap);
+	list_free(imap->views);
+	list_free(imap->searches);
+	body_cache_free(imap->bodies);
+	uid_map_finish(&imap->copyuid);
+	free(imap->status_poll.selected);
 	free(imap);
 }
 
@@ -260,12 +617,34 @@ bool imap_connect(struct imap_connection *imap, const struct uri *uri,
 	raw = fopen("raw.log", "w"); // temp, todo figure out a permenant solution
 #endif
 	imap_init(imap);
-	imap->socket = absocket_new(uri, use_ssl);
-	if (!imap->socket) {
-		return false;
-	}
+	return imap_reconnect(imap, uri, use_ssl, callback, data);
+}
+
+static void attach_socket(struct imap_connection *imap, absocket_t *socket,
+		imap_callback_t callback, void *data) {
+	imap->socket = socket;
 	imap->poll[0].fd = imap->socket->basefd;
 	imap->poll[0].events = POLLIN;
 	hashtable_set(imap->pending, "*", make_callback(callback, data));
+}
+
+void imap_connect_socket(struct imap_connection *imap, absocket_t *socket,
+		imap_callback_t callback, void *data) {
+	imap_init(imap);
+	attach_socket(imap, socket, callback, data);
+}
+
+/*
+ * Opens a new connection after imap_disconnect, keeping what we know of the
+ * mailboxes. callback is called once the server has greeted us, as for
+ * imap_connect.
+ */
+bool imap_reconnect(struct imap_connection *imap, const struct uri *uri,
+		bool use_ssl, imap_callback_t callback, void *data) {
+	absocket_t *socket = absocket_new(uri, use_ssl);
+	if (!socket) {
+		return false;
+	}
+	attach_socket(imap, socket, callback, data);
 	return true;
 }
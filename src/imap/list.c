@@ -8,6 +8,7 @@
 
 #include "imap/imap.h"
 #include "internal/imap.h"
+#include "util/intern.h"
 #include "util/list.h"
 
 void imap_list(struct imap_connection *imap, imap_callback_t callback,
@@ -25,7 +26,7 @@ void handle_imap_list(struct imap_connection *imap, const char *token,
 	while (flags) {
 		if (flags->type == IMAP_ATOM) {
 			struct mailbox_flag *flag = calloc(1, sizeof(struct mailbox_flag));
-			flag->name = strdup(flags->str);
+			flag->name = intern(flags->str);
 			list_add(mbox->flags, flag);
 		}
 		flags = flags->next;
@@ -0,0 +1,79 @@
+/*
+ * imap/notify.c - issues STATUS, LIST-STATUS (RFC 5819) and NOTIFY (RFC 5465)
+ * commands, and handles the STATUS responses they produce
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imap/imap.h"
+#include "internal/imap.h"
+#include "log.h"
+
+#define STATUS_ITEMS "MESSAGES UNSEEN RECENT"
+
+void imap_status(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *mailbox) {
+	char *quoted = imap_quote(imap, mailbox);
+	imap_send(imap, callback, data, "STATUS %s (" STATUS_ITEMS ")", quoted);
+	free(quoted);
+}
+
+void imap_list_status(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *refname, const char *boxname) {
+	char *ref = imap_quote(imap, refname);
+	char *box = imap_quote(imap, boxname);
+	imap_send(imap, callback, data,
+			"LIST %s %s RETURN (STATUS (" STATUS_ITEMS "))", ref, box);
+	free(ref);
+	free(box);
+}
+
+/*
+ * Asks for the selected mailbox's changes as usual, and for a STATUS response
+ * whenever messages come and go or change flags in any of the others. The
+ * STATUS indicator gets us one for each of them straight away, too.
+ */
+void imap_notify(struct imap_connection *imap, imap_callback_t callback,
+		void *data) {
+	imap_send(imap, callback, data, "NOTIFY SET STATUS "
+			"(selected (MessageNew MessageExpunge FlagChange)) "
+			"(personal (MessageNew MessageExpunge FlagChange))");
+}
+
+void handle_imap_mailbox_status(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args) {
+	if (!args || !args->str || !args->next || args->next->type != IMAP_LIST) {
+		worker_log(L_DEBUG, "Got malformed STATUS response");
+		return;
+	}
+	struct mailbox *mbox = get_mailbox(imap, args->str);
+	if (!mbox) {
+		// Not one we've listed, so the UI doesn't know about it either
+		return;
+	}
+	struct { const char *name; long *ptr; } items[] = {
+		{ "MESSAGES", &mbox->status.messages },
+		{ "UNSEEN", &mbox->status.unseen },
+		{ "RECENT", &mbox->status.recent },
+	};
+	bool changed = false;
+	for (imap_arg_t *item = args->next->list; item && item->next;
+			item = item->next->next) {
+		if (item->type != IMAP_ATOM || item->next->type != IMAP_NUMBER) {
+			continue;
+		}
+		for (size_t i = 0; i < sizeof(items) / sizeof(items[0]); ++i) {
+			if (strcmp(items[i].name, item->str) == 0
+					&& *items[i].ptr != item->next->num) {
+				*items[i].ptr = item->next->num;
+				changed = true;
+			}
+		}
+	}
+	if (changed && imap->events.mailbox_status) {
+		imap->events.mailbox_status(imap, mbox);
+	}
+}
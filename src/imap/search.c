@@ -0,0 +1,127 @@
+/*
+ * imap/search.c - issues and handles IMAP UID SEARCH commands, with ESEARCH
+ * (RFC 4731) results when the server supports them
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "imap/imap.h"
+#include "internal/imap.h"
+#include "log.h"
+#include "util/list.h"
+#include "util/uid_set.h"
+
+/*
+ * As with SORT, the untagged SEARCH or ESEARCH the server sends belongs to the
+ * oldest of our searches still in flight.
+ */
+struct pending_search {
+	struct uid_set *results;
+	imap_callback_t callback;
+	void *data;
+};
+
+static void search_done(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	struct pending_search *pending = data;
+	for (size_t i = 0; i < imap->searches->length; ++i) {
+		if (imap->searches->items[i] == pending) {
+			list_del(imap->searches, i);
+			break;
+		}
+	}
+	if (pending->callback) {
+		pending->callback(imap, pending->data, status, args);
+	}
+	free(pending);
+}
+
+static struct uid_set *current_results(struct imap_connection *imap) {
+	if (!imap->searches->length) {
+		return NULL;
+	}
+	struct pending_search *pending = imap->searches->items[0];
+	return pending->results;
+}
+
+void imap_search(struct imap_connection *imap, imap_callback_t callback,
+		void *data, struct uid_set *results, const char *criteria) {
+	struct pending_search *pending = malloc(sizeof(struct pending_search));
+	pending->results = results;
+	pending->callback = callback;
+	pending->data = data;
+	list_add(imap->searches, pending);
+	if (imap->cap && imap->cap->esearch) {
+		// Results come back as a sequence-set instead of one number per UID
+		imap_send(imap, search_done, pending,
+				"UID SEARCH RETURN (ALL) %s", criteria);
+	} else {
+		imap_send(imap, search_done, pending, "UID SEARCH %s", criteria);
+	}
+}
+
+void handle_imap_search(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args) {
+	struct uid_set *results = current_results(imap);
+	if (!results) {
+		worker_log(L_DEBUG, "Got unsolicited SEARCH response");
+		return;
+	}
+	for (; args; args = args->next) {
+		if (args->type == IMAP_NUMBER) {
+			uid_set_add(results, args->num);
+		}
+	}
+}
+
+void handle_imap_esearch(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args) {
+	struct uid_set *results = current_results(imap);
+	if (!results) {
+		worker_log(L_DEBUG, "Got unsolicited ESEARCH response");
+		return;
+	}
+	/*
+	 * * ESEARCH (TAG "a1") UID ALL 4:19,21 COUNT 17
+	 *
+	 * We split sequence-sets into a number and an atom for the rest, so
+	 * it's pieced back together here.
+	 */
+	for (; args; args = args->next) {
+		if (args->type != IMAP_ATOM || strcasecmp(args->str, "ALL") != 0) {
+			continue;
+		}
+		size_t len = 0, size = 64;
+		char *set = malloc(size);
+		set[0] = '\0';
+		for (args = args->next; args; args = args->next) {
+			char num[16];
+			const char *part;
+			if (args->type == IMAP_NUMBER) {
+				snprintf(num, sizeof(num), "%ld", args->num);
+				part = num;
+			} else if (args->type == IMAP_ATOM && len
+					&& (args->str[0] == ':' || args->str[0] == ',')) {
+				part = args->str;
+			} else {
+				break;
+			}
+			size_t plen = strlen(part);
+			if (len + plen + 1 > size) {
+				size = (len + plen + 1) * 2;
+				set = realloc(set, size);
+			}
+			memcpy(set + len, part, plen + 1);
+			len += plen;
+		}
+		if (!uid_set_parse(results, set)) {
+			worker_log(L_DEBUG, "Invalid ESEARCH result: %s", set);
+		}
+		free(set);
+		break;
+	}
+}
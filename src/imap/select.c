@@ -11,12 +11,15 @@
 #include "imap/imap.h"
 #include "internal/imap.h"
 #include "log.h"
+#include "util/intern.h"
 #include "util/list.h"
 #include "util/stringop.h"
+#include "util/uid_set.h"
 
 struct callback_data {
 	void *data;
 	char *mailbox;
+	const char *command; // SELECT or EXAMINE
 	imap_callback_t callback;
 };
 
@@ -24,34 +27,33 @@ static void imap_select_callback(struct imap_connection *imap,
 		void *data, enum imap_status status, const char *args) {
 	struct callback_data *cbdata = data;
 	list_pop(imap->select_queue);
-	if (status != STATUS_OK) {
-		if (cbdata->callback) {
-			cbdata->callback(imap, cbdata->data, status, args);
+	struct mailbox *mbox = NULL;
+	if (status == STATUS_OK) {
+		mbox = get_mailbox(imap, cbdata->mailbox);
+		mbox->selected = true;
+		if (imap->selected) {
+			free(imap->selected);
 		}
-		return;
-	}
-	struct mailbox *mbox = get_mailbox(imap, cbdata->mailbox);
-	mbox->selected = true;
-	if (imap->selected) {
-		free(imap->selected);
+		imap->selected = strdup(cbdata->mailbox);
 	}
-	imap->selected = strdup(cbdata->mailbox);
 	if (imap->select_queue->length) {
 		struct callback_data *_cbdata = list_peek(imap->select_queue);
 		imap_send(imap, imap_select_callback, _cbdata,
-				"SELECT \"%s\"", _cbdata->mailbox);
-	} else if (cbdata->callback) {
+				"%s \"%s\"", _cbdata->command, _cbdata->mailbox);
+	}
+	if (cbdata->callback) {
 		cbdata->callback(imap, cbdata->data, status, args);
 	}
-	if (imap->events.mailbox_updated) {
+	if (mbox && imap->events.mailbox_updated) {
 		imap->events.mailbox_updated(imap, mbox);
 	}
 	free(cbdata->mailbox);
 	free(cbdata);
 }
 
-void imap_select(struct imap_connection *imap, imap_callback_t callback,
-		void *data, const char *mailbox) {
+static void select_mailbox(struct imap_connection *imap,
+		imap_callback_t callback, void *data, const char *mailbox,
+		const char *command) {
 	if (mailbox_get_flag(imap, mailbox, "\\noselect")) {
 		callback(imap, data, STATUS_PRE_ERROR, "Cannot select this mailbox");
 		return;
@@ -59,12 +61,43 @@ void imap_select(struct imap_connection *imap, imap_callback_t callback,
 	struct callback_data *cbdata = malloc(sizeof(struct callback_data));
 	cbdata->data = data;
 	cbdata->mailbox = strdup(mailbox);
+	cbdata->command = command;
 	cbdata->callback = callback;
 	list_enqueue(imap->select_queue, cbdata);
 	if (imap->select_queue->length > 1) {
 		return;
 	}
-	imap_send(imap, imap_select_callback, cbdata, "SELECT \"%s\"", mailbox);
+	imap_send(imap, imap_select_callback, cbdata, "%s \"%s\"", command, mailbox);
+}
+
+void imap_select(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *mailbox) {
+	select_mailbox(imap, callback, data, mailbox, "SELECT");
+}
+
+/* As imap_select, but read-only, so it leaves \Recent alone */
+void imap_examine(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const char *mailbox) {
+	select_mailbox(imap, callback, data, mailbox, "EXAMINE");
+}
+
+/*
+ * Forgets the SELECTs and EXAMINEs that haven't been sent yet, because another
+ * is about to replace them. Their callbacks are told so.
+ */
+void imap_cancel_selects(struct imap_connection *imap) {
+	while (imap->select_queue->length > 1) {
+		// The one on the wire is at the end
+		struct callback_data *cbdata = imap->select_queue->items[0];
+		list_del(imap->select_queue, 0);
+		worker_log(L_DEBUG, "Not selecting %s after all", cbdata->mailbox);
+		if (cbdata->callback) {
+			cbdata->callback(imap, cbdata->data, STATUS_PRE_ERROR,
+					"Superseded");
+		}
+		free(cbdata->mailbox);
+		free(cbdata);
+	}
 }
 
 static const char *get_selected(struct imap_connection *imap) {
@@ -75,6 +108,146 @@ static const char *get_selected(struct imap_connection *imap) {
 	return selected;
 }
 
+/* Adds count messages we know nothing about yet to the end */
+static void add_messages(struct mailbox *mbox, long count) {
+	while (count-- > 0) {
+		struct mailbox_message *msg = calloc(1,
+				sizeof(struct mailbox_message));
+		msg->index = mbox->messages->length;
+		list_add(mbox->messages, msg);
+	}
+	message_table_cow(&mbox->table);
+	message_table_resize(mbox->table, mbox->messages->length);
+	mbox->table_dirty = true;
+}
+
+struct resync {
+	imap_callback_t callback;
+	void *data;
+	char *mailbox;
+	long uidvalidity; // From before we were away, 0 if we never knew it
+	struct uid_set *uids; // What the server has now
+};
+
+/*
+ * Sequence numbers go up with UIDs, so a message we already know must be at
+ * the index of its UID among those the server has now. Returns false if any
+ * of them aren't, because something we didn't know about came in between.
+ */
+static bool in_place(struct mailbox *mbox, const struct uid_set *uids) {
+	size_t range = 0, before = 0; // UIDs in the ranges before this one
+	for (size_t i = 0; i < mbox->messages->length; ++i) {
+		struct mailbox_message *msg = mbox->messages->items[i];
+		if (!msg->uid) {
+			continue;
+		}
+		while (range < uids->length && uids->ranges[range].max < msg->uid) {
+			before += uids->ranges[range].max - uids->ranges[range].min + 1;
+			++range;
+		}
+		if (range == uids->length
+				|| before + (msg->uid - uids->ranges[range].min) != i) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void expunge_all(struct imap_connection *imap, struct mailbox *mbox) {
+	while (mbox->messages->length) {
+		mailbox_expunge(imap, mbox, mbox->messages->length - 1);
+	}
+}
+
+/*
+ * Brings our messages in line with the UIDs the server has after being away:
+ * the ones it no longer has are expunged, and the rest stay as they are, with
+ * their bodies and headers, if they're still where they should be. If they
+ * aren't, we start over, and the caches spare us fetching the bodies again.
+ */
+static void reconcile(struct imap_connection *imap, struct mailbox *mbox,
+		const struct uid_set *uids) {
+	long count = uid_set_count(uids);
+	for (size_t i = mbox->messages->length; i > 0; --i) {
+		struct mailbox_message *msg = mbox->messages->items[i - 1];
+		if (msg->uid && !uid_set_contains(uids, msg->uid)) {
+			mailbox_expunge(imap, mbox, i - 1);
+		}
+	}
+	if (!in_place(mbox, uids)) {
+		worker_log(L_DEBUG, "Messages in %s moved while we were away, "
+				"listing them again", mbox->name);
+		expunge_all(imap, mbox);
+	}
+	// Any left over past the end are ones we never knew the UIDs of
+	while ((long)mbox->messages->length > count) {
+		mailbox_expunge(imap, mbox, mbox->messages->length - 1);
+	}
+	add_messages(mbox, count - mbox->messages->length);
+	mbox->exists = count;
+	worker_log(L_DEBUG, "Resynced %s, %ld messages", mbox->name, count);
+	if (imap->events.mailbox_updated) {
+		imap->events.mailbox_updated(imap, mbox);
+	}
+}
+
+static void resync_searched(struct imap_connection *imap,
+		void *data, enum imap_status status, const char *args) {
+	struct resync *resync = data;
+	struct mailbox *mbox = imap->selected
+		&& strcmp(imap->selected, resync->mailbox) == 0 ?
+		get_mailbox(imap, resync->mailbox) : NULL;
+	if (status == STATUS_OK && mbox) {
+		if (resync->uidvalidity && resync->uidvalidity != mbox->uidvalidity) {
+			// The UIDs we have are for other messages now, if any
+			worker_log(L_DEBUG, "UIDVALIDITY of %s changed while we were "
+					"away, starting over", mbox->name);
+			expunge_all(imap, mbox);
+			if (imap->bodies) {
+				body_cache_drop_mailbox(imap->bodies, mbox->name);
+			}
+		}
+		reconcile(imap, mbox, resync->uids);
+	}
+	uid_set_free(resync->uids);
+	resync->uids = NULL;
+}
+
+static void resync_fetched(struct imap_connection *imap,
+		void *data, enum imap_status status, const char *args) {
+	struct resync *resync = data;
+	if (resync->callback) {
+		resync->callback(imap, resync->data, status, args);
+	}
+	free(resync->mailbox);
+	free(resync);
+}
+
+/*
+ * Catches up with what happened to the mailbox being selected while we
+ * weren't connected. Send it straight after the SELECT: the UIDs the server
+ * has are compared with ours once it's done, and the FETCH for their flags
+ * is answered after that. So it's all one round trip.
+ */
+void imap_resync(struct imap_connection *imap, imap_callback_t callback,
+		void *data) {
+	const char *selected = get_selected(imap);
+	if (!selected) {
+		callback(imap, data, STATUS_PRE_ERROR, "No mailbox selected");
+		return;
+	}
+	struct resync *resync = calloc(1, sizeof(struct resync));
+	resync->callback = callback;
+	resync->data = data;
+	resync->mailbox = strdup(selected);
+	// The SELECT's answer hasn't come in yet, so this is still the old one
+	struct mailbox *mbox = get_mailbox(imap, selected);
+	resync->uidvalidity = mbox ? mbox->uidvalidity : 0;
+	resync->uids = uid_set_create();
+	imap_search(imap, resync_searched, resync, resync->uids, "ALL");
+	imap_send(imap, resync_fetched, resync, "FETCH 1:* (UID FLAGS)");
+}
+
 void handle_imap_existsunseenrecent(struct imap_connection *imap, const char *token,
 		const char *cmd, imap_arg_t *args) {
 	assert(args);
@@ -98,12 +271,7 @@ void handle_imap_existsunseenrecent(struct imap_connection *imap, const char *to
 					diff = args->num;
 				}
 				if (diff > 0) {
-					while (diff--) {
-						struct mailbox_message *msg = calloc(1,
-								sizeof(struct mailbox_message));
-						msg->index = mbox->messages->length;
-						list_add(mbox->messages, msg);
-					}
+					add_messages(mbox, diff);
 				} else if (diff == 0) {
 					/* no-op */
 				} else {
@@ -133,6 +301,20 @@ void handle_imap_uidnext(struct imap_connection *imap, const char *token,
 	mbox->nextuid = args->num;
 }
 
+void handle_imap_uidvalidity(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args) {
+	assert(args);
+	assert(args->type == IMAP_NUMBER);
+	const char *selected = get_selected(imap);
+	struct mailbox *mbox = get_mailbox(imap, selected);
+	if (mbox->uidvalidity && mbox->uidvalidity != args->num && imap->bodies) {
+		// The bodies we have belong to whatever had those UIDs before
+		worker_log(L_DEBUG, "UIDVALIDITY of %s changed", selected);
+		body_cache_drop_mailbox(imap->bodies, selected);
+	}
+	mbox->uidvalidity = args->num;
+}
+
 void handle_imap_readwrite(struct imap_connection *imap, const char *token,
 		const char *cmd, imap_arg_t *args) {
 	const char *selected = get_selected(imap);
@@ -158,7 +340,7 @@ void handle_imap_flags(struct imap_connection *imap, const char *token,
 			struct mailbox_flag *flag = mailbox_get_flag(imap, mbox->name, flags->str);
 			if (!flag) {
 				flag = calloc(1, sizeof(struct mailbox_flag));
-				flag->name = strdup(flags->str);
+				flag->name = intern(flags->str);
 				list_add(mbox->flags, flag);
 			}
 			flag->permanent = perm;
@@ -0,0 +1,120 @@
+/*
+ * imap/sort.c - issues and handles IMAP SORT and THREAD commands (RFC 5256)
+ */
+#define _POSIX_C_SOURCE 201112LL
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "imap/imap.h"
+#include "internal/imap.h"
+#include "log.h"
+#include "message_view.h"
+#include "util/list.h"
+
+/*
+ * The server answers commands in the order they're sent, so the untagged
+ * SORT or THREAD it sends belongs to the oldest of ours still in flight.
+ */
+struct pending_view {
+	struct message_view *view;
+	imap_callback_t callback;
+	void *data;
+};
+
+static void view_done(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	struct pending_view *pending = data;
+	for (size_t i = 0; i < imap->views->length; ++i) {
+		if (imap->views->items[i] == pending) {
+			list_del(imap->views, i);
+			break;
+		}
+	}
+	if (pending->callback) {
+		pending->callback(imap, pending->data, status, args);
+	}
+	free(pending);
+}
+
+static struct pending_view *pending_view(struct imap_connection *imap,
+		imap_callback_t callback, void *data, struct message_view *view) {
+	struct pending_view *pending = malloc(sizeof(struct pending_view));
+	pending->view = view;
+	pending->callback = callback;
+	pending->data = data;
+	view->server = true;
+	list_add(imap->views, pending);
+	return pending;
+}
+
+static struct message_view *current_view(struct imap_connection *imap) {
+	if (!imap->views->length) {
+		return NULL;
+	}
+	struct pending_view *pending = imap->views->items[0];
+	return pending->view;
+}
+
+void imap_sort(struct imap_connection *imap, imap_callback_t callback,
+		void *data, struct message_view *view, const char *criteria) {
+	imap_send(imap, view_done, pending_view(imap, callback, data, view),
+			"SORT (%s) UTF-8 ALL", criteria);
+}
+
+void imap_thread(struct imap_connection *imap, imap_callback_t callback,
+		void *data, struct message_view *view, const char *algorithm) {
+	imap_send(imap, view_done, pending_view(imap, callback, data, view),
+			"THREAD %s UTF-8 ALL", algorithm);
+}
+
+void handle_imap_sort(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args) {
+	struct message_view *view = current_view(imap);
+	if (!view) {
+		worker_log(L_DEBUG, "Got unsolicited SORT response");
+		return;
+	}
+	for (; args; args = args->next) {
+		if (args->type == IMAP_NUMBER) {
+			message_view_append(view, args->num - 1, 0);
+		}
+	}
+}
+
+/*
+ * A thread is a list where each number is a reply to the one before it, and a
+ * nested list is one of several branches hanging off the last message:
+ * (3 6 (4 23)(44 7 96))
+ */
+static void parse_thread(struct message_view *view, imap_arg_t *args,
+		int depth) {
+	for (; args; args = args->next) {
+		if (args->type == IMAP_NUMBER) {
+			message_view_append(view, args->num - 1, depth++);
+		} else if (args->type == IMAP_LIST) {
+			parse_thread(view, args->list, depth);
+		}
+	}
+}
+
+void handle_imap_thread(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args) {
+	struct message_view *view = current_view(imap);
+	if (!view) {
+		worker_log(L_DEBUG, "Got unsolicited THREAD response");
+		return;
+	}
+	// Threads arrive oldest first, we show the newest on top
+	list_t *threads = create_list();
+	for (; args; args = args->next) {
+		if (args->type == IMAP_LIST) {
+			list_add(threads, args);
+		}
+	}
+	for (size_t i = threads->length; i > 0; --i) {
+		imap_arg_t *thread = threads->items[i - 1];
+		parse_thread(view, thread->list, 0);
+	}
+	list_free(threads);
+}
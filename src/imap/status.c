@@ -64,6 +64,9 @@ void handle_imap_status(struct imap_connection *imap, const char *token,
 	bool has_callback = hashtable_contains(imap->pending, token);
 	struct imap_pending_callback *callback = hashtable_del(imap->pending, token);
 	if (has_callback) {
+		if (strcmp(token, "*") != 0) {
+			--imap->outstanding;
+		}
 		if (callback && callback->callback) {
 			callback->callback(imap, callback->data, estatus, args->original);
 		}
@@ -0,0 +1,293 @@
+/*
+ * imap/uid.c - issues UID STORE, COPY, MOVE (RFC 6851) and EXPUNGE (RFC 4315)
+ * commands over sets of UIDs, split up to keep each command line short, and
+ * handles the COPYUID responses to them
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "imap/imap.h"
+#include "internal/imap.h"
+#include "log.h"
+#include "util/uid_set.h"
+
+/* At most 22 bytes each, so every command fits in the 8000 RFC 7162 asks for */
+#define RANGES_PER_COMMAND 256
+/* More than any mailbox holds, so a bogus range can't eat all our memory */
+#define MAX_COPYUIDS (1 << 20)
+
+struct uid_batch {
+	size_t pending;
+	enum imap_status status; // Of the first to fail, if any did
+	char *args;
+	imap_callback_t callback;
+	void *data;
+	struct uid_map *map;
+};
+
+void uid_map_finish(struct uid_map *map) {
+	free(map->source);
+	free(map->destination);
+	memset(map, 0, sizeof(struct uid_map));
+}
+
+static int compare_pairs(const void *_a, const void *_b) {
+	uint64_t a = *(const uint64_t *)_a, b = *(const uint64_t *)_b;
+	return a < b ? -1 : a > b;
+}
+
+void uid_map_sort(struct uid_map *map) {
+	// Source in the high half, so they sort by that
+	uint64_t *pairs = malloc(map->length * sizeof(uint64_t));
+	if (!pairs) {
+		return;
+	}
+	for (size_t i = 0; i < map->length; ++i) {
+		pairs[i] = (uint64_t)map->source[i] << 32 | map->destination[i];
+	}
+	qsort(pairs, map->length, sizeof(uint64_t), compare_pairs);
+	for (size_t i = 0; i < map->length; ++i) {
+		map->source[i] = pairs[i] >> 32;
+		map->destination[i] = (uint32_t)pairs[i];
+	}
+	free(pairs);
+}
+
+uint32_t uid_map_find(const struct uid_map *map, uint32_t source) {
+	size_t lo = 0, hi = map->length;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (map->source[mid] < source) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo < map->length && map->source[lo] == source ?
+		map->destination[lo] : 0;
+}
+
+static void uid_map_add(struct uid_map *map, uint32_t source,
+		uint32_t destination) {
+	if (map->length == map->capacity) {
+		map->capacity = map->capacity ? map->capacity * 2 : 16;
+		map->source = realloc(map->source, map->capacity * sizeof(uint32_t));
+		map->destination = realloc(map->destination,
+				map->capacity * sizeof(uint32_t));
+	}
+	map->source[map->length] = source;
+	map->destination[map->length++] = destination;
+}
+
+/*
+ * We split sequence-sets into a number and an atom for the rest, so this
+ * pieces one back together (see handle_imap_esearch) and leaves *args after it
+ */
+static char *join_set(imap_arg_t **args) {
+	size_t len = 0, size = 64;
+	char *set = malloc(size);
+	set[0] = '\0';
+	for (; *args; *args = (*args)->next) {
+		char num[16];
+		const char *part;
+		if ((*args)->type == IMAP_NUMBER) {
+			snprintf(num, sizeof(num), "%ld", (*args)->num);
+			part = num;
+		} else if ((*args)->type == IMAP_ATOM && len
+				&& ((*args)->str[0] == ':' || (*args)->str[0] == ',')) {
+			part = (*args)->str;
+		} else {
+			break;
+		}
+		if (len && (*args)->type == IMAP_NUMBER && set[len - 1] != ':'
+				&& set[len - 1] != ',') {
+			// The start of the next set
+			break;
+		}
+		size_t plen = strlen(part);
+		if (len + plen + 1 > size) {
+			size = (len + plen + 1) * 2;
+			set = realloc(set, size);
+		}
+		memcpy(set + len, part, plen + 1);
+		len += plen;
+	}
+	return set;
+}
+
+/*
+ * Unlike uid_set_parse this keeps the order the server wrote them in, since
+ * that's how COPYUID pairs them up. Returns the number of UIDs, or 0 if the set
+ * is invalid.
+ */
+static size_t expand_set(const char *set, uint32_t **uids) {
+	size_t length = 0, capacity = 0;
+	*uids = NULL;
+	while (*set) {
+		char *end;
+		unsigned long min = strtoul(set, &end, 10), max = min;
+		if (end == set) {
+			goto invalid;
+		}
+		if (*end == ':') {
+			set = end + 1;
+			max = strtoul(set, &end, 10);
+			if (end == set) {
+				goto invalid;
+			}
+		}
+		long step = min <= max ? 1 : -1;
+		if ((min <= max ? max - min : min - max) >= MAX_COPYUIDS - length) {
+			goto invalid;
+		}
+		for (unsigned long uid = min; ; uid += step) {
+			if (length == capacity) {
+				capacity = capacity ? capacity * 2 : 16;
+				*uids = realloc(*uids, capacity * sizeof(uint32_t));
+			}
+			(*uids)[length++] = uid;
+			if (uid == max) {
+				break;
+			}
+		}
+		if (*end == ',') {
+			++end;
+		} else if (*end) {
+			goto invalid;
+		}
+		set = end;
+	}
+	return length;
+invalid:
+	free(*uids);
+	*uids = NULL;
+	return 0;
+}
+
+/* * OK [COPYUID uidvalidity source-set destination-set] */
+void handle_imap_copyuid(struct imap_connection *imap, const char *token,
+		const char *cmd, imap_arg_t *args) {
+	if (!args || args->type != IMAP_NUMBER) {
+		worker_log(L_DEBUG, "Got malformed COPYUID response");
+		return;
+	}
+	uint32_t uidvalidity = args->num;
+	args = args->next;
+	char *source = join_set(&args);
+	char *destination = join_set(&args);
+	uint32_t *src, *dst;
+	size_t nsrc = expand_set(source, &src);
+	size_t ndst = expand_set(destination, &dst);
+	if (!nsrc || nsrc != ndst) {
+		worker_log(L_DEBUG, "Invalid COPYUID response: %s %s",
+				source, destination);
+	} else {
+		if (imap->copyuid.length
+				&& imap->copyuid.uidvalidity != uidvalidity) {
+			uid_map_finish(&imap->copyuid);
+		}
+		imap->copyuid.uidvalidity = uidvalidity;
+		for (size_t i = 0; i < nsrc; ++i) {
+			uid_map_add(&imap->copyuid, src[i], dst[i]);
+		}
+	}
+	free(src);
+	free(dst);
+	free(source);
+	free(destination);
+}
+
+static void batch_done(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	struct uid_batch *batch = data;
+	if (batch->map && imap->copyuid.length) {
+		// The server answers in turn, so these all came with this command
+		batch->map->uidvalidity = imap->copyuid.uidvalidity;
+		for (size_t i = 0; i < imap->copyuid.length; ++i) {
+			uid_map_add(batch->map, imap->copyuid.source[i],
+					imap->copyuid.destination[i]);
+		}
+	}
+	uid_map_finish(&imap->copyuid);
+	if (status != STATUS_OK && batch->status == STATUS_OK) {
+		batch->status = status;
+		free(batch->args);
+		batch->args = strdup(args ? args : "");
+	}
+	if (--batch->pending) {
+		return;
+	}
+	if (batch->callback) {
+		batch->callback(imap, batch->data, batch->status,
+				batch->status == STATUS_OK ? args : batch->args);
+	}
+	free(batch->args);
+	free(batch);
+}
+
+/* Sends "UID command set args" once per slice of the set */
+static void send_batch(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const struct uid_set *uids, const char *command,
+		const char *args, struct uid_map *map) {
+	if (!uids->length) {
+		if (callback) {
+			callback(imap, data, STATUS_PRE_ERROR, "No messages");
+		}
+		return;
+	}
+	struct uid_batch *batch = calloc(1, sizeof(struct uid_batch));
+	batch->callback = callback;
+	batch->data = data;
+	batch->map = map;
+	batch->pending = (uids->length + RANGES_PER_COMMAND - 1)
+		/ RANGES_PER_COMMAND;
+	for (size_t i = 0; i < uids->length; i += RANGES_PER_COMMAND) {
+		char *set = uid_set_format(uids, i, RANGES_PER_COMMAND);
+		imap_send(imap, batch_done, batch, "UID %s %s%s%s", command, set,
+				args ? " " : "", args ? args : "");
+		free(set);
+	}
+}
+
+void imap_uid_store(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const struct uid_set *uids, enum imap_store_mode mode,
+		const char *flags) {
+	const char *_mode = mode == STORE_FLAGS_APPEND ? "+FLAGS"
+		: mode == STORE_FLAGS_REMOVE ? "-FLAGS" : "FLAGS";
+	char *args = malloc(strlen(_mode) + strlen(flags) + 4);
+	strcpy(args, _mode);
+	strcat(args, " (");
+	strcat(args, flags);
+	strcat(args, ")");
+	send_batch(imap, callback, data, uids, "STORE", args, NULL);
+	free(args);
+}
+
+void imap_uid_copy(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const struct uid_set *uids, const char *destination,
+		struct uid_map *map) {
+	char *quoted = imap_quote(imap, destination);
+	send_batch(imap, callback, data, uids, "COPY", quoted, map);
+	free(quoted);
+}
+
+/* Only if the server has MOVE, see struct imap_capabilities */
+void imap_uid_move(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const struct uid_set *uids, const char *destination,
+		struct uid_map *map) {
+	char *quoted = imap_quote(imap, destination);
+	send_batch(imap, callback, data, uids, "MOVE", quoted, map);
+	free(quoted);
+}
+
+/*
+ * Only if the server has UIDPLUS. Unlike EXPUNGE it leaves alone any other
+ * messages someone else marked \Deleted.
+ */
+void imap_uid_expunge(struct imap_connection *imap, imap_callback_t callback,
+		void *data, const struct uid_set *uids) {
+	send_batch(imap, callback, data, uids, "EXPUNGE", NULL, NULL);
+}
@@ -3,13 +3,57 @@
  */
 #define _POSIX_C_SOURCE 200809L
 
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 
 #include "imap/imap.h"
+#include "internal/imap.h"
 #include "email/headers.h"
+#include "util/intern.h"
 #include "util/list.h"
+#include "worker.h"
+
+/*
+ * Returns str as a string to go in a command (free it): quoted, or as a
+ * literal if it has 8-bit characters or line breaks, which quoted strings
+ * can't hold. imap_send waits for the server's "+" when it has to.
+ */
+char *imap_quote(struct imap_connection *imap, const char *str) {
+	size_t len = strlen(str), escapes = 0;
+	bool literal = false;
+	for (const char *c = str; *c; ++c) {
+		if ((unsigned char)*c >= 0x80 || *c == '\r' || *c == '\n') {
+			literal = true;
+			break;
+		}
+		if (*c == '"' || *c == '\\') {
+			++escapes;
+		}
+	}
+	if (literal) {
+		bool plus = imap->cap && (imap->cap->literal_plus
+				|| (imap->cap->literal_minus && len <= LITERAL_MINUS_MAX));
+		int n = snprintf(NULL, 0, "{%zu%s}\r\n", len, plus ? "+" : "");
+		char *quoted = malloc(n + len + 1);
+		snprintf(quoted, n + 1, "{%zu%s}\r\n", len, plus ? "+" : "");
+		memcpy(quoted + n, str, len + 1);
+		return quoted;
+	}
+	char *quoted = malloc(len + escapes + 3), *q = quoted;
+	*q++ = '"';
+	for (const char *c = str; *c; ++c) {
+		if (*c == '"' || *c == '\\') {
+			*q++ = '\\';
+		}
+		*q++ = *c;
+	}
+	*q++ = '"';
+	*q = '\0';
+	return quoted;
+}
 
 static int get_mbox_compare(const void *_mbox, const void *_name) {
 	const struct mailbox *mbox = _mbox;
@@ -29,11 +73,13 @@ struct mailbox *get_or_make_mailbox(struct imap_connection *imap,
 		const char *name) {
 	struct mailbox *mbox = get_mailbox(imap, name);
 	if (!mbox) {
-		mbox = malloc(sizeof(struct mailbox));
+		mbox = calloc(1, sizeof(struct mailbox));
 		mbox->name = strdup(name);
 		mbox->flags = create_list();
 		mbox->messages = create_list();
+		mbox->table = message_table_create();
 		mbox->exists = mbox->unseen = mbox->recent = -1;
+		mbox->status.messages = mbox->status.unseen = mbox->status.recent = -1;
 		list_add(imap->mailboxes, mbox);
 	}
 	return mbox;
@@ -45,9 +91,10 @@ struct mailbox_flag *mailbox_get_flag(struct imap_connection *imap,
 	if (!box) {
 		return NULL;
 	}
-	for (size_t i = 0; i < box->flags->length; ++i) {
+	flag = intern_find(flag);
+	for (size_t i = 0; flag && i < box->flags->length; ++i) {
 		struct mailbox_flag *f = box->flags->items[i];
-		if (strcasecmp(f->name, flag) == 0) {
+		if (f->name == flag) {
 			return f;
 		}
 	}
@@ -69,12 +116,12 @@ void message_part_free(struct message_part *msg) {
 	if (!msg) {
 		return;
 	}
-	free(msg->type);
-	free(msg->subtype);
+	intern_release(msg->type);
+	intern_release(msg->subtype);
+	intern_release(msg->body_encoding);
 	free(msg->body_id);
 	free(msg->body_description);
-	free(msg->body_encoding);
-	free(msg->content);
+	body_unref(msg->fetched);
 	for (size_t i = 0; msg->parameters && i < msg->parameters->length; ++i) {
 		struct message_parameter *param = msg->parameters->items[i];
 		free(param->key);
@@ -86,16 +133,14 @@ void message_part_free(struct message_part *msg) {
 }
 
 void mailbox_message_free(struct mailbox_message *msg) {
-	for (size_t i = 0; msg->flags && i < msg->flags->length; ++i) {
-		char *f = msg->flags->items[i];
-		free(f);
-	}
-	list_free(msg->flags);
+	keywords_free(msg->keywords);
+	intern_release(msg->multipart_type);
 	for (size_t i = 0; msg->parts && i < msg->parts->length; ++i) {
 		struct message_part *part = msg->parts->items[i];
 		message_part_free(part);
 	}
 	list_free(msg->parts);
+	aerc_message_unref(msg->snapshot);
 	free_headers(msg->headers);
 	free(msg->internal_date);
 	free(msg);
@@ -104,7 +149,6 @@ void mailbox_message_free(struct mailbox_message *msg) {
 void mailbox_free(struct mailbox *mbox) {
 	for (size_t i = 0; i < mbox->flags->length; ++i) {
 		struct mailbox_flag *f = mbox->flags->items[i];
-		free(f->name);
 		free(f);
 	}
 	list_free(mbox->flags);
@@ -113,6 +157,7 @@ void mailbox_free(struct mailbox *mbox) {
 		mailbox_message_free(m);
 	}
 	list_free(mbox->messages);
+	message_table_unref(mbox->table);
 	free(mbox->name);
 	free(mbox);
 }
@@ -0,0 +1,111 @@
+/*
+ * imap/worker/cache.c - Where the worker keeps things between runs, and the
+ * on-disk store of message bodies
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "body_store.h"
+#include "imap/imap.h"
+#include "imap/worker.h"
+#include "log.h"
+#include "tls_cache.h"
+#include "urlparse.h"
+
+static bool make_dirs(char *path) {
+	for (char *slash = strchr(path + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+		if (slash) {
+			*slash = '\0';
+		}
+		bool ok = mkdir(path, 0700) == 0 || errno == EEXIST;
+		if (slash) {
+			*slash = '/';
+		}
+		if (!ok) {
+			return false;
+		}
+		if (!slash) {
+			return true;
+		}
+	}
+}
+
+char *cache_path(const struct uri *uri, const char *name) {
+	const char *cache = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+	if ((!cache || !*cache) && !home) {
+		return NULL;
+	}
+	char *account = malloc(strlen(uri->username) + strlen(uri->hostname) + 2);
+	sprintf(account, "%s@%s", uri->username, uri->hostname);
+	for (char *c = account; *c; ++c) {
+		// Usernames may well contain slashes
+		if (*c == '/') {
+			*c = '_';
+		}
+	}
+	char *path = malloc(strlen(cache && *cache ? cache : home)
+			+ strlen(account) + strlen(name) + sizeof("/.cache/aerc//"));
+	if (cache && *cache) {
+		sprintf(path, "%s/aerc/%s/%s", cache, account, name);
+	} else {
+		sprintf(path, "%s/.cache/aerc/%s/%s", home, account, name);
+	}
+	free(account);
+	if (!make_dirs(path)) {
+		worker_log(L_ERROR, "Unable to create %s", path);
+		free(path);
+		return NULL;
+	}
+	return path;
+}
+
+void open_body_store(struct imap_connection *imap, const struct uri *uri) {
+	if (imap->store) {
+		return;
+	}
+	char *path = cache_path(uri, "bodies");
+	if (!path) {
+		worker_log(L_ERROR, "Message bodies will not be saved");
+		return;
+	}
+	worker_log(L_DEBUG, "Opening body store at %s", path);
+	imap->store = body_store_open(path, BODY_STORE_DEFAULT);
+	free(path);
+}
+
+bool restore_body(struct imap_connection *imap, struct mailbox *mbox,
+		struct mailbox_message *msg, uint32_t part) {
+	if (!imap->store || !msg->uid) {
+		return false;
+	}
+	struct body *body = body_store_get(imap->store, mbox->name,
+			mbox->uidvalidity, msg->uid, part);
+	if (!body) {
+		return false;
+	}
+	body_cache_put(imap->bodies, mbox->name, msg->uid, part, body);
+	body_unref(body);
+	return true;
+}
+
+/* So that the first connection can resume the session from last time */
+void open_tls_sessions(const struct uri *uri) {
+#ifdef USE_OPENSSL
+	char *dir = cache_path(uri, "tls");
+	if (!dir) {
+		return;
+	}
+	char *path = malloc(strlen(dir) + sizeof("/session"));
+	sprintf(path, "%s/session", dir);
+	tls_cache_open(uri->hostname, uri->port, path);
+	free(path);
+	free(dir);
+#endif
+}
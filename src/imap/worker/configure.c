@@ -0,0 +1,35 @@
+/*
+ * imap/worker/configure.c - Handles the WORKER_CONFIGURE action
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+
+#include "body_cache.h"
+#include "body_store.h"
+#include "imap/imap.h"
+#include "imap/worker.h"
+#include "log.h"
+#include "worker.h"
+
+void handle_worker_configure(struct worker_pipe *pipe,
+		struct worker_message *message) {
+	struct imap_connection *imap = pipe->data;
+	struct worker_config *config = message->data;
+	if (imap->bodies) {
+		worker_log(L_DEBUG, "Body cache limited to %zu bytes",
+				config->body_cache_size);
+		body_cache_set_budget(imap->bodies, config->body_cache_size);
+	}
+	if (imap->store) {
+		worker_log(L_DEBUG, "Body store limited to %zu bytes",
+				config->body_store_size);
+		body_store_set_budget(imap->store, config->body_store_size);
+	}
+	if (imap->pool) {
+		pool_configure(imap->pool, config->background_connections);
+	}
+	imap->idle_refresh = config->idle_refresh > 0 ?
+		config->idle_refresh : IDLE_REFRESH_DEFAULT;
+	free(config);
+}
@@ -10,6 +10,7 @@
 
 #include "util/base64.h"
 #include "imap/imap.h"
+#include "imap/worker.h"
 #include "log.h"
 #include "urlparse.h"
 #include "worker.h"
@@ -24,6 +25,11 @@ void handle_imap_ready(struct imap_connection *imap, void *data,
 void imap_starttls_callback(struct imap_connection *imap, void *data,
 		enum imap_status status, const char *args);
 
+static void free_source(char *source) {
+	memset(source, 0, strlen(source));
+	free(source);
+}
+
 void handle_worker_connect(struct worker_pipe *pipe, struct worker_message *message) {
 	struct imap_connection *imap = pipe->data;
 	worker_post_message(pipe, WORKER_ACK, message, NULL);
@@ -33,6 +39,8 @@ void handle_worker_connect(struct worker_pipe *pipe, struct worker_message *mess
 		worker_log(L_DEBUG, "Invalid connection string '%s'",
 			(char*)message->data);
 	}
+	// The pool needs it to log in its own connections
+	char *source = strdup((char *)message->data);
 	// Contains password, clear it out of RAM
 	memset(message->data, 0, strlen((char *)message->data));
 	strcpy((char *)message->data, "password");
@@ -45,6 +53,7 @@ void handle_worker_connect(struct worker_pipe *pipe, struct worker_message *mess
 	} else {
 		worker_post_message(pipe, WORKER_CONNECT_ERROR, message,
 				"Unsupported protocol");
+		free_source(source);
 		return;
 	}
 
@@ -55,6 +64,7 @@ void handle_worker_connect(struct worker_pipe *pipe, struct worker_message *mess
 	if (!uri->password) {
 		worker_post_message(pipe, WORKER_CONNECT_ERROR, message,
 			"Failed to parse password");
+		free_source(source);
 		return;
 	}
 
@@ -65,9 +75,16 @@ void handle_worker_connect(struct worker_pipe *pipe, struct worker_message *mess
 	worker_log(L_DEBUG, "Hostname: %s", uri->hostname);
 	worker_log(L_DEBUG, "Port: %s", uri->port);
 
+	open_tls_sessions(uri);
 	bool res = imap_connect(imap, uri, ssl, handle_imap_ready, pipe);
+	body_cache_on_evict(imap->bodies, handle_body_evicted, imap);
+	open_search_index(imap, uri);
+	open_body_store(imap, uri);
+	open_journal(imap, uri);
 	if (res) {
 		worker_log(L_DEBUG, "Connected to IMAP server");
+		reconnect_init(imap, source, ssl);
+		imap->pool = pool_create(imap, source, ssl);
 		if (ssl) {
 			/*
 			 * If we're using SSL, we need to wait to start doing IMAP
@@ -83,6 +100,7 @@ void handle_worker_connect(struct worker_pipe *pipe, struct worker_message *mess
 			imap->mode = RECV_LINE;
 		}
 	} else {
+		free_source(source);
 		worker_post_message(pipe, WORKER_CONNECT_ERROR, message,
 				"Error connecting to IMAP server");
 	}
@@ -94,11 +112,35 @@ void handle_worker_cert_okay(struct worker_pipe *pipe, struct worker_message *me
 	imap->mode = RECV_LINE;
 }
 
+/*
+ * Background connections tell the pool instead, see imap/worker/pool.c. The
+ * pool waits for us to log in first, so that a wrong password isn't tried
+ * several times over. Connections made again after being lost don't tell the
+ * UI either, see imap/worker/reconnect.c.
+ */
+static bool report_elsewhere(struct imap_connection *imap, bool ok) {
+	if (!imap->background) {
+		if (reconnect_logged_in(imap, ok)) {
+			return true;
+		}
+		if (ok && imap->pool) {
+			pool_approve(imap->pool);
+		}
+		return false;
+	}
+	pool_connected(imap, ok);
+	return true;
+}
+
 void handle_imap_logged_in(struct imap_connection *imap, void *data,
 		enum imap_status status, const char *args) {
 	struct worker_pipe *pipe = data;
+	if (report_elsewhere(imap, status == STATUS_OK)) {
+		return;
+	}
 	if (status == STATUS_OK) {
 		worker_post_message(pipe, WORKER_CONNECT_DONE, NULL, NULL);
+		replay_journal(imap);
 	} else {
 		worker_post_message(pipe, WORKER_CONNECT_ERROR, NULL, args ? strdup(args) : NULL);
 	}
@@ -110,10 +152,15 @@ void handle_imap_cap(struct imap_connection *imap, void *data,
 	if (status != STATUS_OK) {
 		// TODO: Format errors sent to main thread
 		worker_log(L_ERROR, "IMAP error: %s", args);
-		worker_post_message(pipe, WORKER_CONNECT_ERROR, NULL, NULL);
+		if (!report_elsewhere(imap, false)) {
+			worker_post_message(pipe, WORKER_CONNECT_ERROR, NULL, NULL);
+		}
 		return;
 	}
 	if (!imap->cap->imap4rev1) {
+		if (report_elsewhere(imap, false)) {
+			return;
+		}
 		worker_post_message(pipe, WORKER_CONNECT_ERROR, NULL,
 				"IMAP server does not support IMAP4rev1");
 		return;
@@ -122,7 +169,10 @@ void handle_imap_cap(struct imap_connection *imap, void *data,
 	// Attempt to authenticate
 	if (status == STATUS_PREAUTH) {
 		imap->logged_in = true;
-		worker_post_message(pipe, WORKER_CONNECT_DONE, NULL, NULL);
+		if (!report_elsewhere(imap, true)) {
+			worker_post_message(pipe, WORKER_CONNECT_DONE, NULL, NULL);
+			replay_journal(imap);
+		}
 	} else if (imap->cap->auth_plain) {
 		if (imap->uri->username && imap->uri->password) {
 			if (imap->cap->sasl_ir) {
@@ -154,7 +204,7 @@ void handle_imap_cap(struct imap_connection *imap, void *data,
 	} else if (imap->cap->starttls) {
 		imap_send(imap, imap_starttls_callback, pipe, "STARTTLS");
 #endif
-	} else {
+	} else if (!report_elsewhere(imap, false)) {
 		worker_post_message(pipe, WORKER_CONNECT_ERROR, NULL,
 				"IMAP server and client do not share any supported "
 				"authentication mechanisms. Did you provide a username/password?");
@@ -164,6 +214,11 @@ void handle_imap_cap(struct imap_connection *imap, void *data,
 void handle_imap_ready(struct imap_connection *imap, void *data,
 		enum imap_status status, const char *args) {
 	struct worker_pipe *pipe = data;
+	if (status == STATUS_PRE_ERROR) {
+		// Lost before the server greeted us
+		handle_imap_cap(imap, pipe, status, args);
+		return;
+	}
 	if (!imap->cap) {
 		// Often the server will send us these in a status message during the
 		// handshake. Sometimes it won't, though:
@@ -179,6 +234,9 @@ void imap_starttls_callback(struct imap_connection *imap, void *data,
 		enum imap_status status, const char *args) {
 	struct worker_pipe *pipe = data;
 	if (!ab_enable_ssl(imap->socket)) {
+		if (report_elsewhere(imap, false)) {
+			return;
+		}
 		worker_post_message(pipe, WORKER_CONNECT_ERROR, NULL, "TLS connection failed.");
 		return;
 	}
@@ -4,39 +4,213 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "body_store.h"
+#include "email/flags.h"
 #include "imap/imap.h"
+#include "imap/worker.h"
 #include "internal/imap.h"
 #include "worker.h"
 #include "log.h"
+#include "op_journal.h"
 
-void handle_worker_copy_message(struct worker_pipe *pipe, struct worker_message *message) {
-	struct imap_connection *imap = pipe->data;
-	struct aerc_message_move *move = message->data;
-	worker_post_message(pipe, WORKER_ACK, message, NULL);
-	imap_copy(imap, NULL, NULL, move->index + 1, move->destination);
-	free(move->destination);
-	free(move);
+struct move_request {
+	struct aerc_message_move *move;
+	bool copy; // Leave the originals where they are
+	long uidvalidity; // Of the source
+	list_t *snapshots; // struct aerc_message, what we know of them so far
+	struct uid_map map;
+	uint64_t op; // In the journal
+	bool replay; // Of an op the user has long since stopped waiting on
+};
+
+/*
+ * Holds on to the messages as they are now, since with MOVE the server expunges
+ * them before it tells us it's done
+ */
+static struct move_request *move_request_new(struct imap_connection *imap,
+		struct aerc_message_move *move, bool copy) {
+	struct move_request *req = calloc(1, sizeof(struct move_request));
+	req->move = move;
+	req->copy = copy;
+	req->snapshots = create_list();
+	struct mailbox *mbox = get_mailbox(imap, move->mailbox);
+	if (!mbox) {
+		return req;
+	}
+	req->uidvalidity = mbox->uidvalidity;
+	for (size_t i = 0; i < mbox->messages->length; ++i) {
+		struct mailbox_message *msg = mbox->messages->items[i];
+		if (msg->populated && uid_set_contains(move->uids, msg->uid)) {
+			list_add(req->snapshots,
+					serialize_message(imap, move->mailbox, msg));
+		}
+	}
+	return req;
+}
+
+static void move_request_free(struct move_request *req) {
+	for (size_t i = 0; i < req->snapshots->length; ++i) {
+		aerc_message_unref(req->snapshots->items[i]);
+	}
+	list_free(req->snapshots);
+	uid_map_finish(&req->map);
+	free(req);
+}
+
+/*
+ * With UIDPLUS the server tells us each copy's UID, so the bodies we have and
+ * the search index can follow the messages to where they went instead of being
+ * fetched again when the user gets there
+ */
+static void remember_copies(struct imap_connection *imap,
+		struct move_request *req) {
+	const char *destination = req->move->destination;
+	size_t copied = 0, unseen = 0;
+	uid_map_sort(&req->map);
+	for (size_t i = 0; i < req->snapshots->length; ++i) {
+		struct aerc_message *msg = req->snapshots->items[i];
+		uint32_t uid = uid_map_find(&req->map, msg->uid);
+		if (!uid) {
+			continue;
+		}
+		++copied;
+		if (!(msg->flags & FLAG_SEEN)) {
+			++unseen;
+		}
+		for (size_t j = 0; imap->store && msg->parts
+				&& j < msg->parts->length; ++j) {
+			struct aerc_message_part *part = msg->parts->items[j];
+			// The store already has the body, so the copy can just point at it
+			if (!body_store_link(imap->store, req->move->mailbox,
+						req->uidvalidity, msg->uid, j + 1, destination,
+						req->map.uidvalidity, uid) && part->content) {
+				body_store_put(imap->store, destination, req->map.uidvalidity,
+						uid, j + 1, part->content->data, part->content->size);
+			}
+		}
+		index_snapshot(imap, msg, destination, req->map.uidvalidity, uid);
+	}
+	worker_log(L_DEBUG, "Carried %zu messages over to %s", copied, destination);
+	struct mailbox *mbox = get_mailbox(imap, destination);
+	if (!mbox || mbox->status.messages < 0 || !copied) {
+		return;
+	}
+	mbox->status.messages += copied;
+	if (mbox->status.unseen >= 0) {
+		mbox->status.unseen += unseen;
+	}
+	if (imap->events.mailbox_status) {
+		imap->events.mailbox_status(imap, mbox);
+	}
+}
+
+static void move_finished(struct imap_connection *imap,
+		struct move_request *req, enum imap_status status, const char *args) {
+	if (status != STATUS_OK) {
+		worker_log(L_ERROR, "Unable to %s messages to %s: %s",
+				req->copy ? "copy" : "move", req->move->destination, args);
+	}
+	journal_done(imap, req->op, status);
+	if (status == STATUS_PRE_ERROR && req->op) {
+		// It never got there, it'll go again from the journal when we're back
+		status = STATUS_OK;
+	}
+	if (req->copy || req->replay) {
+		aerc_message_move_free(req->move);
+	} else {
+		worker_post_message(imap->data, status == STATUS_OK ?
+				WORKER_MOVE_MESSAGE_DONE : WORKER_MOVE_MESSAGE_ERROR,
+				NULL, req->move);
+	}
+	move_request_free(req);
+}
+
+static void expunge_done(struct imap_connection *imap,
+		void *data, enum imap_status status, const char *args) {
+	move_finished(imap, data, status, args);
 }
 
 static void delete_message_done(struct imap_connection *imap,
 		void *data, enum imap_status status, const char *args) {
-	if (status == STATUS_OK) {
-		imap_expunge(imap, NULL, NULL);
+	struct move_request *req = data;
+	if (status != STATUS_OK) {
+		move_finished(imap, req, status, args);
+	} else if (imap->cap && imap->cap->uidplus) {
+		imap_uid_expunge(imap, expunge_done, req, req->move->uids);
+	} else {
+		imap_expunge(imap, expunge_done, req);
 	}
 }
 
-static void move_complete(struct imap_connection *imap,
+static void copy_done(struct imap_connection *imap,
 		void *data, enum imap_status status, const char *args) {
-	struct aerc_message_move *move = data;
-	imap_store(imap, delete_message_done, NULL, move->index, move->index,
+	struct move_request *req = data;
+	if (status == STATUS_OK) {
+		remember_copies(imap, req);
+	}
+	if (status != STATUS_OK || req->copy || (imap->cap && imap->cap->move)) {
+		move_finished(imap, req, status, args);
+		return;
+	}
+	imap_uid_store(imap, delete_message_done, req, req->move->uids,
 			STORE_FLAGS_APPEND, "\\Deleted");
-	free(move->destination);
-	free(move);
+}
+
+/*
+ * MOVE if the server has it. Otherwise we copy, mark the originals \Deleted
+ * and expunge them, with UID EXPUNGE if we can so that nothing else the user
+ * deleted elsewhere goes with them. replaying is the journal's op if it's being
+ * sent again, or 0 if it's new and has to be written down first.
+ */
+void start_move(struct imap_connection *imap, struct aerc_message_move *move,
+		bool copy, uint64_t replaying) {
+	// So the copies have the flags the user gave them
+	flush_flags(imap, true);
+	worker_log(L_DEBUG, "%s %zu messages to %s", copy ? "Copying" : "Moving",
+			uid_set_count(move->uids), move->destination);
+	struct move_request *req = move_request_new(imap, move, copy);
+	req->op = replaying;
+	req->replay = replaying != 0;
+	if (!replaying) {
+		struct op op = {
+			.type = copy ? OP_COPY : OP_MOVE,
+			.mailbox = move->mailbox,
+			.uidvalidity = req->uidvalidity,
+			.uids = move->uids,
+			.destination = move->destination,
+		};
+		req->op = journal_op(imap, &op);
+	}
+	if (!copy && imap->cap && imap->cap->move) {
+		imap_uid_move(imap, copy_done, req, move->uids, move->destination,
+				&req->map);
+	} else {
+		imap_uid_copy(imap, copy_done, req, move->uids, move->destination,
+				&req->map);
+	}
+}
+
+void handle_worker_copy_message(struct worker_pipe *pipe, struct worker_message *message) {
+	struct imap_connection *imap = pipe->data;
+	struct aerc_message_move *move = message->data;
+	worker_post_message(pipe, WORKER_ACK, message, NULL);
+	if (!batch_selected(imap, move->mailbox)) {
+		aerc_message_move_free(move);
+		return;
+	}
+	start_move(imap, move, true, 0);
 }
 
 void handle_worker_move_message(struct worker_pipe *pipe, struct worker_message *message) {
 	struct imap_connection *imap = pipe->data;
 	struct aerc_message_move *move = message->data;
 	worker_post_message(pipe, WORKER_ACK, message, NULL);
-	imap_copy(imap, move_complete, move, move->index + 1, move->destination);
+	if (!batch_selected(imap, move->mailbox)) {
+		// The UI put them back when it left the mailbox
+		aerc_message_move_free(move);
+		return;
+	}
+	start_move(imap, move, false, 0);
 }
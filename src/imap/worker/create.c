@@ -3,15 +3,34 @@
  */
 #define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
+#include <stdlib.h>
 #include "imap/imap.h"
+#include "imap/worker.h"
 #include "internal/imap.h"
+#include "op_journal.h"
 #include "worker.h"
 #include "log.h"
 
+static void create_done(struct imap_connection *imap,
+		void *data, enum imap_status status, const char *args) {
+	uint64_t *op = data;
+	if (status != STATUS_OK) {
+		worker_log(L_ERROR, "Unable to create mailbox: %s", args);
+	}
+	journal_done(imap, *op, status);
+	free(op);
+}
+
 void handle_worker_create_mailbox(struct worker_pipe *pipe, struct worker_message *message) {
 	struct imap_connection *imap = pipe->data;
 	worker_post_message(pipe, WORKER_ACK, message, NULL);
-	imap_create(imap, NULL, NULL, (const char *)message->data);
+	struct op op = {
+		.type = OP_CREATE_MAILBOX,
+		.mailbox = message->data,
+	};
+	uint64_t *id = malloc(sizeof(uint64_t));
+	*id = journal_op(imap, &op);
+	imap_create(imap, create_done, id, (const char *)message->data);
 	// TODO: Bubble errors/success up to main thread
 	// Would be nice to have a generic transactional flow between threads
 	// WORKER_* -> WORKER_ACK -> [process] -> WORKER_{DONE,ERROR}
@@ -4,32 +4,103 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "imap/imap.h"
+#include "imap/worker.h"
 #include "internal/imap.h"
+#include "op_journal.h"
 #include "worker.h"
 #include "log.h"
 
+struct delete_request {
+	struct aerc_message_move *move;
+	uint64_t op; // In the journal
+	bool replay;
+};
+
+static void delete_mailbox_done(struct imap_connection *imap,
+		void *data, enum imap_status status, const char *args) {
+	uint64_t *op = data;
+	if (status != STATUS_OK) {
+		worker_log(L_ERROR, "Unable to delete mailbox: %s", args);
+	}
+	journal_done(imap, *op, status);
+	free(op);
+}
+
 void handle_worker_delete_mailbox(struct worker_pipe *pipe, struct worker_message *message) {
 	struct imap_connection *imap = pipe->data;
 	worker_post_message(pipe, WORKER_ACK, message, NULL);
-	imap_delete(imap, NULL, NULL, (const char *)message->data);
+	struct op op = {
+		.type = OP_DELETE_MAILBOX,
+		.mailbox = message->data,
+	};
+	uint64_t *id = malloc(sizeof(uint64_t));
+	*id = journal_op(imap, &op);
+	imap_delete(imap, delete_mailbox_done, id, (const char *)message->data);
+}
+
+static void expunge_done(struct imap_connection *imap,
+		void *data, enum imap_status status, const char *args) {
+	struct delete_request *req = data;
+	if (status != STATUS_OK) {
+		worker_log(L_ERROR, "Unable to delete messages: %s", args);
+	}
+	journal_done(imap, req->op, status);
+	if (req->replay) {
+		aerc_message_move_free(req->move);
+	} else {
+		worker_post_message(imap->data, status == STATUS_OK ?
+				WORKER_MOVE_MESSAGE_DONE : WORKER_MOVE_MESSAGE_ERROR,
+				NULL, req->move);
+	}
+	free(req);
 }
 
 static void delete_message_done(struct imap_connection *imap,
 		void *data, enum imap_status status, const char *args) {
-	if (status == STATUS_OK) {
-		imap_expunge(imap, NULL, NULL);
+	struct delete_request *req = data;
+	if (status != STATUS_OK) {
+		expunge_done(imap, req, status, args);
+	} else if (imap->cap && imap->cap->uidplus) {
+		// Leaves alone anything else that happens to be marked \Deleted
+		imap_uid_expunge(imap, expunge_done, req, req->move->uids);
+	} else {
+		imap_expunge(imap, expunge_done, req);
+	}
+}
+
+/* replaying is as for start_move */
+void start_delete(struct imap_connection *imap, struct aerc_message_move *move,
+		uint64_t replaying) {
+	flush_flags(imap, true);
+	worker_log(L_DEBUG, "Deleting %zu messages", uid_set_count(move->uids));
+	struct delete_request *req = calloc(1, sizeof(struct delete_request));
+	req->move = move;
+	req->op = replaying;
+	req->replay = replaying != 0;
+	struct mailbox *mbox = get_mailbox(imap, move->mailbox);
+	if (!replaying) {
+		struct op op = {
+			.type = OP_DELETE,
+			.mailbox = move->mailbox,
+			.uidvalidity = mbox ? mbox->uidvalidity : 0,
+			.uids = move->uids,
+		};
+		req->op = journal_op(imap, &op);
 	}
+	imap_uid_store(imap, delete_message_done, req, move->uids,
+			STORE_FLAGS_APPEND, "\\Deleted");
 }
 
 void handle_worker_delete_message(struct worker_pipe *pipe, struct worker_message *message) {
 	struct imap_connection *imap = pipe->data;
+	struct aerc_message_move *request = message->data;
 	worker_post_message(pipe, WORKER_ACK, message, NULL);
-	size_t *index = message->data;
-	struct mailbox *mbox = get_mailbox(imap, imap->selected);
-	struct mailbox_message *msg = mbox->messages->items[*index];
-	worker_log(L_DEBUG, "Deleting message %d", msg->index);
-	imap_store(imap, delete_message_done, NULL, msg->index, msg->index,
-			STORE_FLAGS_APPEND, "\\Deleted");
-	free(message->data);
+	if (!batch_selected(imap, request->mailbox)) {
+		aerc_message_move_free(request);
+		return;
+	}
+	start_delete(imap, request, 0);
 }
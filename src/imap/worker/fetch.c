@@ -6,7 +6,11 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include "body_cache.h"
 #include "imap/imap.h"
+#include "imap/worker.h"
+#include "internal/imap.h"
+#include "log.h"
 #include "worker.h"
 
 void handle_worker_fetch_messages(struct worker_pipe *pipe,
@@ -14,11 +18,7 @@ void handle_worker_fetch_messages(struct worker_pipe *pipe,
 	struct imap_connection *imap = pipe->data;
 	struct message_range *range = message->data;
 
-	const char *what = "UID FLAGS INTERNALDATE BODYSTRUCTURE BODY.PEEK["
-			"HEADER.FIELDS (DATE FROM SUBJECT TO CC MESSAGE-ID REFERENCES "
-			"CONTENT-TYPE IN-REPLY-TO REPLY-TO)]";
-
-	imap_fetch(imap, NULL, NULL, range->min, range->max, what);
+	imap_fetch(imap, NULL, NULL, range->min, range->max, FETCH_MESSAGE_ITEMS);
 
 	free(range);
 }
@@ -27,6 +27,32 @@ void handle_worker_fetch_message_part(struct worker_pipe *pipe,
 		struct worker_message *message) {
 	struct imap_connection *imap = pipe->data;
 	struct fetch_part_request *request = message->data;
+	struct mailbox *mbox = imap->selected ?
+		get_mailbox(imap, imap->selected) : NULL;
+	if (mbox && request->index >= 0
+			&& (size_t)request->index < mbox->messages->length) {
+		struct mailbox_message *msg = mbox->messages->items[request->index];
+		struct body *body = body_cache_get(imap->bodies, imap->selected,
+				msg->uid, request->part + 1);
+		const struct body_cache_stats *stats = body_cache_stats(imap->bodies);
+		worker_log(L_DEBUG, "Body cache: %zu hits, %zu misses, %zu evictions, "
+				"%zu bodies, %zu bytes", stats->hits, stats->misses,
+				stats->evictions, stats->entries, stats->bytes);
+		if (body) {
+			// The UI let go of it, but we still have it
+			body_unref(body);
+			imap->events.message_updated(imap, msg);
+			free(request);
+			return;
+		}
+		if (restore_body(imap, mbox, msg, request->part + 1)) {
+			worker_log(L_DEBUG, "Read message %d part %d from the body store",
+					request->index, request->part);
+			imap->events.message_updated(imap, msg);
+			free(request);
+			return;
+		}
+	}
 	++request->index; // IMAP is 1 indexed
 	++request->part;
 
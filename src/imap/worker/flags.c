@@ -0,0 +1,348 @@
+/*
+ * imap/worker/flags.c - Handles the WORKER_STORE_FLAGS action, holding on to
+ * flag changes for a moment so that a burst of them goes out as a few batched
+ * UID STORE commands
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "email/flags.h"
+#include "imap/imap.h"
+#include "imap/worker.h"
+#include "internal/imap.h"
+#include "log.h"
+#include "op_journal.h"
+#include "util/list.h"
+#include "util/time.h"
+#include "worker.h"
+
+#define FLAG_COUNT 5 // \Seen to \Draft, \Recent is the only one clients can't set
+#define FLUSH_DELAY 300 // Milliseconds to wait for more changes
+
+/* The journal's ops behind the changes that went out in one flush */
+struct flag_flush {
+	uint64_t *ops;
+	size_t length, capacity;
+	size_t stores; // That haven't been answered yet
+	enum imap_status status; // The worst of their answers
+};
+
+/* A UID STORE we're waiting on */
+struct flag_store {
+	char *mailbox;
+	uint32_t flag;
+	bool add;
+	struct uid_set *uids;
+	struct flag_flush *flush;
+};
+
+struct flag_queue {
+	char *mailbox; // The changes below belong to
+	struct uid_set *add[FLAG_COUNT], *remove[FLAG_COUNT];
+	bool dirty;
+	struct timespec last; // When the last change came in
+	struct flag_flush *flush; // Of the changes above
+	list_t *sent; // struct flag_store, oldest first
+};
+
+static void flush_free(struct flag_flush *flush) {
+	if (flush) {
+		free(flush->ops);
+		free(flush);
+	}
+}
+
+static void flush_add(struct flag_queue *queue, uint64_t op) {
+	if (!queue->flush) {
+		queue->flush = calloc(1, sizeof(struct flag_flush));
+	}
+	struct flag_flush *flush = queue->flush;
+	if (flush->length == flush->capacity) {
+		flush->capacity = flush->capacity ? flush->capacity * 2 : 8;
+		flush->ops = realloc(flush->ops, flush->capacity * sizeof(uint64_t));
+	}
+	flush->ops[flush->length++] = op;
+}
+
+static void flush_done(struct imap_connection *imap, struct flag_flush *flush) {
+	for (size_t i = 0; i < flush->length; ++i) {
+		journal_done(imap, flush->ops[i], flush->status);
+	}
+	flush_free(flush);
+}
+
+/* Leaves them in the journal, to be sent when the mailbox is next selected */
+static void flush_abandon(struct imap_connection *imap,
+		struct flag_flush *flush) {
+	for (size_t i = 0; flush && i < flush->length; ++i) {
+		journal_abandon(imap, flush->ops[i]);
+	}
+	flush_free(flush);
+}
+
+static void flag_store_free(struct flag_store *store) {
+	if (store->flush && !--store->flush->stores) {
+		flush_free(store->flush);
+	}
+	free(store->mailbox);
+	uid_set_free(store->uids);
+	free(store);
+}
+
+static void clear_changes(struct flag_queue *queue) {
+	for (size_t i = 0; i < FLAG_COUNT; ++i) {
+		uid_set_free(queue->add[i]);
+		uid_set_free(queue->remove[i]);
+		queue->add[i] = queue->remove[i] = NULL;
+	}
+	queue->dirty = false;
+}
+
+void flag_queue_free(struct imap_connection *imap) {
+	struct flag_queue *queue = imap->flag_queue;
+	if (!queue) {
+		return;
+	}
+	clear_changes(queue);
+	// They're in the journal, to be sent next time
+	flush_abandon(imap, queue->flush);
+	// The STOREs we sent are dropped along with their callbacks
+	for (size_t i = 0; i < queue->sent->length; ++i) {
+		flag_store_free(queue->sent->items[i]);
+	}
+	list_free(queue->sent);
+	free(queue->mailbox);
+	free(queue);
+	imap->flag_queue = NULL;
+}
+
+/* How the server will have a message's flags once it answers what we sent */
+static uint32_t after_sent(struct flag_queue *queue, const char *mailbox,
+		uint32_t uid, uint32_t flags) {
+	for (size_t i = 0; i < queue->sent->length; ++i) {
+		struct flag_store *store = queue->sent->items[i];
+		if (strcmp(store->mailbox, mailbox) != 0
+				|| !uid_set_contains(store->uids, uid)) {
+			continue;
+		}
+		flags = store->add ? flags | store->flag : flags & ~store->flag;
+	}
+	return flags;
+}
+
+/*
+ * The flags the user expects a message to have. The server's FETCH responses
+ * overwrite ours as they come in, so this is applied on top of them until
+ * the server has caught up.
+ */
+uint32_t queued_flags(struct imap_connection *imap, const char *mailbox,
+		uint32_t uid, uint32_t flags) {
+	struct flag_queue *queue = imap->flag_queue;
+	if (!queue || !uid || !mailbox) {
+		return flags;
+	}
+	flags = after_sent(queue, mailbox, uid, flags);
+	if (!queue->mailbox || strcmp(queue->mailbox, mailbox) != 0) {
+		return flags;
+	}
+	for (size_t i = 0; i < FLAG_COUNT; ++i) {
+		if (queue->add[i] && uid_set_contains(queue->add[i], uid)) {
+			flags |= 1 << i;
+		} else if (queue->remove[i] && uid_set_contains(queue->remove[i], uid)) {
+			flags &= ~(1 << i);
+		}
+	}
+	return flags;
+}
+
+static void queue_changes(struct flag_queue *queue,
+		const struct uid_set *uids, uint32_t flags, bool add) {
+	for (size_t i = 0; i < FLAG_COUNT; ++i) {
+		if (!(flags & (1 << i))) {
+			continue;
+		}
+		struct uid_set **into = add ? &queue->add[i] : &queue->remove[i];
+		struct uid_set *other = add ? queue->remove[i] : queue->add[i];
+		if (!*into) {
+			*into = uid_set_create();
+		}
+		for (size_t j = 0; j < uids->length; ++j) {
+			const struct uid_range *range = &uids->ranges[j];
+			uid_set_add_range(*into, range->min, range->max);
+			for (uint32_t uid = range->min; other && other->length; ++uid) {
+				uid_set_remove(other, uid);
+				if (uid == range->max) {
+					break;
+				}
+			}
+		}
+	}
+	queue->dirty = true;
+	get_nanoseconds(&queue->last);
+}
+
+static void store_flags_done(struct imap_connection *imap,
+		void *data, enum imap_status status, const char *args) {
+	struct flag_store *store = data;
+	struct flag_queue *queue = imap->flag_queue;
+	for (size_t i = 0; queue && i < queue->sent->length; ++i) {
+		if (queue->sent->items[i] == store) {
+			list_del(queue->sent, i);
+			break;
+		}
+	}
+	struct mailbox *mbox = imap->selected
+		&& strcmp(imap->selected, store->mailbox) == 0 ?
+		get_mailbox(imap, store->mailbox) : NULL;
+	if (status != STATUS_OK) {
+		worker_log(L_ERROR, "Unable to update message flags: %s", args);
+		// Put the server's flags back in front of the user
+		for (size_t i = 0; mbox && i < mbox->messages->length; ++i) {
+			struct mailbox_message *msg = mbox->messages->items[i];
+			if (msg->uid && uid_set_contains(store->uids, msg->uid)) {
+				publish_message(imap, mbox, msg);
+			}
+		}
+		store->flush->status = status;
+	}
+	struct flag_flush *flush = store->flush;
+	if (!--flush->stores) {
+		flush_done(imap, flush);
+	}
+	store->flush = NULL;
+	flag_store_free(store);
+}
+
+static void send_store(struct imap_connection *imap, const char *mailbox,
+		uint32_t flag, bool add, struct uid_set *uids,
+		struct flag_flush *flush) {
+	struct flag_store *store = calloc(1, sizeof(struct flag_store));
+	store->mailbox = strdup(mailbox);
+	store->flag = flag;
+	store->add = add;
+	store->uids = uids;
+	store->flush = flush;
+	++flush->stores;
+	list_add(imap->flag_queue->sent, store);
+	imap_uid_store(imap, store_flags_done, store, uids,
+			add ? STORE_FLAGS_APPEND : STORE_FLAGS_REMOVE, flag_name(flag));
+}
+
+/*
+ * Sends what's queued, once it's been quiet for FLUSH_DELAY or right away if
+ * now is set. Anything that has been toggled back to how the server has it is
+ * dropped. Returns true if anything was sent.
+ */
+bool flush_flags(struct imap_connection *imap, bool now) {
+	struct flag_queue *queue = imap->flag_queue;
+	if (!queue || !queue->dirty || !imap->logged_in) {
+		// Offline they wait here until we're back
+		return false;
+	}
+	if (!now) {
+		struct timespec time;
+		get_nanoseconds(&time);
+		long elapsed = (time.tv_sec - queue->last.tv_sec) * 1000
+			+ (time.tv_nsec - queue->last.tv_nsec) / 1000000;
+		if (elapsed < FLUSH_DELAY) {
+			return false;
+		}
+	}
+	if (!imap->selected || strcmp(imap->selected, queue->mailbox) != 0) {
+		worker_log(L_DEBUG, "Flag changes for %s will be sent when it's "
+				"next selected", queue->mailbox);
+		flush_abandon(imap, queue->flush);
+		queue->flush = NULL;
+		clear_changes(queue);
+		return false;
+	}
+	struct mailbox *mbox = get_mailbox(imap, queue->mailbox);
+	for (size_t i = 0; mbox && i < mbox->messages->length; ++i) {
+		struct mailbox_message *msg = mbox->messages->items[i];
+		if (!msg->uid || !msg->populated) {
+			continue;
+		}
+		uint32_t flags = after_sent(queue, mbox->name, msg->uid, msg->flags);
+		for (size_t j = 0; j < FLAG_COUNT; ++j) {
+			if ((flags & (1 << j)) && queue->add[j]) {
+				uid_set_remove(queue->add[j], msg->uid);
+			} else if (!(flags & (1 << j)) && queue->remove[j]) {
+				uid_set_remove(queue->remove[j], msg->uid);
+			}
+		}
+	}
+	struct flag_flush *flush = queue->flush ? queue->flush
+		: calloc(1, sizeof(struct flag_flush));
+	queue->flush = NULL;
+	bool sent = false;
+	for (size_t i = 0; i < FLAG_COUNT; ++i) {
+		if (queue->add[i] && queue->add[i]->length) {
+			send_store(imap, queue->mailbox, 1 << i, true, queue->add[i], flush);
+			queue->add[i] = NULL;
+			sent = true;
+		}
+		if (queue->remove[i] && queue->remove[i]->length) {
+			send_store(imap, queue->mailbox, 1 << i, false, queue->remove[i],
+					flush);
+			queue->remove[i] = NULL;
+			sent = true;
+		}
+	}
+	if (!sent) {
+		// It all came back to how the server has it
+		flush_done(imap, flush);
+	}
+	clear_changes(queue);
+	return sent;
+}
+
+void handle_worker_store_flags(struct worker_pipe *pipe,
+		struct worker_message *message) {
+	struct imap_connection *imap = pipe->data;
+	struct store_flags_request *request = message->data;
+	if (!batch_selected(imap, request->mailbox)) {
+		store_flags_request_free(request);
+		return;
+	}
+	if (!imap->flag_queue) {
+		imap->flag_queue = calloc(1, sizeof(struct flag_queue));
+		imap->flag_queue->sent = create_list();
+	}
+	struct flag_queue *queue = imap->flag_queue;
+	if (queue->mailbox && strcmp(queue->mailbox, request->mailbox) != 0) {
+		flush_flags(imap, true);
+	}
+	free(queue->mailbox);
+	queue->mailbox = strdup(request->mailbox);
+	struct mailbox *mbox = get_mailbox(imap, request->mailbox);
+	// One op per flag, since that's how they're sent
+	for (size_t i = 0; i < FLAG_COUNT; ++i) {
+		if (!(request->flags & (1 << i))) {
+			continue;
+		}
+		struct op op = {
+			.type = OP_STORE_FLAGS,
+			.mailbox = request->mailbox,
+			.uidvalidity = mbox ? mbox->uidvalidity : 0,
+			.uids = request->uids,
+			.flags = 1 << i,
+			.add = request->add,
+		};
+		uint64_t id = journal_op(imap, &op);
+		if (id) {
+			flush_add(queue, id);
+		}
+	}
+	queue_changes(queue, request->uids, request->flags, request->add);
+	// So that the worker's own copies agree with what the UI is showing
+	for (size_t i = 0; mbox && i < mbox->messages->length; ++i) {
+		struct mailbox_message *msg = mbox->messages->items[i];
+		if (msg->uid && uid_set_contains(request->uids, msg->uid)) {
+			publish_message(imap, mbox, msg);
+		}
+	}
+	store_flags_request_free(request);
+}
@@ -0,0 +1,220 @@
+/*
+ * imap/worker/journal.c - Writes the user's changes down before they're sent,
+ * and sends again the ones the server never answered
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "email/flags.h"
+#include "imap/imap.h"
+#include "imap/worker.h"
+#include "internal/imap.h"
+#include "log.h"
+#include "op_journal.h"
+#include "urlparse.h"
+#include "worker.h"
+
+struct worker_journal {
+	struct op_journal *ops;
+	uint64_t *sent; // Ops we're waiting to hear about on this connection
+	size_t sent_length, sent_capacity;
+};
+
+void open_journal(struct imap_connection *imap, const struct uri *uri) {
+	if (imap->journal) {
+		return;
+	}
+	char *dir = cache_path(uri, "journal");
+	if (!dir) {
+		worker_log(L_ERROR, "Changes made offline will not be kept");
+		return;
+	}
+	char *path = malloc(strlen(dir) + sizeof("/ops"));
+	sprintf(path, "%s/ops", dir);
+	worker_log(L_DEBUG, "Opening op journal at %s", path);
+	imap->journal = calloc(1, sizeof(struct worker_journal));
+	imap->journal->ops = op_journal_open(path);
+	free(path);
+	free(dir);
+}
+
+void journal_free(struct imap_connection *imap) {
+	struct worker_journal *journal = imap->journal;
+	if (!journal) {
+		return;
+	}
+	op_journal_close(journal->ops);
+	free(journal->sent);
+	free(journal);
+	imap->journal = NULL;
+}
+
+static void add_sent(struct worker_journal *journal, uint64_t id) {
+	if (journal->sent_length == journal->sent_capacity) {
+		journal->sent_capacity = journal->sent_capacity ?
+			journal->sent_capacity * 2 : 16;
+		journal->sent = realloc(journal->sent,
+				journal->sent_capacity * sizeof(uint64_t));
+	}
+	journal->sent[journal->sent_length++] = id;
+}
+
+static bool remove_sent(struct worker_journal *journal, uint64_t id) {
+	for (size_t i = 0; i < journal->sent_length; ++i) {
+		if (journal->sent[i] == id) {
+			journal->sent[i] = journal->sent[--journal->sent_length];
+			return true;
+		}
+	}
+	return false;
+}
+
+uint64_t journal_op(struct imap_connection *imap, const struct op *op) {
+	if (!imap->journal) {
+		return 0;
+	}
+	uint64_t id = op_journal_append(imap->journal->ops, op);
+	if (id) {
+		add_sent(imap->journal, id);
+	}
+	return id;
+}
+
+/*
+ * Once the server has answered, one way or the other, there's nothing to gain
+ * from sending it again. If it never did, it stays in the journal.
+ */
+void journal_done(struct imap_connection *imap, uint64_t id,
+		enum imap_status status) {
+	if (!imap->journal || !id) {
+		return;
+	}
+	remove_sent(imap->journal, id);
+	if (status == STATUS_OK || status == STATUS_NO || status == STATUS_BAD) {
+		op_journal_done(imap->journal->ops, id);
+	}
+}
+
+void journal_abandon(struct imap_connection *imap, uint64_t id) {
+	if (imap->journal && id) {
+		remove_sent(imap->journal, id);
+	}
+}
+
+bool journal_maintain(struct imap_connection *imap) {
+	return imap->journal && op_journal_maintain(imap->journal->ops);
+}
+
+static void replay_done(struct imap_connection *imap,
+		void *data, enum imap_status status, const char *args) {
+	uint64_t *id = data;
+	if (status != STATUS_OK) {
+		worker_log(L_ERROR, "The server refused a change made earlier: %s",
+				args);
+	}
+	journal_done(imap, *id, status);
+	free(id);
+}
+
+static uint64_t *replay_ref(uint64_t id) {
+	uint64_t *ref = malloc(sizeof(uint64_t));
+	*ref = id;
+	return ref;
+}
+
+static struct aerc_message_move *op_move(const struct op *op) {
+	struct aerc_message_move *move = calloc(1, sizeof(struct aerc_message_move));
+	move->mailbox = strdup(op->mailbox);
+	move->destination = op->destination ? strdup(op->destination) : NULL;
+	move->uids = uid_set_create();
+	for (size_t i = 0; i < op->uids->length; ++i) {
+		uid_set_add_range(move->uids,
+				op->uids->ranges[i].min, op->uids->ranges[i].max);
+	}
+	return move;
+}
+
+/* Returns false if op was dropped instead */
+static bool replay(struct imap_connection *imap, const struct op *op) {
+	const char *flag;
+	switch (op->type) {
+	case OP_CREATE_MAILBOX:
+		imap_create(imap, replay_done, replay_ref(op->id), op->mailbox);
+		break;
+	case OP_DELETE_MAILBOX:
+		imap_delete(imap, replay_done, replay_ref(op->id), op->mailbox);
+		break;
+	case OP_STORE_FLAGS:
+		flag = flag_name(op->flags);
+		if (!flag) {
+			op_journal_done(imap->journal->ops, op->id);
+			return false;
+		}
+		imap_uid_store(imap, replay_done, replay_ref(op->id), op->uids,
+				op->add ? STORE_FLAGS_APPEND : STORE_FLAGS_REMOVE, flag);
+		break;
+	case OP_COPY:
+	case OP_MOVE:
+		start_move(imap, op_move(op), op->type == OP_COPY, op->id);
+		break;
+	case OP_DELETE:
+		start_delete(imap, op_move(op), op->id);
+		break;
+	}
+	add_sent(imap->journal, op->id);
+	return true;
+}
+
+static bool sent(struct worker_journal *journal, uint64_t id) {
+	for (size_t i = 0; i < journal->sent_length; ++i) {
+		if (journal->sent[i] == id) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Sends the ops we haven't heard back about that can go out now: the mailbox
+ * ones once we're logged in, and the rest once their mailbox is selected. The
+ * UIDs in those only mean anything with the same UIDVALIDITY, so if it has
+ * changed they're dropped.
+ */
+void replay_journal(struct imap_connection *imap) {
+	struct worker_journal *journal = imap->journal;
+	if (!journal || !imap->logged_in) {
+		return;
+	}
+	const list_t *pending = op_journal_pending(journal->ops);
+	size_t replayed = 0;
+	for (size_t i = 0; i < pending->length; ) {
+		const struct op *op = pending->items[i];
+		if (sent(journal, op->id)) {
+			++i;
+			continue;
+		}
+		bool mailbox_op = op->type == OP_CREATE_MAILBOX
+			|| op->type == OP_DELETE_MAILBOX;
+		struct mailbox *mbox = !mailbox_op && imap->selected
+			&& strcmp(imap->selected, op->mailbox) == 0 ?
+			get_mailbox(imap, op->mailbox) : NULL;
+		if (!mailbox_op && !mbox) {
+			++i;
+		} else if (mbox && (uint32_t)mbox->uidvalidity != op->uidvalidity) {
+			worker_log(L_ERROR, "Dropping a change to %s made before "
+					"its UIDs were reset", op->mailbox);
+			op_journal_done(journal->ops, op->id);
+		} else if (replay(imap, op)) {
+			++replayed;
+			++i;
+		}
+	}
+	if (replayed) {
+		worker_log(L_DEBUG, "Sent %zu changes made earlier", replayed);
+	}
+}
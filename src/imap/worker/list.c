@@ -23,7 +23,7 @@ void imap_list_callback(struct imap_connection *imap,
 		list_t *mboxes = create_list();
 		for (size_t i = 0; i < imap->mailboxes->length; ++i) {
 			struct mailbox *source = imap->mailboxes->items[i];
-			struct aerc_mailbox *dest = serialize_mailbox(source);
+			struct aerc_mailbox *dest = serialize_mailbox(imap, source);
 			list_add(mboxes, dest);
 		}
 		worker_post_message(data->pipe, WORKER_LIST_DONE, data->message, mboxes);
@@ -0,0 +1,490 @@
+/*
+ * imap/worker/pool.c - Background connections which sync the mailboxes that
+ * aren't selected, warming the body store and the search index
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "absocket.h"
+#include "body_store.h"
+#include "imap/imap.h"
+#include "imap/worker.h"
+#include "internal/imap.h"
+#include "log.h"
+#include "urlparse.h"
+#include "util/list.h"
+#include "util/stringop.h"
+#include "worker.h"
+
+#ifdef USE_OPENSSL
+#include <openssl/x509.h>
+#endif
+
+#define SYNC_MESSAGES 50 // The newest messages of each mailbox
+#define SYNC_BUDGET (1024 * 1024) // Bytes of bodies per mailbox
+#define SYNC_BODY_CACHE (4 * 1024 * 1024)
+#define MAX_FAILURES 3
+
+void handle_imap_ready(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args);
+
+enum sync_phase {
+	SYNC_CONNECTING,
+	SYNC_LISTING,
+	SYNC_READY, // For the next mailbox
+	SYNC_EXAMINING,
+	SYNC_HEADERS,
+	SYNC_BODIES,
+	SYNC_FAILED,
+};
+
+/*
+ * Resolving, connecting and the TLS handshake can take a while, so they're
+ * done on a thread of their own. Whichever of it and the pool lets go last
+ * frees this, so closing a connection doesn't have to wait for it.
+ */
+struct opener {
+	atomic_int refs;
+	atomic_bool done;
+	struct uri uri; // Just the host and port
+	bool ssl;
+	absocket_t *socket; // Once done, NULL if it couldn't connect
+};
+
+struct background {
+	struct imap_pool *pool;
+	struct imap_connection *imap;
+	struct opener *opener; // Until the socket's open
+	enum sync_phase phase;
+	bool busy; // Waiting on a command
+	char *mailbox; // Being synced, to put back if the connection drops
+	long next; // The next message to fetch bodies for, newest first
+	long oldest;
+	size_t spent;
+};
+
+struct imap_pool {
+	struct imap_connection *interactive;
+	char *source; // Contains the password
+	bool ssl;
+	bool approved; // The interactive connection has logged in
+	bool listed;
+	size_t size, failures;
+	list_t *connections; // struct background
+	list_t *pending; // Mailboxes we haven't synced yet
+};
+
+struct imap_pool *pool_create(struct imap_connection *imap, char *source,
+		bool ssl) {
+	struct imap_pool *pool = calloc(1, sizeof(struct imap_pool));
+	pool->interactive = imap;
+	pool->source = source;
+	pool->ssl = ssl;
+	pool->connections = create_list();
+	pool->pending = create_list();
+	return pool;
+}
+
+static void opener_unref(struct opener *opener) {
+	if (!opener || atomic_fetch_sub(&opener->refs, 1) != 1) {
+		return;
+	}
+	absocket_free(opener->socket);
+	free(opener->uri.hostname);
+	free(opener->uri.port);
+	free(opener);
+}
+
+static void *open_socket(void *data) {
+	struct opener *opener = data;
+	opener->socket = absocket_new(&opener->uri, opener->ssl);
+	atomic_store(&opener->done, true);
+	opener_unref(opener);
+	return NULL;
+}
+
+static void close_background(struct imap_pool *pool, struct background *bg) {
+	for (size_t i = 0; i < pool->connections->length; ++i) {
+		if (pool->connections->items[i] == bg) {
+			list_del(pool->connections, i);
+			break;
+		}
+	}
+	if (bg->imap->uri) {
+		uri_free(bg->imap->uri);
+		free(bg->imap->uri);
+	}
+	if (bg->opener) {
+		// Never got as far as being set up
+		opener_unref(bg->opener);
+		free(bg->imap);
+	} else {
+		// Shared with the interactive connection
+		bg->imap->store = NULL;
+		bg->imap->search = NULL;
+		imap_close(bg->imap);
+	}
+	free(bg->mailbox);
+	free(bg);
+}
+
+void pool_free(struct imap_pool *pool) {
+	if (!pool) {
+		return;
+	}
+	while (pool->connections->length) {
+		close_background(pool, pool->connections->items[0]);
+	}
+	list_free(pool->connections);
+	free_flat_list(pool->pending);
+	memset(pool->source, 0, strlen(pool->source));
+	free(pool->source);
+	free(pool);
+}
+
+void pool_configure(struct imap_pool *pool, size_t size) {
+	pool->size = size;
+	// Let the extra connections finish what they're doing first
+	for (size_t i = pool->connections->length; i > size; --i) {
+		struct background *bg = pool->connections->items[i - 1];
+		if (!bg->busy) {
+			close_background(pool, bg);
+		}
+	}
+}
+
+void pool_approve(struct imap_pool *pool) {
+	pool->approved = true;
+}
+
+static struct background *find_background(struct imap_pool *pool,
+		struct imap_connection *imap) {
+	for (size_t i = 0; i < pool->connections->length; ++i) {
+		struct background *bg = pool->connections->items[i];
+		if (bg->imap == imap) {
+			return bg;
+		}
+	}
+	return NULL;
+}
+
+static void sync_message_updated(struct imap_connection *imap,
+		struct mailbox_message *msg) {
+	index_message(imap, msg);
+}
+
+static void list_done(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	struct background *bg = data;
+	struct imap_pool *pool = bg->pool;
+	bg->busy = false;
+	if (status != STATUS_OK) {
+		++pool->failures;
+		bg->phase = SYNC_FAILED;
+		return;
+	}
+	bg->phase = SYNC_READY;
+	if (pool->listed) {
+		return;
+	}
+	for (size_t i = 0; i < imap->mailboxes->length; ++i) {
+		struct mailbox *mbox = imap->mailboxes->items[i];
+		if (!mailbox_get_flag(imap, mbox->name, "\\noselect")) {
+			list_add(pool->pending, strdup(mbox->name));
+		}
+	}
+	pool->listed = true;
+	worker_log(L_DEBUG, "Syncing %zu mailboxes in the background",
+			pool->pending->length);
+}
+
+void pool_connected(struct imap_connection *imap, bool ok) {
+	struct imap_pool *pool = imap->pool;
+	struct background *bg = find_background(pool, imap);
+	if (!bg) {
+		return;
+	}
+	if (!ok) {
+		worker_log(L_ERROR, "Background connection failed to log in");
+		++pool->failures;
+		bg->phase = SYNC_FAILED;
+		return;
+	}
+	bg->phase = SYNC_LISTING;
+	bg->busy = true;
+	imap_list(imap, list_done, bg, "", "%");
+}
+
+/* Starts opening another connection, which finish_open picks up */
+static bool open_background(struct imap_pool *pool) {
+	struct uri *uri = malloc(sizeof(struct uri));
+	if (!parse_uri(uri, pool->source)) {
+		free(uri);
+		return false;
+	}
+	if (!uri->port) {
+		uri->port = strdup(pool->ssl ? "993" : "143");
+	}
+	struct opener *opener = calloc(1, sizeof(struct opener));
+	// One for us and one for the thread
+	atomic_init(&opener->refs, 2);
+	atomic_init(&opener->done, false);
+	opener->uri.hostname = strdup(uri->hostname);
+	opener->uri.port = strdup(uri->port);
+	opener->ssl = pool->ssl;
+	struct background *bg = calloc(1, sizeof(struct background));
+	bg->pool = pool;
+	bg->imap = calloc(1, sizeof(struct imap_connection));
+	bg->imap->uri = uri;
+	bg->opener = opener;
+	bg->phase = SYNC_CONNECTING;
+	bg->busy = true;
+	list_add(pool->connections, bg);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, open_socket, opener) != 0) {
+		atomic_fetch_sub(&opener->refs, 1);
+		++pool->failures;
+		close_background(pool, bg);
+		return false;
+	}
+	pthread_detach(thread);
+	return true;
+}
+
+/* Takes over the socket once it's open. Returns false if it's no good. */
+static bool finish_open(struct imap_pool *pool, struct background *bg) {
+	absocket_t *socket = bg->opener->socket;
+	bg->opener->socket = NULL;
+	if (!socket) {
+		return false;
+	}
+#ifdef USE_OPENSSL
+	// The user has only vouched for the interactive connection's certificate
+	if (pool->ssl && (!socket->cert || !pool->interactive->socket
+				|| !pool->interactive->socket->cert
+				|| X509_cmp(socket->cert,
+					pool->interactive->socket->cert) != 0)) {
+		worker_log(L_ERROR, "Background connection has a different "
+				"certificate, not using it");
+		absocket_free(socket);
+		return false;
+	}
+#endif
+	opener_unref(bg->opener);
+	bg->opener = NULL;
+	struct imap_connection *imap = bg->imap;
+	struct uri *uri = imap->uri;
+	imap_connect_socket(imap, socket, handle_imap_ready,
+			pool->interactive->data);
+	imap->data = pool->interactive->data;
+	imap->uri = uri;
+	imap->background = true;
+	imap->pool = pool;
+	imap->store = pool->interactive->store;
+	imap->search = pool->interactive->search;
+	imap->events.message_updated = sync_message_updated;
+	body_cache_set_budget(imap->bodies, SYNC_BODY_CACHE);
+	imap->mode = RECV_LINE;
+	bg->busy = false;
+	worker_log(L_DEBUG, "Opened background connection %zu",
+			pool->connections->length);
+	return true;
+}
+
+static void sync_done(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	struct background *bg = data;
+	bg->busy = false;
+	if (status != STATUS_OK) {
+		worker_log(L_DEBUG, "Background sync failed: %s", args);
+		bg->phase = SYNC_READY;
+		if (imap->socket) {
+			// The server said no, so there's no use trying it again
+			free(bg->mailbox);
+			bg->mailbox = NULL;
+		}
+		return;
+	}
+	if (bg->phase == SYNC_EXAMINING) {
+		bg->phase = SYNC_HEADERS;
+	} else if (bg->phase == SYNC_HEADERS) {
+		bg->phase = SYNC_BODIES;
+	}
+}
+
+/* Takes the next mailbox the user isn't looking at */
+static char *next_mailbox(struct imap_pool *pool) {
+	const char *selected = pool->interactive->selected;
+	for (size_t i = 0; i < pool->pending->length; ++i) {
+		char *name = pool->pending->items[i];
+		if (!selected || strcmp(name, selected) != 0) {
+			list_del(pool->pending, i);
+			return name;
+		}
+	}
+	return NULL;
+}
+
+/* Fetches the text parts of the next message that aren't stored yet */
+static bool fetch_bodies(struct background *bg) {
+	struct imap_connection *imap = bg->imap;
+	struct mailbox *mbox = imap->selected ?
+		get_mailbox(imap, imap->selected) : NULL;
+	if (!mbox || bg->next >= (long)mbox->messages->length) {
+		// Expunged from under us, we'll catch it next time
+		return false;
+	}
+	for (; bg->next >= bg->oldest; --bg->next) {
+		struct mailbox_message *msg = mbox->messages->items[bg->next];
+		if (!msg->populated || !msg->parts) {
+			continue;
+		}
+		size_t size = msg->parts->length * 24 + 1;
+		char *what = malloc(size);
+		what[0] = '\0';
+		for (size_t i = 0; i < msg->parts->length; ++i) {
+			struct message_part *part = msg->parts->items[i];
+			if (!part->type || strcasecmp(part->type, "text") != 0
+					|| body_store_contains(imap->store, mbox->name,
+						mbox->uidvalidity, msg->uid, i + 1)) {
+				continue;
+			}
+			if (bg->spent + part->size > SYNC_BUDGET) {
+				bg->next = bg->oldest;
+				break;
+			}
+			bg->spent += part->size;
+			size_t len = strlen(what);
+			snprintf(what + len, size - len, "%sBODY.PEEK[%zu]",
+					len ? " " : "", i + 1);
+		}
+		if (what[0]) {
+			imap_fetch(imap, sync_done, bg, bg->next + 1, bg->next + 1, what);
+			bg->busy = true;
+			--bg->next;
+			free(what);
+			return true;
+		}
+		free(what);
+	}
+	return false;
+}
+
+/* Sends the next command for this connection, if there is one */
+static bool sync_next(struct background *bg) {
+	struct imap_connection *imap = bg->imap;
+	struct mailbox *mbox;
+	switch (bg->phase) {
+	case SYNC_READY:;
+		char *name = next_mailbox(bg->pool);
+		if (!name) {
+			return false;
+		}
+		worker_log(L_DEBUG, "Syncing %s in the background", name);
+		bg->phase = SYNC_EXAMINING;
+		bg->busy = true;
+		imap_examine(imap, sync_done, bg, name);
+		free(bg->mailbox);
+		bg->mailbox = name;
+		return true;
+	case SYNC_HEADERS:
+		mbox = imap->selected ? get_mailbox(imap, imap->selected) : NULL;
+		if (!mbox || mbox->exists <= 0) {
+			bg->phase = SYNC_READY;
+			free(bg->mailbox);
+			bg->mailbox = NULL;
+			return false;
+		}
+		bg->oldest = mbox->exists > SYNC_MESSAGES ?
+			mbox->exists - SYNC_MESSAGES : 0;
+		bg->next = mbox->exists - 1;
+		bg->spent = 0;
+		bg->busy = true;
+		imap_fetch(imap, sync_done, bg, bg->oldest + 1, mbox->exists,
+				FETCH_MESSAGE_ITEMS);
+		return true;
+	case SYNC_BODIES:
+		if (!imap->store || !fetch_bodies(bg)) {
+			bg->phase = SYNC_READY;
+			free(bg->mailbox);
+			bg->mailbox = NULL;
+			return false;
+		}
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * The interactive connection always comes first: we only touch the background
+ * connections on passes where it had nothing to do, so a big background sync
+ * never holds up the folder the user is reading.
+ */
+bool pool_run(struct imap_pool *pool, bool idle) {
+	if (!pool || !pool->approved || !idle) {
+		return false;
+	}
+	bool worked = false;
+	bool more = !pool->listed || pool->pending->length;
+	if (more && pool->connections->length < pool->size
+			&& pool->failures < MAX_FAILURES) {
+		worked |= open_background(pool);
+	}
+	bool busy = false;
+	for (size_t i = 0; i < pool->connections->length; ++i) {
+		struct background *bg = pool->connections->items[i];
+		if (bg->opener) {
+			if (!atomic_load(&bg->opener->done)) {
+				busy = true;
+				continue;
+			}
+			worked = true;
+			if (!finish_open(pool, bg)) {
+				++pool->failures;
+				close_background(pool, bg);
+				--i;
+				continue;
+			}
+		}
+		if (imap_receive(bg->imap)) {
+			worked = true;
+		}
+		if (!bg->imap->socket && bg->mailbox) {
+			// Dropped, so whatever it was syncing goes to another one
+			list_insert(pool->pending, 0, bg->mailbox);
+			bg->mailbox = NULL;
+		}
+		if (!bg->imap->socket && bg->phase != SYNC_FAILED) {
+			worker_log(L_DEBUG, "Lost a background connection");
+			++pool->failures;
+			bg->phase = SYNC_FAILED;
+		}
+		if (bg->phase == SYNC_FAILED
+				|| (!bg->busy && i >= pool->size)) {
+			close_background(pool, bg);
+			--i;
+			continue;
+		}
+		if (!bg->busy && sync_next(bg)) {
+			worked = true;
+		}
+		busy |= bg->busy || bg->phase < SYNC_READY;
+	}
+	if (!busy && pool->listed && !pool->pending->length
+			&& pool->connections->length) {
+		// Everything is warm, so let the server have its connections back
+		worker_log(L_DEBUG, "Background sync done");
+		while (pool->connections->length) {
+			close_background(pool, pool->connections->items[0]);
+		}
+	}
+	return worked;
+}
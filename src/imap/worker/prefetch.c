@@ -0,0 +1,174 @@
+/*
+ * imap/worker/prefetch.c - Fetches the messages the user is likely to open
+ * next while the connection is otherwise idle
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "imap/imap.h"
+#include "imap/worker.h"
+#include "internal/imap.h"
+#include "log.h"
+#include "worker.h"
+
+struct prefetch_queue {
+	struct prefetch_request *request;
+	size_t next; // Position in request->indices
+	size_t spent; // Bytes of the budget used
+	bool headers_requested; // For the next message
+	/*
+	 * We keep at most one prefetch command on the wire, and only send it when
+	 * nothing else is, so that they never hold up what the user asked for.
+	 */
+	bool in_flight;
+};
+
+void prefetch_request_free(struct prefetch_request *request) {
+	if (!request) {
+		return;
+	}
+	free(request->mailbox);
+	free(request->indices);
+	free(request);
+}
+
+void cancel_prefetch(struct imap_connection *imap) {
+	if (!imap->prefetch) {
+		return;
+	}
+	prefetch_request_free(imap->prefetch->request);
+	imap->prefetch->request = NULL;
+}
+
+void prefetch_free(struct imap_connection *imap) {
+	cancel_prefetch(imap);
+	free(imap->prefetch);
+	imap->prefetch = NULL;
+}
+
+void handle_worker_prefetch(struct worker_pipe *pipe,
+		struct worker_message *message) {
+	struct imap_connection *imap = pipe->data;
+	if (!imap->prefetch) {
+		imap->prefetch = calloc(1, sizeof(struct prefetch_queue));
+	}
+	cancel_prefetch(imap);
+	imap->prefetch->request = message->data;
+	imap->prefetch->next = imap->prefetch->spent = 0;
+	imap->prefetch->headers_requested = false;
+}
+
+static void prefetch_done(struct imap_connection *imap,
+		void *data, enum imap_status status, const char *args) {
+	if (imap->prefetch) {
+		imap->prefetch->in_flight = false;
+	}
+	if (status != STATUS_OK) {
+		worker_log(L_DEBUG, "Prefetch failed: %s", args);
+	}
+}
+
+/*
+ * Appends BODY.PEEK items for the text parts we don't have yet, as long as
+ * they fit in the budget. Parts in the body store are read from there for
+ * free. Returns false once the budget is exhausted.
+ */
+static bool body_items(struct imap_connection *imap,
+		struct prefetch_queue *queue, struct mailbox *mbox,
+		struct mailbox_message *msg, char *what, size_t size) {
+	bool restored = false;
+	bool more = true;
+	for (size_t i = 0; msg->parts && i < msg->parts->length; ++i) {
+		struct message_part *part = msg->parts->items[i];
+		if (!part->type || strcasecmp(part->type, "text") != 0
+				|| body_cache_peek(imap->bodies, imap->selected,
+					msg->uid, i + 1)) {
+			continue;
+		}
+		if (restore_body(imap, mbox, msg, i + 1)) {
+			restored = true;
+			continue;
+		}
+		if (queue->spent + part->size > queue->request->budget) {
+			more = false;
+			break;
+		}
+		queue->spent += part->size;
+		size_t len = strlen(what);
+		snprintf(what + len, size - len, "%sBODY.PEEK[%zu]",
+				len ? " " : "", i + 1);
+	}
+	if (restored) {
+		imap->events.message_updated(imap, msg);
+	}
+	return more;
+}
+
+bool prefetch_next(struct imap_connection *imap) {
+	struct prefetch_queue *queue = imap->prefetch;
+	if (!queue || !queue->request || queue->in_flight
+			|| !imap->logged_in || !imap->selected) {
+		return false;
+	}
+	// An IDLE is the only thing we'll interrupt
+	if (imap_busy(imap) > 0) {
+		return false;
+	}
+	struct prefetch_request *request = queue->request;
+	struct mailbox *mbox = get_mailbox(imap, imap->selected);
+	if (!mbox || strcmp(request->mailbox, imap->selected) != 0) {
+		cancel_prefetch(imap);
+		return false;
+	}
+	while (queue->next < request->length) {
+		int index = request->indices[queue->next];
+		if (index < 0 || (size_t)index >= mbox->messages->length) {
+			++queue->next;
+			continue;
+		}
+		struct mailbox_message *msg = mbox->messages->items[index];
+		if (!msg->populated) {
+			if (msg->fetching) {
+				// Already on its way, we'll get to the body once it's here
+				return false;
+			}
+			if (queue->headers_requested) {
+				// We asked and didn't get them, so don't ask again
+				++queue->next;
+				queue->headers_requested = false;
+				continue;
+			}
+			imap_fetch(imap, prefetch_done, NULL, index + 1, index + 1,
+					FETCH_MESSAGE_ITEMS);
+			queue->headers_requested = true;
+			queue->in_flight = true;
+			return true;
+		}
+		++queue->next;
+		queue->headers_requested = false;
+		size_t size = (msg->parts ? msg->parts->length : 0) * 24 + 1;
+		char *what = malloc(size);
+		what[0] = '\0';
+		bool more = body_items(imap, queue, mbox, msg, what, size);
+		if (what[0]) {
+			worker_log(L_DEBUG, "Prefetching message %d: %s", index, what);
+			imap_fetch(imap, prefetch_done, NULL, index + 1, index + 1, what);
+			queue->in_flight = true;
+		}
+		free(what);
+		if (!more) {
+			worker_log(L_DEBUG, "Prefetch budget of %zu bytes used up",
+					request->budget);
+			queue->next = request->length;
+		}
+		if (queue->in_flight) {
+			return true;
+		}
+	}
+	return false;
+}
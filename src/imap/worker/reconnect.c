@@ -0,0 +1,233 @@
+/*
+ * imap/worker/reconnect.c - Gets the connection back when it's lost, backing
+ * off between attempts, and picks up where it left off
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "imap/imap.h"
+#include "imap/worker.h"
+#include "log.h"
+#include "urlparse.h"
+#include "util/time.h"
+#include "worker.h"
+
+#define RETRY_MIN 1000 // Milliseconds before the first attempt
+#define RETRY_MAX (5 * 60 * 1000)
+
+void handle_imap_ready(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args);
+
+struct reconnect {
+	char *source; // Contains the password
+	bool ssl;
+	char *mailbox; // Selected when we lost it
+	bool lost, connecting; // Waiting on the server to let us back in
+	unsigned int failures; // Since we lost it
+	unsigned int seed;
+	struct timespec since, next;
+	struct connection_stats stats;
+};
+
+static long elapsed_ms(const struct timespec *from, const struct timespec *to) {
+	return (to->tv_sec - from->tv_sec) * 1000
+		+ (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+void reconnect_init(struct imap_connection *imap, const char *source,
+		bool ssl) {
+	struct reconnect *reconnect = calloc(1, sizeof(struct reconnect));
+	reconnect->source = strdup(source);
+	reconnect->ssl = ssl;
+	struct timespec now;
+	get_nanoseconds(&now);
+	reconnect->seed = now.tv_nsec ^ getpid();
+	imap->reconnect = reconnect;
+}
+
+void reconnect_free(struct imap_connection *imap) {
+	struct reconnect *reconnect = imap->reconnect;
+	if (!reconnect) {
+		return;
+	}
+	memset(reconnect->source, 0, strlen(reconnect->source));
+	free(reconnect->source);
+	free(reconnect->mailbox);
+	free(reconnect->stats.reason);
+	free(reconnect);
+	imap->reconnect = NULL;
+}
+
+static struct connection_stats *copy_stats(struct reconnect *reconnect) {
+	struct connection_stats *stats = malloc(sizeof(struct connection_stats));
+	*stats = reconnect->stats;
+	stats->reason = reconnect->stats.reason ?
+		strdup(reconnect->stats.reason) : NULL;
+	return stats;
+}
+
+/*
+ * Doubles the wait after each failure, up to RETRY_MAX. It's anywhere from
+ * half of that to all of it, so that clients that all lost the same server
+ * don't all come back at once.
+ */
+static void schedule(struct reconnect *reconnect) {
+	long delay = RETRY_MAX;
+	if (reconnect->failures < 16) {
+		delay = RETRY_MIN << reconnect->failures;
+		if (delay > RETRY_MAX) {
+			delay = RETRY_MAX;
+		}
+	}
+	delay = delay / 2 + rand_r(&reconnect->seed) % (delay / 2 + 1);
+	++reconnect->failures;
+	reconnect->stats.retry_in = delay;
+	get_nanoseconds(&reconnect->next);
+	reconnect->next.tv_sec += delay / 1000;
+	reconnect->next.tv_nsec += (delay % 1000) * 1000000;
+	if (reconnect->next.tv_nsec >= 1000000000) {
+		reconnect->next.tv_sec += 1;
+		reconnect->next.tv_nsec -= 1000000000;
+	}
+	worker_log(L_DEBUG, "Reconnecting in %ld ms", delay);
+}
+
+/* imap->events.disconnected */
+void handle_disconnected(struct imap_connection *imap, const char *reason) {
+	struct reconnect *reconnect = imap->reconnect;
+	if (!reconnect) {
+		return;
+	}
+	if (!reconnect->lost) {
+		reconnect->lost = true;
+		get_nanoseconds(&reconnect->since);
+		free(reconnect->mailbox);
+		reconnect->mailbox = imap->selected ? strdup(imap->selected) : NULL;
+		++reconnect->stats.disconnects;
+	}
+	reconnect->connecting = false;
+	free(reconnect->stats.reason);
+	reconnect->stats.reason = strdup(reason);
+	// The new connection has to ask for NOTIFY again
+	imap->status_poll.notify = imap->status_poll.notify_tried = false;
+	imap->status_poll.pending = 0;
+	schedule(reconnect);
+	worker_post_message(imap->data, WORKER_CONNECTION_LOST, NULL,
+			copy_stats(reconnect));
+}
+
+bool reconnect_run(struct imap_connection *imap) {
+	struct reconnect *reconnect = imap->reconnect;
+	if (!reconnect || !reconnect->lost || reconnect->connecting) {
+		return false;
+	}
+	struct timespec now;
+	get_nanoseconds(&now);
+	if (elapsed_ms(&reconnect->next, &now) < 0) {
+		return false;
+	}
+	struct uri *uri = malloc(sizeof(struct uri));
+	if (!parse_uri(uri, reconnect->source)) {
+		free(uri);
+		return false;
+	}
+	if (!uri->port) {
+		uri->port = strdup(reconnect->ssl ? "993" : "143");
+	}
+	++reconnect->stats.attempts;
+	worker_log(L_DEBUG, "Reconnecting to %s (attempt %u)",
+			uri->hostname, reconnect->failures);
+	if (!imap_reconnect(imap, uri, reconnect->ssl, handle_imap_ready,
+				imap->data)) {
+		uri_free(uri);
+		free(uri);
+		schedule(reconnect);
+		return true;
+	}
+	if (imap->uri) {
+		uri_free(imap->uri);
+		free(imap->uri);
+	}
+	imap->uri = uri;
+	reconnect->connecting = true;
+	if (reconnect->ssl) {
+#ifdef USE_OPENSSL
+		// It may not be the certificate the user approved last time
+		struct cert_check_message *ccm = calloc(1,
+				sizeof(struct cert_check_message));
+		ccm->cert = imap->socket->cert;
+		worker_post_message(imap->data, WORKER_CONNECT_CERT_CHECK, NULL, ccm);
+#endif
+	} else {
+		imap->mode = RECV_LINE;
+	}
+	return true;
+}
+
+static void reconnected(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	struct reconnect *reconnect = imap->reconnect;
+	if (!imap->socket) {
+		// Lost again before it was done
+		return;
+	}
+	if (status != STATUS_OK && reconnect->mailbox) {
+		worker_log(L_DEBUG, "Unable to catch up with %s: %s",
+				reconnect->mailbox, args);
+	}
+	struct timespec now;
+	get_nanoseconds(&now);
+	long outage = elapsed_ms(&reconnect->since, &now);
+	reconnect->stats.outage = outage;
+	reconnect->stats.total_outage += outage;
+	if (outage > reconnect->stats.longest_outage) {
+		reconnect->stats.longest_outage = outage;
+	}
+	++reconnect->stats.reconnects;
+	reconnect->stats.retry_in = 0;
+	reconnect->lost = reconnect->connecting = false;
+	reconnect->failures = 0;
+	worker_log(L_DEBUG, "Reconnected after %ld ms, %zu attempts so far",
+			outage, reconnect->stats.attempts);
+	replay_journal(imap);
+	worker_post_message(imap->data, WORKER_RECONNECTED, NULL,
+			copy_stats(reconnect));
+}
+
+static void reselected(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	if (status != STATUS_OK) {
+		worker_log(L_ERROR, "Unable to select %s again: %s",
+				imap->reconnect->mailbox, args);
+		free(imap->selected);
+		imap->selected = NULL;
+	}
+}
+
+/*
+ * Called once the new connection has logged in, or failed to. Returns false
+ * if it wasn't a new connection. The mailbox that was selected is selected
+ * again and caught up in the same round trip.
+ */
+bool reconnect_logged_in(struct imap_connection *imap, bool ok) {
+	struct reconnect *reconnect = imap->reconnect;
+	if (!reconnect || !reconnect->connecting) {
+		return false;
+	}
+	if (!ok) {
+		imap_disconnect(imap, "Unable to log in again");
+		return true;
+	}
+	if (!reconnect->mailbox) {
+		reconnected(imap, NULL, STATUS_OK, NULL);
+		return true;
+	}
+	imap_select(imap, reselected, NULL, reconnect->mailbox);
+	imap_resync(imap, reconnected, NULL);
+	return true;
+}
@@ -0,0 +1,285 @@
+/*
+ * imap/worker/search.c - Feeds the local search index and handles the
+ * WORKER_SEARCH action
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "email/headers.h"
+#include "imap/imap.h"
+#include "imap/worker.h"
+#include "internal/imap.h"
+#include "log.h"
+#include "search_index.h"
+#include "util/intern.h"
+#include "worker.h"
+
+void open_search_index(struct imap_connection *imap, const struct uri *uri) {
+	if (imap->search) {
+		return;
+	}
+	char *path = cache_path(uri, "index");
+	if (!path) {
+		worker_log(L_ERROR, "Search index will not be saved");
+		imap->search = search_index_open(NULL);
+		return;
+	}
+	worker_log(L_DEBUG, "Opening search index at %s", path);
+	imap->search = search_index_open(path);
+	free(path);
+}
+
+static void append_header(char **text, size_t *length,
+		struct email_headers *headers, const char *key) {
+	const char *value = get_header(headers, key);
+	if (!value) {
+		return;
+	}
+	size_t len = strlen(value);
+	*text = realloc(*text, *length + len + 2);
+	memcpy(*text + *length, value, len);
+	(*text)[*length + len] = '\n';
+	*length += len + 1;
+}
+
+static void index_headers(struct imap_connection *imap, const char *mailbox,
+		uint32_t uidvalidity, uint32_t uid, struct email_headers *headers) {
+	char *text = NULL;
+	size_t length = 0;
+	const char *keys[] = { "Subject", "From", "To", "Cc" };
+	for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+		append_header(&text, &length, headers, keys[i]);
+	}
+	if (text) {
+		search_index_add(imap->search, mailbox, uidvalidity, uid, 0,
+				text, length, false);
+		free(text);
+	}
+}
+
+static void index_part(struct imap_connection *imap, const char *mailbox,
+		uint32_t uidvalidity, uint32_t uid, size_t part, const char *type,
+		const char *subtype, struct body *body) {
+	if (!body || !type || strcasecmp(type, "text") != 0) {
+		return;
+	}
+	bool html = subtype && strcasecmp(subtype, "html") == 0;
+	search_index_add(imap->search, mailbox, uidvalidity, uid, part,
+			(const char *)body->data, body->size, html);
+}
+
+void index_message(struct imap_connection *imap, struct mailbox_message *msg) {
+	if (!imap->search || !imap->selected || !msg->uid) {
+		return;
+	}
+	struct mailbox *mbox = get_mailbox(imap, imap->selected);
+	if (!mbox) {
+		return;
+	}
+	if (msg->headers) {
+		index_headers(imap, imap->selected, mbox->uidvalidity, msg->uid,
+				msg->headers);
+	}
+	for (size_t i = 0; msg->parts && i < msg->parts->length; ++i) {
+		struct message_part *part = msg->parts->items[i];
+		index_part(imap, imap->selected, mbox->uidvalidity, msg->uid, i + 1,
+				part->type, part->subtype, body_cache_peek(imap->bodies,
+					imap->selected, msg->uid, i + 1));
+	}
+}
+
+/* Indexes a copy of a message we've already seen, which went to mailbox */
+void index_snapshot(struct imap_connection *imap, struct aerc_message *msg,
+		const char *mailbox, uint32_t uidvalidity, uint32_t uid) {
+	if (!imap->search) {
+		return;
+	}
+	if (msg->headers) {
+		index_headers(imap, mailbox, uidvalidity, uid, msg->headers);
+	}
+	for (size_t i = 0; msg->parts && i < msg->parts->length; ++i) {
+		struct aerc_message_part *part = msg->parts->items[i];
+		index_part(imap, mailbox, uidvalidity, uid, i + 1, part->type,
+				part->subtype, part->content);
+	}
+}
+
+static int compare_uids(const void *_a, const void *_b) {
+	const struct search_hit *a = _a, *b = _b;
+	return (a->uid > b->uid) - (a->uid < b->uid);
+}
+
+static struct aerc_search_results *create_results(struct imap_connection *imap,
+		struct mailbox *mbox) {
+	struct aerc_search_results *results =
+		calloc(1, sizeof(struct aerc_search_results));
+	results->mailbox = strdup(imap->selected);
+	results->indices = malloc((mbox->messages->length + 1) * sizeof(int));
+	return results;
+}
+
+static void search_local(struct worker_pipe *pipe, struct imap_connection *imap,
+		struct mailbox *mbox, const char *query) {
+	struct search_hit *hits;
+	size_t nhits = search_index_query(imap->search, query, &hits);
+	// Hits are sorted by mailbox, then UIDVALIDITY, then UID
+	const char *mailbox = intern_mailbox(imap->selected);
+	uint32_t uidvalidity = mbox->uidvalidity;
+	size_t start = 0;
+	while (start < nhits && (hits[start].mailbox != mailbox
+				|| hits[start].uidvalidity != uidvalidity)) {
+		++start;
+	}
+	size_t end = start;
+	while (end < nhits && hits[end].mailbox == mailbox
+			&& hits[end].uidvalidity == uidvalidity) {
+		++end;
+	}
+
+	struct aerc_search_results *results = create_results(imap, mbox);
+	// The server's answer will replace these
+	results->partial = imap->logged_in;
+	for (size_t i = 0; i < mbox->messages->length && end > start; ++i) {
+		struct mailbox_message *msg = mbox->messages->items[i];
+		struct search_hit key = { .uid = msg->uid };
+		if (msg->uid && bsearch(&key, &hits[start], end - start,
+					sizeof(struct search_hit), compare_uids)) {
+			results->indices[results->length++] = i;
+		}
+	}
+	free(hits);
+	worker_log(L_DEBUG, "Local search found %zu messages", results->length);
+	worker_post_message(pipe, WORKER_SEARCH_DONE, NULL, results);
+}
+
+/*
+ * Turns the query into SEARCH criteria, one TEXT key per term, which the
+ * server ANDs together. Terms that can't be quoted go as literals.
+ */
+static char *search_criteria(struct imap_connection *imap, const char *query) {
+	size_t len = 0, size = sizeof("CHARSET UTF-8 ");
+	char *criteria = malloc(size);
+	criteria[0] = '\0';
+	for (const char *q = query; *q; ++q) {
+		if ((unsigned char)*q >= 0x80) {
+			len = sprintf(criteria, "CHARSET UTF-8 ");
+			break;
+		}
+	}
+	const char *term = query;
+	while (*term) {
+		term += strspn(term, " \t");
+		size_t n = strcspn(term, " \t");
+		if (!n) {
+			break;
+		}
+		char *text = strndup(term, n);
+		char *quoted = imap_quote(imap, text);
+		size += strlen(quoted) + sizeof("TEXT  ");
+		criteria = realloc(criteria, size);
+		len += sprintf(criteria + len, "%sTEXT %s",
+				len && criteria[len - 1] != ' ' ? " " : "", quoted);
+		free(quoted);
+		free(text);
+		term += n;
+	}
+	return criteria;
+}
+
+struct search_request {
+	struct worker_pipe *pipe;
+	char *mailbox;
+	struct uid_set *uids; // Filled in as the server answers
+};
+
+static void search_done(struct imap_connection *imap,
+		void *data, enum imap_status status, const char *args) {
+	struct search_request *request = data;
+	struct worker_pipe *pipe = request->pipe;
+	struct uid_set *uids = request->uids;
+	struct mailbox *mbox = imap->selected ?
+		get_mailbox(imap, imap->selected) : NULL;
+	if (!mbox || strcmp(request->mailbox, imap->selected) != 0) {
+		// We've selected another mailbox since
+		goto exit;
+	}
+	if (status != STATUS_OK) {
+		worker_log(L_DEBUG, "Server search failed: %s", args);
+		goto exit;
+	}
+
+	struct aerc_search_results *results = create_results(imap, mbox);
+	struct uid_set *known = uid_set_create();
+	for (size_t i = 0; i < mbox->messages->length; ++i) {
+		struct mailbox_message *msg = mbox->messages->items[i];
+		if (msg->uid && uid_set_contains(uids, msg->uid)) {
+			results->indices[results->length++] = i;
+			uid_set_add(known, msg->uid);
+		}
+	}
+	/*
+	 * We don't know the UIDs of the messages we haven't fetched. Ask for just
+	 * the UIDs of the matches among them, so they can be placed in the list as
+	 * the answers arrive without fetching their headers.
+	 */
+	struct uid_set *missing = uid_set_create();
+	for (size_t i = 0; i < uids->length; ++i) {
+		for (uint32_t uid = uids->ranges[i].min; ; ++uid) {
+			if (!uid_set_contains(known, uid)) {
+				uid_set_add(missing, uid);
+			}
+			if (uid == uids->ranges[i].max) {
+				break;
+			}
+		}
+	}
+	for (size_t i = 0; i < missing->length; i += 500) {
+		char *set = uid_set_format(missing, i, 500);
+		imap_send(imap, NULL, NULL, "UID FETCH %s (UID)", set);
+		free(set);
+	}
+	worker_log(L_DEBUG, "Server search found %zu messages, %zu unknown",
+			uid_set_count(uids), uid_set_count(missing));
+	uid_set_free(known);
+	uid_set_free(missing);
+	results->uids = uids;
+	uids = NULL;
+	worker_post_message(pipe, WORKER_SEARCH_DONE, NULL, results);
+
+exit:
+	uid_set_free(uids);
+	free(request->mailbox);
+	free(request);
+}
+
+void handle_worker_search(struct worker_pipe *pipe, struct worker_message *message) {
+	struct imap_connection *imap = pipe->data;
+	char *query = message->data;
+	worker_post_message(pipe, WORKER_ACK, message, NULL);
+	struct mailbox *mbox = imap->selected ?
+		get_mailbox(imap, imap->selected) : NULL;
+	if (!mbox || (!imap->search && !imap->logged_in)) {
+		worker_post_message(pipe, WORKER_SEARCH_ERROR, NULL, NULL);
+		free(query);
+		return;
+	}
+	if (imap->search) {
+		// Answer from the local index straight away
+		search_local(pipe, imap, mbox, query);
+	}
+	if (imap->logged_in) {
+		char *criteria = search_criteria(imap, query);
+		struct search_request *request = malloc(sizeof(struct search_request));
+		request->pipe = pipe;
+		request->mailbox = strdup(imap->selected);
+		request->uids = uid_set_create();
+		imap_search(imap, search_done, request, request->uids, criteria);
+		free(criteria);
+	}
+	free(query);
+}
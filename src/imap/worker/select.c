@@ -4,20 +4,36 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "imap/imap.h"
+#include "imap/worker.h"
 #include "worker.h"
 #include "log.h"
 
+struct select_request {
+	struct worker_pipe *pipe;
+	unsigned long generation; // Of the view the user asked for
+};
+
 static void select_done(struct imap_connection *imap,
 		void *data, enum imap_status status, const char *args) {
-	struct worker_pipe *pipe = data;
+	struct select_request *request = data;
+	struct worker_pipe *pipe = request->pipe;
 	if (status == STATUS_OK) {
 		worker_log(L_DEBUG, "Selected %s", imap->selected);
-		worker_post_message(pipe, WORKER_SELECT_MAILBOX_DONE, NULL, imap->selected);
+		// Everything we hear about from now on belongs to this view
+		pipe->worker_generation = request->generation;
+		worker_post_message(pipe, WORKER_SELECT_MAILBOX_DONE, NULL,
+				strdup(imap->selected));
+		// Whatever was left over from last time
+		replay_journal(imap);
 	} else {
-		worker_post_message(pipe, WORKER_SELECT_MAILBOX_ERROR, NULL, NULL);
+		worker_post_message_generation(pipe, WORKER_SELECT_MAILBOX_ERROR,
+				NULL, NULL, request->generation);
 	}
+	free(request);
 }
 
 void handle_worker_select_mailbox(struct worker_pipe *pipe, struct worker_message *message) {
@@ -27,5 +43,14 @@ void handle_worker_select_mailbox(struct worker_pipe *pipe, struct worker_messag
 	 */
 	struct imap_connection *imap = pipe->data;
 	worker_post_message(pipe, WORKER_ACK, message, NULL);
-	imap_select(imap, select_done, pipe, (const char *)message->data);
+	cancel_prefetch(imap);
+	// UID STORE only reaches the mailbox that's selected
+	flush_flags(imap, true);
+	// Nobody is waiting on the mailboxes the user skipped past any more
+	imap_cancel_selects(imap);
+	struct select_request *request = malloc(sizeof(struct select_request));
+	request->pipe = pipe;
+	request->generation = message->generation;
+	imap_select(imap, select_done, request, (const char *)message->data);
+	free(message->data);
 }
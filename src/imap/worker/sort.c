@@ -0,0 +1,82 @@
+/*
+ * imap/worker/sort.c - Handles the WORKER_SORT action
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "imap/imap.h"
+#include "imap/worker.h"
+#include "log.h"
+#include "message_view.h"
+#include "worker.h"
+
+struct sort_state {
+	struct worker_pipe *pipe;
+	struct message_view *view;
+};
+
+static void sort_callback(struct imap_connection *imap,
+		void *data, enum imap_status status, const char *args) {
+	struct sort_state *state = data;
+	if (status == STATUS_OK) {
+		worker_post_message(state->pipe, WORKER_SORT_DONE, NULL, state->view);
+	} else {
+		worker_log(L_DEBUG, "Server-side sort failed: %s", args);
+		message_view_free(state->view);
+		worker_post_message(state->pipe, WORKER_SORT_ERROR, NULL, NULL);
+	}
+	free(state);
+}
+
+static struct sort_state *sort_state(struct worker_pipe *pipe) {
+	struct sort_state *state = malloc(sizeof(struct sort_state));
+	state->pipe = pipe;
+	state->view = message_view_create(SORT_NONE, THREAD_NONE, false);
+	return state;
+}
+
+static const char *sort_criteria(enum view_sort sort, bool reverse) {
+	/*
+	 * We show the newest/largest messages on top, so those are reversed by
+	 * default. ARRIVAL is the internal date, which is what we sort on locally.
+	 */
+	switch (sort) {
+	case SORT_DATE:
+		return reverse ? "ARRIVAL" : "REVERSE ARRIVAL";
+	case SORT_SIZE:
+		return reverse ? "SIZE" : "REVERSE SIZE";
+	case SORT_FROM:
+		return reverse ? "REVERSE FROM" : "FROM";
+	case SORT_SUBJECT:
+		return reverse ? "REVERSE SUBJECT" : "SUBJECT";
+	default:
+		return NULL;
+	}
+}
+
+void handle_worker_sort(struct worker_pipe *pipe, struct worker_message *message) {
+	struct imap_connection *imap = pipe->data;
+	struct sort_request *request = message->data;
+	worker_post_message(pipe, WORKER_ACK, message, NULL);
+
+	const char *criteria = sort_criteria(request->sort, request->reverse);
+	struct imap_capabilities none = { 0 };
+	const struct imap_capabilities *cap = imap->cap ? imap->cap : &none;
+	if (request->thread == THREAD_REFERENCES && cap->thread_references) {
+		struct sort_state *state = sort_state(pipe);
+		imap_thread(imap, sort_callback, state, state->view, "REFERENCES");
+	} else if (request->thread == THREAD_ORDEREDSUBJECT
+			&& cap->thread_orderedsubject) {
+		struct sort_state *state = sort_state(pipe);
+		imap_thread(imap, sort_callback, state, state->view, "ORDEREDSUBJECT");
+	} else if (request->thread == THREAD_NONE && criteria && cap->sort) {
+		struct sort_state *state = sort_state(pipe);
+		imap_sort(imap, sort_callback, state, state->view, criteria);
+	} else {
+		// Not supported by the server, the UI sorts locally
+		worker_post_message(pipe, WORKER_SORT_DONE, NULL, NULL);
+	}
+	free(request);
+}
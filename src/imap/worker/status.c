@@ -0,0 +1,100 @@
+/*
+ * imap/worker/status.c - Keeps the counts of the mailboxes that aren't
+ * selected up to date, with NOTIFY if the server has it and by asking every so
+ * often if not
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "imap/imap.h"
+#include "imap/worker.h"
+#include "internal/imap.h"
+#include "log.h"
+#include "util/time.h"
+
+#define STATUS_INTERVAL 60 // Seconds between polls without NOTIFY
+
+static void notify_done(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	imap->status_poll.pending = 0;
+	if (status == STATUS_OK) {
+		worker_log(L_DEBUG, "The server will tell us about other mailboxes");
+		imap->status_poll.notify = true;
+	} else {
+		worker_log(L_DEBUG, "NOTIFY failed, polling instead: %s", args);
+	}
+}
+
+static void status_done(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	if (imap->status_poll.pending) {
+		--imap->status_poll.pending;
+	}
+	if (status != STATUS_OK) {
+		worker_log(L_DEBUG, "STATUS failed: %s", args);
+	}
+}
+
+bool poll_status(struct imap_connection *imap) {
+	if (!imap->logged_in || !imap->cap || !imap->mailboxes
+			|| !imap->mailboxes->length || imap->status_poll.pending) {
+		return false;
+	}
+	// An IDLE is the only thing we'll interrupt
+	if (imap_busy(imap) > 0) {
+		return false;
+	}
+	if (imap->selected && (!imap->status_poll.selected
+				|| strcmp(imap->selected, imap->status_poll.selected) != 0)) {
+		/*
+		 * Changes to the mailbox we've just left came as EXISTS and FETCH
+		 * responses, so its counts from before it was selected are stale
+		 */
+		char *previous = imap->status_poll.selected;
+		imap->status_poll.selected = strdup(imap->selected);
+		if (previous && get_mailbox(imap, previous)) {
+			++imap->status_poll.pending;
+			imap_status(imap, status_done, NULL, previous);
+		}
+		free(previous);
+		if (imap->status_poll.pending) {
+			return true;
+		}
+	}
+	if (imap->status_poll.notify) {
+		return false;
+	}
+	if (imap->cap->notify && !imap->status_poll.notify_tried) {
+		imap->status_poll.notify_tried = true;
+		imap->status_poll.pending = 1;
+		imap_notify(imap, notify_done, NULL);
+		return true;
+	}
+	struct timespec now;
+	get_nanoseconds(&now);
+	if (imap->status_poll.last.tv_sec
+			&& now.tv_sec - imap->status_poll.last.tv_sec < STATUS_INTERVAL) {
+		return false;
+	}
+	imap->status_poll.last = now;
+	if (imap->cap->list_status) {
+		imap->status_poll.pending = 1;
+		imap_list_status(imap, status_done, NULL, "", "%");
+		return true;
+	}
+	// Pipelined, the server answers them all in one go
+	for (size_t i = 0; i < imap->mailboxes->length; ++i) {
+		struct mailbox *mbox = imap->mailboxes->items[i];
+		if ((imap->selected && strcmp(mbox->name, imap->selected) == 0)
+				|| mailbox_get_flag(imap, mbox->name, "\\noselect")) {
+			continue;
+		}
+		++imap->status_poll.pending;
+		imap_status(imap, status_done, NULL, mbox->name);
+	}
+	return imap->status_poll.pending > 0;
+}
@@ -8,14 +8,21 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "absocket.h"
 #include "worker.h"
 #include "email/headers.h"
 #include "imap/imap.h"
 #include "imap/worker.h"
 #include "internal/imap.h"
 #include "log.h"
+#include "search_index.h"
+#include "util/intern.h"
 #include "util/list.h"
 
+#define FETCH_CHUNK 100 // Messages per FETCH when filling in the message list
+#define BACKGROUND_DEPTH 2 // Bulk commands we let onto the wire at once
+#define SLEEP_TIME 50 // Milliseconds at most, the timers are checked this often
+
 struct action_handler {
 	enum worker_message_type action;
 	void (*handler)(struct worker_pipe *pipe, struct worker_message *message);
@@ -23,6 +30,7 @@ struct action_handler {
 
 struct action_handler handlers[] = {
 	{ WORKER_CONNECT, handle_worker_connect },
+	{ WORKER_CONFIGURE, handle_worker_configure },
 	{ WORKER_LIST, handle_worker_list },
 	{ WORKER_SELECT_MAILBOX, handle_worker_select_mailbox },
 #ifdef USE_OPENSSL
@@ -31,10 +39,14 @@ struct action_handler handlers[] = {
 	{ WORKER_CREATE_MAILBOX, handle_worker_create_mailbox },
 	{ WORKER_FETCH_MESSAGES, handle_worker_fetch_messages },
 	{ WORKER_FETCH_MESSAGE_PART, handle_worker_fetch_message_part },
+	{ WORKER_PREFETCH, handle_worker_prefetch },
+	{ WORKER_STORE_FLAGS, handle_worker_store_flags },
 	{ WORKER_DELETE_MAILBOX, handle_worker_delete_mailbox },
 	{ WORKER_DELETE_MESSAGE, handle_worker_delete_message },
 	{ WORKER_COPY_MESSAGE, handle_worker_copy_message },
 	{ WORKER_MOVE_MESSAGE, handle_worker_move_message },
+	{ WORKER_SORT, handle_worker_sort },
+	{ WORKER_SEARCH, handle_worker_search },
 };
 
 void handle_message(struct worker_pipe *pipe, struct worker_message *message) {
@@ -47,27 +59,35 @@ void handle_message(struct worker_pipe *pipe, struct worker_message *message) {
 	worker_post_message(pipe, WORKER_UNSUPPORTED, message, NULL);
 }
 
-struct aerc_message *serialize_message(struct mailbox_message *source) {
+/* Batch actions name messages by UID, which only mean something in one mailbox */
+bool batch_selected(struct imap_connection *imap, const char *mailbox) {
+	if (imap->selected && mailbox && strcmp(imap->selected, mailbox) == 0) {
+		return true;
+	}
+	worker_log(L_DEBUG, "Ignoring action for %s, which is no longer selected",
+			mailbox ? mailbox : "no mailbox");
+	return false;
+}
+
+struct aerc_message *serialize_message(struct imap_connection *imap,
+		const char *mailbox, struct mailbox_message *source) {
 	if (!source) return NULL;
-	struct aerc_message *dest = calloc(1, sizeof(struct aerc_message));
+	if (source->snapshot) {
+		return aerc_message_ref(source->snapshot);
+	}
+	struct aerc_message *dest = aerc_message_new();
 	dest->index = source->index;
 	dest->fetched = source->populated;
+	// May be known before the rest, see imap/worker/search.c
+	dest->uid = source->uid;
 	if (!source->populated) {
+		// Not cached, the UI marks these as fetching
 		return dest;
 	}
-	dest->uid = source->uid;
-	dest->flags = create_list();
-	for (size_t i = 0; i < source->flags->length; ++i) {
-		list_add(dest->flags, strdup(source->flags->items[i]));
-	}
-	dest->headers = create_list();
-	for (size_t i = 0; i < source->headers->length; ++i) {
-		struct email_header *header = source->headers->items[i];
-		struct email_header *copy = malloc(sizeof(struct email_header));
-		copy->key = strdup(header->key);
-		copy->value = strdup(header->value);
-		list_add(dest->headers, copy);
-	}
+	dest->size = source->size;
+	dest->flags = queued_flags(imap, mailbox, source->uid, source->flags);
+	dest->keywords = keywords_dup(source->keywords);
+	dest->headers = headers_dup(source->headers);
 	dest->internal_date = calloc(1, sizeof(struct tm));
 	memcpy(dest->internal_date, source->internal_date, sizeof(struct tm));
 	if (source->parts) {
@@ -77,48 +97,75 @@ struct aerc_message *serialize_message(struct mailbox_message *source) {
 			struct aerc_message_part *dpart =
 				calloc(sizeof(struct aerc_message_part), 1);
 			// TODO: parameters, if anyone gives a shit
-			if (spart->type) dpart->type = strdup(spart->type);
-			if (spart->subtype) dpart->subtype = strdup(spart->subtype);
+			dpart->type = intern_copy(spart->type);
+			dpart->subtype = intern_copy(spart->subtype);
 			if (spart->body_id) dpart->body_id = strdup(spart->body_id);
 			if (spart->body_description) dpart->body_description = strdup(spart->body_description);
-			if (spart->body_encoding) dpart->body_encoding = strdup(spart->body_encoding);
+			dpart->body_encoding = intern_copy(spart->body_encoding);
 			dpart->size = spart->size;
-			if (spart->content) dpart->content = spart->content; // Not duplicated
+			dpart->content = body_ref(body_cache_peek(imap->bodies,
+						mailbox, source->uid, i + 1));
 			list_add(dest->parts, dpart);
 		}
 	}
+	source->snapshot = aerc_message_ref(dest);
 	return dest;
 }
 
-struct aerc_mailbox *serialize_mailbox(struct mailbox *source) {
-	struct aerc_mailbox *dest = calloc(1, sizeof(struct mailbox));
+static void invalidate_message(struct mailbox_message *msg) {
+	aerc_message_unref(msg->snapshot);
+	msg->snapshot = NULL;
+}
+
+struct aerc_mailbox *serialize_mailbox(struct imap_connection *imap,
+		struct mailbox *source) {
+	struct aerc_mailbox *dest = calloc(1, sizeof(struct aerc_mailbox));
 	dest->name = strdup(source->name);
 	dest->exists = source->exists;
 	dest->recent = source->recent;
 	dest->unseen = source->unseen;
+	dest->status.messages = source->status.messages;
+	dest->status.unseen = source->status.unseen;
+	dest->status.recent = source->status.recent;
 	dest->selected = source->selected;
 	dest->flags = create_list();
 	for (size_t i = 0; i < source->flags->length; ++i) {
 		struct mailbox_flag *flag = source->flags->items[i];
 		// TODO: Send along the permanent bool as well
-		list_add(dest->flags, strdup(flag->name));
+		list_add(dest->flags, (void *)flag->name);
 	}
+	dest->table = message_table_ref(source->table);
+	source->table_dirty = false;
 	dest->messages = create_list();
 	for (size_t i = 0; i < source->messages->length; ++i) {
-		list_add(dest->messages, serialize_message(source->messages->items[i]));
+		list_add(dest->messages, serialize_message(imap, source->name,
+					source->messages->items[i]));
 	}
 	return dest;
 }
 
 static void update_mailbox(struct imap_connection *imap, struct mailbox *updated) {
-	struct aerc_mailbox *mbox = serialize_mailbox(updated);
+	struct aerc_mailbox *mbox = serialize_mailbox(imap, updated);
 	struct worker_pipe *pipe = imap->data;
 	worker_post_message(pipe, WORKER_MAILBOX_UPDATED, NULL, mbox);
 }
 
+static void update_mailbox_status(struct imap_connection *imap,
+		struct mailbox *mbox) {
+	struct aerc_mailbox_status *status =
+		calloc(1, sizeof(struct aerc_mailbox_status));
+	status->mailbox = strdup(mbox->name);
+	status->messages = mbox->status.messages;
+	status->unseen = mbox->status.unseen;
+	status->recent = mbox->status.recent;
+	worker_post_message(imap->data, WORKER_MAILBOX_STATUS, NULL, status);
+}
+
 static void update_message(struct imap_connection *imap,
 		struct mailbox_message *msg) {
-	struct aerc_message *aerc_msg = serialize_message(msg);
+	invalidate_message(msg);
+	index_message(imap, msg);
+	struct aerc_message *aerc_msg = serialize_message(imap, imap->selected, msg);
 	struct worker_pipe *pipe = imap->data;
 	struct aerc_message_update *update = calloc(1, sizeof(struct aerc_message_update));
 	update->message = aerc_msg;
@@ -126,6 +173,34 @@ static void update_message(struct imap_connection *imap,
 	worker_post_message(pipe, WORKER_MESSAGE_UPDATED, NULL, update);
 }
 
+/* Sends the UI a fresh snapshot of a message that changed on our side */
+void publish_message(struct imap_connection *imap, struct mailbox *mbox,
+		struct mailbox_message *msg) {
+	invalidate_message(msg);
+	struct aerc_message_update *update =
+		calloc(1, sizeof(struct aerc_message_update));
+	update->message = serialize_message(imap, mbox->name, msg);
+	update->mailbox = strdup(mbox->name);
+	worker_post_message(imap->data, WORKER_MESSAGE_UPDATED, NULL, update);
+}
+
+/*
+ * The UI's copy of the message still refers to the body, so we publish one
+ * without it to let it go.
+ */
+void handle_body_evicted(void *data, const char *mailbox, uint32_t uid,
+		uint32_t part) {
+	struct imap_connection *imap = data;
+	struct mailbox *mbox = get_mailbox(imap, mailbox);
+	for (size_t i = 0; mbox && i < mbox->messages->length; ++i) {
+		struct mailbox_message *msg = mbox->messages->items[i];
+		if (msg->uid == uid) {
+			publish_message(imap, mbox, msg);
+			break;
+		}
+	}
+}
+
 static void delete_mailbox(struct imap_connection *imap, const char *mailbox) {
 	struct worker_pipe *pipe = imap->data;
 	worker_post_message(pipe, WORKER_MAILBOX_DELETED, NULL, strdup(mailbox));
@@ -137,6 +212,105 @@ static void delete_message(struct imap_connection *imap,
 	struct aerc_message_delete *event = calloc(1, sizeof(struct aerc_message_delete));
 	event->index = msg->index;
 	worker_post_message(pipe, WORKER_MESSAGE_DELETED, NULL, event);
+	// Every message after this one has a new index
+	struct mailbox *mbox = get_mailbox(imap, imap->selected);
+	for (size_t i = 0; mbox && i < mbox->messages->length; ++i) {
+		struct mailbox_message *_msg = mbox->messages->items[i];
+		if (_msg->index >= msg->index) {
+			invalidate_message(_msg);
+		}
+	}
+}
+
+static void publish_tables(struct imap_connection *imap) {
+	struct worker_pipe *pipe = imap->data;
+	for (size_t i = 0; i < imap->mailboxes->length; ++i) {
+		struct mailbox *mbox = imap->mailboxes->items[i];
+		if (!mbox->table_dirty) {
+			continue;
+		}
+		struct aerc_table_update *update =
+			calloc(1, sizeof(struct aerc_table_update));
+		update->mailbox = strdup(mbox->name);
+		update->table = message_table_ref(mbox->table);
+		worker_post_message(pipe, WORKER_MAILBOX_TABLE_UPDATED, NULL, update);
+		mbox->table_dirty = false;
+	}
+}
+
+static void free_prefetch(void *data) {
+	prefetch_request_free(data);
+}
+
+/* For the actions still queued when we're told to stop */
+static void free_action(struct worker_message *message) {
+	switch (message->type) {
+	case WORKER_PREFETCH:
+		prefetch_request_free(message->data);
+		break;
+	case WORKER_STORE_FLAGS:
+		store_flags_request_free(message->data);
+		break;
+	case WORKER_DELETE_MESSAGE:
+	case WORKER_COPY_MESSAGE:
+	case WORKER_MOVE_MESSAGE:
+		aerc_message_move_free(message->data);
+		break;
+	default:
+		// Strings, ranges and the like, or nothing at all
+		free(message->data);
+		break;
+	}
+}
+
+/*
+ * Whatever was queued for a view the user has since left is meaningless: the
+ * message list and the viewer use indices, which would now refer to another
+ * mailbox.
+ */
+static void cancel_stale(struct imap_connection *imap,
+		struct worker_scheduler *sched, unsigned long generation) {
+	struct {
+		enum worker_message_type type;
+		void (*free_data)(void *data);
+	} stale[] = {
+		{ WORKER_FETCH_MESSAGES, free },
+		{ WORKER_FETCH_MESSAGE_PART, free },
+		{ WORKER_PREFETCH, free_prefetch },
+		{ WORKER_SORT, free },
+		{ WORKER_SEARCH, free },
+	};
+	size_t cancelled = 0;
+	for (size_t i = 0; i < sizeof(stale) / sizeof(stale[0]); ++i) {
+		cancelled += worker_scheduler_cancel(sched, stale[i].type,
+				generation, stale[i].free_data);
+	}
+	cancel_prefetch(imap);
+	if (cancelled) {
+		worker_log(L_DEBUG, "Cancelled %zu stale actions", cancelled);
+	}
+}
+
+/*
+ * A long range goes out a chunk at a time, so anything the user asks for in
+ * the meantime only waits behind a chunk or two of it on the wire.
+ */
+static struct worker_message *take_chunk(struct worker_scheduler *sched,
+		struct worker_message *message) {
+	struct message_range *range = message->data;
+	if (message->type != WORKER_FETCH_MESSAGES
+			|| range->max - range->min < FETCH_CHUNK) {
+		return message;
+	}
+	struct message_range *chunk = malloc(sizeof(struct message_range));
+	chunk->min = range->min;
+	chunk->max = range->min + FETCH_CHUNK - 1;
+	range->min += FETCH_CHUNK;
+	worker_scheduler_requeue(sched, message);
+	struct worker_message *first = calloc(1, sizeof(struct worker_message));
+	*first = *message;
+	first->data = chunk;
+	return first;
 }
 
 void *imap_worker(void *_pipe) {
@@ -150,29 +324,90 @@ void *imap_worker(void *_pipe) {
 	imap->events.mailbox_deleted = delete_mailbox;
 	imap->events.message_updated = update_message;
 	imap->events.message_deleted = delete_message;
+	imap->events.mailbox_status = update_mailbox_status;
+	imap->events.disconnected = handle_disconnected;
+	struct worker_scheduler *sched = worker_scheduler_new();
 	worker_log(L_DEBUG, "Starting IMAP worker");
 	while (1) {
 		bool sleep = true;
-		if (worker_get_action(pipe, &message)) {
+		while (worker_get_action(pipe, &message)) {
 			if (message->type == WORKER_END) {
+				// Without waiting to hear back, that's the best we can do
+				flush_flags(imap, true);
+				flag_queue_free(imap);
+				journal_free(imap);
+				reconnect_free(imap);
+				worker_scheduler_free(sched, free_action);
+				search_index_close(imap->search);
+				body_store_close(imap->store);
+				prefetch_free(imap);
+				pool_free(imap->pool);
 				imap_close(imap);
 				free(imap);
 				worker_message_free(message);
 				return NULL;
-			} else {
-				handle_message(pipe, message);
 			}
+			if (message->type == WORKER_CANCEL) {
+				worker_log(L_DEBUG, "Cancelling actions before %lu (generation %lu)",
+						message->id, message->generation);
+				cancel_stale(imap, sched, message->generation);
+				worker_message_free(message);
+				continue;
+			}
+			worker_scheduler_add(sched, message);
+		}
+		// What the user is waiting on goes out ahead of any bulk work
+		while (worker_scheduler_next(sched, PRIORITY_INTERACTIVE, &message)) {
+			handle_message(pipe, message);
+			worker_message_free(message);
+			sleep = false;
+		}
+		int busy = imap_busy(imap);
+		if (busy < BACKGROUND_DEPTH
+				&& worker_scheduler_next(sched, PRIORITY_BACKGROUND, &message)) {
+			message = take_chunk(sched, message);
+			handle_message(pipe, message);
 			worker_message_free(message);
 			sleep = false;
 		}
+		if (flush_flags(imap, false)) {
+			sleep = false;
+		}
 		if (imap_receive(imap)) {
 			sleep = false;
 		}
+		if (reconnect_run(imap)) {
+			sleep = false;
+		}
+		if (prefetch_next(imap)) {
+			sleep = false;
+		}
+		if (poll_status(imap)) {
+			sleep = false;
+		}
+		if (imap->mailboxes) {
+			// Once per pass, so a burst of FETCH responses is published once
+			publish_tables(imap);
+		}
+		if (sleep && imap->search && search_index_maintain(imap->search)) {
+			sleep = false;
+		}
+		if (sleep && imap->store && body_store_maintain(imap->store)) {
+			sleep = false;
+		}
+		if (sleep && journal_maintain(imap)) {
+			sleep = false;
+		}
+		// Only when the interactive connection has nothing better to do
+		if (pool_run(imap->pool, sleep && imap_busy(imap) <= 0)) {
+			sleep = false;
+		}
 		if (sleep) {
-			// We only sleep if we aren't working
+			// We only sleep if we aren't working, and only until the server
+			// or the UI has something for us
 			// Side note, it is currently 4:39 AM
-			struct timespec spec = { 0, .5e+8 };
-			nanosleep(&spec, NULL);
+			worker_wait(pipe, imap->socket ? imap->socket->basefd : -1,
+					imap->socket ? ab_events(imap->socket) : 0, SLEEP_TIME);
 		}
 	}
 	return NULL;
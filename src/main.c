@@ -19,6 +19,7 @@
 #include "imap/worker.h"
 #include "log.h"
 #include "render.h"
+#include "smtp/worker.h"
 #include "state.h"
 #include "ui.h"
 #include "util/list.h"
@@ -34,6 +35,8 @@ struct message_handler {
 struct message_handler message_handlers[] = {
 	{ WORKER_CONNECT_DONE, handle_worker_connect_done },
 	{ WORKER_CONNECT_ERROR, handle_worker_connect_error },
+	{ WORKER_CONNECTION_LOST, handle_worker_connection_lost },
+	{ WORKER_RECONNECTED, handle_worker_reconnected },
 	{ WORKER_SELECT_MAILBOX_DONE, handle_worker_select_done },
 	{ WORKER_SELECT_MAILBOX_ERROR, handle_worker_select_error },
 	{ WORKER_LIST_DONE, handle_worker_list_done },
@@ -42,9 +45,19 @@ struct message_handler message_handlers[] = {
 	{ WORKER_CONNECT_CERT_CHECK, handle_worker_connect_cert_check },
 #endif
 	{ WORKER_MAILBOX_UPDATED, handle_worker_mailbox_updated },
+	{ WORKER_MAILBOX_TABLE_UPDATED, handle_worker_mailbox_table_updated },
+	{ WORKER_MAILBOX_STATUS, handle_worker_mailbox_status },
 	{ WORKER_MAILBOX_DELETED, handle_worker_mailbox_deleted },
 	{ WORKER_MESSAGE_UPDATED, handle_worker_message_updated },
 	{ WORKER_MESSAGE_DELETED, handle_worker_message_deleted },
+	{ WORKER_SORT_DONE, handle_worker_sort_done },
+	{ WORKER_SORT_ERROR, handle_worker_sort_error },
+	{ WORKER_SEARCH_DONE, handle_worker_search_done },
+	{ WORKER_SEARCH_ERROR, handle_worker_search_error },
+	{ WORKER_MOVE_MESSAGE_DONE, handle_worker_move_done },
+	{ WORKER_MOVE_MESSAGE_ERROR, handle_worker_move_error },
+	{ WORKER_SEND_MESSAGE_DONE, handle_worker_send_done },
+	{ WORKER_SEND_MESSAGE_ERROR, handle_worker_send_error },
 };
 
 void handle_worker_message(struct account_state *account, struct worker_message *msg) {
@@ -114,11 +127,17 @@ int main(int argc, char **argv) {
 		account->config = ac;
 		worker_post_action(account->worker.pipe, WORKER_CONNECT, NULL,
 				ac->source);
-		worker_post_action(account->worker.pipe, WORKER_CONFIGURE, NULL,
-				ac->extras);
+		configure_worker(account);
 		// TODO: Detect appropriate worker based on source
 		pthread_create(&account->worker.thread, NULL, imap_worker,
 				account->worker.pipe);
+		if (ac->outgoing) {
+			account->sender.pipe = worker_pipe_new();
+			worker_post_action(account->sender.pipe, WORKER_CONNECT, NULL,
+					strdup(ac->outgoing));
+			pthread_create(&account->sender.thread, NULL, smtp_worker,
+					account->sender.pipe);
+		}
 		list_add(state->accounts, account);
 		set_status(account, ACCOUNT_NOT_READY, "Connecting...");
 	}
@@ -136,6 +155,12 @@ int main(int argc, char **argv) {
 				handle_worker_message(account, msg);
 				worker_message_free(msg);
 			}
+			if (account->sender.pipe
+					&& worker_get_message(account->sender.pipe, &msg)) {
+				sleep = false;
+				handle_worker_message(account, msg);
+				worker_message_free(msg);
+			}
 		}
 
 		if (sleep && !ui_tick()) {
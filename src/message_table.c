@@ -0,0 +1,238 @@
+/*
+ * message_table.c - columnar index of the messages in a mailbox
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "email/headers.h"
+#include "message_table.h"
+
+struct message_table *message_table_create() {
+	struct message_table *table = calloc(1, sizeof(struct message_table));
+	if (!table) {
+		return NULL;
+	}
+	atomic_init(&table->refs, 1);
+	// Offset 0 is reserved for the empty string
+	table->strings.size = 256;
+	table->strings.data = calloc(1, table->strings.size);
+	table->strings.length = 1;
+	return table;
+}
+
+static void *dup_column(const void *src, size_t size) {
+	if (!src || !size) {
+		return NULL;
+	}
+	void *dest = malloc(size);
+	memcpy(dest, src, size);
+	return dest;
+}
+
+struct message_table *message_table_dup(const struct message_table *table) {
+	if (!table) {
+		return NULL;
+	}
+	struct message_table *copy = calloc(1, sizeof(struct message_table));
+	atomic_init(&copy->refs, 1);
+	copy->length = copy->capacity = table->length;
+	copy->uids = dup_column(table->uids, table->length * sizeof(uint32_t));
+	copy->flags = dup_column(table->flags, table->length * sizeof(uint32_t));
+	copy->dates = dup_column(table->dates, table->length * sizeof(time_t));
+	copy->subjects = dup_column(table->subjects, table->length * sizeof(uint32_t));
+	copy->senders = dup_column(table->senders, table->length * sizeof(uint32_t));
+	copy->strings.size = copy->strings.length = table->strings.length;
+	copy->strings.data = dup_column(table->strings.data, table->strings.length);
+	copy->strings.garbage = table->strings.garbage;
+	return copy;
+}
+
+struct message_table *message_table_ref(struct message_table *table) {
+	if (table) {
+		atomic_fetch_add(&table->refs, 1);
+	}
+	return table;
+}
+
+void message_table_unref(struct message_table *table) {
+	if (!table || atomic_fetch_sub(&table->refs, 1) != 1) {
+		return;
+	}
+	free(table->uids);
+	free(table->flags);
+	free(table->dates);
+	free(table->subjects);
+	free(table->senders);
+	free(table->strings.data);
+	free(table);
+}
+
+void message_table_cow(struct message_table **table) {
+	if (atomic_load(&(*table)->refs) == 1) {
+		return;
+	}
+	struct message_table *copy = message_table_dup(*table);
+	message_table_unref(*table);
+	*table = copy;
+}
+
+static const char *pool_get(const struct message_table *table,
+		uint32_t offset) {
+	return table->strings.data + offset;
+}
+
+static void pool_compact(struct message_table *table) {
+	char *data = malloc(table->strings.size);
+	size_t length = 1;
+	data[0] = '\0';
+	uint32_t *columns[] = { table->subjects, table->senders };
+	for (size_t c = 0; c < sizeof(columns) / sizeof(columns[0]); ++c) {
+		for (size_t i = 0; i < table->length; ++i) {
+			if (!columns[c][i]) {
+				continue;
+			}
+			const char *str = pool_get(table, columns[c][i]);
+			size_t len = strlen(str) + 1;
+			memcpy(data + length, str, len);
+			columns[c][i] = length;
+			length += len;
+		}
+	}
+	free(table->strings.data);
+	table->strings.data = data;
+	table->strings.length = length;
+	table->strings.garbage = 0;
+}
+
+static void pool_release(struct message_table *table, uint32_t offset) {
+	if (offset) {
+		table->strings.garbage += strlen(pool_get(table, offset)) + 1;
+	}
+}
+
+static uint32_t pool_add(struct message_table *table, const char *str) {
+	if (!str || !*str) {
+		return 0;
+	}
+	size_t len = strlen(str) + 1;
+	if (table->strings.length + len > table->strings.size) {
+		if (table->strings.garbage > table->strings.length / 2) {
+			pool_compact(table);
+		}
+		while (table->strings.length + len > table->strings.size) {
+			table->strings.size *= 2;
+		}
+		table->strings.data = realloc(table->strings.data,
+				table->strings.size);
+	}
+	uint32_t offset = table->strings.length;
+	memcpy(table->strings.data + offset, str, len);
+	table->strings.length += len;
+	return offset;
+}
+
+static void grow_column(void **column, size_t elem, size_t old, size_t new) {
+	*column = realloc(*column, new * elem);
+	memset((char *)*column + old * elem, 0, (new - old) * elem);
+}
+
+void message_table_resize(struct message_table *table, size_t length) {
+	if (length > table->capacity) {
+		size_t capacity = table->capacity ? table->capacity : 64;
+		while (capacity < length) {
+			capacity *= 2;
+		}
+		size_t old = table->capacity;
+		grow_column((void **)&table->uids, sizeof(uint32_t), old, capacity);
+		grow_column((void **)&table->flags, sizeof(uint32_t), old, capacity);
+		grow_column((void **)&table->dates, sizeof(time_t), old, capacity);
+		grow_column((void **)&table->subjects, sizeof(uint32_t), old, capacity);
+		grow_column((void **)&table->senders, sizeof(uint32_t), old, capacity);
+		table->capacity = capacity;
+	}
+	if (length < table->length) {
+		// Rows beyond length must read as zero if the table grows again
+		size_t n = table->length - length;
+		for (size_t i = length; i < table->length; ++i) {
+			pool_release(table, table->subjects[i]);
+			pool_release(table, table->senders[i]);
+		}
+		memset(&table->uids[length], 0, n * sizeof(uint32_t));
+		memset(&table->flags[length], 0, n * sizeof(uint32_t));
+		memset(&table->dates[length], 0, n * sizeof(time_t));
+		memset(&table->subjects[length], 0, n * sizeof(uint32_t));
+		memset(&table->senders[length], 0, n * sizeof(uint32_t));
+	}
+	table->length = length;
+}
+
+static void remove_row(void *column, size_t elem, size_t row, size_t length) {
+	char *base = column;
+	memmove(base + row * elem, base + (row + 1) * elem,
+			(length - row - 1) * elem);
+	memset(base + (length - 1) * elem, 0, elem);
+}
+
+void message_table_remove(struct message_table *table, size_t row) {
+	if (row >= table->length) {
+		return;
+	}
+	pool_release(table, table->subjects[row]);
+	pool_release(table, table->senders[row]);
+	remove_row(table->uids, sizeof(uint32_t), row, table->length);
+	remove_row(table->flags, sizeof(uint32_t), row, table->length);
+	remove_row(table->dates, sizeof(time_t), row, table->length);
+	remove_row(table->subjects, sizeof(uint32_t), row, table->length);
+	remove_row(table->senders, sizeof(uint32_t), row, table->length);
+	--table->length;
+}
+
+void message_table_update(struct message_table *table, size_t row, long uid,
+		uint32_t flags, const struct tm *date, struct email_headers *headers) {
+	if (row >= table->length) {
+		message_table_resize(table, row + 1);
+	}
+	table->uids[row] = uid;
+	table->flags[row] = flags | TABLE_ROW_FETCHED;
+	if (date) {
+		struct tm tm = *date;
+		table->dates[row] = timegm(&tm) - date->tm_gmtoff;
+	}
+	// Release before adding so a compaction can't see stale offsets
+	pool_release(table, table->subjects[row]);
+	pool_release(table, table->senders[row]);
+	table->subjects[row] = table->senders[row] = 0;
+	table->subjects[row] = pool_add(table, get_header(headers, "Subject"));
+	table->senders[row] = pool_add(table, get_header(headers, "From"));
+}
+
+size_t message_table_count(const struct message_table *table,
+		uint32_t mask, uint32_t value) {
+	if (!table) {
+		return 0;
+	}
+	size_t count = 0;
+	const uint32_t *flags = table->flags;
+	for (size_t i = 0; i < table->length; ++i) {
+		count += (flags[i] & mask) == value;
+	}
+	return count;
+}
+
+size_t message_table_unread(const struct message_table *table) {
+	return message_table_count(table,
+			TABLE_ROW_FETCHED | FLAG_SEEN, TABLE_ROW_FETCHED);
+}
+
+const char *message_table_subject(const struct message_table *table,
+		size_t row) {
+	return pool_get(table, table->subjects[row]);
+}
+
+const char *message_table_sender(const struct message_table *table,
+		size_t row) {
+	return pool_get(table, table->senders[row]);
+}
@@ -0,0 +1,656 @@
+/*
+ * message_view.c - display order of the message list, with local sorting and
+ * threading
+ */
+#define _DEFAULT_SOURCE
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "email/headers.h"
+#include "message_view.h"
+#include "util/list.h"
+#include "worker.h"
+
+/*
+ * Local threading follows JWZ's algorithm (https://www.jwz.org/doc/threading.html)
+ * without the subject grouping step. Placeholder nodes (index == -1) stand in
+ * for messages that are referenced but not present and are never displayed;
+ * their children are shown in their place.
+ */
+struct thread_node {
+	char *id;
+	int index;
+	bool fetched, linked;
+	time_t date;
+	struct thread_node *parent, *child, *next;
+	struct thread_node *alloc_next;
+};
+
+struct message_view *message_view_create(enum view_sort sort,
+		enum view_thread thread, bool reverse) {
+	struct message_view *view = calloc(1, sizeof(struct message_view));
+	if (!view) {
+		return NULL;
+	}
+	view->sort = sort;
+	view->thread = thread;
+	view->reverse = reverse;
+	return view;
+}
+
+static void free_threads(struct message_view *view) {
+	struct thread_node *node = view->all;
+	while (node) {
+		struct thread_node *next = node->alloc_next;
+		free(node->id);
+		free(node);
+		node = next;
+	}
+	view->all = view->roots = NULL;
+	free(view->ids.items);
+	memset(&view->ids, 0, sizeof(view->ids));
+}
+
+void message_view_free(struct message_view *view) {
+	if (!view) {
+		return;
+	}
+	free_threads(view);
+	free(view->index);
+	free(view->depth);
+	free(view->nodes);
+	free(view);
+}
+
+static void ensure_capacity(struct message_view *view, size_t length) {
+	if (length <= view->capacity) {
+		return;
+	}
+	size_t capacity = view->capacity ? view->capacity * 2 : 64;
+	while (capacity < length) {
+		capacity *= 2;
+	}
+	view->index = realloc(view->index, capacity * sizeof(int));
+	view->depth = realloc(view->depth, capacity * sizeof(int));
+	view->nodes = realloc(view->nodes, capacity * sizeof(struct thread_node *));
+	view->capacity = capacity;
+}
+
+static void insert_row(struct message_view *view, size_t row,
+		int index, int depth) {
+	ensure_capacity(view, view->length + 1);
+	memmove(&view->index[row + 1], &view->index[row],
+			(view->length - row) * sizeof(int));
+	memmove(&view->depth[row + 1], &view->depth[row],
+			(view->length - row) * sizeof(int));
+	view->index[row] = index;
+	view->depth[row] = depth;
+	++view->length;
+}
+
+static void remove_row(struct message_view *view, int index) {
+	for (size_t row = 0; row < view->length; ++row) {
+		if (view->index[row] == index) {
+			memmove(&view->index[row], &view->index[row + 1],
+					(view->length - row - 1) * sizeof(int));
+			memmove(&view->depth[row], &view->depth[row + 1],
+					(view->length - row - 1) * sizeof(int));
+			--view->length;
+			return;
+		}
+	}
+}
+
+void message_view_append(struct message_view *view, int index, int depth) {
+	insert_row(view, view->length, index, depth);
+	++view->count;
+}
+
+static time_t message_date(struct aerc_message *msg) {
+	if (!msg->internal_date) {
+		return 0;
+	}
+	struct tm tm = *msg->internal_date;
+	return timegm(&tm) - msg->internal_date->tm_gmtoff;
+}
+
+static const char *base_subject(const char *subject, size_t *len) {
+	if (!subject) {
+		*len = 0;
+		return "";
+	}
+	while (true) {
+		while (isspace((unsigned char)*subject)) ++subject;
+		if (strncasecmp(subject, "re:", 3) == 0) {
+			subject += 3;
+		} else if (strncasecmp(subject, "fwd:", 4) == 0) {
+			subject += 4;
+		} else if (strncasecmp(subject, "fw:", 3) == 0) {
+			subject += 3;
+		} else {
+			break;
+		}
+	}
+	size_t n = strlen(subject);
+	if (n >= 5 && strncasecmp(subject + n - 5, "(fwd)", 5) == 0) {
+		n -= 5;
+	}
+	while (n && isspace((unsigned char)subject[n - 1])) --n;
+	*len = n;
+	return subject;
+}
+
+static int compare_subjects(struct aerc_message *a, struct aerc_message *b) {
+	size_t alen, blen;
+	const char *as = base_subject(get_header(a->headers, "Subject"), &alen);
+	const char *bs = base_subject(get_header(b->headers, "Subject"), &blen);
+	int cmp = strncasecmp(as, bs, alen < blen ? alen : blen);
+	if (cmp == 0) {
+		cmp = (alen > blen) - (alen < blen);
+	}
+	return cmp;
+}
+
+/* Returns < 0 if a is shown above b */
+static int sort_compare(const struct message_view *view,
+		struct aerc_message *a, struct aerc_message *b) {
+	if (!a->fetched || !b->fetched) {
+		// Unfetched messages go on top so that they get fetched and moved
+		if (a->fetched != b->fetched) {
+			return a->fetched ? 1 : -1;
+		}
+		return b->index - a->index;
+	}
+	int cmp = 0;
+	switch (view->sort) {
+	case SORT_NONE:
+		break;
+	case SORT_DATE: {
+		time_t ad = message_date(a), bd = message_date(b);
+		cmp = (ad < bd) - (ad > bd);
+		break;
+	}
+	case SORT_SIZE:
+		cmp = (a->size < b->size) - (a->size > b->size);
+		break;
+	case SORT_FROM: {
+		const char *af = get_header(a->headers, "From");
+		const char *bf = get_header(b->headers, "From");
+		cmp = strcasecmp(af ? af : "", bf ? bf : "");
+		break;
+	}
+	case SORT_SUBJECT:
+		cmp = compare_subjects(a, b);
+		break;
+	}
+	if (cmp == 0) {
+		cmp = b->index - a->index;
+	}
+	return view->reverse ? -cmp : cmp;
+}
+
+static void sort_insert(struct message_view *view, list_t *messages, int index) {
+	struct aerc_message *msg = messages->items[index];
+	size_t lo = 0, hi = view->length;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		struct aerc_message *other = messages->items[view->index[mid]];
+		if (sort_compare(view, other, msg) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	insert_row(view, lo, index, 0);
+}
+
+static struct {
+	const struct message_view *view;
+	list_t *messages;
+} sort_context;
+
+static int qsort_compare(const void *_a, const void *_b) {
+	int a = *(const int *)_a, b = *(const int *)_b;
+	return sort_compare(sort_context.view,
+			sort_context.messages->items[a], sort_context.messages->items[b]);
+}
+
+static unsigned int hash_id(const char *id, size_t len) {
+	unsigned int hash = 5381;
+	for (size_t i = 0; i < len; ++i) {
+		hash = ((hash << 5) + hash) + (unsigned char)id[i];
+	}
+	return hash;
+}
+
+static struct thread_node *node_new(struct message_view *view) {
+	struct thread_node *node = calloc(1, sizeof(struct thread_node));
+	node->index = -1;
+	node->alloc_next = view->all;
+	view->all = node;
+	return node;
+}
+
+static struct thread_node **id_slot(struct thread_node **items, size_t capacity,
+		const char *id, size_t len) {
+	size_t i = hash_id(id, len) & (capacity - 1);
+	while (items[i] && (strncmp(items[i]->id, id, len) != 0
+				|| items[i]->id[len] != '\0')) {
+		i = (i + 1) & (capacity - 1);
+	}
+	return &items[i];
+}
+
+static struct thread_node *id_lookup(struct message_view *view,
+		const char *id, size_t len) {
+	if ((view->ids.length + 1) * 4 > view->ids.capacity * 3) {
+		size_t capacity = view->ids.capacity ? view->ids.capacity * 2 : 256;
+		struct thread_node **items = calloc(capacity, sizeof(*items));
+		for (size_t i = 0; i < view->ids.capacity; ++i) {
+			struct thread_node *node = view->ids.items[i];
+			if (node) {
+				*id_slot(items, capacity, node->id, strlen(node->id)) = node;
+			}
+		}
+		free(view->ids.items);
+		view->ids.items = items;
+		view->ids.capacity = capacity;
+	}
+	struct thread_node **slot = id_slot(view->ids.items, view->ids.capacity,
+			id, len);
+	if (!*slot) {
+		struct thread_node *node = node_new(view);
+		node->id = strndup(id, len);
+		*slot = node;
+		++view->ids.length;
+	}
+	return *slot;
+}
+
+/* Placeholders take the date of their first (oldest) child */
+static bool node_date(const struct thread_node *node, time_t *date) {
+	while (node && node->index == -1) {
+		node = node->child;
+	}
+	if (!node || !node->fetched) {
+		return false;
+	}
+	*date = node->date;
+	return true;
+}
+
+/* Ascending by date, with unfetched messages last */
+static int node_compare(const struct thread_node *a,
+		const struct thread_node *b) {
+	time_t ad, bd;
+	bool ak = node_date(a, &ad), bk = node_date(b, &bd);
+	if (ak != bk) {
+		return ak ? -1 : 1;
+	}
+	if (ak && ad != bd) {
+		return ad < bd ? -1 : 1;
+	}
+	return a->index - b->index;
+}
+
+static void node_unlink(struct message_view *view, struct thread_node *node) {
+	if (!node->linked) {
+		return;
+	}
+	struct thread_node **link = node->parent ? &node->parent->child : &view->roots;
+	while (*link != node) {
+		link = &(*link)->next;
+	}
+	*link = node->next;
+	node->next = node->parent = NULL;
+	node->linked = false;
+}
+
+static void node_link(struct message_view *view, struct thread_node *parent,
+		struct thread_node *node) {
+	node_unlink(view, node);
+	node->parent = parent;
+	node->linked = true;
+	// Threads are shown newest first, replies within them oldest first
+	struct thread_node **link = parent ? &parent->child : &view->roots;
+	while (*link) {
+		int cmp = node_compare(*link, node);
+		if (parent ? cmp > 0 : cmp < 0) {
+			break;
+		}
+		link = &(*link)->next;
+	}
+	node->next = *link;
+	*link = node;
+	if (parent && parent->index == -1 && parent->child == node) {
+		// The placeholder's date changed, move it accordingly
+		node_link(view, parent->parent, parent);
+	}
+}
+
+static bool is_ancestor(const struct thread_node *ancestor,
+		const struct thread_node *node) {
+	for (; node; node = node->parent) {
+		if (node == ancestor) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static const char *next_id(const char *str, size_t *len) {
+	const char *start = str ? strchr(str, '<') : NULL;
+	const char *end = start ? strchr(start, '>') : NULL;
+	if (!end) {
+		return NULL;
+	}
+	*len = end - start + 1;
+	return start;
+}
+
+static void thread_add_references(struct message_view *view,
+		struct aerc_message *msg) {
+	struct thread_node *node = NULL;
+	size_t len;
+	const char *id = msg->fetched ?
+		next_id(get_header(msg->headers, "Message-ID"), &len) : NULL;
+	if (id) {
+		node = id_lookup(view, id, len);
+		if (node->index != -1) {
+			// Duplicate Message-ID, thread this one on its own
+			node = NULL;
+		}
+	}
+	if (!node) {
+		node = node_new(view);
+	}
+	node->index = msg->index;
+	node->fetched = msg->fetched;
+	node->date = message_date(msg);
+	view->nodes[msg->index] = node;
+
+	struct thread_node *parent = NULL;
+	const char *refs = NULL;
+	if (msg->fetched) {
+		refs = get_header(msg->headers, "References");
+		if (!refs) {
+			refs = get_header(msg->headers, "In-Reply-To");
+		}
+	}
+	while ((id = next_id(refs, &len))) {
+		refs = id + len;
+		struct thread_node *ref = id_lookup(view, id, len);
+		if (ref == node) {
+			continue;
+		}
+		if (parent && !ref->parent && !is_ancestor(ref, parent)) {
+			node_link(view, parent, ref);
+		} else if (!ref->linked) {
+			node_link(view, NULL, ref);
+		}
+		parent = ref;
+	}
+	// The message's own References win over what others implied
+	if (parent && is_ancestor(node, parent)) {
+		parent = NULL;
+	}
+	node_link(view, parent, node);
+}
+
+static void thread_add_subject(struct message_view *view,
+		struct aerc_message *msg) {
+	struct thread_node *node = node_new(view);
+	node->index = msg->index;
+	node->fetched = msg->fetched;
+	node->date = message_date(msg);
+	view->nodes[msg->index] = node;
+	if (!msg->fetched) {
+		node_link(view, NULL, node);
+		return;
+	}
+	size_t len;
+	const char *subject = base_subject(
+			get_header(msg->headers, "Subject"), &len);
+	// Prefixed so that subjects never collide with Message-IDs
+	char *key = malloc(len + 2);
+	key[0] = '\n';
+	for (size_t i = 0; i < len; ++i) {
+		key[i + 1] = tolower((unsigned char)subject[i]);
+	}
+	key[len + 1] = '\0';
+	struct thread_node *thread = id_lookup(view, key, len + 1);
+	free(key);
+	if (!thread->linked) {
+		node_link(view, NULL, thread);
+	}
+	node_link(view, thread, node);
+}
+
+static void thread_add(struct message_view *view, list_t *messages, int index) {
+	ensure_capacity(view, index + 1);
+	struct aerc_message *msg = messages->items[index];
+	if (view->thread == THREAD_ORDEREDSUBJECT) {
+		thread_add_subject(view, msg);
+	} else {
+		thread_add_references(view, msg);
+	}
+	view->dirty = true;
+}
+
+static void thread_remove(struct message_view *view, int index) {
+	struct thread_node *node = view->nodes[index];
+	view->nodes[index] = NULL;
+	if (!node) {
+		return;
+	}
+	node->index = -1;
+	node->fetched = false;
+	if (!node->child) {
+		node_unlink(view, node);
+	} else {
+		// Now a placeholder, which sorts by its first child
+		node_link(view, node->parent, node);
+	}
+	view->dirty = true;
+}
+
+static void flatten(struct message_view *view, struct thread_node *node,
+		int depth) {
+	for (; node; node = node->next) {
+		if (node->index != -1) {
+			insert_row(view, view->length, node->index, depth);
+			flatten(view, node->child, depth + 1);
+		} else if (view->thread == THREAD_ORDEREDSUBJECT && node->child) {
+			// The oldest message starts the thread, the rest hang off it
+			struct thread_node *child = node->child;
+			insert_row(view, view->length, child->index, depth);
+			for (child = child->next; child; child = child->next) {
+				insert_row(view, view->length, child->index, depth + 1);
+			}
+		} else {
+			flatten(view, node->child, depth);
+		}
+	}
+}
+
+static void ensure_flat(struct message_view *view) {
+	if (!view->dirty) {
+		return;
+	}
+	view->length = 0;
+	flatten(view, view->roots, 0);
+	view->dirty = false;
+}
+
+static void add_message(struct message_view *view, list_t *messages,
+		int index) {
+	if (view->server) {
+		// Until the server sorts again, new messages go on top
+		insert_row(view, 0, index, 0);
+	} else if (view->thread != THREAD_NONE) {
+		thread_add(view, messages, index);
+	} else {
+		sort_insert(view, messages, index);
+	}
+	++view->count;
+}
+
+void message_view_build(struct message_view *view, list_t *messages) {
+	free_threads(view);
+	view->server = false;
+	view->length = view->count = 0;
+	ensure_capacity(view, messages->length);
+	if (view->thread != THREAD_NONE) {
+		for (size_t i = 0; i < messages->length; ++i) {
+			add_message(view, messages, i);
+		}
+		return;
+	}
+	for (size_t i = 0; i < messages->length; ++i) {
+		view->index[i] = i;
+		view->depth[i] = 0;
+	}
+	view->length = view->count = messages->length;
+	sort_context.view = view;
+	sort_context.messages = messages;
+	qsort(view->index, view->length, sizeof(int), qsort_compare);
+}
+
+void message_view_refresh(struct message_view *view, list_t *old,
+		list_t *messages) {
+	size_t known = view->count;
+	if (known > messages->length) {
+		known = messages->length;
+	}
+	if (!view->server && old) {
+		bool *changed = calloc(known + 1, sizeof(bool));
+		size_t n = 0;
+		for (size_t i = 0; i < known && i < old->length; ++i) {
+			if (old->items[i] != messages->items[i]) {
+				changed[i] = true;
+				++n;
+			}
+		}
+		if (view->thread != THREAD_NONE) {
+			for (size_t i = 0; n && i < known; ++i) {
+				if (changed[i]) {
+					thread_remove(view, i);
+					thread_add(view, messages, i);
+				}
+			}
+		} else if (n) {
+			// Take them all out first so the rest stays sorted for insertion
+			size_t rows = 0;
+			for (size_t row = 0; row < view->length; ++row) {
+				int index = view->index[row];
+				if ((size_t)index >= known || !changed[index]) {
+					view->index[rows] = index;
+					view->depth[rows++] = 0;
+				}
+			}
+			view->length = rows;
+			for (size_t i = 0; i < known; ++i) {
+				if (changed[i]) {
+					sort_insert(view, messages, i);
+				}
+			}
+		}
+		free(changed);
+	}
+	for (size_t i = view->count; i < messages->length; ++i) {
+		add_message(view, messages, i);
+	}
+}
+
+void message_view_update(struct message_view *view, list_t *messages,
+		int index) {
+	if (view->server || (size_t)index >= view->count) {
+		return;
+	}
+	if (view->thread != THREAD_NONE) {
+		thread_remove(view, index);
+		thread_add(view, messages, index);
+	} else {
+		remove_row(view, index);
+		sort_insert(view, messages, index);
+	}
+}
+
+void message_view_remove(struct message_view *view, int index) {
+	if ((size_t)index >= view->count) {
+		return;
+	}
+	if (!view->server && view->thread != THREAD_NONE) {
+		thread_remove(view, index);
+		memmove(&view->nodes[index], &view->nodes[index + 1],
+				(view->count - index - 1) * sizeof(struct thread_node *));
+		for (size_t i = index; i < view->count - 1; ++i) {
+			if (view->nodes[i]) {
+				view->nodes[i]->index = i;
+			}
+		}
+	} else {
+		remove_row(view, index);
+		for (size_t row = 0; row < view->length; ++row) {
+			if (view->index[row] > index) {
+				--view->index[row];
+			}
+		}
+	}
+	--view->count;
+}
+
+static int compare_indices(const void *_a, const void *_b) {
+	const int *a = _a, *b = _b;
+	return (*a > *b) - (*a < *b);
+}
+
+struct message_view *message_view_filter(struct message_view *view,
+		size_t length, const int *indices, size_t count) {
+	struct message_view *filtered =
+		message_view_create(SORT_NONE, THREAD_NONE, false);
+	// Rebuilt from scratch whenever the results change
+	filtered->server = true;
+	ensure_capacity(filtered, count);
+	int index;
+	for (size_t row = 0; (index = message_view_index(view, length, row)) >= 0;
+			++row) {
+		if (bsearch(&index, indices, count, sizeof(int), compare_indices)) {
+			message_view_append(filtered, index, 0);
+		}
+	}
+	return filtered;
+}
+
+int message_view_index(struct message_view *view, size_t length, size_t row) {
+	if (!view) {
+		return row < length ? (int)(length - row - 1) : -1;
+	}
+	ensure_flat(view);
+	return row < view->length ? view->index[row] : -1;
+}
+
+int message_view_depth(struct message_view *view, size_t row) {
+	if (!view) {
+		return 0;
+	}
+	ensure_flat(view);
+	return row < view->length ? view->depth[row] : 0;
+}
+
+size_t message_view_row(struct message_view *view, size_t length, int index) {
+	if (!view) {
+		return length - index - 1;
+	}
+	ensure_flat(view);
+	for (size_t row = 0; row < view->length; ++row) {
+		if (view->index[row] == index) {
+			return row;
+		}
+	}
+	return view->length;
+}
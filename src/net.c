@@ -0,0 +1,297 @@
+/*
+ * net.c - Resolves servers and connects to whichever of their addresses
+ * answers first
+ */
+#define _POSIX_C_SOURCE 201112L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "net.h"
+#include "util/time.h"
+
+#define ATTEMPT_DELAY 250 // Milliseconds before the next address is tried too
+#define CONNECT_TIMEOUT (30 * 1000)
+#define CACHE_SIZE 8
+#define CACHE_TTL (5 * 60) // Seconds; getaddrinfo doesn't tell us the real one
+
+struct cache_entry {
+	char *host, *port;
+	struct net_address *addrs;
+	size_t count;
+	time_t expires;
+};
+
+/* Each account's worker has its own thread, and they often share servers */
+static struct cache_entry cache[CACHE_SIZE];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long elapsed_ms(const struct timespec *since) {
+	struct timespec now;
+	get_nanoseconds(&now);
+	return (now.tv_sec - since->tv_sec) * 1000
+		+ (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static void clear_entry(struct cache_entry *entry) {
+	free(entry->host);
+	free(entry->port);
+	free(entry->addrs);
+	memset(entry, 0, sizeof(struct cache_entry));
+}
+
+static struct cache_entry *find_entry(const char *host, const char *port) {
+	for (size_t i = 0; i < CACHE_SIZE; ++i) {
+		struct cache_entry *entry = &cache[i];
+		if (entry->host && strcmp(entry->host, host) == 0
+				&& strcmp(entry->port, port) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static struct net_address *copy_addrs(const struct net_address *addrs,
+		size_t count) {
+	struct net_address *copy = malloc(count * sizeof(struct net_address));
+	memcpy(copy, addrs, count * sizeof(struct net_address));
+	return copy;
+}
+
+/*
+ * Alternates between the families, starting with whichever getaddrinfo put
+ * first, so that a family that's broken on this network only costs us one
+ * attempt delay at a time.
+ */
+static struct net_address *interleave(struct addrinfo *result, size_t *count) {
+	size_t total = 0;
+	for (struct addrinfo *rp = result; rp; rp = rp->ai_next) {
+		++total;
+	}
+	struct net_address *addrs = calloc(total, sizeof(struct net_address));
+	struct addrinfo *next[2] = { result, NULL };
+	for (struct addrinfo *rp = result; rp; rp = rp->ai_next) {
+		if (rp->ai_family != result->ai_family) {
+			next[1] = rp;
+			break;
+		}
+	}
+	size_t n = 0;
+	int turn = 0;
+	while (next[0] || next[1]) {
+		struct addrinfo *rp = next[turn];
+		if (rp) {
+			memcpy(&addrs[n].addr, rp->ai_addr, rp->ai_addrlen);
+			addrs[n++].length = rp->ai_addrlen;
+			bool first = rp->ai_family == result->ai_family;
+			do {
+				rp = rp->ai_next;
+			} while (rp && (rp->ai_family == result->ai_family) != first);
+			next[turn] = rp;
+		}
+		turn = !turn;
+	}
+	*count = n;
+	return addrs;
+}
+
+struct net_address *net_resolve(const char *host, const char *port,
+		size_t *count, const char **error) {
+	pthread_mutex_lock(&cache_lock);
+	struct cache_entry *entry = find_entry(host, port);
+	if (entry && entry->expires > time(NULL)) {
+		struct net_address *addrs = copy_addrs(entry->addrs, entry->count);
+		*count = entry->count;
+		pthread_mutex_unlock(&cache_lock);
+		return addrs;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	struct addrinfo *result;
+	int s;
+	if ((s = getaddrinfo(host, port, &hints, &result))) {
+		*error = gai_strerror(s);
+		return NULL;
+	}
+	struct net_address *addrs = interleave(result, count);
+	freeaddrinfo(result);
+
+	pthread_mutex_lock(&cache_lock);
+	entry = find_entry(host, port);
+	if (!entry) {
+		// Replace whichever is closest to going stale anyway
+		entry = &cache[0];
+		for (size_t i = 1; i < CACHE_SIZE && entry->host; ++i) {
+			if (!cache[i].host || cache[i].expires < entry->expires) {
+				entry = &cache[i];
+			}
+		}
+	}
+	clear_entry(entry);
+	entry->host = strdup(host);
+	entry->port = strdup(port);
+	entry->addrs = copy_addrs(addrs, *count);
+	entry->count = *count;
+	entry->expires = time(NULL) + CACHE_TTL;
+	pthread_mutex_unlock(&cache_lock);
+	return addrs;
+}
+
+void net_forget(const char *host, const char *port) {
+	pthread_mutex_lock(&cache_lock);
+	struct cache_entry *entry = find_entry(host, port);
+	if (entry) {
+		clear_entry(entry);
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+bool net_set_blocking(int fd, bool blocking) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0) {
+		return false;
+	}
+	flags = blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK;
+	return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+/*
+ * Starts connecting to addr. Returns the socket, or -1 with errno set if it
+ * failed straight away. connected is set if it didn't have to wait.
+ */
+static int start_attempt(const struct net_address *addr, bool *connected) {
+	int fd = socket(addr->addr.ss_family, SOCK_STREAM, 0);
+	if (fd < 0) {
+		// This might fail because i.e. you don't support ipv6
+		return -1;
+	}
+	if (!net_set_blocking(fd, false)) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	*connected = connect(fd, (const struct sockaddr *)&addr->addr,
+			addr->length) == 0;
+	if (!*connected && errno != EINPROGRESS) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+int net_connect_any(const struct net_address *addrs, size_t count,
+		int timeout) {
+	struct pollfd *fds = calloc(count ? count : 1, sizeof(struct pollfd));
+	size_t started = 0, failed = 0;
+	int fd = -1, err = ETIMEDOUT;
+	long next = 0;
+	struct timespec since;
+	get_nanoseconds(&since);
+	while (fd < 0 && failed < count) {
+		long elapsed = elapsed_ms(&since);
+		if (started < count && elapsed >= next) {
+			bool connected = false;
+			int s = start_attempt(&addrs[started], &connected);
+			fds[started].fd = s;
+			fds[started].events = POLLOUT;
+			++started;
+			if (s < 0) {
+				err = errno;
+				++failed;
+				continue;
+			}
+			if (connected) {
+				fd = s;
+				fds[started - 1].fd = -1;
+				break;
+			}
+			next = elapsed + ATTEMPT_DELAY;
+		}
+		if (elapsed >= timeout) {
+			err = ETIMEDOUT;
+			break;
+		}
+		long wait = timeout - elapsed;
+		if (started < count && next - elapsed < wait) {
+			wait = next - elapsed;
+		}
+		if (poll(fds, started, wait) < 0 && errno != EINTR) {
+			err = errno;
+			break;
+		}
+		for (size_t i = 0; i < started && fd < 0; ++i) {
+			if (fds[i].fd < 0 || !fds[i].revents) {
+				continue;
+			}
+			int soerr = 0;
+			socklen_t len = sizeof(soerr);
+			if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR,
+						&soerr, &len) < 0) {
+				soerr = errno;
+			}
+			if (soerr == 0) {
+				fd = fds[i].fd;
+			} else {
+				// Don't wait out the delay to try the next one
+				err = soerr;
+				close(fds[i].fd);
+				++failed;
+				next = 0;
+			}
+			fds[i].fd = -1;
+		}
+	}
+	for (size_t i = 0; i < started; ++i) {
+		if (fds[i].fd >= 0) {
+			close(fds[i].fd);
+		}
+	}
+	free(fds);
+	if (fd >= 0 && !net_set_blocking(fd, true)) {
+		err = errno;
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0) {
+		errno = err;
+	}
+	return fd;
+}
+
+int net_connect(const char *host, const char *port, const char **error) {
+	size_t count;
+	struct net_address *addrs = net_resolve(host, port, &count, error);
+	if (!addrs) {
+		return -1;
+	}
+	struct timespec since;
+	get_nanoseconds(&since);
+	int fd = net_connect_any(addrs, count, CONNECT_TIMEOUT);
+	free(addrs);
+	if (fd < 0) {
+		*error = strerror(errno);
+		// The server may have moved since we looked it up
+		net_forget(host, port);
+		return -1;
+	}
+	worker_log(L_DEBUG, "Connected to %s in %ld ms", host, elapsed_ms(&since));
+	return fd;
+}
@@ -0,0 +1,389 @@
+/*
+ * op_journal.c - on-disk journal of the changes the server hasn't confirmed
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "op_journal.h"
+#include "util/list.h"
+#include "util/uid_set.h"
+
+/*
+ * The file is a header followed by records: one per op as it's made, with the
+ * mailbox names and the UID set in IMAP form after it, and one per op that's
+ * done. Unlike the body store this isn't a cache, but it never leaves this
+ * machine either, so it's in host byte order too.
+ */
+static const char journal_magic[4] = { 'A', 'O', 'J', '1' };
+
+#define JOURNAL_VERSION 1
+#define MAX_NAME 4096
+#define COMPACT_SLACK 256 // Done records we put up with regardless
+
+#define RECORD_DONE 0x80
+
+struct journal_header {
+	char magic[4];
+	uint32_t version;
+};
+
+struct record {
+	uint8_t type; // enum op_type, or RECORD_DONE
+	uint8_t add;
+	uint16_t mailbox_length;
+	uint16_t destination_length;
+	uint16_t reserved;
+	uint32_t uidvalidity;
+	uint32_t flags;
+	uint32_t uids_length;
+	uint32_t reserved2;
+	uint64_t id;
+};
+
+_Static_assert(sizeof(struct record) == 32, "op journal record layout");
+
+struct op_journal {
+	char *path;
+	int fd;
+	uint64_t next_id;
+	size_t records;
+	list_t *pending; // struct op, oldest first
+};
+
+void op_free(struct op *op) {
+	if (!op) {
+		return;
+	}
+	free(op->mailbox);
+	uid_set_free(op->uids);
+	free(op->destination);
+	free(op);
+}
+
+struct op *op_dup(const struct op *op) {
+	struct op *copy = malloc(sizeof(struct op));
+	*copy = *op;
+	copy->mailbox = op->mailbox ? strdup(op->mailbox) : NULL;
+	copy->destination = op->destination ? strdup(op->destination) : NULL;
+	copy->uids = NULL;
+	if (op->uids) {
+		copy->uids = uid_set_create();
+		for (size_t i = 0; i < op->uids->length; ++i) {
+			uid_set_add_range(copy->uids,
+					op->uids->ranges[i].min, op->uids->ranges[i].max);
+		}
+	}
+	return copy;
+}
+
+static bool write_all(int fd, const void *buf, size_t size) {
+	const uint8_t *p = buf;
+	while (size) {
+		ssize_t n = write(fd, p, size);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool write_op(int fd, const struct op *op) {
+	char *uids = op->uids ? uid_set_format(op->uids, 0, op->uids->length) : NULL;
+	struct record rec = {
+		.type = op->type,
+		.add = op->add,
+		.mailbox_length = op->mailbox ? strlen(op->mailbox) : 0,
+		.destination_length = op->destination ? strlen(op->destination) : 0,
+		.uidvalidity = op->uidvalidity,
+		.flags = op->flags,
+		.uids_length = uids ? strlen(uids) : 0,
+		.id = op->id,
+	};
+	size_t size = sizeof(rec) + rec.mailbox_length + rec.destination_length
+		+ rec.uids_length;
+	uint8_t *buf = malloc(size), *p = buf;
+	memcpy(p, &rec, sizeof(rec));
+	p += sizeof(rec);
+	if (rec.mailbox_length) {
+		memcpy(p, op->mailbox, rec.mailbox_length);
+		p += rec.mailbox_length;
+	}
+	if (rec.destination_length) {
+		memcpy(p, op->destination, rec.destination_length);
+		p += rec.destination_length;
+	}
+	if (rec.uids_length) {
+		memcpy(p, uids, rec.uids_length);
+	}
+	bool ok = write_all(fd, buf, size);
+	free(buf);
+	free(uids);
+	return ok;
+}
+
+static void remove_pending(struct op_journal *journal, uint64_t id) {
+	for (size_t i = 0; i < journal->pending->length; ++i) {
+		struct op *op = journal->pending->items[i];
+		if (op->id == id) {
+			list_del(journal->pending, i);
+			op_free(op);
+			return;
+		}
+	}
+}
+
+static char *read_string(const uint8_t *p, size_t length) {
+	char *str = malloc(length + 1);
+	memcpy(str, p, length);
+	str[length] = '\0';
+	return str;
+}
+
+/* Returns the size of the record at p, or 0 if it's invalid or cut short */
+static size_t read_record(struct op_journal *journal, const uint8_t *p,
+		size_t left) {
+	struct record rec;
+	if (left < sizeof(rec)) {
+		return 0;
+	}
+	memcpy(&rec, p, sizeof(rec));
+	size_t size = sizeof(rec) + rec.mailbox_length + rec.destination_length
+		+ rec.uids_length;
+	if (!rec.id || rec.mailbox_length > MAX_NAME
+			|| rec.destination_length > MAX_NAME || left < size) {
+		return 0;
+	}
+	if (rec.id >= journal->next_id) {
+		journal->next_id = rec.id + 1;
+	}
+	if (rec.type == RECORD_DONE) {
+		remove_pending(journal, rec.id);
+		return size;
+	}
+	if (rec.type < OP_STORE_FLAGS || rec.type > OP_DELETE_MAILBOX) {
+		return 0;
+	}
+	p += sizeof(rec);
+	struct op *op = calloc(1, sizeof(struct op));
+	op->id = rec.id;
+	op->type = rec.type;
+	op->add = rec.add;
+	op->uidvalidity = rec.uidvalidity;
+	op->flags = rec.flags;
+	op->mailbox = read_string(p, rec.mailbox_length);
+	p += rec.mailbox_length;
+	if (rec.destination_length) {
+		op->destination = read_string(p, rec.destination_length);
+	}
+	p += rec.destination_length;
+	if (rec.uids_length) {
+		char *uids = read_string(p, rec.uids_length);
+		op->uids = uid_set_create();
+		bool ok = uid_set_parse(op->uids, uids);
+		free(uids);
+		if (!ok) {
+			op_free(op);
+			return 0;
+		}
+	}
+	list_add(journal->pending, op);
+	return size;
+}
+
+/*
+ * Replays the journal and opens it for appending. A record cut short by a
+ * crash is truncated away, and a journal we don't understand is started over.
+ */
+static void load_journal(struct op_journal *journal) {
+	int fd = open(journal->path, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		worker_log(L_ERROR, "Unable to open the op journal: %s",
+				strerror(errno));
+		return;
+	}
+	struct stat st;
+	uint8_t *buf = NULL;
+	size_t size = 0;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		size = st.st_size;
+		buf = malloc(size);
+		if (pread(fd, buf, size, 0) != (ssize_t)size) {
+			size = 0;
+		}
+	}
+	size_t end = 0;
+	struct journal_header header;
+	if (size >= sizeof(header)) {
+		memcpy(&header, buf, sizeof(header));
+		if (memcmp(header.magic, journal_magic, sizeof(journal_magic)) == 0
+				&& header.version == JOURNAL_VERSION) {
+			end = sizeof(header);
+		}
+	}
+	while (end && end < size) {
+		size_t used = read_record(journal, buf + end, size - end);
+		if (!used) {
+			worker_log(L_ERROR, "Dropping the end of the op journal, "
+					"%zu bytes we can't read", size - end);
+			break;
+		}
+		++journal->records;
+		end += used;
+	}
+	free(buf);
+	if (!end) {
+		memcpy(header.magic, journal_magic, sizeof(journal_magic));
+		header.version = JOURNAL_VERSION;
+		if (ftruncate(fd, 0) != 0
+				|| !write_all(fd, &header, sizeof(header))) {
+			close(fd);
+			return;
+		}
+		end = sizeof(header);
+	} else if (end != size && ftruncate(fd, end) != 0) {
+		close(fd);
+		return;
+	}
+	if (lseek(fd, end, SEEK_SET) < 0) {
+		close(fd);
+		return;
+	}
+	journal->fd = fd;
+}
+
+struct op_journal *op_journal_open(const char *path) {
+	struct op_journal *journal = calloc(1, sizeof(struct op_journal));
+	journal->fd = -1;
+	journal->next_id = 1;
+	journal->pending = create_list();
+	if (path) {
+		journal->path = strdup(path);
+		load_journal(journal);
+	}
+	if (journal->pending->length) {
+		worker_log(L_DEBUG, "%zu changes from last time are yet to be sent",
+				journal->pending->length);
+	}
+	return journal;
+}
+
+void op_journal_close(struct op_journal *journal) {
+	if (!journal) {
+		return;
+	}
+	if (journal->fd >= 0) {
+		close(journal->fd);
+	}
+	for (size_t i = 0; i < journal->pending->length; ++i) {
+		op_free(journal->pending->items[i]);
+	}
+	list_free(journal->pending);
+	free(journal->path);
+	free(journal);
+}
+
+uint64_t op_journal_append(struct op_journal *journal, const struct op *op) {
+	struct op *copy = op_dup(op);
+	copy->id = journal->next_id++;
+	list_add(journal->pending, copy);
+	if (journal->fd < 0) {
+		return journal->path ? 0 : copy->id;
+	}
+	++journal->records;
+	// It has to be on disk before the server hears of it
+	if (!write_op(journal->fd, copy) || fsync(journal->fd) != 0) {
+		worker_log(L_ERROR, "Unable to write to the op journal: %s",
+				strerror(errno));
+		return 0;
+	}
+	return copy->id;
+}
+
+void op_journal_done(struct op_journal *journal, uint64_t id) {
+	if (!id) {
+		return;
+	}
+	remove_pending(journal, id);
+	if (journal->fd < 0) {
+		return;
+	}
+	++journal->records;
+	struct record rec = { .type = RECORD_DONE, .id = id };
+	// Losing this only means it's sent again, so it isn't worth an fsync
+	if (!write_all(journal->fd, &rec, sizeof(rec))) {
+		worker_log(L_ERROR, "Unable to write to the op journal: %s",
+				strerror(errno));
+	}
+}
+
+const list_t *op_journal_pending(struct op_journal *journal) {
+	return journal->pending;
+}
+
+const struct op *op_journal_get(struct op_journal *journal, uint64_t id) {
+	for (size_t i = 0; i < journal->pending->length; ++i) {
+		struct op *op = journal->pending->items[i];
+		if (op->id == id) {
+			return op;
+		}
+	}
+	return NULL;
+}
+
+static bool compact(struct op_journal *journal) {
+	char *tmp = malloc(strlen(journal->path) + sizeof(".tmp"));
+	sprintf(tmp, "%s.tmp", journal->path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		free(tmp);
+		return false;
+	}
+	struct journal_header header;
+	memcpy(header.magic, journal_magic, sizeof(journal_magic));
+	header.version = JOURNAL_VERSION;
+	bool ok = write_all(fd, &header, sizeof(header));
+	for (size_t i = 0; ok && i < journal->pending->length; ++i) {
+		ok = write_op(fd, journal->pending->items[i]);
+	}
+	ok = ok && fsync(fd) == 0;
+	if (!ok || rename(tmp, journal->path) != 0) {
+		worker_log(L_ERROR, "Unable to compact the op journal");
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		// Make sure we try again later rather than straight away
+		journal->records = journal->pending->length * 2 + COMPACT_SLACK;
+		return false;
+	}
+	close(journal->fd);
+	journal->fd = fd;
+	journal->records = journal->pending->length;
+	free(tmp);
+	return true;
+}
+
+bool op_journal_maintain(struct op_journal *journal) {
+	if (journal->fd < 0
+			|| journal->records <= journal->pending->length * 2 + COMPACT_SLACK) {
+		return false;
+	}
+	worker_log(L_DEBUG, "Compacting the op journal, %zu records for %zu ops",
+			journal->records, journal->pending->length);
+	compact(journal);
+	return true;
+}
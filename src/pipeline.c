@@ -24,14 +24,15 @@ static int header_cmp(const void *_a, const void *_b) {
 	return strcmp(a, b);
 }
 
-static void add_header(void *_header) {
-	struct email_header *header = _header;
-	if (list_seq_find(config->ui.show_headers, header_cmp, header->key) == -1) {
+static void add_header(struct email_headers *headers, size_t index) {
+	const char *key = header_key(headers, index);
+	if (list_seq_find(config->ui.show_headers, header_cmp, key) == -1) {
 		return;
 	}
-	int len = snprintf(NULL, 0, "%s: %s\n", header->key, header->value);
+	const char *value = header_value(headers, index);
+	int len = snprintf(NULL, 0, "%s: %s\n", key, value);
 	char *h = malloc(len + 1);
-	snprintf(h, len + 1, "%s: %s\n", header->key, header->value);
+	snprintf(h, len + 1, "%s: %s\n", key, value);
 	subprocess_queue_stdin(header_subp, (uint8_t *)h, len);
 }
 
@@ -39,6 +40,8 @@ struct pipeline_state {
 	struct account_state *account;
 	struct aerc_message *msg;
 	struct aerc_message_part *part;
+	char *text; // What we fed the preprocessor
+	size_t length;
 };
 
 static void subp_complete(struct subprocess *subp) {
@@ -49,7 +52,9 @@ static void subp_complete(struct subprocess *subp) {
 	char *argv[] = { "sh", "-c", config->viewer.pager, NULL };
 	subp = subprocess_init(argv, true);
 	header_subp = subp;
-	list_foreach(state->msg->headers, add_header);
+	for (size_t i = 0; state->msg->headers && i < state->msg->headers->length; ++i) {
+		add_header(state->msg->headers, i);
+	}
 	if (capture) {
 		unsigned char *data = malloc(capture->len);
 		memcpy(data, capture->data, capture->len);
@@ -59,6 +64,8 @@ static void subp_complete(struct subprocess *subp) {
 	subprocess_start(subp);
 	request_rerender(PANEL_MESSAGE_VIEW);
 
+	aerc_message_unref(state->msg);
+	free(state->text);
 	free(state);
 }
 
@@ -78,33 +85,35 @@ static void spawn_subprocess(struct account_state *account,
 
 	struct pipeline_state *state = calloc(1, sizeof(struct pipeline_state));
 	state->account = account;
-	state->msg = msg;
+	// The UI may drop the message in the meantime, e.g. to free its body
+	state->msg = aerc_message_ref(msg);
 	state->part = part;
 
-	// Strip non-printable characters from message
-	// TODO: this actually mutates the "official" copy of the message in memory
-	// maybe we want to copy it somewhere else first or translate it on the fly
-	// or something
-	char *data = (char *)part->content;
-	int i = 0;
-	while (i < part->size) {
-		uint32_t ch = utf8_decode((const char **)&data);
-		int usize = utf8_chsize(ch);
-		i += usize;
+	// Strip non-printable characters from message, into a copy since the body
+	// is shared with the worker
+	const char *data = (const char *)part->content->data;
+	const char *end = data + part->content->size;
+	state->text = malloc(part->content->size + 1);
+	while (data < end) {
+		const char *ch_start = data;
+		uint32_t ch = utf8_decode(&data);
+		if (data > end) {
+			data = end;
+		}
 		if ((ch <= 0x1F && ch != '\n' && ch != '\r') || ch == 0x7F || ch == 0x200B) {
 			// Delete these characters
-			memmove(&data[-usize], data, part->size - i);
-			part->size -= usize - 1;
-			data -= usize - 1;
+			continue;
 		}
+		memcpy(state->text + state->length, ch_start, data - ch_start);
+		state->length += data - ch_start;
 	}
 
 	char *argv[] = { "sh", "-c", "cat", NULL };
 	for (size_t i = 0; i < config->viewer.mime_handlers->length; ++i) {
 		struct mime_handler *handler = config->viewer.mime_handlers->items[i];
-		if (strcmp(part->type, handler->mime.type) == 0) {
+		if (strcasecmp(part->type, handler->mime.type) == 0) {
 			if (strcmp(handler->mime.subtype, "*") == 0 ||
-					strcmp(handler->mime.subtype, part->subtype) == 0) {
+					strcasecmp(handler->mime.subtype, part->subtype) == 0) {
 				argv[2] = handler->command;
 				break;
 			}
@@ -114,12 +123,12 @@ static void spawn_subprocess(struct account_state *account,
 	struct subprocess *subp = subprocess_init(argv, false);
 	subp->user = state;
 	subp->complete = subp_complete;
-	if (part->size == 0) {
+	if (state->length == 0) {
 		// Don't actually run preprocessor on empty input
 		subp_complete(subp);
 		return;
 	}
-	subprocess_queue_stdin(subp, part->content, part->size);
+	subprocess_queue_stdin(subp, (uint8_t *)state->text, state->length);
 	subprocess_capture_stdout(subp);
 	subprocess_capture_stderr(subp);
 
@@ -134,9 +143,9 @@ void spawn_email_handler(struct account_state *account,
 		struct mimetype *mime = config->viewer.alternatives->items[i];
 		for (size_t j = 0; j < msg->parts->length; ++j) {
 			struct aerc_message_part *_part = msg->parts->items[j];
-			if (strcmp(_part->type, mime->type) == 0) {
+			if (strcasecmp(_part->type, mime->type) == 0) {
 				if (strcmp(mime->subtype, "*") == 0 ||
-						strcmp(mime->subtype, _part->type) == 0) {
+						strcasecmp(mime->subtype, _part->subtype) == 0) {
 					part = _part;
 					break;
 				}
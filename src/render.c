@@ -1,3 +1,5 @@
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
@@ -116,11 +118,24 @@ void render_sidebar(struct geometry geo) {
 				tb_put_cell(geo.x + l, geo.y, &cell);
 				l++;
 			}
-			if (get_mailbox_flag(mailbox, "\\HasChildren")) {
+			bool children = get_mailbox_flag(mailbox, "\\HasChildren");
+			if (children) {
 				cell.ch = '.';
 				tb_put_cell(geo.x + geo.width - 2, geo.y, &cell);
 				tb_put_cell(geo.x + geo.width - 3, geo.y, &cell);
 			}
+			size_t unread = message_table_unread(mailbox->table);
+			if (strcmp(mailbox->name, account->selected) != 0
+					&& mailbox->status.unseen >= 0) {
+				// The table is out of date, if we have one at all
+				unread = mailbox->status.unseen;
+			}
+			if (unread) {
+				char count[16];
+				int n = snprintf(count, sizeof(count), "%zu", unread);
+				tb_printf(geo.x + geo.width - (children ? 4 : 1) - n,
+						geo.y, &cell, "%s", count);
+			}
 		}
 		geo.x = _x;
 	} else {
@@ -193,7 +208,8 @@ void render_status(struct geometry geo) {
 	}
 }
 
-void render_item(struct geometry geo, struct aerc_message *message, bool selected) {
+void render_item(struct geometry geo, struct aerc_message *message,
+		bool selected, int depth) {
 	if (geo.y > geo.height) {
 		return;
 	}
@@ -205,7 +221,7 @@ void render_item(struct geometry geo, struct aerc_message *message, bool selecte
 			request_fetch(message);
 		}
 	} else {
-		bool seen = get_message_flag(message, "\\Seen");
+		bool seen = message->flags & FLAG_SEEN;
 		if (selected) {
 			get_color("message-list-selected", &cell);
 			if (!seen) {
@@ -216,12 +232,19 @@ void render_item(struct geometry geo, struct aerc_message *message, bool selecte
 			if (!seen) {
 				get_color("message-list-unselected-unread", &cell);
 			}
+			struct account_state *account =
+				state->accounts->items[state->selected_account];
+			if (account->ui.marks.uids
+					&& uid_set_contains(account->ui.marks.uids, message->uid)) {
+				get_color("message-list-marked", &cell);
+			}
 		}
 		char date[64];
 		strftime(date, sizeof(date), config->ui.timestamp_format,
 				message->internal_date);
 		const char *subject = get_message_header(message, "Subject");
-		int l = tb_printf(geo.x, geo.y, &cell, "%s %s", date, subject);
+		int l = tb_printf(geo.x, geo.y, &cell, "%s %*s%s", date,
+				depth * 2, "", subject);
 		geo.x += l;
 		geo.width -= 1;
 		geo.height = 1;
@@ -251,18 +274,20 @@ void render_items(struct geometry geo) {
 	}
 
 	int limit = geo.height + geo.y;
-	int selected = mailbox->messages->length - account->ui.selected_message - 1;
-	for (int i = mailbox->messages->length - account->ui.list_offset - 1;
-			i >= 0 && geo.y < limit;
-			--i, ++geo.y) {
-		if ((size_t)i >= mailbox->messages->length) {
+	size_t rows = displayed_rows(account, mailbox);
+	for (size_t row = account->ui.list_offset;
+			row < rows && geo.y < limit;
+			++row, ++geo.y) {
+		struct aerc_message *message = get_message_at_row(account, mailbox, row);
+		if (!message) {
 			continue;
 		}
-		struct aerc_message *message = mailbox->messages->items[i];
 		const char *subject = get_message_header(message, "Subject");
 		worker_log(L_DEBUG, "Rendering message %d of %zd at %d (offs %zd) [%s]",
-				i, mailbox->messages->length, geo.y, account->ui.list_offset, subject);
-		render_item(geo, message, selected == i);
+				message->index, mailbox->messages->length, geo.y,
+				account->ui.list_offset, subject);
+		render_item(geo, message, row == account->ui.selected_message,
+				message_view_depth(displayed_view(account), row));
 	}
 }
 
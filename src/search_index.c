@@ -0,0 +1,1037 @@
+/*
+ * search_index.c - local full-text index of message headers and bodies
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "search_index.h"
+#include "util/intern.h"
+#include "util/list.h"
+
+#define MIN_TOKEN 2
+#define MAX_TOKEN 64
+#define FLUSH_DOCS 8192
+#define FLUSH_BYTES (8 << 20)
+#define FLUSH_IDLE 5 // Seconds without new documents
+#define MAX_SEGMENTS 16
+#define SEGMENT_VERSION 2
+
+/*
+ * A segment file is the header, followed by the term dictionary sorted by
+ * term, the document table, the string pool (terms and mailbox names) and the
+ * postings. It's a cache, so it's in host byte order. Each posting list starts
+ * with the distance from the segment's first document.
+ */
+static const char segment_magic[4] = { 'A', 'I', 'X', '1' };
+
+struct segment_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t base, ndocs;
+	uint32_t nterms;
+	uint32_t reserved;
+	uint64_t terms, docs, strings, postings, size;
+};
+
+_Static_assert(sizeof(struct segment_header) == 64, "segment header layout");
+
+struct segment_term {
+	uint32_t term; // Offset into the string pool
+	uint32_t count;
+	uint32_t last; // Last document, so segments merge without decoding
+	uint32_t length;
+	uint64_t postings; // Offset into the postings
+};
+
+struct segment_doc {
+	uint32_t uidvalidity, uid, part;
+	uint32_t mailbox; // Offset into the string pool
+};
+
+struct segment {
+	char *file;
+	uint8_t *map;
+	size_t size;
+	uint32_t base, ndocs;
+	const struct segment_term *terms;
+	size_t nterms;
+	const struct segment_doc *docs;
+	const char *strings;
+	size_t strings_size;
+	const uint8_t *postings;
+	size_t postings_size;
+	// Last mailbox looked up, to avoid interning it for every hit
+	uint32_t last_mailbox;
+	const char *last_interned;
+};
+
+struct buffer {
+	uint8_t *data;
+	size_t length, capacity;
+};
+
+struct pending_doc {
+	const char *mailbox; // Interned
+	uint32_t uidvalidity, uid, part;
+};
+
+struct posting {
+	char *term;
+	uint32_t count, last;
+	struct buffer data;
+};
+
+struct search_index {
+	char *path;
+	uint32_t next_doc;
+	list_t *segments; // struct segment *, by first document
+	struct {
+		uint32_t base;
+		time_t updated;
+		size_t bytes;
+		struct pending_doc *docs;
+		size_t ndocs, docs_capacity;
+		struct posting *terms; // Open addressing by term
+		size_t nterms, capacity;
+	} pending;
+	struct {
+		uint64_t *items; // Open addressing, 0 is empty
+		size_t length, capacity;
+	} seen;
+};
+
+static void buffer_append(struct buffer *buf, const void *data, size_t len) {
+	if (buf->length + len > buf->capacity) {
+		size_t capacity = buf->capacity ? buf->capacity * 2 : 16;
+		while (capacity < buf->length + len) {
+			capacity *= 2;
+		}
+		buf->data = realloc(buf->data, capacity);
+		buf->capacity = capacity;
+	}
+	memcpy(buf->data + buf->length, data, len);
+	buf->length += len;
+}
+
+static void put_varint(struct buffer *buf, uint32_t value) {
+	uint8_t bytes[5];
+	size_t n = 0;
+	while (value >= 0x80) {
+		bytes[n++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	bytes[n++] = value;
+	buffer_append(buf, bytes, n);
+}
+
+/* Returns NULL if the varint is truncated */
+static const uint8_t *get_varint(const uint8_t *p, const uint8_t *end,
+		uint32_t *value) {
+	uint32_t v = 0;
+	for (int shift = 0; p < end && shift < 35; shift += 7) {
+		uint8_t b = *p++;
+		v |= (uint32_t)(b & 0x7F) << shift;
+		if (!(b & 0x80)) {
+			*value = v;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+static uint64_t hash_bytes(const char *str, size_t len) {
+	/* FNV-1a */
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= (unsigned char)str[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static char lower(unsigned char c) {
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static bool is_token_char(unsigned char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')
+		|| (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+static void tokenize(const char *text, size_t length, bool html,
+		void (*emit)(const char *token, size_t len, void *data), void *data) {
+	char token[MAX_TOKEN];
+	size_t len = 0;
+	bool tag = false;
+	for (size_t i = 0; i <= length; ++i) {
+		unsigned char c = i < length ? text[i] : ' ';
+		if (html && c == '<') {
+			tag = true;
+		}
+		if (!tag && is_token_char(c)) {
+			// Longer tokens are truncated, the same happens to queries
+			if (len < MAX_TOKEN) {
+				token[len++] = lower(c);
+			}
+			continue;
+		}
+		if (html && c == '>') {
+			tag = false;
+		}
+		if (len >= MIN_TOKEN) {
+			emit(token, len, data);
+		}
+		len = 0;
+	}
+}
+
+/*
+ * Identifies an indexed part of a message. Mailbox names are case-sensitive,
+ * except INBOX. A UID only means the same message under the same UIDVALIDITY.
+ */
+static uint64_t doc_key(const char *mailbox, uint32_t uidvalidity,
+		uint32_t uid, uint32_t part) {
+	uint64_t hash = 14695981039346656037ULL;
+	if (strcasecmp(mailbox, "INBOX") == 0) {
+		mailbox = "INBOX";
+	}
+	for (const char *c = mailbox; *c; ++c) {
+		hash ^= (unsigned char)*c;
+		hash *= 1099511628211ULL;
+	}
+	hash ^= uidvalidity;
+	hash *= 1099511628211ULL;
+	hash ^= ((uint64_t)uid << 20) ^ part;
+	hash *= 0x9E3779B97F4A7C15ULL;
+	return hash | 1;
+}
+
+static uint64_t *seen_slot(uint64_t *items, size_t capacity, uint64_t key) {
+	size_t i = (key >> 16) & (capacity - 1);
+	while (items[i] && items[i] != key) {
+		i = (i + 1) & (capacity - 1);
+	}
+	return &items[i];
+}
+
+/* Returns false if the key was already present */
+static bool seen_insert(struct search_index *index, uint64_t key) {
+	if ((index->seen.length + 1) * 4 > index->seen.capacity * 3) {
+		size_t capacity = index->seen.capacity ? index->seen.capacity * 2 : 1024;
+		uint64_t *items = calloc(capacity, sizeof(uint64_t));
+		for (size_t i = 0; i < index->seen.capacity; ++i) {
+			if (index->seen.items[i]) {
+				*seen_slot(items, capacity, index->seen.items[i]) =
+					index->seen.items[i];
+			}
+		}
+		free(index->seen.items);
+		index->seen.items = items;
+		index->seen.capacity = capacity;
+	}
+	uint64_t *slot = seen_slot(index->seen.items, index->seen.capacity, key);
+	if (*slot) {
+		return false;
+	}
+	*slot = key;
+	++index->seen.length;
+	return true;
+}
+
+static struct posting *posting_slot(struct posting *items, size_t capacity,
+		const char *term, size_t len) {
+	size_t i = hash_bytes(term, len) & (capacity - 1);
+	while (items[i].term && (strncmp(items[i].term, term, len) != 0
+				|| items[i].term[len] != '\0')) {
+		i = (i + 1) & (capacity - 1);
+	}
+	return &items[i];
+}
+
+static struct posting *pending_find(struct search_index *index,
+		const char *term, size_t len) {
+	if (!index->pending.capacity) {
+		return NULL;
+	}
+	struct posting *p = posting_slot(index->pending.terms,
+			index->pending.capacity, term, len);
+	return p->term ? p : NULL;
+}
+
+static struct posting *pending_term(struct search_index *index,
+		const char *term, size_t len) {
+	if ((index->pending.nterms + 1) * 4 > index->pending.capacity * 3) {
+		size_t capacity = index->pending.capacity ?
+			index->pending.capacity * 2 : 4096;
+		struct posting *items = calloc(capacity, sizeof(struct posting));
+		for (size_t i = 0; i < index->pending.capacity; ++i) {
+			struct posting *p = &index->pending.terms[i];
+			if (p->term) {
+				*posting_slot(items, capacity, p->term, strlen(p->term)) = *p;
+			}
+		}
+		free(index->pending.terms);
+		index->pending.terms = items;
+		index->pending.capacity = capacity;
+	}
+	struct posting *p = posting_slot(index->pending.terms,
+			index->pending.capacity, term, len);
+	if (!p->term) {
+		p->term = strndup(term, len);
+		++index->pending.nterms;
+		index->pending.bytes += len + sizeof(struct posting);
+	}
+	return p;
+}
+
+static void pending_clear(struct search_index *index) {
+	for (size_t i = 0; i < index->pending.capacity; ++i) {
+		free(index->pending.terms[i].term);
+		free(index->pending.terms[i].data.data);
+	}
+	free(index->pending.terms);
+	free(index->pending.docs);
+	memset(&index->pending, 0, sizeof(index->pending));
+}
+
+struct add_context {
+	struct search_index *index;
+	uint32_t doc;
+};
+
+static void add_token(const char *token, size_t len, void *data) {
+	struct add_context *ctx = data;
+	struct search_index *index = ctx->index;
+	struct posting *p = pending_term(index, token, len);
+	if (p->count && p->last == ctx->doc) {
+		return;
+	}
+	size_t before = p->data.length;
+	put_varint(&p->data, ctx->doc - (p->count ? p->last : index->pending.base));
+	index->pending.bytes += p->data.length - before;
+	p->last = ctx->doc;
+	++p->count;
+}
+
+bool search_index_add(struct search_index *index, const char *mailbox,
+		uint32_t uidvalidity, uint32_t uid, uint32_t part,
+		const char *text, size_t length, bool html) {
+	if (!seen_insert(index, doc_key(mailbox, uidvalidity, uid, part))) {
+		return false;
+	}
+	if (!index->pending.ndocs) {
+		index->pending.base = index->next_doc;
+	}
+	if (index->pending.ndocs == index->pending.docs_capacity) {
+		index->pending.docs_capacity = index->pending.docs_capacity ?
+			index->pending.docs_capacity * 2 : 64;
+		index->pending.docs = realloc(index->pending.docs,
+				index->pending.docs_capacity * sizeof(struct pending_doc));
+	}
+	index->pending.docs[index->pending.ndocs++] = (struct pending_doc){
+		.mailbox = intern_mailbox(mailbox),
+		.uidvalidity = uidvalidity,
+		.uid = uid,
+		.part = part,
+	};
+	index->pending.bytes += sizeof(struct pending_doc);
+	struct add_context ctx = { index, index->next_doc++ };
+	tokenize(text, length, html, add_token, &ctx);
+	index->pending.updated = time(NULL);
+	if (index->pending.ndocs >= FLUSH_DOCS
+			|| index->pending.bytes >= FLUSH_BYTES) {
+		search_index_flush(index);
+	}
+	return true;
+}
+
+static void segment_free(struct segment *seg) {
+	if (!seg) {
+		return;
+	}
+	munmap(seg->map, seg->size);
+	free(seg->file);
+	free(seg);
+}
+
+static struct segment *segment_open(const char *file) {
+	int fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0
+			|| (size_t)st.st_size < sizeof(struct segment_header)) {
+		close(fd);
+		return NULL;
+	}
+	uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+	struct segment *seg = calloc(1, sizeof(struct segment));
+	seg->file = strdup(file);
+	seg->map = map;
+	seg->size = st.st_size;
+
+	const struct segment_header *header = (const void *)map;
+	if (memcmp(header->magic, segment_magic, sizeof(segment_magic)) == 0
+			&& header->version != SEGMENT_VERSION) {
+		// It's only a cache, so the messages are indexed again as we see them
+		worker_log(L_DEBUG, "Removing old search index segment %s", file);
+		unlink(file);
+		segment_free(seg);
+		return NULL;
+	}
+	if (memcmp(header->magic, segment_magic, sizeof(segment_magic)) != 0
+			|| header->version != SEGMENT_VERSION
+			|| header->size != seg->size
+			|| header->terms != sizeof(struct segment_header)
+			|| header->docs != header->terms
+				+ (uint64_t)header->nterms * sizeof(struct segment_term)
+			|| header->strings != header->docs
+				+ (uint64_t)header->ndocs * sizeof(struct segment_doc)
+			|| header->postings < header->strings
+			|| header->size < header->postings) {
+		goto invalid;
+	}
+	seg->base = header->base;
+	seg->ndocs = header->ndocs;
+	seg->terms = (const void *)(map + header->terms);
+	seg->nterms = header->nterms;
+	seg->docs = (const void *)(map + header->docs);
+	seg->strings = (const char *)(map + header->strings);
+	seg->strings_size = header->postings - header->strings;
+	seg->postings = map + header->postings;
+	seg->postings_size = header->size - header->postings;
+	if (seg->strings_size && seg->strings[seg->strings_size - 1] != '\0') {
+		goto invalid;
+	}
+	for (size_t i = 0; i < seg->nterms; ++i) {
+		const struct segment_term *term = &seg->terms[i];
+		if (term->term >= seg->strings_size || !term->count
+				|| term->postings + term->length > seg->postings_size) {
+			goto invalid;
+		}
+	}
+	for (size_t i = 0; i < seg->ndocs; ++i) {
+		if (seg->docs[i].mailbox >= seg->strings_size) {
+			goto invalid;
+		}
+	}
+	seg->last_mailbox = UINT32_MAX;
+	return seg;
+invalid:
+	worker_log(L_ERROR, "Ignoring invalid search index segment %s", file);
+	segment_free(seg);
+	return NULL;
+}
+
+static const struct segment_term *segment_find(const struct segment *seg,
+		const char *term) {
+	size_t lo = 0, hi = seg->nterms;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(seg->strings + seg->terms[mid].term, term);
+		if (cmp == 0) {
+			return &seg->terms[mid];
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+struct segment_writer {
+	uint32_t base, ndocs, nterms;
+	struct buffer terms, docs, strings, postings;
+	list_t *mailboxes; // Offsets of the mailbox names in strings
+	const char *last_mailbox;
+	uint32_t last_offset;
+};
+
+static uint32_t writer_string(struct segment_writer *w, const char *str) {
+	uint32_t offset = w->strings.length;
+	buffer_append(&w->strings, str, strlen(str) + 1);
+	return offset;
+}
+
+static void writer_doc(struct segment_writer *w, const char *mailbox,
+		uint32_t uidvalidity, uint32_t uid, uint32_t part) {
+	if (!w->last_mailbox || strcmp(w->last_mailbox, mailbox) != 0) {
+		size_t i;
+		for (i = 0; i < w->mailboxes->length; ++i) {
+			uint32_t offset = (uintptr_t)w->mailboxes->items[i];
+			if (strcmp((char *)w->strings.data + offset, mailbox) == 0) {
+				w->last_offset = offset;
+				break;
+			}
+		}
+		if (i == w->mailboxes->length) {
+			w->last_offset = writer_string(w, mailbox);
+			list_add(w->mailboxes, (void *)(uintptr_t)w->last_offset);
+		}
+		w->last_mailbox = mailbox;
+	}
+	struct segment_doc doc = { uidvalidity, uid, part, w->last_offset };
+	buffer_append(&w->docs, &doc, sizeof(doc));
+}
+
+/* Call after appending the term's postings to w->postings */
+static void writer_term(struct segment_writer *w, const char *term,
+		uint32_t count, uint32_t last, size_t postings) {
+	struct segment_term t = {
+		.term = writer_string(w, term),
+		.count = count,
+		.last = last,
+		.length = w->postings.length - postings,
+		.postings = postings,
+	};
+	buffer_append(&w->terms, &t, sizeof(t));
+	++w->nterms;
+}
+
+static void writer_free(struct segment_writer *w) {
+	free(w->terms.data);
+	free(w->docs.data);
+	free(w->strings.data);
+	free(w->postings.data);
+	list_free(w->mailboxes);
+}
+
+static bool write_all(int fd, const void *data, size_t len) {
+	const uint8_t *p = data;
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			return false;
+		}
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static struct segment *writer_finish(struct search_index *index,
+		struct segment_writer *w) {
+	struct segment_header header = {
+		.version = SEGMENT_VERSION,
+		.base = w->base,
+		.ndocs = w->ndocs,
+		.nterms = w->nterms,
+	};
+	memcpy(header.magic, segment_magic, sizeof(segment_magic));
+	header.terms = sizeof(header);
+	header.docs = header.terms + w->terms.length;
+	header.strings = header.docs + w->docs.length;
+	header.postings = header.strings + w->strings.length;
+	header.size = header.postings + w->postings.length;
+
+	size_t len = strlen(index->path);
+	char *tmp = malloc(len + sizeof("/.tmp-XXXXXX"));
+	sprintf(tmp, "%s/.tmp-XXXXXX", index->path);
+	int fd = mkstemp(tmp);
+	if (fd < 0) {
+		worker_log(L_ERROR, "Unable to create %s", tmp);
+		free(tmp);
+		return NULL;
+	}
+	bool ok = write_all(fd, &header, sizeof(header))
+		&& write_all(fd, w->terms.data, w->terms.length)
+		&& write_all(fd, w->docs.data, w->docs.length)
+		&& write_all(fd, w->strings.data, w->strings.length)
+		&& write_all(fd, w->postings.data, w->postings.length)
+		&& fsync(fd) == 0;
+	close(fd);
+	char *file = malloc(len + sizeof("/00000000-00000000.seg"));
+	sprintf(file, "%s/%08x-%08x.seg", index->path,
+			w->base, w->base + w->ndocs);
+	if (!ok || rename(tmp, file) != 0) {
+		worker_log(L_ERROR, "Unable to write search index segment %s", file);
+		unlink(tmp);
+		free(tmp);
+		free(file);
+		return NULL;
+	}
+	free(tmp);
+	struct segment *seg = segment_open(file);
+	free(file);
+	return seg;
+}
+
+static int compare_postings(const void *_a, const void *_b) {
+	const struct posting *a = *(const struct posting **)_a;
+	const struct posting *b = *(const struct posting **)_b;
+	return strcmp(a->term, b->term);
+}
+
+bool search_index_flush(struct search_index *index) {
+	if (!index->pending.ndocs || !index->path) {
+		return false;
+	}
+	struct segment_writer w = {
+		.base = index->pending.base,
+		.ndocs = index->pending.ndocs,
+		.mailboxes = create_list(),
+	};
+	for (size_t i = 0; i < index->pending.ndocs; ++i) {
+		struct pending_doc *doc = &index->pending.docs[i];
+		writer_doc(&w, doc->mailbox, doc->uidvalidity, doc->uid, doc->part);
+	}
+	struct posting **terms = malloc(
+			(index->pending.nterms + 1) * sizeof(struct posting *));
+	size_t nterms = 0;
+	for (size_t i = 0; i < index->pending.capacity; ++i) {
+		if (index->pending.terms[i].term) {
+			terms[nterms++] = &index->pending.terms[i];
+		}
+	}
+	qsort(terms, nterms, sizeof(struct posting *), compare_postings);
+	for (size_t i = 0; i < nterms; ++i) {
+		size_t start = w.postings.length;
+		buffer_append(&w.postings, terms[i]->data.data, terms[i]->data.length);
+		writer_term(&w, terms[i]->term, terms[i]->count, terms[i]->last, start);
+	}
+	free(terms);
+	struct segment *seg = writer_finish(index, &w);
+	writer_free(&w);
+	if (!seg) {
+		// Keep what we have in memory and stop trying to write
+		worker_log(L_ERROR, "Search index is now in memory only");
+		free(index->path);
+		index->path = NULL;
+		return false;
+	}
+	worker_log(L_DEBUG, "Flushed %u documents to %s", seg->ndocs, seg->file);
+	list_add(index->segments, seg);
+	pending_clear(index);
+	return true;
+}
+
+/* Appends a posting list from seg, starting relative to prev */
+static bool append_postings(struct segment_writer *w, const struct segment *seg,
+		const struct segment_term *term, uint32_t prev) {
+	const uint8_t *p = seg->postings + term->postings;
+	const uint8_t *end = p + term->length;
+	uint32_t first;
+	if (!(p = get_varint(p, end, &first))) {
+		return false;
+	}
+	put_varint(&w->postings, seg->base + first - prev);
+	buffer_append(&w->postings, p, end - p);
+	return true;
+}
+
+static struct segment *merge_segments(struct search_index *index,
+		const struct segment *a, const struct segment *b) {
+	struct segment_writer w = {
+		.base = a->base,
+		.ndocs = a->ndocs + b->ndocs,
+		.mailboxes = create_list(),
+	};
+	for (size_t i = 0; i < a->ndocs; ++i) {
+		const struct segment_doc *doc = &a->docs[i];
+		writer_doc(&w, a->strings + doc->mailbox,
+				doc->uidvalidity, doc->uid, doc->part);
+	}
+	for (size_t i = 0; i < b->ndocs; ++i) {
+		const struct segment_doc *doc = &b->docs[i];
+		writer_doc(&w, b->strings + doc->mailbox,
+				doc->uidvalidity, doc->uid, doc->part);
+	}
+	size_t i = 0, j = 0;
+	while (i < a->nterms || j < b->nterms) {
+		const struct segment_term *ta = i < a->nterms ? &a->terms[i] : NULL;
+		const struct segment_term *tb = j < b->nterms ? &b->terms[j] : NULL;
+		int cmp = !ta ? 1 : !tb ? -1 :
+			strcmp(a->strings + ta->term, b->strings + tb->term);
+		size_t start = w.postings.length;
+		if (cmp < 0) {
+			buffer_append(&w.postings, a->postings + ta->postings, ta->length);
+			writer_term(&w, a->strings + ta->term, ta->count, ta->last, start);
+			++i;
+		} else if (cmp > 0) {
+			if (append_postings(&w, b, tb, a->base)) {
+				writer_term(&w, b->strings + tb->term,
+						tb->count, tb->last, start);
+			}
+			++j;
+		} else {
+			buffer_append(&w.postings, a->postings + ta->postings, ta->length);
+			if (append_postings(&w, b, tb, ta->last)) {
+				writer_term(&w, a->strings + ta->term,
+						ta->count + tb->count, tb->last, start);
+			} else {
+				w.postings.length = start + ta->length;
+				writer_term(&w, a->strings + ta->term,
+						ta->count, ta->last, start);
+			}
+			++i, ++j;
+		}
+	}
+	struct segment *seg = writer_finish(index, &w);
+	writer_free(&w);
+	return seg;
+}
+
+bool search_index_maintain(struct search_index *index) {
+	if (index->pending.ndocs
+			&& time(NULL) - index->pending.updated >= FLUSH_IDLE) {
+		return search_index_flush(index);
+	}
+	if (!index->path) {
+		return false;
+	}
+	/*
+	 * Merging a segment into its predecessor once it's at least half the size
+	 * works like a binary counter: each document is rewritten a logarithmic
+	 * number of times and there are a logarithmic number of segments.
+	 */
+	list_t *segments = index->segments;
+	size_t pick = segments->length;
+	uint64_t best = UINT64_MAX;
+	for (size_t i = 0; i + 1 < segments->length; ++i) {
+		struct segment *a = segments->items[i], *b = segments->items[i + 1];
+		if (a->base + a->ndocs != b->base) {
+			continue;
+		}
+		uint64_t size = (uint64_t)a->ndocs + b->ndocs;
+		if ((a->ndocs < 2 * (uint64_t)b->ndocs
+					|| segments->length > MAX_SEGMENTS) && size < best) {
+			pick = i;
+			best = size;
+		}
+	}
+	if (pick == segments->length) {
+		return false;
+	}
+	struct segment *a = segments->items[pick], *b = segments->items[pick + 1];
+	struct segment *merged = merge_segments(index, a, b);
+	if (!merged) {
+		return false;
+	}
+	worker_log(L_DEBUG, "Merged search index segments into %s", merged->file);
+	unlink(a->file);
+	unlink(b->file);
+	segment_free(a);
+	segment_free(b);
+	segments->items[pick] = merged;
+	list_del(segments, pick + 1);
+	return true;
+}
+
+static int compare_segments(const void *_a, const void *_b) {
+	const struct segment *a = *(void **)_a;
+	const struct segment *b = *(void **)_b;
+	if (a->base != b->base) {
+		return a->base < b->base ? -1 : 1;
+	}
+	// Larger first, so the ones it covers are dropped
+	return (a->ndocs < b->ndocs) - (a->ndocs > b->ndocs);
+}
+
+static void load_segments(struct search_index *index) {
+	DIR *dir = opendir(index->path);
+	if (!dir) {
+		worker_log(L_ERROR, "Unable to open search index at %s", index->path);
+		return;
+	}
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		size_t len = strlen(ent->d_name);
+		bool tmp = strncmp(ent->d_name, ".tmp-", 5) == 0;
+		if (!tmp && (len < 4 || strcmp(ent->d_name + len - 4, ".seg") != 0)) {
+			continue;
+		}
+		char *file = malloc(strlen(index->path) + len + 2);
+		sprintf(file, "%s/%s", index->path, ent->d_name);
+		if (tmp) {
+			// Left over from an interrupted flush or merge
+			unlink(file);
+		} else {
+			struct segment *seg = segment_open(file);
+			if (seg) {
+				list_add(index->segments, seg);
+			}
+		}
+		free(file);
+	}
+	closedir(dir);
+
+	list_qsort(index->segments, compare_segments);
+	// A merge may have been interrupted before removing its inputs
+	uint32_t end = 0;
+	for (size_t i = 0; i < index->segments->length; ++i) {
+		struct segment *seg = index->segments->items[i];
+		if (i && seg->base < end) {
+			worker_log(L_DEBUG, "Removing stale segment %s", seg->file);
+			unlink(seg->file);
+			segment_free(seg);
+			list_del(index->segments, i--);
+			continue;
+		}
+		end = seg->base + seg->ndocs;
+	}
+	index->next_doc = end;
+}
+
+struct search_index *search_index_open(const char *path) {
+	struct search_index *index = calloc(1, sizeof(struct search_index));
+	if (!index) {
+		return NULL;
+	}
+	index->segments = create_list();
+	if (path) {
+		index->path = strdup(path);
+		load_segments(index);
+	}
+	for (size_t i = 0; i < index->segments->length; ++i) {
+		struct segment *seg = index->segments->items[i];
+		for (size_t j = 0; j < seg->ndocs; ++j) {
+			const struct segment_doc *doc = &seg->docs[j];
+			seen_insert(index, doc_key(seg->strings + doc->mailbox,
+						doc->uidvalidity, doc->uid, doc->part));
+		}
+	}
+	return index;
+}
+
+void search_index_close(struct search_index *index) {
+	if (!index) {
+		return;
+	}
+	search_index_flush(index);
+	pending_clear(index);
+	for (size_t i = 0; i < index->segments->length; ++i) {
+		segment_free(index->segments->items[i]);
+	}
+	list_free(index->segments);
+	free(index->seen.items);
+	free(index->path);
+	free(index);
+}
+
+struct doc_list {
+	uint32_t *items;
+	size_t length, capacity;
+};
+
+static void doc_list_add(struct doc_list *list, uint32_t doc) {
+	if (list->length == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		list->items = realloc(list->items, list->capacity * sizeof(uint32_t));
+	}
+	list->items[list->length++] = doc;
+}
+
+static void decode_postings(struct doc_list *list, const uint8_t *p,
+		const uint8_t *end, uint32_t doc) {
+	uint32_t delta;
+	while (p < end && (p = get_varint(p, end, &delta))) {
+		doc += delta;
+		doc_list_add(list, doc);
+	}
+}
+
+/* Documents containing term, in order */
+static void find_term(struct search_index *index, const char *term,
+		struct doc_list *list) {
+	for (size_t i = 0; i < index->segments->length; ++i) {
+		struct segment *seg = index->segments->items[i];
+		const struct segment_term *t = segment_find(seg, term);
+		if (t) {
+			const uint8_t *p = seg->postings + t->postings;
+			decode_postings(list, p, p + t->length, seg->base);
+		}
+	}
+	struct posting *p = pending_find(index, term, strlen(term));
+	if (p) {
+		decode_postings(list, p->data.data, p->data.data + p->data.length,
+				index->pending.base);
+	}
+}
+
+static int compare_doc_lists(const void *_a, const void *_b) {
+	const struct doc_list *a = _a, *b = _b;
+	return (a->length > b->length) - (a->length < b->length);
+}
+
+/* Also used on candidates, which start with their hit */
+static int compare_hits(const void *_a, const void *_b) {
+	const struct search_hit *a = _a, *b = _b;
+	if (a->mailbox != b->mailbox) {
+		return strcmp(a->mailbox, b->mailbox);
+	}
+	if (a->uidvalidity != b->uidvalidity) {
+		return a->uidvalidity < b->uidvalidity ? -1 : 1;
+	}
+	return (a->uid > b->uid) - (a->uid < b->uid);
+}
+
+static void add_query_term(const char *token, size_t len, void *data) {
+	list_t *terms = data;
+	for (size_t i = 0; i < terms->length; ++i) {
+		const char *term = terms->items[i];
+		if (strncmp(term, token, len) == 0 && term[len] == '\0') {
+			return;
+		}
+	}
+	list_add(terms, strndup(token, len));
+}
+
+static bool doc_hit(struct search_index *index, uint32_t doc,
+		struct search_hit *hit) {
+	if (index->pending.ndocs && doc >= index->pending.base) {
+		struct pending_doc *pdoc = &index->pending.docs[doc - index->pending.base];
+		hit->mailbox = pdoc->mailbox;
+		hit->uidvalidity = pdoc->uidvalidity;
+		hit->uid = pdoc->uid;
+		return true;
+	}
+	size_t lo = 0, hi = index->segments->length;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		struct segment *seg = index->segments->items[mid];
+		if (doc < seg->base) {
+			hi = mid;
+		} else if (doc >= seg->base + seg->ndocs) {
+			lo = mid + 1;
+		} else {
+			const struct segment_doc *sdoc = &seg->docs[doc - seg->base];
+			if (sdoc->mailbox != seg->last_mailbox) {
+				seg->last_mailbox = sdoc->mailbox;
+				seg->last_interned =
+					intern_mailbox(seg->strings + sdoc->mailbox);
+			}
+			hit->mailbox = seg->last_interned;
+			hit->uidvalidity = sdoc->uidvalidity;
+			hit->uid = sdoc->uid;
+			return true;
+		}
+	}
+	return false;
+}
+
+struct candidate {
+	struct search_hit hit;
+	size_t matched, last_term;
+};
+
+static struct candidate **candidate_slot(struct candidate **items,
+		size_t capacity, const struct search_hit *hit) {
+	size_t i = (((uintptr_t)hit->mailbox >> 4) ^ hit->uid * 2654435761u)
+		& (capacity - 1);
+	while (items[i] && (items[i]->hit.mailbox != hit->mailbox
+				|| items[i]->hit.uidvalidity != hit->uidvalidity
+				|| items[i]->hit.uid != hit->uid)) {
+		i = (i + 1) & (capacity - 1);
+	}
+	return &items[i];
+}
+
+size_t search_index_query(struct search_index *index, const char *query,
+		struct search_hit **hits) {
+	*hits = NULL;
+	list_t *terms = create_list();
+	tokenize(query, strlen(query), false, add_query_term, terms);
+	if (!terms->length) {
+		list_free(terms);
+		return 0;
+	}
+	struct doc_list *lists = calloc(terms->length, sizeof(struct doc_list));
+	size_t nlists = terms->length;
+	for (size_t i = 0; i < nlists; ++i) {
+		find_term(index, terms->items[i], &lists[i]);
+		free(terms->items[i]);
+	}
+	list_free(terms);
+
+	/*
+	 * The headers and each body part of a message are separate documents, so
+	 * terms are matched per message: the messages containing the rarest term
+	 * are the candidates, and the other terms are counted against them.
+	 */
+	qsort(lists, nlists, sizeof(struct doc_list), compare_doc_lists);
+	size_t ncandidates = 0;
+	struct candidate *candidates = malloc(
+			(lists[0].length + 1) * sizeof(struct candidate));
+	for (size_t i = 0; i < lists[0].length; ++i) {
+		if (doc_hit(index, lists[0].items[i], &candidates[ncandidates].hit)) {
+			++ncandidates;
+		}
+	}
+	qsort(candidates, ncandidates, sizeof(struct candidate), compare_hits);
+	size_t n = 0;
+	for (size_t i = 0; i < ncandidates; ++i) {
+		if (!n || compare_hits(&candidates[n - 1], &candidates[i]) != 0) {
+			candidates[n] = candidates[i];
+			candidates[n].matched = 1;
+			candidates[n].last_term = 0;
+			++n;
+		}
+	}
+	ncandidates = n;
+
+	if (nlists > 1 && ncandidates) {
+		size_t capacity = 16;
+		while (capacity < ncandidates * 2) {
+			capacity *= 2;
+		}
+		struct candidate **table = calloc(capacity, sizeof(struct candidate *));
+		for (size_t i = 0; i < ncandidates; ++i) {
+			*candidate_slot(table, capacity, &candidates[i].hit) = &candidates[i];
+		}
+		for (size_t t = 1; t < nlists; ++t) {
+			for (size_t i = 0; i < lists[t].length; ++i) {
+				struct search_hit hit;
+				if (!doc_hit(index, lists[t].items[i], &hit)) {
+					continue;
+				}
+				struct candidate *c = *candidate_slot(table, capacity, &hit);
+				if (c && c->last_term != t) {
+					c->last_term = t;
+					++c->matched;
+				}
+			}
+		}
+		free(table);
+	}
+
+	size_t length = 0;
+	for (size_t i = 0; i < ncandidates; ++i) {
+		if (candidates[i].matched == nlists) {
+			++length;
+		}
+	}
+	if (length) {
+		*hits = malloc(length * sizeof(struct search_hit));
+		length = 0;
+		for (size_t i = 0; i < ncandidates; ++i) {
+			if (candidates[i].matched == nlists) {
+				(*hits)[length++] = candidates[i].hit;
+			}
+		}
+	}
+	free(candidates);
+	for (size_t i = 0; i < nlists; ++i) {
+		free(lists[i].items);
+	}
+	free(lists);
+	return length;
+}
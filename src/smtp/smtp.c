@@ -0,0 +1,800 @@
+/*
+ * smtp/smtp.c - Submits messages to an SMTP server, one after another on the
+ * same connection
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "absocket.h"
+#include "log.h"
+#include "smtp/smtp.h"
+#include "urlparse.h"
+#include "util/base64.h"
+#include "util/list.h"
+#include "util/stringop.h"
+#include "util/time.h"
+
+#define BUFFER_SIZE 1024
+#define CHUNK_SIZE (64 * 1024) // Of the message, read off disk at a time
+
+struct smtp_pending {
+	smtp_callback_t callback;
+	void *data;
+};
+
+struct smtp_held {
+	char *cmd;
+	size_t length;
+	struct smtp_pending pending;
+};
+
+static void handle_ehlo(struct smtp_connection *smtp, void *data,
+		int code, const char *text);
+static void start_next(struct smtp_connection *smtp);
+
+static bool positive(int code) {
+	return code >= 200 && code < 300;
+}
+
+static void expect(struct smtp_connection *smtp, smtp_callback_t callback,
+		void *data) {
+	struct smtp_pending *pending = malloc(sizeof(struct smtp_pending));
+	pending->callback = callback;
+	pending->data = data;
+	list_add(smtp->awaiting, pending);
+}
+
+/* If the write fails, the next smtp_receive finds out */
+static void send_raw(struct smtp_connection *smtp, const char *buf, size_t len) {
+	ab_send(smtp->socket, buf, len);
+}
+
+/*
+ * Without PIPELINING each command has to wait on the last one's reply, so
+ * they're held here until then.
+ */
+static void smtp_send(struct smtp_connection *smtp, smtp_callback_t callback,
+		void *data, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+
+	char *cmd = malloc(len + 3);
+	va_start(args, fmt);
+	vsnprintf(cmd, len + 1, fmt, args);
+	va_end(args);
+	if (strncmp(cmd, "AUTH ", 5) == 0) {
+		worker_log(L_DEBUG, "-> AUTH *****");
+	} else {
+		worker_log(L_DEBUG, "-> %s", cmd);
+	}
+	strcpy(cmd + len, "\r\n");
+	len += 2;
+
+	if (smtp->awaiting->length && !smtp->cap.pipelining) {
+		struct smtp_held *held = malloc(sizeof(struct smtp_held));
+		held->cmd = cmd;
+		held->length = len;
+		held->pending.callback = callback;
+		held->pending.data = data;
+		list_add(smtp->held, held);
+		return;
+	}
+	send_raw(smtp, cmd, len);
+	expect(smtp, callback, data);
+	memset(cmd, 0, len);
+	free(cmd);
+}
+
+static void send_held(struct smtp_connection *smtp) {
+	if (smtp->awaiting->length || !smtp->held->length) {
+		return;
+	}
+	struct smtp_held *held = smtp->held->items[0];
+	list_del(smtp->held, 0);
+	send_raw(smtp, held->cmd, held->length);
+	expect(smtp, held->pending.callback, held->pending.data);
+	memset(held->cmd, 0, held->length);
+	free(held->cmd);
+	free(held);
+}
+
+static void fail_all(struct smtp_connection *smtp, const char *reason) {
+	while (smtp->queue->length) {
+		struct smtp_message *msg = smtp->queue->items[0];
+		list_del(smtp->queue, 0);
+		smtp->sent(smtp, msg, false, reason);
+	}
+}
+
+static void finish_message(struct smtp_connection *smtp, bool ok,
+		const char *reply) {
+	struct smtp_message *msg = smtp->queue->items[0];
+	list_del(smtp->queue, 0);
+	if (msg->file) {
+		fclose(msg->file);
+		msg->file = NULL;
+	}
+	char *error = smtp->error;
+	smtp->error = NULL;
+	smtp->state = SMTP_READY;
+	smtp->sent(smtp, msg, ok, ok || !error ? reply : error);
+	free(error);
+	start_next(smtp);
+}
+
+static void set_error(struct smtp_connection *smtp, const char *fmt, ...) {
+	if (smtp->error) {
+		return; // The first is the one that matters
+	}
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	smtp->error = malloc(len + 1);
+	va_start(args, fmt);
+	vsnprintf(smtp->error, len + 1, fmt, args);
+	va_end(args);
+}
+
+static void smtp_disconnect(struct smtp_connection *smtp, const char *reason) {
+	worker_log(L_DEBUG, "Disconnected from SMTP server: %s", reason);
+	enum smtp_state was = smtp->state;
+	absocket_free(smtp->socket);
+	smtp->socket = NULL;
+	smtp->state = SMTP_DISCONNECTED;
+	while (smtp->awaiting->length) {
+		free(smtp->awaiting->items[0]);
+		list_del(smtp->awaiting, 0);
+	}
+	while (smtp->held->length) {
+		struct smtp_held *held = smtp->held->items[0];
+		memset(held->cmd, 0, held->length);
+		free(held->cmd);
+		free(held);
+		list_del(smtp->held, 0);
+	}
+	free(smtp->reply);
+	smtp->reply = NULL;
+	free(smtp->error);
+	smtp->error = NULL;
+	smtp->line_index = 0;
+	if (was == SMTP_CONNECTING) {
+		// It'd only happen again
+		fail_all(smtp, reason);
+		return;
+	}
+	if (was == SMTP_READY || was == SMTP_QUITTING || !smtp->queue->length) {
+		return;
+	}
+	struct smtp_message *msg = smtp->queue->items[0];
+	if (!msg->answered && msg->attempts < 2) {
+		// The connection we kept open was gone by the time we used it
+		worker_log(L_DEBUG, "Sending it again on a new connection");
+		rewind(msg->file);
+		msg->last = '\n';
+		msg->eof = false;
+		return;
+	}
+	list_del(smtp->queue, 0);
+	smtp->sent(smtp, msg, false, reason);
+}
+
+static void handle_line(struct smtp_connection *smtp, const char *line) {
+	worker_log(L_DEBUG, "<- %s", line);
+	if (strlen(line) < 3 || !isdigit((unsigned char)line[0])
+			|| !isdigit((unsigned char)line[1])
+			|| !isdigit((unsigned char)line[2])) {
+		worker_log(L_DEBUG, "Ignoring what the server said");
+		return;
+	}
+	int code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+	bool more = line[3] == '-';
+	const char *text = line[3] ? line + 4 : "";
+
+	size_t have = smtp->reply ? strlen(smtp->reply) : 0;
+	smtp->reply = realloc(smtp->reply, have + strlen(text) + 2);
+	if (have) {
+		smtp->reply[have++] = '\n';
+	}
+	strcpy(smtp->reply + have, text);
+	if (more) {
+		return;
+	}
+
+	char *reply = smtp->reply;
+	smtp->reply = NULL;
+	if (smtp->awaiting->length) {
+		struct smtp_pending *pending = smtp->awaiting->items[0];
+		list_del(smtp->awaiting, 0);
+		pending->callback(smtp, pending->data, code, reply);
+		free(pending);
+	} else if (code != 421) {
+		worker_log(L_DEBUG, "Reply to nothing we sent, ignoring");
+	}
+	if (code == 421 && smtp->socket) {
+		// The server's going away, and will say so at any time
+		smtp_disconnect(smtp, reply);
+	} else if (smtp->socket) {
+		send_held(smtp);
+	}
+	free(reply);
+}
+
+/*
+ * A reply's callback may take what's left after its line out of our hands, as
+ * STARTTLS does, by setting line_index and line_next to 0.
+ */
+static void handle_lines(struct smtp_connection *smtp) {
+	size_t start = 0;
+	char *end;
+	while (smtp->socket && start < smtp->line_index
+			&& (end = memchr(smtp->line + start, '\n',
+					smtp->line_index - start))) {
+		*end = '\0';
+		if (end > smtp->line + start && end[-1] == '\r') {
+			end[-1] = '\0';
+		}
+		smtp->line_next = end + 1 - smtp->line;
+		handle_line(smtp, smtp->line + start);
+		start = smtp->line_next;
+	}
+	if (!smtp->socket) {
+		return;
+	}
+	smtp->line_index -= start;
+	memmove(smtp->line, smtp->line + start, smtp->line_index);
+	if (smtp->line_index == smtp->line_size) {
+		smtp->line_size += BUFFER_SIZE;
+		smtp->line = realloc(smtp->line, smtp->line_size + 1);
+	}
+}
+
+/* Gives up on the connection, and on everything waiting to go out on it */
+static void abandon(struct smtp_connection *smtp, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	char *reason = malloc(len + 1);
+	va_start(args, fmt);
+	vsnprintf(reason, len + 1, fmt, args);
+	va_end(args);
+	worker_log(L_ERROR, "%s", reason);
+	smtp->state = SMTP_CONNECTING;
+	smtp_disconnect(smtp, reason);
+	free(reason);
+}
+
+static void handle_greeting(struct smtp_connection *smtp, void *data,
+		int code, const char *text) {
+	if (code != 220) {
+		abandon(smtp, "SMTP server turned us away: %s", text);
+		return;
+	}
+	char host[256];
+	if (gethostname(host, sizeof(host)) != 0 || !*host) {
+		strcpy(host, "localhost");
+	}
+	host[sizeof(host) - 1] = '\0';
+	smtp_send(smtp, handle_ehlo, NULL, "EHLO %s", host);
+}
+
+static void parse_capabilities(struct smtp_connection *smtp, const char *text) {
+	memset(&smtp->cap, 0, sizeof(smtp->cap));
+	smtp->cap.size = -1;
+	// The first line is the server's name
+	const char *line = strchr(text, '\n');
+	while (line) {
+		++line;
+		const char *end = strchr(line, '\n');
+		size_t len = end ? (size_t)(end - line) : strlen(line);
+		char *cap = strndup(line, len);
+		if (strcasecmp(cap, "PIPELINING") == 0) {
+			smtp->cap.pipelining = true;
+		} else if (strcasecmp(cap, "CHUNKING") == 0) {
+			smtp->cap.chunking = true;
+		} else if (strcasecmp(cap, "8BITMIME") == 0) {
+			smtp->cap.eightbitmime = true;
+		} else if (strcasecmp(cap, "STARTTLS") == 0) {
+			smtp->cap.starttls = true;
+		} else if (strcasecmp(cap, "SIZE") == 0) {
+			smtp->cap.size = 0;
+		} else if (strncasecmp(cap, "SIZE ", 5) == 0) {
+			smtp->cap.size = strtol(cap + 5, NULL, 10);
+		} else if (strncasecmp(cap, "AUTH ", 5) == 0) {
+			list_t *mechs = split_string(cap + 5, " ");
+			for (size_t i = 0; i < mechs->length; ++i) {
+				if (strcasecmp(mechs->items[i], "PLAIN") == 0) {
+					smtp->cap.auth_plain = true;
+				}
+			}
+			free_flat_list(mechs);
+		}
+		free(cap);
+		line = end;
+	}
+}
+
+static void smtp_ready(struct smtp_connection *smtp) {
+	worker_log(L_DEBUG, "Ready to send mail%s%s%s",
+			smtp->cap.pipelining ? ", pipelining" : "",
+			smtp->cap.chunking ? ", chunking" : "",
+			smtp->cap.eightbitmime ? ", 8-bit" : "");
+	smtp->state = SMTP_READY;
+	start_next(smtp);
+}
+
+static void handle_auth(struct smtp_connection *smtp, void *data,
+		int code, const char *text) {
+	if (code != 235) {
+		abandon(smtp, "SMTP authentication failed: %s", text);
+		return;
+	}
+	smtp_ready(smtp);
+}
+
+#ifdef USE_OPENSSL
+static void handle_starttls(struct smtp_connection *smtp, void *data,
+		int code, const char *text) {
+	if (code != 220) {
+		abandon(smtp, "SMTP server refused STARTTLS: %s", text);
+		return;
+	}
+	if (smtp->line_index > smtp->line_next) {
+		// Whoever sent it would have it taken as said over TLS
+		abandon(smtp, "SMTP server sent more before the TLS handshake");
+		return;
+	}
+	smtp->line_index = smtp->line_next = 0;
+	if (!ab_enable_ssl(smtp->socket)) {
+		abandon(smtp, "TLS connection failed.");
+		return;
+	}
+	// Anything it said before means nothing now
+	handle_greeting(smtp, NULL, 220, "");
+}
+#endif
+
+static void handle_ehlo(struct smtp_connection *smtp, void *data,
+		int code, const char *text) {
+	if (!positive(code)) {
+		abandon(smtp, "SMTP server refused EHLO: %s", text);
+		return;
+	}
+	parse_capabilities(smtp, text);
+#ifdef USE_OPENSSL
+	if (!smtp->socket->use_ssl && smtp->cap.starttls) {
+		smtp_send(smtp, handle_starttls, NULL, "STARTTLS");
+		return;
+	}
+#endif
+	if (!smtp->socket->use_ssl && smtp->security != SMTP_INSECURE) {
+		abandon(smtp, "%s, use smtp+insecure:// to send without TLS",
+				smtp->cap.starttls ? "aerc was compiled without SSL support"
+				: "SMTP server does not offer STARTTLS");
+		return;
+	}
+	struct uri *uri = smtp->uri;
+	if (!uri->username || !uri->password) {
+		smtp_ready(smtp);
+		return;
+	}
+	if (!smtp->socket->use_ssl) {
+		abandon(smtp, "Not sending the password without TLS");
+		return;
+	}
+	if (!smtp->cap.auth_plain) {
+		abandon(smtp, "SMTP server and client do not share any supported "
+				"authentication mechanisms.");
+		return;
+	}
+	int len = snprintf(NULL, 0, "%c%s%c%s",
+			'\0', uri->username, '\0', uri->password);
+	char *buf = malloc(len + 1);
+	snprintf(buf, len + 1, "%c%s%c%s", '\0', uri->username, '\0', uri->password);
+	size_t _;
+	char *enc = b64_encode(buf, len, &_);
+	smtp_send(smtp, handle_auth, NULL, "AUTH PLAIN %s", enc);
+	memset(enc, 0, strlen(enc));
+	memset(buf, 0, len);
+	free(enc);
+	free(buf);
+}
+
+static void smtp_connect(struct smtp_connection *smtp) {
+	worker_log(L_DEBUG, "Connecting to SMTP server %s:%s",
+			smtp->uri->hostname, smtp->uri->port);
+	// This blocks, as it does for IMAP
+	smtp->socket = absocket_new(smtp->uri,
+			smtp->security == SMTP_TLS);
+	if (!smtp->socket) {
+		fail_all(smtp, "Error connecting to SMTP server");
+		return;
+	}
+	smtp->poll[0].fd = smtp->socket->basefd;
+	smtp->state = SMTP_CONNECTING;
+	memset(&smtp->cap, 0, sizeof(smtp->cap));
+	smtp->cap.size = -1;
+	get_nanoseconds(&smtp->last_network);
+	expect(smtp, handle_greeting, NULL);
+}
+
+static void handle_quit(struct smtp_connection *smtp, void *data,
+		int code, const char *text) {
+	smtp_disconnect(smtp, "Said goodbye");
+}
+
+void smtp_quit(struct smtp_connection *smtp) {
+	if (!smtp->socket || smtp->state != SMTP_READY || smtp->queue->length) {
+		return;
+	}
+	smtp_send(smtp, handle_quit, NULL, "QUIT");
+	smtp->state = SMTP_QUITTING;
+}
+
+static void handle_reset(struct smtp_connection *smtp, void *data,
+		int code, const char *text) {
+	finish_message(smtp, false, text);
+}
+
+/* Called once every reply to the message so far is in */
+static void settle(struct smtp_connection *smtp, const char *text) {
+	if (smtp->awaiting->length || smtp->held->length) {
+		return;
+	}
+	if (smtp->error) {
+		// So whatever it took of the message is forgotten
+		smtp_send(smtp, handle_reset, NULL, "RSET");
+		return;
+	}
+	if (smtp->state == SMTP_FINISHING) {
+		finish_message(smtp, true, text);
+	}
+}
+
+static void handle_data(struct smtp_connection *smtp, void *data,
+		int code, const char *text) {
+	if (code != 354) {
+		set_error(smtp, "SMTP server refused the message: %s", text);
+		settle(smtp, text);
+		return;
+	}
+	smtp->state = SMTP_BODY;
+}
+
+static void handle_recipient(struct smtp_connection *smtp, void *data,
+		int code, const char *text) {
+	char *recipient = data;
+	if (!positive(code)) {
+		set_error(smtp, "SMTP server refused recipient %s: %s",
+				recipient, text);
+	}
+	if (smtp->awaiting->length || smtp->held->length || smtp->error) {
+		settle(smtp, text);
+		return;
+	}
+	// Every recipient's good, so on with the message
+	if (smtp->cap.chunking) {
+		smtp->state = SMTP_BODY;
+	} else {
+		smtp_send(smtp, handle_data, NULL, "DATA");
+	}
+}
+
+static void handle_mail(struct smtp_connection *smtp, void *data,
+		int code, const char *text) {
+	struct smtp_message *msg = data;
+	msg->answered = true;
+	if (!positive(code)) {
+		set_error(smtp, "SMTP server refused sender %s: %s", msg->from, text);
+	}
+}
+
+static void start_next(struct smtp_connection *smtp) {
+	while (smtp->state == SMTP_READY && smtp->queue->length) {
+		struct smtp_message *msg = smtp->queue->items[0];
+		if (smtp->cap.size > 0 && msg->size > smtp->cap.size) {
+			set_error(smtp, "Message is too big for the SMTP server "
+					"(%ld bytes, it takes %ld)", msg->size, smtp->cap.size);
+			finish_message(smtp, false, NULL);
+			return;
+		}
+		if (!msg->recipients->length) {
+			set_error(smtp, "Message has no recipients");
+			finish_message(smtp, false, NULL);
+			return;
+		}
+		++msg->attempts;
+		msg->answered = false;
+		smtp->state = SMTP_ENVELOPE;
+		char size[32] = "";
+		if (smtp->cap.size >= 0) {
+			snprintf(size, sizeof(size), " SIZE=%ld", msg->size);
+		}
+		// The whole envelope goes out at once if the server allows it
+		smtp_send(smtp, handle_mail, msg, "MAIL FROM:<%s>%s%s", msg->from,
+				msg->eightbit && smtp->cap.eightbitmime ?
+					" BODY=8BITMIME" : "", size);
+		for (size_t i = 0; i < msg->recipients->length; ++i) {
+			smtp_send(smtp, handle_recipient, msg->recipients->items[i],
+					"RCPT TO:<%s>", msg->recipients->items[i]);
+		}
+	}
+}
+
+static void handle_chunk(struct smtp_connection *smtp, void *data,
+		int code, const char *text) {
+	if (!positive(code)) {
+		set_error(smtp, "SMTP server refused the message: %s", text);
+		// Nothing more of it is any use
+		smtp->state = SMTP_FINISHING;
+	}
+	settle(smtp, text);
+}
+
+static void handle_end(struct smtp_connection *smtp, void *data,
+		int code, const char *text) {
+	if (!positive(code)) {
+		set_error(smtp, "SMTP server refused the message: %s", text);
+		// That's the end of it anyway, there's nothing to reset
+		finish_message(smtp, false, text);
+		return;
+	}
+	settle(smtp, text);
+}
+
+/*
+ * Copies in to out with every line ending in CRLF, and with a dot added to
+ * lines that start with one if stuff is set, since a dot on its own ends the
+ * message after DATA. out needs room for twice as much.
+ */
+static size_t canonicalize(struct smtp_message *msg, const char *in,
+		size_t len, char *out, bool stuff) {
+	size_t j = 0;
+	for (size_t i = 0; i < len; ++i) {
+		char c = in[i];
+		if (c == '\n' && msg->last != '\r') {
+			out[j++] = '\r';
+		} else if (c == '.' && stuff && msg->last == '\n') {
+			out[j++] = '.';
+		}
+		out[j++] = c;
+		msg->last = c;
+	}
+	return j;
+}
+
+/*
+ * The next chunk of the message goes out only once the socket has taken most
+ * of the last, so no more than a couple are ever in memory however big the
+ * message is.
+ */
+static bool send_body(struct smtp_connection *smtp) {
+	bool sent = false;
+	while (smtp->socket && smtp->state == SMTP_BODY
+			&& (smtp->cap.pipelining || !smtp->awaiting->length)) {
+		ssize_t queued = ab_flush(smtp->socket);
+		if (queued < 0 || queued >= CHUNK_SIZE) {
+			break;
+		}
+		struct smtp_message *msg = smtp->queue->items[0];
+		char *in = smtp->chunk, *out = smtp->chunk + CHUNK_SIZE;
+		size_t amt = fread(in, 1, CHUNK_SIZE, msg->file);
+		if (amt < CHUNK_SIZE) {
+			if (ferror(msg->file)) {
+				// There's no telling the server, but it drops half a message
+				char reason[256];
+				snprintf(reason, sizeof(reason), "Unable to read message: %s",
+						strerror(errno));
+				msg->answered = true;
+				smtp_disconnect(smtp, reason);
+				return true;
+			}
+			msg->eof = true;
+		}
+		bool chunking = smtp->cap.chunking;
+		size_t len = canonicalize(msg, in, amt, out, !chunking);
+		if (msg->eof && msg->last != '\n') {
+			memcpy(out + len, "\r\n", 2);
+			len += 2;
+			msg->last = '\n';
+		}
+		if (chunking) {
+			char header[64];
+			int hlen = snprintf(header, sizeof(header), "BDAT %zu%s\r\n",
+					len, msg->eof ? " LAST" : "");
+			worker_log(L_DEBUG, "-> BDAT %zu%s", len, msg->eof ? " LAST" : "");
+			send_raw(smtp, header, hlen);
+			send_raw(smtp, out, len);
+			expect(smtp, handle_chunk, NULL);
+		} else {
+			send_raw(smtp, out, len);
+			if (msg->eof) {
+				worker_log(L_DEBUG, "-> .");
+				send_raw(smtp, ".\r\n", 3);
+				expect(smtp, handle_end, NULL);
+			}
+		}
+		if (msg->eof) {
+			smtp->state = SMTP_FINISHING;
+		}
+		get_nanoseconds(&smtp->last_network);
+		sent = true;
+	}
+	return sent;
+}
+
+int smtp_receive(struct smtp_connection *smtp) {
+	if (!smtp->socket) {
+		if (smtp->queue->length) {
+			smtp_connect(smtp);
+			return 1;
+		}
+		return 0;
+	}
+	size_t before = smtp->socket->out_end - smtp->socket->out_start;
+	ssize_t left = ab_flush(smtp->socket);
+	if (left < 0) {
+		smtp_disconnect(smtp, strerror(errno));
+		return 1;
+	}
+	if ((size_t)left < before) {
+		// It's slow going, but it's going
+		get_nanoseconds(&smtp->last_network);
+	}
+	int ret = send_body(smtp) ? 1 : 0;
+	if (!smtp->socket) {
+		return 1;
+	}
+
+	smtp->poll[0].events = ab_events(smtp->socket);
+	poll(smtp->poll, 1, 0);
+	if (ab_pending(smtp->socket)) {
+		smtp->poll[0].revents |= POLLIN;
+	}
+	if (smtp->poll[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+		ssize_t amt = ab_recv(smtp->socket, smtp->line + smtp->line_index,
+				smtp->line_size - smtp->line_index);
+		if (amt < 0 && (errno == EINTR || errno == EAGAIN)) {
+			return ret;
+		}
+		if (amt <= 0) {
+			smtp_disconnect(smtp, amt == 0 ? "Connection closed"
+					: strerror(errno));
+			return 1;
+		}
+		get_nanoseconds(&smtp->last_network);
+		smtp->line_index += amt;
+		handle_lines(smtp);
+		return 1;
+	}
+
+	struct timespec now;
+	get_nanoseconds(&now);
+	long quiet = now.tv_sec - smtp->last_network.tv_sec;
+	if (smtp->awaiting->length && quiet >= SMTP_TIMEOUT) {
+		smtp_disconnect(smtp, "Timed out waiting on the SMTP server");
+		return 1;
+	}
+	if (smtp->state == SMTP_READY && !smtp->queue->length
+			&& quiet >= SMTP_KEEP_OPEN) {
+		smtp_quit(smtp);
+		return 1;
+	}
+	return ret;
+}
+
+void smtp_submit(struct smtp_connection *smtp, struct smtp_message *msg) {
+	list_add(smtp->queue, msg);
+	// Otherwise it's started once we're connected, or done with the last
+	start_next(smtp);
+}
+
+struct smtp_connection *smtp_new(struct uri *uri, enum smtp_security security,
+		smtp_sent_t sent, void *data) {
+	struct smtp_connection *smtp = calloc(1, sizeof(struct smtp_connection));
+	smtp->uri = uri;
+	smtp->security = security;
+	smtp->sent = sent;
+	smtp->data = data;
+	smtp->line_size = BUFFER_SIZE;
+	smtp->line = malloc(smtp->line_size + 1);
+	smtp->awaiting = create_list();
+	smtp->held = create_list();
+	smtp->queue = create_list();
+	smtp->chunk = malloc(CHUNK_SIZE * 3 + 2);
+	smtp->poll[0].fd = -1;
+	smtp->cap.size = -1;
+	return smtp;
+}
+
+void smtp_free(struct smtp_connection *smtp) {
+	if (smtp->socket) {
+		smtp->state = SMTP_READY; // Whatever was going on is over
+		smtp_disconnect(smtp, "Closing");
+	}
+	fail_all(smtp, "Closing");
+	list_free(smtp->awaiting);
+	list_free(smtp->held);
+	list_free(smtp->queue);
+	if (smtp->uri->password) {
+		memset(smtp->uri->password, 0, strlen(smtp->uri->password));
+	}
+	uri_free(smtp->uri);
+	free(smtp->uri);
+	free(smtp->line);
+	free(smtp->chunk);
+	free(smtp);
+}
+
+/*
+ * Reads the message once to find out how big it'll be with CRLF line endings,
+ * which SIZE asks for up front, and whether it needs 8BITMIME.
+ */
+static void measure(struct smtp_message *msg) {
+	char buf[BUFFER_SIZE * 4];
+	size_t amt;
+	char last = '\n';
+	while ((amt = fread(buf, 1, sizeof(buf), msg->file)) > 0) {
+		for (size_t i = 0; i < amt; ++i) {
+			if (buf[i] == '\n' && last != '\r') {
+				++msg->size;
+			}
+			if (buf[i] & 0x80) {
+				msg->eightbit = true;
+			}
+			last = buf[i];
+		}
+		msg->size += amt;
+	}
+	if (last != '\n') {
+		msg->size += 2;
+	}
+	rewind(msg->file);
+}
+
+struct smtp_message *smtp_message_open(const char *path, const char *from,
+		list_t *recipients) {
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		return NULL;
+	}
+	struct smtp_message *msg = calloc(1, sizeof(struct smtp_message));
+	msg->file = file;
+	msg->from = strdup(from);
+	msg->recipients = create_list();
+	for (size_t i = 0; i < recipients->length; ++i) {
+		list_add(msg->recipients, strdup(recipients->items[i]));
+	}
+	msg->last = '\n';
+	measure(msg);
+	if (ferror(file)) {
+		int error = errno;
+		smtp_message_free(msg);
+		errno = error;
+		return NULL;
+	}
+	return msg;
+}
+
+void smtp_message_free(struct smtp_message *msg) {
+	if (!msg) return;
+	if (msg->file) {
+		fclose(msg->file);
+	}
+	free(msg->from);
+	free_flat_list(msg->recipients);
+	free(msg);
+}
@@ -0,0 +1,150 @@
+/*
+ * smtp/worker.c - SMTP worker main thread and action dispatcher
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "absocket.h"
+#include "log.h"
+#include "smtp/smtp.h"
+#include "smtp/worker.h"
+#include "urlparse.h"
+#include "worker.h"
+
+#define SLEEP_TIME 50 // Milliseconds at most, the timers are checked this often
+
+static void send_failed(struct worker_pipe *pipe, struct send_request *req,
+		const char *reason) {
+	worker_log(L_ERROR, "Unable to send %s: %s", req->path, reason);
+	free(req->error);
+	req->error = strdup(reason);
+	worker_post_message(pipe, WORKER_SEND_MESSAGE_ERROR, NULL, req);
+}
+
+static void handle_sent(struct smtp_connection *smtp, struct smtp_message *msg,
+		bool ok, const char *reply) {
+	struct worker_pipe *pipe = smtp->data;
+	struct send_request *req = msg->data;
+	if (ok) {
+		worker_log(L_DEBUG, "Sent %s: %s", req->path, reply);
+		worker_post_message(pipe, WORKER_SEND_MESSAGE_DONE, NULL, req);
+	} else {
+		send_failed(pipe, req, reply ? reply : "Unable to send message");
+	}
+	smtp_message_free(msg);
+}
+
+static void handle_connect(struct worker_pipe *pipe,
+		struct worker_message *message) {
+	worker_post_message(pipe, WORKER_ACK, message, NULL);
+	char *source = message->data;
+	struct uri *uri = calloc(1, sizeof(struct uri));
+	bool ok = parse_uri(uri, source);
+	// Contains password, clear it out of RAM
+	memset(source, 0, strlen(source));
+	free(source);
+	if (!ok || !uri->scheme || !uri->hostname) {
+		worker_log(L_ERROR, "Invalid outgoing server");
+		uri_free(uri);
+		free(uri);
+		return;
+	}
+
+	enum smtp_security security;
+	if (strcmp(uri->scheme, "smtp") == 0) {
+		security = SMTP_STARTTLS;
+	} else if (strcmp(uri->scheme, "smtp+insecure") == 0) {
+		security = SMTP_INSECURE;
+	} else if (strcmp(uri->scheme, "smtps") == 0) {
+		security = SMTP_TLS;
+	} else {
+		worker_log(L_ERROR, "Unsupported outgoing protocol %s", uri->scheme);
+		uri_free(uri);
+		free(uri);
+		return;
+	}
+	if (!uri->port) {
+		uri->port = strdup(security == SMTP_TLS ? "465" : "587");
+	}
+
+	if (pipe->data) {
+		smtp_free(pipe->data);
+	}
+	pipe->data = smtp_new(uri, security, handle_sent, pipe);
+}
+
+static void handle_send(struct worker_pipe *pipe,
+		struct worker_message *message) {
+	struct smtp_connection *smtp = pipe->data;
+	struct send_request *req = message->data;
+	worker_post_message(pipe, WORKER_ACK, message, NULL);
+	if (!smtp) {
+		send_failed(pipe, req, "No outgoing server configured");
+		return;
+	}
+	struct smtp_message *msg = smtp_message_open(req->path, req->from,
+			req->recipients);
+	if (!msg) {
+		send_failed(pipe, req, strerror(errno));
+		return;
+	}
+	msg->data = req;
+	smtp_submit(smtp, msg);
+}
+
+struct action_handler {
+	enum worker_message_type action;
+	void (*handler)(struct worker_pipe *pipe, struct worker_message *message);
+};
+
+static struct action_handler handlers[] = {
+	{ WORKER_CONNECT, handle_connect },
+	{ WORKER_SEND_MESSAGE, handle_send },
+};
+
+static void handle_message(struct worker_pipe *pipe,
+		struct worker_message *message) {
+	for (size_t i = 0; i < sizeof(handlers) / sizeof(struct action_handler); i++) {
+		if (handlers[i].action == message->type) {
+			handlers[i].handler(pipe, message);
+			return;
+		}
+	}
+	worker_post_message(pipe, WORKER_UNSUPPORTED, message, NULL);
+}
+
+void *smtp_worker(void *_pipe) {
+	/* Worker thread main loop */
+	struct worker_pipe *pipe = _pipe;
+	struct worker_message *message;
+	worker_log(L_DEBUG, "Starting SMTP worker");
+	while (1) {
+		bool sleep = true;
+		while (worker_get_action(pipe, &message)) {
+			if (message->type == WORKER_END) {
+				if (pipe->data) {
+					smtp_free(pipe->data);
+				}
+				worker_message_free(message);
+				return NULL;
+			}
+			handle_message(pipe, message);
+			worker_message_free(message);
+			sleep = false;
+		}
+		struct smtp_connection *smtp = pipe->data;
+		if (smtp && smtp_receive(smtp)) {
+			sleep = false;
+		}
+		if (sleep) {
+			absocket_t *socket = smtp ? smtp->socket : NULL;
+			worker_wait(pipe, socket ? socket->basefd : -1,
+					socket ? ab_events(socket) : 0, SLEEP_TIME);
+		}
+	}
+	return NULL;
+}
@@ -8,6 +8,7 @@
 #include "config.h"
 #include "state.h"
 #include "ui.h"
+#include "util/intern.h"
 #include "util/time.h"
 #include "util/stringop.h"
 #include "util/list.h"
@@ -57,83 +58,293 @@ struct aerc_mailbox *get_aerc_mailbox(struct account_state *account,
 void free_aerc_mailbox(struct aerc_mailbox *mbox) {
 	if (!mbox) return;
 	free(mbox->name);
-	free_flat_list(mbox->flags);
+	list_free(mbox->flags);
 	for (size_t i = 0; i < mbox->messages->length; ++i) {
 		struct aerc_message *msg = mbox->messages->items[i];
-		free_aerc_message(msg);
+		aerc_message_unref(msg);
 	}
+	list_free(mbox->messages);
+	message_table_unref(mbox->table);
 	free(mbox);
 }
 
-void free_aerc_message_part(struct aerc_message_part *part) {
-	if (!part) return;
-	free(part->type);
-	free(part->subtype);
-	free(part->body_id);
-	free(part->body_description);
-	free(part->body_encoding);
-	free(part);
-}
-
-void free_aerc_message(struct aerc_message *msg) {
-	if (!msg) return;
-	free_flat_list(msg->flags);
-	if (msg->headers) {
-		for (size_t i = 0; i < msg->headers->length; ++i) {
-			struct email_header *header = msg->headers->items[i];
-			free(header->key);
-			free(header->value);
+/* The view the message list is drawn from: the search results, if any */
+struct message_view *displayed_view(struct account_state *account) {
+	return account->ui.filtered ? account->ui.filtered : account->ui.view;
+}
+
+size_t displayed_rows(struct account_state *account, struct aerc_mailbox *mbox) {
+	return account->ui.filtered ?
+		account->ui.filtered->length : mbox->messages->length;
+}
+
+int get_index_at_row(struct account_state *account,
+		struct aerc_mailbox *mbox, size_t row) {
+	return message_view_index(displayed_view(account),
+			mbox->messages->length, row);
+}
+
+struct aerc_message *get_message_at_row(struct account_state *account,
+		struct aerc_mailbox *mbox, size_t row) {
+	int index = get_index_at_row(account, mbox, row);
+	if (index < 0 || (size_t)index >= mbox->messages->length) {
+		return NULL;
+	}
+	return mbox->messages->items[index];
+}
+
+void configure_worker(struct account_state *account) {
+	struct worker_config *worker_config = calloc(1, sizeof(struct worker_config));
+	worker_config->body_cache_size = (size_t)config->cache.max_memory << 20;
+	worker_config->body_store_size = (size_t)config->cache.max_disk << 20;
+	worker_config->background_connections =
+		config->cache.background_connections > 0 ?
+		config->cache.background_connections : 0;
+	struct account_config *c = account->config;
+	for (size_t i = 0; c && i < c->extras->length; ++i) {
+		struct account_config_extra *extra = c->extras->items[i];
+		if (strcmp(extra->key, "idle-refresh") == 0) {
+			worker_config->idle_refresh = atoi(extra->value);
+		}
+	}
+	worker_post_action(account->worker.pipe, WORKER_CONFIGURE,
+			NULL, worker_config);
+}
+
+/*
+ * Leaves the current view, so that whatever the worker still has to do for it
+ * is dropped and whatever it still has to say about it is ignored. Takes
+ * ownership of mailbox.
+ */
+void request_select(struct account_state *account, char *mailbox) {
+	struct worker_pipe *pipe = account->worker.pipe;
+	worker_pipe_advance(pipe);
+	account->ui.selecting = true;
+	worker_post_action(pipe, WORKER_CANCEL, NULL, NULL);
+	worker_post_action(pipe, WORKER_SELECT_MAILBOX, NULL, mailbox);
+}
+
+void request_sort(struct account_state *account) {
+	struct sort_request *order = &account->ui.order;
+	if (order->sort == SORT_NONE && order->thread == THREAD_NONE
+			&& !order->reverse) {
+		message_view_free(account->ui.view);
+		account->ui.view = NULL;
+		return;
+	}
+	struct sort_request *request = malloc(sizeof(struct sort_request));
+	*request = *order;
+	worker_post_action(account->worker.pipe, WORKER_SORT, NULL, request);
+}
+
+static bool has_text(struct aerc_message *msg) {
+	if (!msg->fetched || !msg->parts) {
+		return false;
+	}
+	for (size_t i = 0; i < msg->parts->length; ++i) {
+		struct aerc_message_part *part = msg->parts->items[i];
+		if (strcasecmp(part->type, "text") == 0 && !part->content) {
+			return false;
 		}
 	}
-	free_flat_list(msg->headers);
-	if (msg->parts) {
-		for (size_t i = 0; i < msg->parts->length; ++i) {
-			struct aerc_message_part *part = msg->parts->items[i];
-			free_aerc_message_part(part);
+	return true;
+}
+
+static void add_prefetch(struct prefetch_request *request,
+		struct account_state *account, struct aerc_mailbox *mbox, long row) {
+	if (row < 0) {
+		return;
+	}
+	int index = get_index_at_row(account, mbox, row);
+	if (index < 0 || has_text(mbox->messages->items[index])) {
+		return;
+	}
+	for (size_t i = 0; i < request->length; ++i) {
+		if (request->indices[i] == index) {
+			return;
 		}
-		list_free(msg->parts);
 	}
-	free(msg);
+	request->indices[request->length++] = index;
 }
 
-const char *get_message_header(struct aerc_message *msg, char *key) {
-	if (!msg || !msg->headers) {
-		return NULL;
+/*
+ * Guesses which messages will be opened next and asks the worker to download
+ * them in the background: the selected one, the next few in the direction the
+ * user is moving, the next unread one, then the next few the other way.
+ */
+void request_prefetch(struct account_state *account) {
+	struct aerc_mailbox *mbox = get_aerc_mailbox(account, account->selected);
+	int n = config->ui.prefetch_messages;
+	if (!mbox || n <= 0 || account->ui.selecting) {
+		return;
+	}
+	long selected = account->ui.selected_message;
+	long last = account->ui.prefetch.last_row;
+	if (selected != last) {
+		account->ui.prefetch.direction = selected > last ? 1 : -1;
+	}
+	account->ui.prefetch.last_row = selected;
+	int dir = account->ui.prefetch.direction ? account->ui.prefetch.direction : 1;
+
+	struct prefetch_request *request = calloc(1, sizeof(struct prefetch_request));
+	request->mailbox = strdup(account->selected);
+	request->indices = malloc((n * 2 + 2) * sizeof(int));
+	request->budget = (size_t)config->ui.prefetch_budget * 1024;
+	add_prefetch(request, account, mbox, selected);
+	for (int i = 1; i <= n; ++i) {
+		add_prefetch(request, account, mbox, selected + dir * i);
 	}
-	for (size_t i = 0; i < msg->headers->length; ++i) {
-		struct email_header *header = msg->headers->items[i];
-		if (!header->key) {
+	long rows = displayed_rows(account, mbox);
+	// Only as far as we have the flags for, we don't want to fetch the lot
+	for (long row = selected + dir; row >= 0 && row < rows; row += dir) {
+		struct aerc_message *msg = get_message_at_row(account, mbox, row);
+		if (!msg || !msg->fetched) {
 			break;
 		}
-		if (strcasecmp(header->key, key) == 0) {
-			return header->value;
+		if (!(msg->flags & FLAG_SEEN)) {
+			add_prefetch(request, account, mbox, row);
+			break;
 		}
 	}
-	return NULL;
+	for (int i = 1; i <= n; ++i) {
+		add_prefetch(request, account, mbox, selected - dir * i);
+	}
+	worker_post_action(account->worker.pipe, WORKER_PREFETCH, NULL, request);
 }
 
-bool get_mailbox_flag(struct aerc_mailbox *mbox, char *flag) {
-	if (!mbox->flags) return false;
-	for (size_t i = 0; i < mbox->flags->length; ++i) {
-		const char *_flag = mbox->flags->items[i];
-		if (strcmp(flag, _flag) == 0) {
-			return true;
+void update_filter(struct account_state *account) {
+	message_view_free(account->ui.filtered);
+	account->ui.filtered = NULL;
+	struct aerc_mailbox *mbox = get_aerc_mailbox(account, account->selected);
+	struct uid_set *moving = account->ui.moving;
+	bool hiding = moving && moving->length;
+	if (!mbox || (!account->ui.search.active && !hiding)) {
+		return;
+	}
+	if (!hiding) {
+		account->ui.filtered = message_view_filter(account->ui.view,
+				mbox->messages->length, account->ui.search.indices,
+				account->ui.search.length);
+		return;
+	}
+	size_t length = account->ui.search.active ?
+		account->ui.search.length : mbox->messages->length;
+	int *indices = malloc((length + 1) * sizeof(int));
+	size_t count = 0;
+	for (size_t i = 0; i < length; ++i) {
+		int index = account->ui.search.active ?
+			account->ui.search.indices[i] : (int)i;
+		struct aerc_message *msg = index < (int)mbox->messages->length ?
+			mbox->messages->items[index] : NULL;
+		if (!msg || !msg->uid || !uid_set_contains(moving, msg->uid)) {
+			indices[count++] = index;
 		}
 	}
-	return false;
+	account->ui.filtered = message_view_filter(account->ui.view,
+			mbox->messages->length, indices, count);
+	free(indices);
+}
+
+void clear_search(struct account_state *account) {
+	free(account->ui.search.indices);
+	account->ui.search.indices = NULL;
+	account->ui.search.length = 0;
+	uid_set_free(account->ui.search.uids);
+	account->ui.search.uids = NULL;
+	account->ui.search.active = false;
+	message_view_free(account->ui.filtered);
+	account->ui.filtered = NULL;
+}
+
+void clear_marks(struct account_state *account) {
+	uid_set_free(account->ui.marks.uids);
+	account->ui.marks.uids = NULL;
+	account->ui.marks.anchor = 0;
 }
 
-bool get_message_flag(struct aerc_message *msg, char *flag) {
-	if (!msg->flags) return false;
-	for (size_t i = 0; i < msg->flags->length; ++i) {
-		const char *_flag = msg->flags->items[i];
-		if (strcmp(flag, _flag) == 0) {
+/*
+ * The messages a command acts on: the marked ones if there are any, which are
+ * unmarked, otherwise the one at row. NULL if that one hasn't loaded yet.
+ */
+struct uid_set *take_targets(struct account_state *account,
+		struct aerc_mailbox *mbox, size_t row) {
+	struct uid_set *uids = account->ui.marks.uids;
+	if (uids && uids->length) {
+		account->ui.marks.uids = NULL;
+		clear_marks(account);
+		return uids;
+	}
+	struct aerc_message *msg = get_message_at_row(account, mbox, row);
+	if (!msg || !msg->uid) {
+		return NULL;
+	}
+	uids = uid_set_create();
+	uid_set_add(uids, msg->uid);
+	return uids;
+}
+
+/*
+ * Shows the change straight away and leaves the worker to tell the server when
+ * it gets a chance, see imap/worker/flags.c. Takes ownership of uids.
+ */
+void change_flags(struct account_state *account, struct aerc_mailbox *mbox,
+		struct uid_set *uids, uint32_t flags, bool add) {
+	for (size_t i = 0; i < mbox->messages->length; ++i) {
+		struct aerc_message *msg = mbox->messages->items[i];
+		if (!msg->uid || !uid_set_contains(uids, msg->uid)) {
+			continue;
+		}
+		uint32_t updated = add ? msg->flags | flags : msg->flags & ~flags;
+		if (updated == msg->flags) {
+			continue;
+		}
+		struct aerc_message *copy = aerc_message_with_flags(msg, updated);
+		mbox->messages->items[i] = copy;
+		if (account->viewer.msg == msg) {
+			account->viewer.msg = copy;
+		}
+		aerc_message_unref(msg);
+	}
+	struct store_flags_request *request =
+		calloc(1, sizeof(struct store_flags_request));
+	request->mailbox = strdup(mbox->name);
+	request->uids = uids;
+	request->flags = flags;
+	request->add = add;
+	worker_post_action(account->worker.pipe, WORKER_STORE_FLAGS, NULL, request);
+	request_rerender(PANEL_MESSAGE_LIST);
+}
+
+const char *get_message_header(struct aerc_message *msg, char *key) {
+	if (!msg) {
+		return NULL;
+	}
+	return get_header(msg->headers, key);
+}
+
+static bool has_interned(list_t *list, const char *str) {
+	if (!list) return false;
+	str = intern_find(str);
+	for (size_t i = 0; str && i < list->length; ++i) {
+		if (list->items[i] == str) {
 			return true;
 		}
 	}
 	return false;
 }
 
+bool get_mailbox_flag(struct aerc_mailbox *mbox, const char *flag) {
+	return has_interned(mbox->flags, flag);
+}
+
+bool get_message_flag(struct aerc_message *msg, const char *flag) {
+	uint32_t bit = parse_flag(flag);
+	if (bit) {
+		return msg->flags & bit;
+	}
+	return has_keyword(msg->keywords, flag);
+}
+
 struct account_config *config_for_account(const char *name) {
 	for (size_t i = 0; i < config->accounts->length; ++i) {
 		struct account_config *c = config->accounts->items[i];
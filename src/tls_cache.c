@@ -0,0 +1,202 @@
+/*
+ * tls_cache.c - The process-wide SSL_CTX and the TLS sessions to resume
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#ifdef USE_OPENSSL
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "log.h"
+#include "tls_cache.h"
+#include "util/list.h"
+
+#define MAX_SESSION (64 * 1024)
+
+struct tls_entry {
+	char *key; // host:port
+	char *path; // Where it's kept on disk, if anywhere
+	SSL_SESSION *session;
+};
+
+static SSL_CTX *context;
+static int key_index = -1; // Of the key on each SSL we made
+static pthread_once_t context_once = PTHREAD_ONCE_INIT;
+/* Each account's worker has its own thread, and they may share servers */
+static list_t *entries;
+static pthread_mutex_t entries_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *make_key(const char *host, const char *port) {
+	char *key = malloc(strlen(host) + strlen(port) + 2);
+	sprintf(key, "%s:%s", host, port);
+	return key;
+}
+
+/* Call with entries_lock held */
+static struct tls_entry *get_entry(const char *key, bool create) {
+	for (size_t i = 0; entries && i < entries->length; ++i) {
+		struct tls_entry *entry = entries->items[i];
+		if (strcmp(entry->key, key) == 0) {
+			return entry;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+	if (!entries) {
+		entries = create_list();
+	}
+	struct tls_entry *entry = calloc(1, sizeof(struct tls_entry));
+	entry->key = strdup(key);
+	list_add(entries, entry);
+	return entry;
+}
+
+static bool still_good(SSL_SESSION *session) {
+	return SSL_SESSION_is_resumable(session)
+		&& SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session)
+			> time(NULL);
+}
+
+static void save_session(const char *path, SSL_SESSION *session) {
+	int length = i2d_SSL_SESSION(session, NULL);
+	if (length <= 0 || length > MAX_SESSION) {
+		return;
+	}
+	unsigned char *der = malloc(length), *p = der;
+	i2d_SSL_SESSION(session, &p);
+	char *tmp = malloc(strlen(path) + sizeof(".tmp"));
+	sprintf(tmp, "%s.tmp", path);
+	// It has the keys to the session in it
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	bool ok = fd >= 0 && write(fd, der, length) == length;
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (!ok || rename(tmp, path) != 0) {
+		worker_log(L_DEBUG, "Unable to save the TLS session to %s", path);
+		unlink(tmp);
+	}
+	free(tmp);
+	free(der);
+}
+
+static SSL_SESSION *load_session(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	unsigned char *der = malloc(MAX_SESSION);
+	ssize_t length = read(fd, der, MAX_SESSION);
+	close(fd);
+	const unsigned char *p = der;
+	SSL_SESSION *session = length > 0 ?
+		d2i_SSL_SESSION(NULL, &p, length) : NULL;
+	free(der);
+	if (session && !still_good(session)) {
+		SSL_SESSION_free(session);
+		session = NULL;
+	}
+	return session;
+}
+
+/*
+ * With TLS 1.3 the server sends its tickets after the handshake, whenever it
+ * likes, so this is the only place to pick them up.
+ */
+static int new_session(SSL *ssl, SSL_SESSION *session) {
+	const char *key = SSL_get_ex_data(ssl, key_index);
+	if (!key || !SSL_SESSION_is_resumable(session)) {
+		return 0;
+	}
+	pthread_mutex_lock(&entries_lock);
+	struct tls_entry *entry = get_entry(key, true);
+	if (entry->session) {
+		SSL_SESSION_free(entry->session);
+	}
+	entry->session = session;
+	char *path = entry->path ? strdup(entry->path) : NULL;
+	SSL_SESSION_up_ref(session);
+	pthread_mutex_unlock(&entries_lock);
+	if (path) {
+		save_session(path, session);
+		free(path);
+	}
+	SSL_SESSION_free(session);
+	return 1; // entry->session holds the reference we were given
+}
+
+static void free_key(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+		int idx, long argl, void *argp) {
+	free(ptr);
+}
+
+static void create_context() {
+	context = SSL_CTX_new(TLS_client_method());
+	if (!context) {
+		worker_log(L_ERROR, "Unable to allocate SSL context: %s",
+				ERR_error_string(ERR_get_error(), NULL));
+		return;
+	}
+	// TODO: Make ssl_options customizable
+	SSL_CTX_set_options(context, SSL_OP_NO_SSLv3 | SSL_OP_NO_SSLv2);
+	// TODO: client certificates
+	//SSL_CTX_set_cipher_list(context, ""); // TODO: configurable
+	SSL_CTX_set_session_cache_mode(context,
+			SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(context, new_session);
+	key_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, free_key);
+}
+
+SSL_CTX *tls_context() {
+	pthread_once(&context_once, create_context);
+	return context;
+}
+
+void tls_cache_open(const char *host, const char *port, const char *path) {
+	char *key = make_key(host, port);
+	SSL_SESSION *session = load_session(path);
+	pthread_mutex_lock(&entries_lock);
+	struct tls_entry *entry = get_entry(key, true);
+	free(entry->path);
+	entry->path = strdup(path);
+	if (session && !entry->session) {
+		entry->session = session;
+		session = NULL;
+	}
+	pthread_mutex_unlock(&entries_lock);
+	if (session) {
+		SSL_SESSION_free(session);
+	}
+	free(key);
+}
+
+bool tls_cache_resume(SSL *ssl, const char *host, const char *port) {
+	if (!tls_context()) {
+		return false;
+	}
+	char *key = make_key(host, port);
+	bool resuming = false;
+	pthread_mutex_lock(&entries_lock);
+	struct tls_entry *entry = get_entry(key, false);
+	if (entry && entry->session && still_good(entry->session)) {
+		resuming = SSL_set_session(ssl, entry->session) == 1;
+	}
+	pthread_mutex_unlock(&entries_lock);
+	// Handed to the SSL, so new_session knows where it's from
+	SSL_set_ex_data(ssl, key_index, key);
+	return resuming;
+}
+
+#endif
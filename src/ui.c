@@ -131,6 +131,11 @@ void request_fetch(struct aerc_message *message) {
 void fetch_pending() {
 	struct account_state *account =
 		state->accounts->items[state->selected_account];
+	if (account->ui.selecting) {
+		// They're for the mailbox we're leaving
+		reset_fetches();
+		return;
+	}
 	while (account->ui.fetch_requests->length) {
 		struct message_range *range = account->ui.fetch_requests->items[0];
 		range->max++;
@@ -275,20 +280,24 @@ void rerender_item(size_t index) {
 	if (!mailbox || index >= mailbox->messages->length) {
 		return;
 	}
+	size_t row = message_view_row(displayed_view(account),
+			mailbox->messages->length, index);
+	if (row >= displayed_rows(account, mailbox)) {
+		// Not shown, e.g. not a search result
+		return;
+	}
 	int folder_width = config->ui.sidebar_width;
 	struct geometry geo = {
 		.width = tb_width(),
 		.height = tb_height(),
 		.x = folder_width,
-		.y = state->panels.message_list.y +
-			mailbox->messages->length - account->ui.list_offset - (index + 1)
+		.y = state->panels.message_list.y + row - account->ui.list_offset
 	};
 	worker_log(L_DEBUG, "Rerendering item %zd at %d", index, geo.y);
 	struct aerc_message *message = mailbox->messages->items[index];
 	if (!message) {
 		return;
 	}
-	size_t selected = mailbox->messages->length - account->ui.selected_message - 1;
 	for (size_t i = 0; i < loading_indicators->length; ++i) {
 		struct loading_indicator *indic = loading_indicators->items[i];
 		if (indic->x == geo.x && indic->y == geo.y) {
@@ -298,7 +307,8 @@ void rerender_item(size_t index) {
 	}
 	geo.width -= folder_width;
 	geo.height -= 2;
-	render_item(geo, message, selected == index);
+	render_item(geo, message, row == account->ui.selected_message,
+			message_view_depth(displayed_view(account), row));
 	tb_present();
 }
 
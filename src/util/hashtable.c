@@ -28,71 +28,43 @@ void free_hashtable(hashtable_t *table) {
 	free(table);
 }
 
-bool hashtable_contains(hashtable_t *table, const void *key) {
-	unsigned int hash = table->hash(key);
-	unsigned int bucket = hash % table->bucket_count;
-	hashtable_entry_t *entry = table->buckets[bucket];
-	if (entry) {
-		if (entry->key != hash) {
-			while (entry->next) {
-				entry = entry->next;
-				if (!entry || entry->key == hash) {
-					break;
-				}
-			}
-		}
-	} else {
-		return false;
+/*
+ * Keys are only told apart by their hashes. Several of them can share a
+ * bucket, so we have to look along the chain for the right one.
+ */
+static hashtable_entry_t *find_entry(hashtable_t *table, unsigned int hash,
+		hashtable_entry_t **previous) {
+	hashtable_entry_t *entry = table->buckets[hash % table->bucket_count];
+	hashtable_entry_t *prev = NULL;
+	while (entry && entry->key != hash) {
+		prev = entry;
+		entry = entry->next;
+	}
+	if (previous) {
+		*previous = prev;
 	}
-	return true;
+	return entry;
+}
+
+bool hashtable_contains(hashtable_t *table, const void *key) {
+	return find_entry(table, table->hash(key), NULL) != NULL;
 }
 
 void *hashtable_get(hashtable_t *table, const void *key) {
-	unsigned int hash = table->hash(key);
-	unsigned int bucket = hash % table->bucket_count;
-	hashtable_entry_t *entry = table->buckets[bucket];
-	if (entry) {
-		if (entry->key != hash) {
-			while (entry->next) {
-				entry = entry->next;
-				if (!entry || entry->key == hash) {
-					break;
-				}
-			}
-		}
-	} else {
-		return NULL;
-	}
-	return entry->value;
+	hashtable_entry_t *entry = find_entry(table, table->hash(key), NULL);
+	return entry ? entry->value : NULL;
 }
 
 void *hashtable_set(hashtable_t *table, const void *key, void *value) {
 	unsigned int hash = table->hash(key);
-	unsigned int bucket = hash % table->bucket_count;
-	hashtable_entry_t *entry = table->buckets[bucket];
-	hashtable_entry_t *previous = NULL;
-
-	if (entry) {
-		if (entry->key != hash) {
-			while (entry->next) {
-				previous = entry;
-				entry = entry->next;
-				if (!entry || entry->key == hash) {
-					break;
-				}
-			}
-		}
-	}
-
+	hashtable_entry_t *entry = find_entry(table, hash, NULL);
 	if (entry == NULL) {
+		unsigned int bucket = hash % table->bucket_count;
 		entry = calloc(1, sizeof(hashtable_entry_t));
 		entry->key = hash;
+		entry->next = table->buckets[bucket];
 		table->buckets[bucket] = entry;
-		if (previous) {
-			previous->next = entry;
-		}
 	}
-
 	void *old = entry->value;
 	entry->value = value;
 	return old;
@@ -100,32 +72,17 @@ void *hashtable_set(hashtable_t *table, const void *key, void *value) {
 
 void *hashtable_del(hashtable_t *table, const void *key) {
 	unsigned int hash = table->hash(key);
-	unsigned int bucket = hash % table->bucket_count;
-	hashtable_entry_t *entry = table->buckets[bucket];
-	hashtable_entry_t *previous = NULL;
-
-	if (entry) {
-		if (entry->key != hash) {
-			while (entry->next) {
-				previous = entry;
-				entry = entry->next;
-				if (!entry || entry->key == hash) {
-					break;
-				}
-			}
-		}
-	}
-
+	hashtable_entry_t *previous;
+	hashtable_entry_t *entry = find_entry(table, hash, &previous);
 	if (entry == NULL) {
 		return NULL;
+	}
+	if (previous) {
+		previous->next = entry->next;
 	} else {
-		void *old = entry->value;
-		if (previous) {
-			previous->next = entry->next;
-		} else {
-			table->buckets[bucket] = NULL;
-		}
-		free(entry);
-		return old;
+		table->buckets[hash % table->bucket_count] = entry->next;
 	}
+	void *old = entry->value;
+	free(entry);
+	return old;
 }
@@ -0,0 +1,123 @@
+/*
+ * util/intern.c - process-wide string interning
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "util/intern.h"
+
+struct intern_table {
+	bool nocase;
+	size_t length, capacity;
+	const char **items;
+};
+
+static struct intern_table table = { .nocase = true };
+static struct intern_table mailbox_table = { .nocase = false };
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int hash_str(const struct intern_table *t, const char *str) {
+	/* djb2, case folded for the case-insensitive table */
+	unsigned int hash = 5381;
+	unsigned char c;
+	while ((c = *str++)) {
+		hash = ((hash << 5) + hash) + (t->nocase ? tolower(c) : c);
+	}
+	return hash;
+}
+
+static const char **find_slot(const struct intern_table *t,
+		const char **items, size_t capacity, const char *str, unsigned int hash) {
+	/* Open addressing with linear probing, capacity is a power of two */
+	size_t i = hash & (capacity - 1);
+	while (items[i] && (t->nocase ? strcasecmp(items[i], str)
+				: strcmp(items[i], str)) != 0) {
+		i = (i + 1) & (capacity - 1);
+	}
+	return &items[i];
+}
+
+static void table_grow(struct intern_table *t) {
+	size_t capacity = t->capacity ? t->capacity * 2 : 256;
+	const char **items = calloc(capacity, sizeof(const char *));
+	for (size_t i = 0; i < t->capacity; ++i) {
+		const char *str = t->items[i];
+		if (str) {
+			*find_slot(t, items, capacity, str, hash_str(t, str)) = str;
+		}
+	}
+	free(t->items);
+	t->items = items;
+	t->capacity = capacity;
+}
+
+static const char *_intern(struct intern_table *t, const char *str,
+		bool insert) {
+	if (!str) {
+		return NULL;
+	}
+	unsigned int hash = hash_str(t, str);
+	pthread_mutex_lock(&table_lock);
+	if (insert && (t->length + 1) * 4 > t->capacity * 3) {
+		table_grow(t);
+	}
+	const char *result = NULL;
+	if (t->capacity) {
+		const char **slot = find_slot(t, t->items, t->capacity, str, hash);
+		if (!*slot && insert) {
+			*slot = strdup(str);
+			++t->length;
+		}
+		result = *slot;
+	}
+	pthread_mutex_unlock(&table_lock);
+	return result;
+}
+
+const char *intern(const char *str) {
+	return _intern(&table, str, true);
+}
+
+const char *intern_find(const char *str) {
+	return _intern(&table, str, false);
+}
+
+const char *intern_known(const char *str, const char *const *known) {
+	if (!str) {
+		return NULL;
+	}
+	for (size_t i = 0; known[i]; ++i) {
+		if (strcasecmp(known[i], str) == 0) {
+			return intern(known[i]);
+		}
+	}
+	return strdup(str);
+}
+
+const char *intern_copy(const char *str) {
+	return !str || intern_find(str) == str ? str : strdup(str);
+}
+
+void intern_release(const char *str) {
+	if (str && intern_find(str) != str) {
+		free((char *)str);
+	}
+}
+
+static const char *fold_inbox(const char *name) {
+	return name && strcasecmp(name, "INBOX") == 0 ? "INBOX" : name;
+}
+
+const char *intern_mailbox(const char *name) {
+	return _intern(&mailbox_table, fold_inbox(name), true);
+}
+
+const char *intern_mailbox_find(const char *name) {
+	return _intern(&mailbox_table, fold_inbox(name), false);
+}
@@ -0,0 +1,177 @@
+/*
+ * util/uid_set.c - sets of message UIDs as IMAP sequence-sets
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/uid_set.h"
+
+struct uid_set *uid_set_create(void) {
+	return calloc(1, sizeof(struct uid_set));
+}
+
+void uid_set_free(struct uid_set *set) {
+	if (!set) {
+		return;
+	}
+	free(set->ranges);
+	free(set);
+}
+
+/* Index of the first range that ends at or after uid */
+static size_t find_range(const struct uid_set *set, uint32_t uid) {
+	size_t lo = 0, hi = set->length;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (set->ranges[mid].max < uid) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+void uid_set_add_range(struct uid_set *set, uint32_t min, uint32_t max) {
+	if (min > max) {
+		uint32_t tmp = min;
+		min = max;
+		max = tmp;
+	}
+	// Ranges that overlap or touch [min, max] are merged into it
+	size_t first = find_range(set, min ? min - 1 : 0);
+	size_t last = first;
+	while (last < set->length
+			&& (uint64_t)set->ranges[last].min <= (uint64_t)max + 1) {
+		if (set->ranges[last].min < min) {
+			min = set->ranges[last].min;
+		}
+		if (set->ranges[last].max > max) {
+			max = set->ranges[last].max;
+		}
+		++last;
+	}
+	if (first == last) {
+		if (set->length == set->capacity) {
+			set->capacity = set->capacity ? set->capacity * 2 : 8;
+			set->ranges = realloc(set->ranges,
+					set->capacity * sizeof(struct uid_range));
+		}
+		memmove(&set->ranges[first + 1], &set->ranges[first],
+				(set->length - first) * sizeof(struct uid_range));
+		++set->length;
+	} else if (last - first > 1) {
+		memmove(&set->ranges[first + 1], &set->ranges[last],
+				(set->length - last) * sizeof(struct uid_range));
+		set->length -= last - first - 1;
+	}
+	set->ranges[first].min = min;
+	set->ranges[first].max = max;
+}
+
+void uid_set_add(struct uid_set *set, uint32_t uid) {
+	// UIDs usually arrive in order, which only ever touches the last range
+	if (set->length && set->ranges[set->length - 1].max + 1 == uid) {
+		set->ranges[set->length - 1].max = uid;
+		return;
+	}
+	uid_set_add_range(set, uid, uid);
+}
+
+void uid_set_remove(struct uid_set *set, uint32_t uid) {
+	size_t i = find_range(set, uid);
+	if (i == set->length || set->ranges[i].min > uid) {
+		return;
+	}
+	struct uid_range *range = &set->ranges[i];
+	if (range->min == range->max) {
+		memmove(range, range + 1,
+				(set->length - i - 1) * sizeof(struct uid_range));
+		--set->length;
+	} else if (range->min == uid) {
+		++range->min;
+	} else if (range->max == uid) {
+		--range->max;
+	} else {
+		// Split in two
+		uint32_t max = range->max;
+		range->max = uid - 1;
+		uid_set_add_range(set, uid + 1, max);
+	}
+}
+
+bool uid_set_contains(const struct uid_set *set, uint32_t uid) {
+	size_t i = find_range(set, uid);
+	return i < set->length && set->ranges[i].min <= uid;
+}
+
+size_t uid_set_count(const struct uid_set *set) {
+	size_t count = 0;
+	for (size_t i = 0; i < set->length; ++i) {
+		count += (size_t)set->ranges[i].max - set->ranges[i].min + 1;
+	}
+	return count;
+}
+
+static bool parse_number(const char **str, uint32_t *value) {
+	const char *s = *str;
+	uint64_t v = 0;
+	if (*s < '1' || *s > '9') {
+		return false;
+	}
+	while (*s >= '0' && *s <= '9') {
+		v = v * 10 + (*s++ - '0');
+		if (v > UINT32_MAX) {
+			return false;
+		}
+	}
+	*value = v;
+	*str = s;
+	return true;
+}
+
+bool uid_set_parse(struct uid_set *set, const char *str) {
+	while (true) {
+		uint32_t min, max;
+		if (!parse_number(&str, &min)) {
+			return false;
+		}
+		max = min;
+		if (*str == ':') {
+			++str;
+			if (!parse_number(&str, &max)) {
+				return false;
+			}
+		}
+		uid_set_add_range(set, min, max);
+		if (*str == '\0') {
+			return true;
+		} else if (*str++ != ',') {
+			return false;
+		}
+	}
+}
+
+char *uid_set_format(const struct uid_set *set, size_t first, size_t count) {
+	if (first > set->length) {
+		first = set->length;
+	}
+	if (count > set->length - first) {
+		count = set->length - first;
+	}
+	// Two ten digit numbers, a colon and a comma per range
+	char *str = malloc(count * 22 + 1);
+	size_t len = 0;
+	str[0] = '\0';
+	for (size_t i = first; i < first + count; ++i) {
+		const struct uid_range *range = &set->ranges[i];
+		len += sprintf(str + len, i == first ? "%u" : ",%u", range->min);
+		if (range->max != range->min) {
+			len += sprintf(str + len, ":%u", range->max);
+		}
+	}
+	return str;
+}
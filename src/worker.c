@@ -1,14 +1,34 @@
 /*
  * worker.c - support code for mail workers
  */
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "util/aqueue.h"
+#include "util/intern.h"
+#include "util/list.h"
+#include "util/stringop.h"
 #include "worker.h"
 
+static bool make_wake(int fds[2]) {
+	if (pipe(fds) != 0) {
+		return false;
+	}
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+	return true;
+}
+
 struct worker_pipe *worker_pipe_new() {
 	struct worker_pipe *pipe = calloc(1, sizeof(struct worker_pipe));
 	if (!pipe) return NULL;
@@ -20,15 +40,42 @@ struct worker_pipe *worker_pipe_new() {
 		free(pipe);
 		return NULL;
 	}
+	if (!make_wake(pipe->wake)) {
+		// Then the worker only finds actions when it wakes up anyway
+		pipe->wake[0] = pipe->wake[1] = -1;
+	}
 	return pipe;
 }
 
 void worker_pipe_free(struct worker_pipe *pipe) {
 	aqueue_free(pipe->messages);
 	aqueue_free(pipe->actions);
+	if (pipe->wake[0] >= 0) {
+		close(pipe->wake[0]);
+		close(pipe->wake[1]);
+	}
 	free(pipe);
 }
 
+static void wake_worker(struct worker_pipe *pipe) {
+	if (pipe->wake[1] >= 0) {
+		// If it's full there's plenty to wake the worker already
+		ssize_t _ = write(pipe->wake[1], "", 1);
+		(void)_;
+	}
+}
+
+void worker_wait(struct worker_pipe *pipe, int fd, short events, int timeout) {
+	struct pollfd fds[2] = {
+		{ .fd = pipe->wake[0], .events = POLLIN },
+		{ .fd = fd, .events = events },
+	};
+	if (poll(fds, 2, timeout) > 0 && fds[0].revents & POLLIN) {
+		char buf[64];
+		while (read(pipe->wake[0], buf, sizeof(buf)) > 0);
+	}
+}
+
 static bool _worker_get(aqueue_t *queue,
 		struct worker_message **message) {
 	void *msg;
@@ -49,10 +96,23 @@ bool worker_get_action(struct worker_pipe *pipe,
 	return _worker_get(pipe->actions, message);
 }
 
-void _worker_post(aqueue_t *queue,
+/* Unless the master says otherwise */
+static enum worker_priority default_priority(enum worker_message_type type) {
+	switch (type) {
+	case WORKER_FETCH_MESSAGES:
+		return PRIORITY_BACKGROUND;
+	case WORKER_PREFETCH:
+		return PRIORITY_PREFETCH;
+	default:
+		return PRIORITY_INTERACTIVE;
+	}
+}
+
+static void _worker_post(aqueue_t *queue,
 		enum worker_message_type type,
 		struct worker_message *in_response_to,
-		void *data) {
+		void *data, enum worker_priority priority,
+		unsigned long id, unsigned long generation) {
 	struct worker_message *message = calloc(1, sizeof(struct worker_message));
 	if (!message) {
 		fprintf(stderr, "Unable to allocate messages, aborting worker thread");
@@ -62,6 +122,9 @@ void _worker_post(aqueue_t *queue,
 	message->type = type;
 	message->in_response_to = in_response_to;
 	message->data = data;
+	message->priority = priority;
+	message->id = id;
+	message->generation = generation;
 	aqueue_enqueue(queue, message);
 }
 
@@ -69,16 +132,240 @@ void worker_post_message(struct worker_pipe *pipe,
 		enum worker_message_type type,
 		struct worker_message *in_response_to,
 		void *data) {
-	_worker_post(pipe->messages, type, in_response_to, data);
+	_worker_post(pipe->messages, type, in_response_to, data,
+			PRIORITY_INTERACTIVE, 0, pipe->worker_generation);
+}
+
+/* For results that belong to a view other than the worker's current one */
+void worker_post_message_generation(struct worker_pipe *pipe,
+		enum worker_message_type type,
+		struct worker_message *in_response_to,
+		void *data, unsigned long generation) {
+	_worker_post(pipe->messages, type, in_response_to, data,
+			PRIORITY_INTERACTIVE, 0, generation);
 }
 
 void worker_post_action(struct worker_pipe *pipe,
 		enum worker_message_type type,
 		struct worker_message *in_response_to,
 		void *data) {
-	_worker_post(pipe->actions, type, in_response_to, data);
+	_worker_post(pipe->actions, type, in_response_to, data,
+			default_priority(type), ++pipe->next_id, pipe->generation);
+	wake_worker(pipe);
+}
+
+void worker_post_action_priority(struct worker_pipe *pipe,
+		enum worker_message_type type,
+		struct worker_message *in_response_to,
+		void *data, enum worker_priority priority) {
+	_worker_post(pipe->actions, type, in_response_to, data, priority,
+			++pipe->next_id, pipe->generation);
+	wake_worker(pipe);
 }
 
 void worker_message_free(struct worker_message *msg) {
 	free(msg);
 }
+
+/* Called by the master when it leaves a view, before it asks for the next */
+unsigned long worker_pipe_advance(struct worker_pipe *pipe) {
+	return ++pipe->generation;
+}
+
+struct worker_scheduler *worker_scheduler_new() {
+	struct worker_scheduler *sched = calloc(1, sizeof(struct worker_scheduler));
+	if (!sched) return NULL;
+	for (size_t i = 0; i < PRIORITY_COUNT; ++i) {
+		sched->queues[i] = create_list();
+	}
+	return sched;
+}
+
+/*
+ * Whatever is still queued is dropped, with free_action freeing its data,
+ * which only the worker knows how to do for each type
+ */
+void worker_scheduler_free(struct worker_scheduler *sched,
+		void (*free_action)(struct worker_message *message)) {
+	if (!sched) {
+		return;
+	}
+	for (size_t i = 0; i < PRIORITY_COUNT; ++i) {
+		list_t *queue = sched->queues[i];
+		for (size_t j = 0; j < queue->length; ++j) {
+			struct worker_message *message = queue->items[j];
+			if (free_action) {
+				free_action(message);
+			}
+			worker_message_free(message);
+		}
+		list_free(queue);
+	}
+	free(sched);
+}
+
+/* Queues are kept newest first, so the next one out is at the end */
+void worker_scheduler_add(struct worker_scheduler *sched,
+		struct worker_message *message) {
+	enum worker_priority priority = message->priority < PRIORITY_COUNT ?
+		message->priority : PRIORITY_BACKGROUND;
+	list_enqueue(sched->queues[priority], message);
+}
+
+/* Puts an action back at the head of its queue, for when it was split */
+void worker_scheduler_requeue(struct worker_scheduler *sched,
+		struct worker_message *message) {
+	enum worker_priority priority = message->priority < PRIORITY_COUNT ?
+		message->priority : PRIORITY_BACKGROUND;
+	list_add(sched->queues[priority], message);
+}
+
+/* Takes the most urgent action no less urgent than lowest */
+bool worker_scheduler_next(struct worker_scheduler *sched,
+		enum worker_priority lowest, struct worker_message **message) {
+	for (size_t i = 0; i <= lowest && i < PRIORITY_COUNT; ++i) {
+		if (sched->queues[i]->length) {
+			*message = list_dequeue(sched->queues[i]);
+			return true;
+		}
+	}
+	return false;
+}
+
+size_t worker_scheduler_pending(struct worker_scheduler *sched,
+		enum worker_priority priority) {
+	return sched->queues[priority]->length;
+}
+
+/*
+ * Drops the queued actions of a type posted in a generation before the one
+ * given, whatever their priority
+ */
+size_t worker_scheduler_cancel(struct worker_scheduler *sched,
+		enum worker_message_type type, unsigned long before,
+		void (*free_data)(void *data)) {
+	size_t cancelled = 0;
+	for (size_t i = 0; i < PRIORITY_COUNT; ++i) {
+		list_t *queue = sched->queues[i];
+		for (size_t j = 0; j < queue->length; ++j) {
+			struct worker_message *message = queue->items[j];
+			if (message->type != type || message->generation >= before) {
+				continue;
+			}
+			if (free_data) {
+				free_data(message->data);
+			}
+			worker_message_free(message);
+			list_del(queue, j--);
+			++cancelled;
+		}
+	}
+	return cancelled;
+}
+
+void aerc_message_move_free(struct aerc_message_move *move) {
+	if (!move) return;
+	free(move->mailbox);
+	uid_set_free(move->uids);
+	free(move->destination);
+	free(move);
+}
+
+void store_flags_request_free(struct store_flags_request *request) {
+	if (!request) return;
+	free(request->mailbox);
+	uid_set_free(request->uids);
+	free(request);
+}
+
+void send_request_free(struct send_request *req) {
+	if (!req) return;
+	free(req->path);
+	free(req->from);
+	free_flat_list(req->recipients);
+	free(req->error);
+	free(req);
+}
+
+struct aerc_message *aerc_message_new() {
+	struct aerc_message *msg = calloc(1, sizeof(struct aerc_message));
+	if (msg) {
+		atomic_init(&msg->refs, 1);
+	}
+	return msg;
+}
+
+/*
+ * Snapshots are shared with the worker, so to show a change before the worker
+ * has made it the UI swaps in a copy instead
+ */
+struct aerc_message *aerc_message_with_flags(const struct aerc_message *msg,
+		uint32_t flags) {
+	struct aerc_message *copy = aerc_message_new();
+	copy->fetching = msg->fetching;
+	copy->fetched = msg->fetched;
+	copy->index = msg->index;
+	copy->uid = msg->uid;
+	copy->flags = flags;
+	copy->size = msg->size;
+	copy->keywords = keywords_dup(msg->keywords);
+	copy->headers = headers_dup(msg->headers);
+	if (msg->internal_date) {
+		copy->internal_date = malloc(sizeof(struct tm));
+		memcpy(copy->internal_date, msg->internal_date, sizeof(struct tm));
+	}
+	if (msg->parts) {
+		copy->parts = create_list();
+		for (size_t i = 0; i < msg->parts->length; ++i) {
+			struct aerc_message_part *part = msg->parts->items[i];
+			struct aerc_message_part *dpart =
+				malloc(sizeof(struct aerc_message_part));
+			*dpart = *part;
+			dpart->type = intern_copy(part->type);
+			dpart->subtype = intern_copy(part->subtype);
+			dpart->body_encoding = intern_copy(part->body_encoding);
+			if (part->body_id) dpart->body_id = strdup(part->body_id);
+			if (part->body_description) {
+				dpart->body_description = strdup(part->body_description);
+			}
+			dpart->content = body_ref(part->content);
+			list_add(copy->parts, dpart);
+		}
+	}
+	return copy;
+}
+
+struct aerc_message *aerc_message_ref(struct aerc_message *msg) {
+	if (msg) {
+		atomic_fetch_add(&msg->refs, 1);
+	}
+	return msg;
+}
+
+static void free_aerc_message_part(struct aerc_message_part *part) {
+	if (!part) return;
+	intern_release(part->type);
+	intern_release(part->subtype);
+	intern_release(part->body_encoding);
+	free(part->body_id);
+	free(part->body_description);
+	body_unref(part->content);
+	free(part);
+}
+
+void aerc_message_unref(struct aerc_message *msg) {
+	if (!msg || atomic_fetch_sub(&msg->refs, 1) != 1) {
+		return;
+	}
+	keywords_free(msg->keywords);
+	free_headers(msg->headers);
+	free(msg->internal_date);
+	if (msg->parts) {
+		for (size_t i = 0; i < msg->parts->length; ++i) {
+			struct aerc_message_part *part = msg->parts->items[i];
+			free_aerc_message_part(part);
+		}
+		list_free(msg->parts);
+	}
+	free(msg);
+}
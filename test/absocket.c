@@ -0,0 +1,151 @@
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "tests.h"
+#include "absocket.h"
+#include "urlparse.h"
+
+void __real_absocket_free(absocket_t *socket);
+ssize_t __real_ab_recv(absocket_t *socket, void *buffer, size_t len);
+
+/* A server on 127.0.0.1 that takes very little at a time */
+static int slow_server(char *port, size_t size) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int rcvbuf = 4096;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t length = sizeof(addr);
+	if (bind(fd, (struct sockaddr *)&addr, length) != 0
+			|| getsockname(fd, (struct sockaddr *)&addr, &length) != 0
+			|| listen(fd, 1) != 0) {
+		close(fd);
+		return -1;
+	}
+	snprintf(port, size, "%d", ntohs(addr.sin_port));
+	return fd;
+}
+
+static absocket_t *connect_to(const char *port) {
+	struct uri uri = { .hostname = "127.0.0.1", .port = (char *)port };
+	return absocket_new(&uri, false);
+}
+
+static int setup(void **state) {
+	real_poll = true;
+	return 0;
+}
+
+static int teardown(void **state) {
+	real_poll = false;
+	return 0;
+}
+
+static void test_send_throttled(void **state) {
+	char port[8];
+	int server = slow_server(port, sizeof(port));
+	assert_true(server >= 0);
+	absocket_t *abs = connect_to(port);
+	assert_non_null(abs);
+	int client = accept(server, NULL, NULL);
+	assert_true(client >= 0);
+
+	// Far more than the socket buffers hold, and it mustn't block
+	const size_t total = 4 * 1024 * 1024;
+	char line[64];
+	size_t sent = 0;
+	for (unsigned int i = 0; sent < total; ++i) {
+		int len = snprintf(line, sizeof(line), "a%08u NOOP\r\n", i);
+		assert_int_equal(ab_send(abs, line, len), len);
+		sent += len;
+	}
+	assert_true(ab_flush(abs) > 0);
+	assert_true(ab_events(abs) & POLLOUT);
+
+	// It all arrives, in order, as the server gets around to reading it
+	char *received = malloc(sent);
+	size_t got = 0;
+	while (got < sent) {
+		ssize_t amt = recv(client, received + got,
+				sent - got < 1000 ? sent - got : 1000, 0);
+		assert_true(amt > 0);
+		got += amt;
+		assert_true(ab_flush(abs) >= 0);
+	}
+	assert_int_equal(ab_flush(abs), 0);
+	assert_false(ab_events(abs) & POLLOUT);
+	for (unsigned int i = 0, offset = 0; offset < got; ++i) {
+		int len = snprintf(line, sizeof(line), "a%08u NOOP\r\n", i);
+		assert_memory_equal(received + offset, line, len);
+		offset += len;
+	}
+
+	free(received);
+	close(client);
+	close(server);
+	__real_absocket_free(abs);
+}
+
+static void test_recv_nothing_yet(void **state) {
+	char port[8];
+	int server = slow_server(port, sizeof(port));
+	assert_true(server >= 0);
+	absocket_t *abs = connect_to(port);
+	assert_non_null(abs);
+	int client = accept(server, NULL, NULL);
+	assert_true(client >= 0);
+
+	char buf[16];
+	assert_int_equal(__real_ab_recv(abs, buf, sizeof(buf)), -1);
+	assert_int_equal(errno, EAGAIN);
+
+	assert_int_equal(send(client, "* OK\r\n", 6, 0), 6);
+	ssize_t amt;
+	do {
+		amt = __real_ab_recv(abs, buf, sizeof(buf));
+	} while (amt < 0 && errno == EAGAIN);
+	assert_int_equal(amt, 6);
+
+	// Then nothing at all once the server has hung up
+	close(client);
+	assert_int_equal(__real_ab_recv(abs, buf, sizeof(buf)), 0);
+
+	close(server);
+	__real_absocket_free(abs);
+}
+
+/* A server that never answers the ClientHello doesn't hold us up forever */
+static void test_handshake_timeout(void **state) {
+	int fds[2];
+	assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	absocket_t abs = { .basefd = fds[0] };
+	// As poll would once the deadline is up
+	will_return(__wrap_poll, 0);
+	assert_false(ab_enable_ssl(&abs));
+	assert_null(abs.ssl);
+	assert_false(abs.use_ssl);
+	char hello[5];
+	// The ClientHello went out without waiting for anything
+	assert_int_equal(recv(fds[1], hello, sizeof(hello), 0), sizeof(hello));
+	assert_int_equal(hello[0], 0x16);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+int run_tests_absocket() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_send_throttled, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_recv_nothing_yet,
+				setup, teardown),
+		cmocka_unit_test(test_handshake_timeout),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "body_cache.h"
+
+static struct body *make_body(size_t size) {
+	uint8_t *data = malloc(size);
+	memset(data, 'x', size);
+	return body_new(data, size);
+}
+
+struct eviction {
+	uint32_t uid, part;
+};
+
+static struct eviction evictions[8];
+static size_t nevictions;
+
+static void record_eviction(void *data, const char *mailbox,
+		uint32_t uid, uint32_t part) {
+	assert_string_equal(mailbox, "INBOX");
+	evictions[nevictions].uid = uid;
+	evictions[nevictions].part = part;
+	++nevictions;
+}
+
+static void put(struct body_cache *cache, uint32_t uid, size_t size) {
+	struct body *body = make_body(size);
+	body_cache_put(cache, "INBOX", uid, 1, body);
+	body_unref(body);
+}
+
+static void test_body_cache_lru(void **state) {
+	nevictions = 0;
+	struct body_cache *cache = body_cache_create(300);
+	body_cache_on_evict(cache, record_eviction, NULL);
+	put(cache, 1, 100);
+	put(cache, 2, 100);
+	put(cache, 3, 100);
+	assert_int_equal(nevictions, 0);
+
+	// 1 is now the most recently used, so 2 goes first
+	struct body *body = body_cache_get(cache, "INBOX", 1, 1);
+	assert_non_null(body);
+	assert_int_equal(body->size, 100);
+	put(cache, 4, 100);
+	assert_int_equal(nevictions, 1);
+	assert_int_equal(evictions[0].uid, 2);
+	assert_null(body_cache_peek(cache, "INBOX", 2, 1));
+	assert_non_null(body_cache_peek(cache, "INBOX", 3, 1));
+
+	// Our reference keeps the body alive after it's evicted
+	body_cache_set_budget(cache, 100);
+	assert_int_equal(nevictions, 3);
+	assert_int_equal(body->data[99], 'x');
+	body_unref(body);
+
+	const struct body_cache_stats *stats = body_cache_stats(cache);
+	assert_int_equal(stats->hits, 1);
+	assert_int_equal(stats->entries, 1);
+	assert_int_equal(stats->bytes, 100);
+	assert_null(body_cache_get(cache, "INBOX", 1, 1));
+	assert_null(body_cache_get(cache, "Archive", 4, 1));
+	assert_int_equal(stats->misses, 2);
+	body_cache_free(cache);
+}
+
+static void test_body_cache_oversized(void **state) {
+	nevictions = 0;
+	struct body_cache *cache = body_cache_create(100);
+	body_cache_on_evict(cache, record_eviction, NULL);
+	put(cache, 1, 50);
+	// Too big to fit, but it stays until the next one comes along
+	put(cache, 2, 500);
+	assert_int_equal(nevictions, 1);
+	assert_int_equal(evictions[0].uid, 1);
+	assert_non_null(body_cache_peek(cache, "INBOX", 2, 1));
+	put(cache, 3, 50);
+	assert_int_equal(nevictions, 2);
+	assert_int_equal(evictions[1].uid, 2);
+
+	// Putting the same part again replaces it
+	put(cache, 3, 80);
+	assert_int_equal(body_cache_stats(cache)->entries, 1);
+	assert_int_equal(body_cache_stats(cache)->bytes, 80);
+	body_cache_free(cache);
+}
+
+static void test_body_cache_many(void **state) {
+	struct body_cache *cache = body_cache_create(1000 * 10);
+	for (uint32_t uid = 1; uid <= 1000; ++uid) {
+		put(cache, uid, 10);
+	}
+	for (uint32_t uid = 1; uid <= 1000; ++uid) {
+		assert_non_null(body_cache_peek(cache, "INBOX", uid, 1));
+	}
+	assert_null(body_cache_peek(cache, "INBOX", 1, 2));
+	body_cache_free(cache);
+}
+
+static void test_body_cache_mailbox_case(void **state) {
+	struct body_cache *cache = body_cache_create(1000);
+	struct body *body = make_body(10);
+	body_cache_put(cache, "Foo", 1, 1, body);
+	body_cache_put(cache, "inbox", 1, 1, body);
+	body_unref(body);
+	// Only INBOX is the same in any case
+	assert_null(body_cache_peek(cache, "foo", 1, 1));
+	assert_non_null(body_cache_peek(cache, "Foo", 1, 1));
+	assert_non_null(body_cache_peek(cache, "INBOX", 1, 1));
+	body_cache_free(cache);
+}
+
+static void test_body_cache_drop_mailbox(void **state) {
+	struct body_cache *cache = body_cache_create(1000);
+	struct body *body = make_body(10);
+	body_cache_put(cache, "INBOX", 1, 1, body);
+	body_cache_put(cache, "Archive", 1, 1, body);
+	body_cache_put(cache, "INBOX", 2, 1, body);
+	body_unref(body);
+	body_cache_drop_mailbox(cache, "INBOX");
+	body_cache_drop_mailbox(cache, "Never seen");
+	assert_null(body_cache_peek(cache, "INBOX", 1, 1));
+	assert_null(body_cache_peek(cache, "INBOX", 2, 1));
+	assert_non_null(body_cache_peek(cache, "Archive", 1, 1));
+	assert_int_equal(body_cache_stats(cache)->entries, 1);
+	assert_int_equal(body_cache_stats(cache)->bytes, 10);
+	body_cache_free(cache);
+}
+
+int run_tests_body_cache() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_body_cache_lru),
+		cmocka_unit_test(test_body_cache_oversized),
+		cmocka_unit_test(test_body_cache_many),
+		cmocka_unit_test(test_body_cache_mailbox_case),
+		cmocka_unit_test(test_body_cache_drop_mailbox),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
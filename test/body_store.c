@@ -0,0 +1,175 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tests.h"
+#include "body_store.h"
+
+static void remove_tree(const char *path) {
+	DIR *dir = opendir(path);
+	struct dirent *ent;
+	while (dir && (ent = readdir(dir))) {
+		if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+			continue;
+		}
+		char *file = malloc(strlen(path) + strlen(ent->d_name) + 2);
+		sprintf(file, "%s/%s", path, ent->d_name);
+		struct stat st;
+		if (stat(file, &st) == 0 && S_ISDIR(st.st_mode)) {
+			remove_tree(file);
+		} else {
+			unlink(file);
+		}
+		free(file);
+	}
+	if (dir) {
+		closedir(dir);
+	}
+	rmdir(path);
+}
+
+static bool put(struct body_store *store, const char *mailbox, uint32_t uid,
+		const char *text) {
+	return body_store_put(store, mailbox, 1, uid, 1,
+			(const uint8_t *)text, strlen(text));
+}
+
+static void assert_body(struct body_store *store, const char *mailbox,
+		uint32_t uid, const char *text) {
+	struct body *body = body_store_get(store, mailbox, 1, uid, 1);
+	assert_non_null(body);
+	assert_int_equal(body->size, strlen(text));
+	assert_memory_equal(body->data, text, body->size);
+	body_unref(body);
+}
+
+static void test_body_store_reopen(void **state) {
+	char path[] = "/tmp/aerc-bodies-XXXXXX";
+	assert_non_null(mkdtemp(path));
+	const char *hello = "Hello, world! Hello, world! Hello, world!";
+	struct body_store *store = body_store_open(path, 1 << 20);
+	assert_true(put(store, "INBOX", 1, hello));
+	assert_true(put(store, "INBOX", 2, "Something else"));
+	// The same message in another mailbox is only stored once
+	assert_true(put(store, "Archive", 7, hello));
+	assert_true(body_store_put(store, "INBOX", 1, 3, 2,
+				(const uint8_t *)"", 0));
+	const struct body_store_stats *stats = body_store_stats(store);
+	assert_int_equal(stats->entries, 4);
+	assert_int_equal(stats->objects, 3);
+	assert_body(store, "Archive", 7, hello);
+	body_store_close(store);
+
+	store = body_store_open(path, 1 << 20);
+	stats = body_store_stats(store);
+	assert_int_equal(stats->entries, 4);
+	assert_int_equal(stats->objects, 3);
+	assert_body(store, "INBOX", 1, hello);
+	assert_body(store, "INBOX", 2, "Something else");
+	struct body *empty = body_store_get(store, "INBOX", 1, 3, 2);
+	assert_non_null(empty);
+	assert_int_equal(empty->size, 0);
+	body_unref(empty);
+	// A different UIDVALIDITY means a different message
+	assert_null(body_store_get(store, "INBOX", 2, 1, 1));
+	assert_false(body_store_contains(store, "INBOX", 1, 1, 2));
+	assert_true(body_store_contains(store, "Archive", 1, 7, 1));
+	body_store_close(store);
+	remove_tree(path);
+}
+
+static void test_body_store_eviction(void **state) {
+	char path[] = "/tmp/aerc-bodies-XXXXXX";
+	assert_non_null(mkdtemp(path));
+	struct body_store *store = body_store_open(path, 1 << 20);
+	assert_true(put(store, "INBOX", 1, "first message"));
+	assert_true(put(store, "INBOX", 2, "second message"));
+	assert_true(put(store, "INBOX", 3, "third message"));
+	// 1 is now the most recently used, so 2 goes first
+	assert_body(store, "INBOX", 1, "first message");
+	const struct body_store_stats *stats = body_store_stats(store);
+	body_store_set_budget(store, stats->bytes - 1);
+	assert_int_equal(stats->entries, 2);
+	assert_false(body_store_contains(store, "INBOX", 1, 2, 1));
+	assert_true(body_store_contains(store, "INBOX", 1, 1, 1));
+	body_store_close(store);
+
+	// Evictions are remembered
+	store = body_store_open(path, 1 << 20);
+	assert_int_equal(body_store_stats(store)->entries, 2);
+	assert_null(body_store_get(store, "INBOX", 1, 2, 1));
+	assert_body(store, "INBOX", 3, "third message");
+	body_store_close(store);
+	remove_tree(path);
+}
+
+static void test_body_store_compaction(void **state) {
+	char path[] = "/tmp/aerc-bodies-XXXXXX";
+	assert_non_null(mkdtemp(path));
+	struct body_store *store = body_store_open(path, 1 << 20);
+	assert_true(put(store, "INBOX", 1, "kept"));
+	assert_true(put(store, "INBOX", 2, "dropped"));
+	assert_true(put(store, "INBOX", 2, "replaced"));
+	for (int i = 0; i < 1100; ++i) {
+		assert_body(store, "INBOX", 1, "kept");
+	}
+	// A body left behind by a crash
+	char *stray = malloc(strlen(path) + sizeof("/objects/00/stray"));
+	sprintf(stray, "%s/objects/00", path);
+	mkdir(stray, 0700);
+	strcat(stray, "/stray");
+	FILE *f = fopen(stray, "w");
+	assert_non_null(f);
+	fclose(f);
+
+	const struct body_store_stats *stats = body_store_stats(store);
+	assert_int_equal(stats->objects, 2);
+	assert_true(stats->journal > 1100);
+	assert_true(body_store_maintain(store));
+	assert_int_not_equal(access(stray, F_OK), 0);
+	assert_true(body_store_maintain(store));
+	assert_int_equal(stats->journal, 2);
+	assert_false(body_store_maintain(store));
+	body_store_close(store);
+	free(stray);
+
+	store = body_store_open(path, 1 << 20);
+	assert_int_equal(body_store_stats(store)->entries, 2);
+	assert_body(store, "INBOX", 1, "kept");
+	assert_body(store, "INBOX", 2, "replaced");
+	body_store_close(store);
+	remove_tree(path);
+}
+
+static void test_body_store_link(void **state) {
+	char path[] = "/tmp/aerc-bodies-XXXXXX";
+	assert_non_null(mkdtemp(path));
+	struct body_store *store = body_store_open(path, 1 << 20);
+	assert_true(put(store, "INBOX", 1, "moved message"));
+	assert_false(body_store_link(store, "INBOX", 1, 2, 1, "Archive", 1, 20));
+	assert_true(body_store_link(store, "INBOX", 1, 1, 1, "Archive", 1, 10));
+	const struct body_store_stats *stats = body_store_stats(store);
+	assert_int_equal(stats->entries, 2);
+	assert_int_equal(stats->objects, 1);
+	assert_body(store, "Archive", 10, "moved message");
+	body_store_close(store);
+
+	store = body_store_open(path, 1 << 20);
+	assert_body(store, "Archive", 10, "moved message");
+	assert_body(store, "INBOX", 1, "moved message");
+	body_store_close(store);
+	remove_tree(path);
+}
+
+int run_tests_body_store() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_body_store_reopen),
+		cmocka_unit_test(test_body_store_eviction),
+		cmocka_unit_test(test_body_store_compaction),
+		cmocka_unit_test(test_body_store_link),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
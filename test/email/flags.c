@@ -0,0 +1,55 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "email/flags.h"
+#include "util/intern.h"
+
+static void test_parse_flag(void **state) {
+	assert_int_equal(FLAG_SEEN, parse_flag("\\Seen"));
+	assert_int_equal(FLAG_SEEN, parse_flag("\\seen"));
+	assert_int_equal(FLAG_DELETED, parse_flag("\\Deleted"));
+	assert_int_equal(0, parse_flag("$Forwarded"));
+	assert_int_equal(0, parse_flag("\\Noselect"));
+	assert_string_equal("\\Flagged", flag_name(FLAG_FLAGGED));
+}
+
+static void test_intern(void **state) {
+	assert_null(intern_find("X-Test-Interned"));
+	const char *a = intern("X-Test-Interned");
+	char buf[] = "x-test-INTERNED";
+	const char *b = intern(buf);
+	assert_ptr_equal(a, b);
+	assert_ptr_equal(a, intern_find("X-TEST-INTERNED"));
+	assert_string_equal("X-Test-Interned", b);
+	assert_ptr_not_equal(a, intern("X-Test-Other"));
+}
+
+/* Keywords come from the server, so unknown ones mustn't pile up in the table */
+static void test_keywords(void **state) {
+	const char *known = keyword_new("$forwarded");
+	assert_ptr_equal(known, intern_find("$Forwarded"));
+	assert_string_equal("$Forwarded", known);
+	const char *unknown = keyword_new("X-Test-Keyword");
+	assert_null(intern_find("X-Test-Keyword"));
+
+	list_t *keywords = create_list();
+	list_add(keywords, (void *)known);
+	list_add(keywords, (void *)unknown);
+	list_t *copy = keywords_dup(keywords);
+	assert_ptr_equal(known, copy->items[0]);
+	assert_ptr_not_equal(unknown, copy->items[1]);
+	keywords_free(keywords);
+	assert_true(has_keyword(copy, "$FORWARDED"));
+	assert_true(has_keyword(copy, "x-test-keyword"));
+	assert_false(has_keyword(copy, "$Junk"));
+	keywords_free(copy);
+}
+
+int run_tests_flags() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_parse_flag),
+		cmocka_unit_test(test_intern),
+		cmocka_unit_test(test_keywords),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -1,25 +1,27 @@
 #include <stdlib.h>
 #include <string.h>
 #include "tests.h"
-#include "util/list.h"
 #include "email/headers.h"
+#include "util/intern.h"
+
+struct expected_header {
+	const char *key, *value;
+};
 
 static void test_parse_headers_simple(void **state) {
 	const char *headers = "Subject: hello world\r\n"
 		"Date: test\r\n"
 		"From: Foo Bar <fbar@example.org>";
-	list_t *output = create_list();
-	parse_headers(headers, output);
+	struct email_headers *output = parse_headers(headers);
 	assert_int_equal(3, output->length);
-	struct email_header expected[] = {
+	struct expected_header expected[] = {
 		{ "Subject", "hello world" },
 		{ "Date", "test" },
 		{ "From", "Foo Bar <fbar@example.org>" }
 	};
 	for (int i = 0; i < 3; ++i) {
-		struct email_header *test = output->items[i];
-		assert_string_equal(test->key, expected[i].key);
-		assert_string_equal(test->value, expected[i].value);
+		assert_string_equal(header_key(output, i), expected[i].key);
+		assert_string_equal(header_value(output, i), expected[i].value);
 	}
 	free_headers(output);
 }
@@ -29,26 +31,84 @@ static void test_parse_headers_continued(void **state) {
 		" extended\r\n"
 		"Date: test\r\n"
 		"From: Foo Bar <fbar@example.org>";
-	list_t *output = create_list();
-	parse_headers(headers, output);
+	struct email_headers *output = parse_headers(headers);
 	assert_int_equal(3, output->length);
-	struct email_header expected[] = {
+	struct expected_header expected[] = {
 		{ "Subject", "hello world extended" },
 		{ "Date", "test" },
 		{ "From", "Foo Bar <fbar@example.org>" }
 	};
 	for (int i = 0; i < 3; ++i) {
-		struct email_header *test = output->items[i];
-		assert_string_equal(test->key, expected[i].key);
-		assert_string_equal(test->value, expected[i].value);
+		assert_string_equal(header_key(output, i), expected[i].key);
+		assert_string_equal(header_value(output, i), expected[i].value);
 	}
 	free_headers(output);
 }
 
+static void test_parse_headers_encoded(void **state) {
+	const char *headers = "Subject: =?utf-8?B?aGVsbG8gd29ybGQ=?=\r\n"
+		"From: =?us-ascii?Q?Foo_Bar?= <fbar@example.org>\r\n\r\n";
+	struct email_headers *output = parse_headers(headers);
+	assert_int_equal(2, output->length);
+	assert_null(output->items[0].decoded);
+	assert_string_equal(get_header(output, "subject"), "hello world");
+	assert_non_null(output->items[0].decoded);
+	assert_string_equal(get_header(output, "From"),
+			"Foo Bar <fbar@example.org>");
+	assert_null(get_header(output, "To"));
+
+	struct email_headers *copy = headers_dup(output);
+	free_headers(output);
+	assert_string_equal(copy->items[0].decoded, "hello world");
+	assert_string_equal(get_header(copy, "Subject"), "hello world");
+	free_headers(copy);
+}
+
+/* Copies are shared between threads, so reading one mustn't write to it */
+static void test_headers_dup_decoded(void **state) {
+	const char *headers = "Subject: =?utf-8?Q?hello?= =?x-bogus?Q?hi?=\r\n"
+		"To: plain\r\n";
+	struct email_headers *output = parse_headers(headers);
+	struct email_headers *copy = headers_dup(output);
+	free_headers(output);
+	const char *raw = "=?utf-8?Q?hello?= =?x-bogus?Q?hi?=";
+	assert_string_equal(copy->items[0].decoded, "hello =?x-bogus?Q?hi?=");
+	assert_null(copy->items[1].decoded);
+	char *before = malloc(copy->size);
+	memcpy(before, copy, copy->size);
+	assert_string_equal(get_header(copy, "Subject"), "hello =?x-bogus?Q?hi?=");
+	assert_string_equal(get_header(copy, "To"), "plain");
+	assert_memory_equal(before, copy, copy->size);
+	assert_string_equal(copy->raw + copy->items[0].value, raw);
+	free(before);
+	free_headers(copy);
+}
+
+static void test_parse_headers_unknown_keys(void **state) {
+	const char *headers = "subject: hi\r\n"
+		"X-Never-Interned-Header: yes\r\n";
+	struct email_headers *output = parse_headers(headers);
+	assert_int_equal(2, output->length);
+	assert_ptr_equal(header_key(output, 0), intern_find("Subject"));
+	// Kept with the message, not in the intern table
+	assert_null(intern_find("X-Never-Interned-Header"));
+	assert_string_equal(get_header(output, "x-never-interned-header"), "yes");
+
+	struct email_headers *copy = headers_dup(output);
+	free_headers(output);
+	assert_string_equal(header_key(copy, 1), "X-Never-Interned-Header");
+	assert_string_equal(get_header(copy, "X-Never-Interned-Header"), "yes");
+	assert_string_equal(get_header(copy, "SUBJECT"), "hi");
+	free_headers(copy);
+}
+
 int run_tests_headers() {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_parse_headers_simple),
 		cmocka_unit_test(test_parse_headers_continued),
+		cmocka_unit_test(test_parse_headers_encoded),
+		cmocka_unit_test(test_headers_dup_decoded),
+		cmocka_unit_test(test_parse_headers_unknown_keys),
 	};
 	return cmocka_run_group_tests(tests, NULL, NULL);
 }
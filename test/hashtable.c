@@ -0,0 +1,41 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "util/hashtable.h"
+
+// The real one, tests elsewhere mock it
+void *__real_hashtable_get(hashtable_t *table, const void *key);
+
+static unsigned int hash_first(const void *key) {
+	return *(const char *)key;
+}
+
+static void test_hashtable_collisions(void **state) {
+	// 'a' and 'e' share a bucket
+	hashtable_t *table = create_hashtable(4, hash_first);
+	int a = 1, e = 2, i = 3;
+	assert_null(hashtable_set(table, "a", &a));
+	assert_null(hashtable_set(table, "e", &e));
+	assert_null(hashtable_set(table, "i", &i));
+	assert_ptr_equal(__real_hashtable_get(table, "a"), &a);
+	assert_ptr_equal(__real_hashtable_get(table, "e"), &e);
+	assert_false(hashtable_contains(table, "m"));
+	assert_null(__real_hashtable_get(table, "m"));
+	// Neither deleting nor replacing one disturbs the others
+	assert_null(hashtable_del(table, "m"));
+	assert_ptr_equal(hashtable_set(table, "e", &a), &e);
+	assert_ptr_equal(hashtable_del(table, "i"), &i);
+	assert_ptr_equal(__real_hashtable_get(table, "a"), &a);
+	assert_ptr_equal(__real_hashtable_get(table, "e"), &a);
+	assert_ptr_equal(hashtable_del(table, "a"), &a);
+	assert_true(hashtable_contains(table, "e"));
+	assert_false(hashtable_contains(table, "a"));
+	free_hashtable(table);
+}
+
+int run_tests_hashtable() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_hashtable_collisions),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,158 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "tests.h"
+#include "internal/imap.h"
+#include "imap/imap.h"
+
+extern void imap_init(struct imap_connection *imap);
+
+static int callback_count;
+static enum imap_status callback_status;
+
+static void test_callback(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	++callback_count;
+	callback_status = status;
+}
+
+static void server_says(struct imap_connection *imap, const char *line) {
+	int _;
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args(line, arg, &_);
+	if (strcmp(arg->str, "+") != 0) {
+		expect_string(__wrap_hashtable_get, key, arg->next->str);
+		will_return(__wrap_hashtable_get, handle_imap_status);
+	}
+	handle_line(imap, arg);
+	imap_arg_free(arg);
+}
+
+static void read_wire(int fd, const char *expected) {
+	char buf[256] = { 0 };
+	assert_int_equal(read(fd, buf, sizeof(buf) - 1), strlen(expected));
+	assert_string_equal(buf, expected);
+}
+
+static struct imap_connection *connected(int fds[2]) {
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	imap->mode = RECV_LINE;
+	imap->logged_in = true;
+	imap->cap = calloc(1, sizeof(struct imap_capabilities));
+	assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	imap->socket = calloc(1, sizeof(absocket_t));
+	imap->socket->basefd = fds[0];
+	return imap;
+}
+
+static void disconnect(struct imap_connection *imap, int fds[2]) {
+	absocket_t *socket = imap->socket;
+	free(imap->cap);
+	imap_close(imap);
+	free(socket->out);
+	free(socket);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void test_append_literal_plus_multiappend(void **state) {
+	int fds[2];
+	struct imap_connection *imap = connected(fds);
+	imap->cap->literal_plus = true;
+	imap->cap->multiappend = true;
+
+	// Two messages out of one mbox-ish file, and one from memory
+	FILE *f = tmpfile();
+	fputs("AAAA\n\nBBB", f);
+	struct imap_append_message messages[] = {
+		{ .file = f, .offset = 0, .size = 4, .flags = FLAG_SEEN },
+		{ .file = f, .offset = 6, .size = 3 },
+		{ .data = "CC", .size = 2, .flags = FLAG_SEEN | FLAG_DRAFT },
+	};
+	imap_append(imap, test_callback, NULL, "Sent", messages, 3);
+
+	// All of it at once, without waiting on the server
+	read_wire(fds[1], "a0001 APPEND \"Sent\" (\\Seen) {4+}\r\nAAAA"
+			" {3+}\r\nBBB (\\Seen \\Draft) {2+}\r\nCC\r\n");
+	assert_int_equal(callback_count, 0);
+
+	server_says(imap, "a0001 OK APPEND completed");
+	assert_int_equal(callback_count, 1);
+	assert_int_equal(callback_status, STATUS_OK);
+	assert_int_equal(imap->appends->length, 0);
+	assert_int_equal(imap->outstanding, 0);
+
+	fclose(f);
+	disconnect(imap, fds);
+}
+
+static void test_append_synchronizing(void **state) {
+	int fds[2];
+	struct imap_connection *imap = connected(fds);
+	struct imap_append_message messages[] = {
+		{ .data = "one", .size = 3 },
+		{ .data = "two", .size = 3 },
+	};
+	imap_append(imap, test_callback, NULL, "Drafts", messages, 2);
+	read_wire(fds[1], "a0001 APPEND \"Drafts\" {3}\r\n");
+
+	// Can't go out in the middle of the APPEND
+	imap_send(imap, NULL, NULL, "NOOP");
+
+	// Once the server's ready for the literal, the rest follows
+	server_says(imap, "+ Ready for literal data");
+	append_run(imap);
+	read_wire(fds[1], "one\r\na0002 NOOP\r\na0003 APPEND \"Drafts\" {3}\r\n");
+
+	// The second is turned down, so its literal never goes
+	server_says(imap, "a0001 OK APPEND completed");
+	assert_int_equal(callback_count, 0);
+	server_says(imap, "a0003 NO Mailbox is full");
+	assert_int_equal(callback_count, 1);
+	assert_int_equal(callback_status, STATUS_NO);
+	assert_int_equal(imap->appends->length, 0);
+	append_run(imap);
+	assert_false(append_in_command(imap));
+
+	disconnect(imap, fds);
+}
+
+static void test_append_mailbox_literal(void **state) {
+	int fds[2];
+	struct imap_connection *imap = connected(fds);
+	struct imap_append_message message = { .data = "one", .size = 3 };
+	imap_append(imap, test_callback, NULL, "Entw\xc3\xbcrfe", &message, 1);
+
+	// The name can't be quoted, so it waits for the server too
+	read_wire(fds[1], "a0001 APPEND {9}\r\n");
+	server_says(imap, "+ Go ahead");
+	append_run(imap);
+	read_wire(fds[1], "Entw\xc3\xbcrfe {3}\r\n");
+	server_says(imap, "+ Go ahead");
+	append_run(imap);
+	read_wire(fds[1], "one\r\n");
+	server_says(imap, "a0001 OK APPEND completed");
+	assert_int_equal(callback_count, 1);
+	assert_int_equal(callback_status, STATUS_OK);
+
+	disconnect(imap, fds);
+}
+
+static int setup(void **state) {
+	callback_count = 0;
+	callback_status = STATUS_PRE_ERROR;
+	return 0;
+}
+
+int run_tests_imap_append() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup(test_append_literal_plus_multiappend, setup),
+		cmocka_unit_test_setup(test_append_synchronizing, setup),
+		cmocka_unit_test_setup(test_append_mailbox_literal, setup),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,118 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tests.h"
+#include "body_cache.h"
+#include "email/flags.h"
+#include "internal/imap.h"
+#include "imap/imap.h"
+#include "imap/worker.h"
+#include "worker.h"
+
+extern void imap_init(struct imap_connection *imap);
+
+static void store_flags(struct worker_pipe *pipe, uint32_t uid,
+		uint32_t flags, bool add) {
+	struct store_flags_request *request =
+		calloc(1, sizeof(struct store_flags_request));
+	request->mailbox = strdup("INBOX");
+	request->uids = uid_set_create();
+	uid_set_add(request->uids, uid);
+	request->flags = flags;
+	request->add = add;
+	struct worker_message message = { .type = WORKER_STORE_FLAGS,
+		.data = request };
+	handle_worker_store_flags(pipe, &message);
+}
+
+/* Returns the flags of the last update the UI was sent */
+static uint32_t published_flags(struct worker_pipe *pipe) {
+	struct worker_message *message;
+	uint32_t flags = 0;
+	while (worker_get_message(pipe, &message)) {
+		assert_int_equal(message->type, WORKER_MESSAGE_UPDATED);
+		struct aerc_message_update *update = message->data;
+		flags = update->message->flags;
+		aerc_message_unref(update->message);
+		free(update->mailbox);
+		free(update);
+		worker_message_free(message);
+	}
+	return flags;
+}
+
+static void test_flags_write_behind(void **state) {
+	struct worker_pipe *pipe = worker_pipe_new();
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	memset(&imap->events, 0, sizeof(imap->events));
+	pipe->data = imap;
+	imap->data = pipe;
+	imap->selected = strdup("INBOX");
+	struct mailbox *mbox = get_or_make_mailbox(imap, "INBOX");
+	struct mailbox_message *msg = calloc(1, sizeof(struct mailbox_message));
+	msg->populated = true;
+	msg->uid = 5;
+	msg->flags = FLAG_ANSWERED;
+	msg->internal_date = calloc(1, sizeof(struct tm));
+	list_add(mbox->messages, msg);
+
+	store_flags(pipe, 5, FLAG_SEEN | FLAG_FLAGGED, true);
+	assert_int_equal(published_flags(pipe),
+			FLAG_ANSWERED | FLAG_SEEN | FLAG_FLAGGED);
+	// What the server says doesn't undo what we haven't sent yet
+	assert_int_equal(queued_flags(imap, "INBOX", 5, 0),
+			FLAG_SEEN | FLAG_FLAGGED);
+	assert_int_equal(queued_flags(imap, "Archive", 5, 0), 0);
+
+	// Toggled back before they went out, so there's nothing to send
+	store_flags(pipe, 5, FLAG_SEEN | FLAG_FLAGGED, false);
+	assert_int_equal(published_flags(pipe), FLAG_ANSWERED);
+	assert_false(flush_flags(imap, true));
+	assert_int_equal(queued_flags(imap, "INBOX", 5, FLAG_ANSWERED),
+			FLAG_ANSWERED);
+
+	flag_queue_free(imap);
+	imap_close(imap);
+	worker_pipe_free(pipe);
+}
+
+static void test_prefetch_leaves_unread(void **state) {
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	memset(&imap->events, 0, sizeof(imap->events));
+	imap->selected = strdup("INBOX");
+	struct mailbox *mbox = get_or_make_mailbox(imap, "INBOX");
+	struct mailbox_message *msg = calloc(1, sizeof(struct mailbox_message));
+	msg->uid = 5;
+	msg->parts = create_list();
+	struct message_part *part = calloc(1, sizeof(struct message_part));
+	part->parameters = create_list();
+	part->size = 5;
+	list_add(msg->parts, part);
+	list_add(mbox->messages, msg);
+
+	// What prefetch gets back for BODY.PEEK[1]
+	int _;
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args("* 1 FETCH (UID 5 BODY[1] \"hello\")\r\n", arg, &_);
+	expect_string(__wrap_hashtable_get, key, "FETCH");
+	will_return(__wrap_hashtable_get, handle_imap_fetch);
+	handle_line(imap, arg);
+	imap_arg_free(arg);
+	assert_false(msg->flags & FLAG_SEEN);
+	struct body *body = body_cache_peek(imap->bodies, "INBOX", 5, 1);
+	assert_non_null(body);
+	assert_memory_equal(body->data, "hello", 5);
+
+	imap_close(imap);
+}
+
+int run_tests_imap_flags() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_flags_write_behind),
+		cmocka_unit_test(test_prefetch_leaves_unread),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
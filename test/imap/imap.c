@@ -1,5 +1,8 @@
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include "tests.h"
 #include "internal/imap.h"
 #include "imap/imap.h"
@@ -8,6 +11,7 @@ extern void imap_init(struct imap_connection *imap);
 extern int handle_line(struct imap_connection *imap, imap_arg_t *arg);
 
 int handler_called = 0;
+static absocket_t test_socket = { .basefd = -1 };
 
 static void test_handle_line_unknown_handler(void **state) {
 	int _;
@@ -58,6 +62,7 @@ static void test_imap_receive_simple(void **state) {
 	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
 	imap_init(imap);
 	imap->mode = RECV_LINE;
+	imap->socket = &test_socket;
 
 	const char *buffer = "a001 FOOBAR\r\n";
 	expect_string(__wrap_hashtable_get, key, "FOOBAR");
@@ -80,6 +85,7 @@ static void test_imap_receive_multiple_lines(void **state) {
 	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
 	imap_init(imap);
 	imap->mode = RECV_LINE;
+	imap->socket = &test_socket;
 
 	const char *buffer = "a001 FOOBAR\r\na002 FOOBAZ\r\n";
 
@@ -106,6 +112,7 @@ static void test_imap_receive_partial_line(void **state) {
 	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
 	imap_init(imap);
 	imap->mode = RECV_LINE;
+	imap->socket = &test_socket;
 
 	const char *buffer = "a001 FOOB";
 
@@ -137,6 +144,7 @@ static void test_imap_receive_multi_partial_line(void **state) {
 	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
 	imap_init(imap);
 	imap->mode = RECV_LINE;
+	imap->socket = &test_socket;
 
 	const char *buffer = "a001 FOOB";
 
@@ -180,6 +188,7 @@ static void test_imap_receive_full_buffer(void **state) {
 	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
 	imap_init(imap);
 	imap->mode = RECV_LINE;
+	imap->socket = &test_socket;
 
 	char buffer[4096];
 	memset(buffer, 'a', 4096);
@@ -224,6 +233,198 @@ static void test_imap_receive_full_buffer(void **state) {
 	imap_close(imap);
 }
 
+static int callback_status = -1;
+static const char *disconnect_reason = NULL;
+
+static void test_callback(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	callback_status = status;
+}
+
+static void test_disconnected(struct imap_connection *imap,
+		const char *reason) {
+	disconnect_reason = reason;
+	assert_string_equal(imap->selected, "INBOX");
+}
+
+static void test_imap_receive_disconnect(void **state) {
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	memset(&imap->events, 0, sizeof(imap->events));
+	imap->events.disconnected = test_disconnected;
+	imap->mode = RECV_LINE;
+	// The command has to go somewhere
+	int fds[2];
+	assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	absocket_t pair = { .basefd = fds[0] };
+	imap->socket = &pair;
+	imap->selected = strdup("INBOX");
+
+	imap_send(imap, test_callback, NULL, "NOOP");
+	assert_int_equal(imap->outstanding, 1);
+
+	// The server hung up
+	will_return(__wrap_ab_recv, 0);
+	will_return(__wrap_poll, 0);
+	imap->poll[0].revents = POLLIN;
+	assert_true(imap_receive(imap));
+
+	assert_int_equal(callback_status, STATUS_PRE_ERROR);
+	assert_string_equal(disconnect_reason, "Connection closed");
+	assert_null(imap->socket);
+	// It's selected again once it's back
+	assert_string_equal(imap->selected, "INBOX");
+	assert_int_equal(imap->outstanding, 0);
+
+	// Anything sent until it's back fails too
+	callback_status = -1;
+	imap_send(imap, test_callback, NULL, "NOOP");
+	assert_true(imap_receive(imap));
+	assert_int_equal(callback_status, STATUS_PRE_ERROR);
+	assert_false(imap_receive(imap));
+
+	imap_close(imap);
+	free(pair.out);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void test_imap_idle_holds_commands(void **state) {
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	imap->mode = RECV_LINE;
+	imap->logged_in = true;
+	imap->cap = calloc(1, sizeof(struct imap_capabilities));
+	imap->cap->idle = true;
+	int fds[2];
+	assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	absocket_t pair = { .basefd = fds[0] };
+	imap->socket = &pair;
+
+	// Nothing outstanding, so it goes straight into IDLE
+	will_return(__wrap_poll, 0);
+	imap->poll[0].revents = 0;
+	imap_receive(imap);
+	char buf[64] = { 0 };
+	assert_int_equal(read(fds[1], buf, sizeof(buf) - 1), 12);
+	assert_string_equal(buf, "a0001 IDLE\r\n");
+	assert_int_equal(imap_busy(imap), 0);
+
+	// The server hasn't said go ahead yet, so this has to wait for it
+	imap_send(imap, test_callback, NULL, "NOOP");
+	assert_int_equal(imap_busy(imap), 1);
+
+	const char *buffer = "+ idling\r\n";
+	set_ab_recv_result((void *)buffer, strlen(buffer));
+	will_return(__wrap_ab_recv, strlen(buffer));
+	will_return(__wrap_poll, 0);
+	imap->poll[0].revents = POLLIN;
+	imap_receive(imap);
+
+	memset(buf, 0, sizeof(buf));
+	assert_int_equal(read(fds[1], buf, sizeof(buf) - 1), 18);
+	assert_string_equal(buf, "DONE\r\na0002 NOOP\r\n");
+	assert_int_equal(imap->idle, IDLE_LEAVING);
+
+	free(imap->cap);
+	imap_close(imap);
+	free(pair.out);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void test_imap_background_no_idle(void **state) {
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	imap->mode = RECV_LINE;
+	imap->logged_in = true;
+	imap->background = true;
+	imap->cap = calloc(1, sizeof(struct imap_capabilities));
+	imap->cap->idle = true;
+	int fds[2];
+	assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	absocket_t pair = { .basefd = fds[0] };
+	imap->socket = &pair;
+
+	will_return(__wrap_poll, 0);
+	imap->poll[0].revents = 0;
+	imap_receive(imap);
+	assert_int_equal(imap->idle, IDLE_NONE);
+	char buf[16];
+	assert_int_equal(recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT), -1);
+
+	free(imap->cap);
+	imap_close(imap);
+	free(pair.out);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+static void test_imap_quote(void **state) {
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	char *q = imap_quote(imap, "Say \"hi\" \\o/");
+	assert_string_equal(q, "\"Say \\\"hi\\\" \\\\o/\"");
+	free(q);
+	q = imap_quote(imap, "caf\xc3\xa9");
+	assert_string_equal(q, "{5}\r\ncaf\xc3\xa9");
+	free(q);
+	imap->cap = calloc(1, sizeof(struct imap_capabilities));
+	imap->cap->literal_plus = true;
+	q = imap_quote(imap, "a\r\nb");
+	assert_string_equal(q, "{4+}\r\na\r\nb");
+	free(q);
+	free(imap->cap);
+	imap_close(imap);
+}
+
+static void test_imap_send_literal(void **state) {
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	int fds[2];
+	assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	absocket_t pair = { .basefd = fds[0] };
+	imap->socket = &pair;
+
+	// Stops at the literal until the server asks for it
+	imap_send(imap, NULL, NULL, "UID SEARCH CHARSET UTF-8 TEXT {3}\r\n\xc3\xa9!");
+	imap_send(imap, NULL, NULL, "NOOP");
+	char buf[128] = { 0 };
+	assert_int_equal(read(fds[1], buf, sizeof(buf) - 1), 41);
+	assert_string_equal(buf, "a0001 UID SEARCH CHARSET UTF-8 TEXT {3}\r\n");
+
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	int _;
+	imap_parse_args("+ go ahead\r\n", arg, &_);
+	handle_line(imap, arg);
+	imap_arg_free(arg);
+	memset(buf, 0, sizeof(buf));
+	assert_int_equal(read(fds[1], buf, sizeof(buf) - 1), 17);
+	assert_string_equal(buf, "\xc3\xa9!\r\na0002 NOOP\r\n");
+
+	// Turned down instead, so what's after it goes ahead
+	imap_send(imap, NULL, NULL, "SELECT {1}\r\nx");
+	imap_send(imap, NULL, NULL, "NOOP");
+	memset(buf, 0, sizeof(buf));
+	assert_int_equal(read(fds[1], buf, sizeof(buf) - 1), 18);
+	assert_string_equal(buf, "a0003 SELECT {1}\r\n");
+	arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args("a0003 BAD No\r\n", arg, &_);
+	expect_string(__wrap_hashtable_get, key, "BAD");
+	will_return(__wrap_hashtable_get, NULL);
+	handle_line(imap, arg);
+	imap_arg_free(arg);
+	memset(buf, 0, sizeof(buf));
+	assert_int_equal(read(fds[1], buf, sizeof(buf) - 1), 12);
+	assert_string_equal(buf, "a0004 NOOP\r\n");
+	assert_null(imap->literal);
+
+	imap_close(imap);
+	free(pair.out);
+	close(fds[0]);
+	close(fds[1]);
+}
+
 static int setup(void **state) {
 	handler_called = 0;
 	return 0;
@@ -238,6 +439,11 @@ int run_tests_imap() {
 		cmocka_unit_test_setup(test_imap_receive_partial_line, setup),
 		cmocka_unit_test_setup(test_imap_receive_multi_partial_line, setup),
 		cmocka_unit_test_setup(test_imap_receive_full_buffer, setup),
+		cmocka_unit_test_setup(test_imap_receive_disconnect, setup),
+		cmocka_unit_test_setup(test_imap_idle_holds_commands, setup),
+		cmocka_unit_test_setup(test_imap_background_no_idle, setup),
+		cmocka_unit_test_setup(test_imap_quote, setup),
+		cmocka_unit_test_setup(test_imap_send_literal, setup),
 	};
 	return cmocka_run_group_tests(tests, setup, NULL);
 }
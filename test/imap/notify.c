@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "internal/imap.h"
+#include "imap/imap.h"
+
+extern void imap_init(struct imap_connection *imap);
+
+static void handle(struct imap_connection *imap, const char *line,
+		void (*handler)(struct imap_connection *, const char *,
+			const char *, imap_arg_t *)) {
+	int _;
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args(line, arg, &_);
+	// Skip the "*" and the response name
+	handler(imap, arg->str, arg->next->str, arg->next->next);
+	imap_arg_free(arg);
+}
+
+static int status_events;
+
+static void count_status(struct imap_connection *imap, struct mailbox *mbox) {
+	++status_events;
+}
+
+static void test_handle_mailbox_status(void **state) {
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	memset(&imap->events, 0, sizeof(imap->events));
+	imap->events.mailbox_status = count_status;
+	status_events = 0;
+	struct mailbox *inbox = get_or_make_mailbox(imap, "INBOX");
+	struct mailbox *sent = get_or_make_mailbox(imap, "Sent Items");
+
+	handle(imap, "* STATUS INBOX (MESSAGES 231 UNSEEN 5)",
+			handle_imap_mailbox_status);
+	assert_int_equal(inbox->status.messages, 231);
+	assert_int_equal(inbox->status.unseen, 5);
+	assert_int_equal(inbox->status.recent, -1);
+	// Not the counts from SELECT
+	assert_int_equal(inbox->exists, -1);
+	assert_int_equal(status_events, 1);
+
+	// Only changes are passed on
+	handle(imap, "* STATUS INBOX (MESSAGES 231 UNSEEN 5)",
+			handle_imap_mailbox_status);
+	assert_int_equal(status_events, 1);
+
+	handle(imap, "* STATUS \"Sent Items\" (RECENT 0 UIDNEXT 17 UNSEEN 0)",
+			handle_imap_mailbox_status);
+	assert_int_equal(sent->status.unseen, 0);
+	assert_int_equal(sent->status.recent, 0);
+	assert_int_equal(status_events, 2);
+
+	// Mailboxes we haven't listed are ignored
+	handle(imap, "* STATUS Archive (MESSAGES 1)", handle_imap_mailbox_status);
+	assert_int_equal(status_events, 2);
+
+	imap_close(imap);
+}
+
+int run_tests_imap_notify() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_handle_mailbox_status),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "internal/imap.h"
+#include "imap/imap.h"
+#include "util/uid_set.h"
+
+extern void imap_init(struct imap_connection *imap);
+
+static void handle(struct imap_connection *imap, const char *line,
+		void (*handler)(struct imap_connection *, const char *,
+			const char *, imap_arg_t *)) {
+	int _;
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args(line, arg, &_);
+	// Skip the "*" and the response name
+	handler(imap, arg->str, arg->next->str, arg->next->next);
+	imap_arg_free(arg);
+}
+
+static void server_says(struct imap_connection *imap, const char *line,
+		void *handler) {
+	int _;
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args(line, arg, &_);
+	expect_string(__wrap_hashtable_get, key, arg->next->str);
+	will_return(__wrap_hashtable_get, handler);
+	handle_line(imap, arg);
+	imap_arg_free(arg);
+}
+
+static void test_handle_search(void **state) {
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	struct uid_set *results = uid_set_create();
+	imap_search(imap, NULL, NULL, results, "ALL");
+
+	handle(imap, "* SEARCH 2 84 882 3 4", handle_imap_search);
+	char *set = uid_set_format(results, 0, 16);
+	assert_string_equal(set, "2:4,84,882");
+	free(set);
+
+	uid_set_free(results);
+	imap_close(imap);
+}
+
+static void test_handle_esearch(void **state) {
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	struct uid_set *results = uid_set_create();
+	imap_search(imap, NULL, NULL, results, "ALL");
+
+	handle(imap, "* ESEARCH (TAG \"a7\") UID ALL 4:19,21,28 COUNT 18",
+			handle_imap_esearch);
+	char *set = uid_set_format(results, 0, 16);
+	assert_string_equal(set, "4:19,21,28");
+	free(set);
+	assert_int_equal(uid_set_count(results), 18);
+
+	uid_set_free(results);
+	imap_close(imap);
+}
+
+static void test_searches_in_flight(void **state) {
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	struct uid_set *first = uid_set_create();
+	struct uid_set *second = uid_set_create();
+
+	// Each gets the answer to its own command
+	imap_search(imap, NULL, NULL, first, "ALL");
+	imap_search(imap, NULL, NULL, second, "TEXT \"foo\"");
+	server_says(imap, "* SEARCH 1 2 3", handle_imap_search);
+	server_says(imap, "a0001 OK Search completed", handle_imap_status);
+	server_says(imap, "* SEARCH 2", handle_imap_search);
+	server_says(imap, "a0002 OK Search completed", handle_imap_status);
+	assert_int_equal(imap->searches->length, 0);
+	assert_int_equal(uid_set_count(first), 3);
+	assert_int_equal(uid_set_count(second), 1);
+	assert_true(uid_set_contains(second, 2));
+
+	uid_set_free(first);
+	uid_set_free(second);
+	imap_close(imap);
+}
+
+int run_tests_imap_search() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_handle_search),
+		cmocka_unit_test(test_handle_esearch),
+		cmocka_unit_test(test_searches_in_flight),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
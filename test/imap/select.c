@@ -0,0 +1,141 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "tests.h"
+#include "body_cache.h"
+#include "internal/imap.h"
+#include "imap/imap.h"
+
+extern void imap_init(struct imap_connection *imap);
+
+static int callback_count;
+
+static void test_callback(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	++callback_count;
+}
+
+static void server_says(struct imap_connection *imap, const char *line,
+		void (*handler)(struct imap_connection *, const char *,
+			const char *, imap_arg_t *)) {
+	int _;
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args(line, arg, &_);
+	expect_string(__wrap_hashtable_get, key, arg->next->str);
+	will_return(__wrap_hashtable_get, handler);
+	handle_line(imap, arg);
+	imap_arg_free(arg);
+}
+
+/* INBOX selected, with UIDs 1 to 3 and the body of UID 2 */
+static struct imap_connection *selected(int fds[2]) {
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	memset(&imap->events, 0, sizeof(imap->events));
+	imap->mode = RECV_LINE;
+	imap->logged_in = true;
+	assert_int_equal(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+	imap->socket = calloc(1, sizeof(absocket_t));
+	imap->socket->basefd = fds[0];
+	imap->selected = strdup("INBOX");
+	struct mailbox *mbox = get_or_make_mailbox(imap, "INBOX");
+	mbox->uidvalidity = 7;
+	for (uint32_t uid = 1; uid <= 3; ++uid) {
+		struct mailbox_message *msg = calloc(1, sizeof(struct mailbox_message));
+		msg->index = mbox->messages->length;
+		msg->uid = uid;
+		list_add(mbox->messages, msg);
+	}
+	mbox->exists = 3;
+	struct body *body = body_new((uint8_t *)strdup("hello"), 5);
+	body_cache_put(imap->bodies, "INBOX", 2, 1, body);
+	body_unref(body);
+	return imap;
+}
+
+static void disconnect(struct imap_connection *imap, int fds[2]) {
+	absocket_t *socket = imap->socket;
+	imap_close(imap);
+	free(socket->out);
+	free(socket);
+	close(fds[0]);
+	close(fds[1]);
+}
+
+/* Same UIDVALIDITY after a reconnect, same UIDs, so nothing's refetched */
+static void test_resync_same_uidvalidity(void **state) {
+	int fds[2];
+	struct imap_connection *imap = selected(fds);
+	struct mailbox *mbox = get_mailbox(imap, "INBOX");
+	imap_resync(imap, test_callback, NULL);
+	server_says(imap, "* SEARCH 1 2 3", handle_imap_search);
+	server_says(imap, "a0001 OK SEARCH completed", handle_imap_status);
+	server_says(imap, "a0002 OK FETCH completed", handle_imap_status);
+	assert_int_equal(callback_count, 1);
+
+	assert_int_equal(mbox->messages->length, 3);
+	struct mailbox_message *msg = mbox->messages->items[1];
+	assert_int_equal(msg->uid, 2);
+	assert_non_null(body_cache_peek(imap->bodies, "INBOX", 2, 1));
+
+	disconnect(imap, fds);
+}
+
+static void test_resync_new_uidvalidity(void **state) {
+	int fds[2];
+	struct imap_connection *imap = selected(fds);
+	struct mailbox *mbox = get_mailbox(imap, "INBOX");
+	imap_resync(imap, test_callback, NULL);
+	// As the answer to the SELECT sent before it would
+	mbox->uidvalidity = 8;
+	server_says(imap, "* SEARCH 1 2 3", handle_imap_search);
+	server_says(imap, "a0001 OK SEARCH completed", handle_imap_status);
+
+	// The UIDs are the same, but the messages aren't
+	assert_int_equal(mbox->messages->length, 3);
+	for (size_t i = 0; i < mbox->messages->length; ++i) {
+		struct mailbox_message *msg = mbox->messages->items[i];
+		assert_int_equal(msg->uid, 0);
+	}
+	assert_null(body_cache_peek(imap->bodies, "INBOX", 2, 1));
+
+	server_says(imap, "a0002 OK FETCH completed", handle_imap_status);
+	assert_int_equal(callback_count, 1);
+	disconnect(imap, fds);
+}
+
+static void uidvalidity(struct imap_connection *imap, const char *line) {
+	int _;
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args(line, arg, &_);
+	handle_imap_uidvalidity(imap, arg->str, arg->next->str, arg->next->next);
+	imap_arg_free(arg);
+}
+
+/* Whenever it changes, not just across a reconnect */
+static void test_uidvalidity_changed(void **state) {
+	int fds[2];
+	struct imap_connection *imap = selected(fds);
+	uidvalidity(imap, "* UIDVALIDITY 7");
+	assert_non_null(body_cache_peek(imap->bodies, "INBOX", 2, 1));
+	uidvalidity(imap, "* UIDVALIDITY 8");
+	assert_int_equal(get_mailbox(imap, "INBOX")->uidvalidity, 8);
+	assert_null(body_cache_peek(imap->bodies, "INBOX", 2, 1));
+	disconnect(imap, fds);
+}
+
+static int setup(void **state) {
+	callback_count = 0;
+	return 0;
+}
+
+int run_tests_imap_select() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup(test_resync_same_uidvalidity, setup),
+		cmocka_unit_test_setup(test_resync_new_uidvalidity, setup),
+		cmocka_unit_test_setup(test_uidvalidity_changed, setup),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,64 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "internal/imap.h"
+#include "imap/imap.h"
+#include "message_view.h"
+
+extern void imap_init(struct imap_connection *imap);
+
+static int callback_count;
+
+static void test_callback(struct imap_connection *imap, void *data,
+		enum imap_status status, const char *args) {
+	++callback_count;
+	assert_int_equal(status, STATUS_OK);
+}
+
+static void server_says(struct imap_connection *imap, const char *line,
+		void *handler) {
+	int _;
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args(line, arg, &_);
+	expect_string(__wrap_hashtable_get, key, arg->next->str);
+	will_return(__wrap_hashtable_get, handler);
+	handle_line(imap, arg);
+	imap_arg_free(arg);
+}
+
+static void test_sorts_in_flight(void **state) {
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	struct message_view *first = message_view_create(SORT_NONE, THREAD_NONE, false);
+	struct message_view *second = message_view_create(SORT_NONE, THREAD_NONE, false);
+
+	// Each gets the answer to its own command
+	imap_sort(imap, test_callback, NULL, first, "SUBJECT");
+	imap_thread(imap, test_callback, NULL, second, "REFERENCES");
+	server_says(imap, "* SORT 3 1 2", handle_imap_sort);
+	server_says(imap, "a0001 OK Sort completed", handle_imap_status);
+	server_says(imap, "* THREAD (1)(2 3)", handle_imap_thread);
+	server_says(imap, "a0002 OK Thread completed", handle_imap_status);
+	assert_int_equal(callback_count, 2);
+	assert_int_equal(imap->views->length, 0);
+
+	assert_int_equal(first->length, 3);
+	assert_int_equal(first->index[0], 2);
+	assert_int_equal(first->index[2], 1);
+	assert_true(first->server);
+	assert_int_equal(second->length, 3);
+	assert_int_equal(second->index[0], 1); // Newest thread on top
+	assert_int_equal(second->depth[1], 1);
+	assert_int_equal(second->index[2], 0);
+
+	message_view_free(first);
+	message_view_free(second);
+	imap_close(imap);
+}
+
+int run_tests_imap_sort() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_sorts_in_flight),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
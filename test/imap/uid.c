@@ -0,0 +1,65 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "internal/imap.h"
+#include "imap/imap.h"
+
+extern void imap_init(struct imap_connection *imap);
+
+static void handle(struct imap_connection *imap, const char *line) {
+	int _;
+	imap_arg_t *arg = calloc(1, sizeof(imap_arg_t));
+	imap_parse_args(line, arg, &_);
+	handle_imap_copyuid(imap, arg->str, arg->next->str, arg->next->next);
+	imap_arg_free(arg);
+}
+
+static void test_handle_copyuid(void **state) {
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	handle(imap, "* COPYUID 38 1:3,7 100:102,110");
+	assert_int_equal(imap->copyuid.uidvalidity, 38);
+	assert_int_equal(imap->copyuid.length, 4);
+	uint32_t source[] = { 1, 2, 3, 7 };
+	uint32_t destination[] = { 100, 101, 102, 110 };
+	assert_memory_equal(imap->copyuid.source, source, sizeof(source));
+	assert_memory_equal(imap->copyuid.destination, destination,
+			sizeof(destination));
+
+	// Sets that don't match up are ignored
+	handle(imap, "* COPYUID 38 4,5 120");
+	assert_int_equal(imap->copyuid.length, 4);
+
+	// A single UID, and the server is free to count down
+	handle(imap, "* COPYUID 38 9 111");
+	handle(imap, "* COPYUID 38 10:11 113:112");
+	assert_int_equal(imap->copyuid.length, 7);
+	assert_int_equal(imap->copyuid.source[4], 9);
+	assert_int_equal(imap->copyuid.destination[4], 111);
+	assert_int_equal(imap->copyuid.destination[5], 113);
+	assert_int_equal(imap->copyuid.destination[6], 112);
+	imap_close(imap);
+}
+
+static void test_uid_map_find(void **state) {
+	struct imap_connection *imap = malloc(sizeof(struct imap_connection));
+	imap_init(imap);
+	handle(imap, "* COPYUID 38 10:12 113:111");
+	handle(imap, "* COPYUID 38 1:3 100:102");
+	uid_map_sort(&imap->copyuid);
+	assert_int_equal(uid_map_find(&imap->copyuid, 1), 100);
+	assert_int_equal(uid_map_find(&imap->copyuid, 3), 102);
+	assert_int_equal(uid_map_find(&imap->copyuid, 10), 113);
+	assert_int_equal(uid_map_find(&imap->copyuid, 12), 111);
+	assert_int_equal(uid_map_find(&imap->copyuid, 4), 0);
+	assert_int_equal(uid_map_find(&imap->copyuid, 13), 0);
+	imap_close(imap);
+}
+
+int run_tests_imap_uid() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_handle_copyuid),
+		cmocka_unit_test(test_uid_map_find),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -14,8 +14,28 @@ int main(int argc, char **argv) {
 
 	// TODO: Run only specific tests etc
 	ret += run_tests_urlparse();
+	ret += run_tests_net();
+	ret += run_tests_absocket();
+	ret += run_tests_smtp();
 	ret += run_tests_imap();
+	ret += run_tests_imap_search();
+	ret += run_tests_imap_notify();
+	ret += run_tests_imap_uid();
+	ret += run_tests_imap_flags();
+	ret += run_tests_imap_sort();
+	ret += run_tests_imap_select();
+	ret += run_tests_imap_append();
 	ret += run_tests_headers();
+	ret += run_tests_flags();
+	ret += run_tests_message_table();
+	ret += run_tests_message_view();
+	ret += run_tests_search_index();
+	ret += run_tests_uid_set();
+	ret += run_tests_hashtable();
+	ret += run_tests_body_cache();
+	ret += run_tests_body_store();
+	ret += run_tests_op_journal();
+	ret += run_tests_worker();
 	ret += run_tests_bind();
 	ret += run_tests_subprocess();
 
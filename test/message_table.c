@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "email/headers.h"
+#include "message_table.h"
+
+static void test_message_table_unread(void **state) {
+	struct message_table *table = message_table_create();
+	message_table_resize(table, 4);
+	assert_int_equal(4, table->length);
+	// Rows that haven't been fetched don't count as unread
+	assert_int_equal(0, message_table_unread(table));
+	message_table_update(table, 0, 10, FLAG_SEEN, NULL, NULL);
+	message_table_update(table, 1, 11, 0, NULL, NULL);
+	message_table_update(table, 3, 13, FLAG_FLAGGED, NULL, NULL);
+	assert_int_equal(2, message_table_unread(table));
+	assert_int_equal(1, message_table_count(table, FLAG_FLAGGED, FLAG_FLAGGED));
+
+	message_table_remove(table, 1);
+	assert_int_equal(3, table->length);
+	assert_int_equal(13, table->uids[2]);
+	assert_int_equal(0, table->uids[1]);
+	assert_int_equal(1, message_table_unread(table));
+	message_table_unref(table);
+}
+
+static void test_message_table_strings(void **state) {
+	struct message_table *table = message_table_create();
+	message_table_resize(table, 2);
+	struct email_headers *headers = parse_headers(
+			"Subject: hello\r\nFrom: Foo <foo@example.org>\r\n\r\n");
+	message_table_update(table, 0, 1, 0, NULL, headers);
+	assert_string_equal("hello", message_table_subject(table, 0));
+	assert_string_equal("Foo <foo@example.org>", message_table_sender(table, 0));
+	assert_string_equal("", message_table_subject(table, 1));
+
+	// Rewriting a row repeatedly must not grow the pool without bound
+	for (int i = 0; i < 1000; ++i) {
+		message_table_update(table, 1, 2, 0, NULL, headers);
+	}
+	assert_true(table->strings.size < 4096);
+	assert_string_equal("hello", message_table_subject(table, 0));
+	assert_string_equal("hello", message_table_subject(table, 1));
+
+	struct message_table *copy = message_table_dup(table);
+	message_table_unref(table);
+	free_headers(headers);
+	assert_int_equal(2, copy->length);
+	assert_string_equal("Foo <foo@example.org>", message_table_sender(copy, 1));
+	message_table_unref(copy);
+}
+
+static void test_message_table_cow(void **state) {
+	struct message_table *table = message_table_create();
+	message_table_resize(table, 2);
+	message_table_update(table, 0, 1, 0, NULL, NULL);
+
+	// Not shared, so no copy is made
+	struct message_table *writer = table;
+	message_table_cow(&writer);
+	assert_ptr_equal(table, writer);
+
+	struct message_table *snapshot = message_table_ref(writer);
+	message_table_cow(&writer);
+	assert_ptr_not_equal(snapshot, writer);
+	message_table_update(writer, 0, 1, FLAG_SEEN, NULL, NULL);
+	assert_int_equal(1, message_table_unread(snapshot));
+	assert_int_equal(0, message_table_unread(writer));
+
+	message_table_unref(snapshot);
+	message_table_unref(writer);
+}
+
+int run_tests_message_table() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_message_table_unread),
+		cmocka_unit_test(test_message_table_strings),
+		cmocka_unit_test(test_message_table_cow),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,148 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tests.h"
+#include "email/headers.h"
+#include "message_view.h"
+#include "worker.h"
+
+static void add_message(list_t *messages, const char *headers,
+		time_t date, long size) {
+	struct aerc_message *msg = aerc_message_new();
+	msg->index = messages->length;
+	msg->fetched = headers != NULL;
+	if (headers) {
+		msg->headers = parse_headers(headers);
+		msg->internal_date = malloc(sizeof(struct tm));
+		gmtime_r(&date, msg->internal_date);
+		msg->size = size;
+	}
+	list_add(messages, msg);
+}
+
+static void free_messages(list_t *messages) {
+	for (size_t i = 0; i < messages->length; ++i) {
+		aerc_message_unref(messages->items[i]);
+	}
+	list_free(messages);
+}
+
+static void assert_rows(struct message_view *view, size_t length,
+		const int *expected, const int *depths) {
+	for (size_t row = 0; row < length; ++row) {
+		assert_int_equal(expected[row], message_view_index(view, length, row));
+		if (depths) {
+			assert_int_equal(depths[row], message_view_depth(view, row));
+		}
+		assert_int_equal(row, message_view_row(view, length, expected[row]));
+	}
+	assert_int_equal(-1, message_view_index(view, length, length));
+}
+
+static void test_message_view_identity(void **state) {
+	const int expected[] = { 2, 1, 0 };
+	assert_rows(NULL, 3, expected, NULL);
+}
+
+static void test_message_view_sort(void **state) {
+	list_t *messages = create_list();
+	add_message(messages, "Subject: b\r\n\r\n", 100, 30);
+	add_message(messages, "Subject: c\r\n\r\n", 200, 10);
+	add_message(messages, NULL, 0, 0);
+	struct message_view *view = message_view_create(SORT_SIZE,
+			THREAD_NONE, false);
+	message_view_build(view, messages);
+	// Unfetched messages are kept on top until they are fetched
+	const int expected[] = { 2, 0, 1 };
+	assert_rows(view, 3, expected, NULL);
+
+	struct aerc_message *msg = messages->items[2];
+	msg->headers = parse_headers("Subject: a\r\n\r\n");
+	msg->fetched = true;
+	msg->size = 20;
+	message_view_update(view, messages, 2);
+	const int fetched[] = { 0, 2, 1 };
+	assert_rows(view, 3, fetched, NULL);
+
+	add_message(messages, "Subject: d\r\n\r\n", 300, 40);
+	message_view_refresh(view, NULL, messages);
+	const int added[] = { 3, 0, 2, 1 };
+	assert_rows(view, 4, added, NULL);
+
+	message_view_remove(view, 0);
+	aerc_message_unref(messages->items[0]);
+	list_del(messages, 0);
+	const int removed[] = { 2, 1, 0 };
+	assert_rows(view, 3, removed, NULL);
+
+	view->sort = SORT_SUBJECT;
+	view->reverse = true;
+	message_view_build(view, messages);
+	const int subject[] = { 2, 0, 1 };
+	assert_rows(view, 3, subject, NULL);
+
+	message_view_free(view);
+	free_messages(messages);
+}
+
+static void test_message_view_thread(void **state) {
+	list_t *messages = create_list();
+	// 2 places 0 under <z@x>, which we never see
+	add_message(messages, "Message-ID: <a@x>\r\n\r\n", 100, 0);
+	add_message(messages, "Message-ID: <b@x>\r\n\r\n", 200, 0);
+	add_message(messages, "Message-ID: <c@x>\r\n"
+			"References: <z@x> <a@x>\r\n\r\n", 300, 0);
+	add_message(messages, "Message-ID: <d@x>\r\n"
+			"In-Reply-To: <b@x>\r\n\r\n", 400, 0);
+	struct message_view *view = message_view_create(SORT_NONE,
+			THREAD_REFERENCES, false);
+	message_view_build(view, messages);
+	const int expected[] = { 1, 3, 0, 2 };
+	const int depths[] = { 0, 1, 0, 1 };
+	assert_rows(view, 4, expected, depths);
+
+	add_message(messages, "Message-ID: <e@x>\r\n"
+			"References: <a@x> <c@x>\r\n\r\n", 500, 0);
+	message_view_refresh(view, NULL, messages);
+	const int added[] = { 1, 3, 0, 2, 4 };
+	const int added_depths[] = { 0, 1, 0, 1, 2 };
+	assert_rows(view, 5, added, added_depths);
+
+	// Expunging the root promotes its reply, moving the thread up
+	message_view_remove(view, 0);
+	aerc_message_unref(messages->items[0]);
+	list_del(messages, 0);
+	const int removed[] = { 1, 3, 0, 2 };
+	const int removed_depths[] = { 0, 1, 0, 1 };
+	assert_rows(view, 4, removed, removed_depths);
+
+	message_view_free(view);
+	free_messages(messages);
+}
+
+static void test_message_view_subject(void **state) {
+	list_t *messages = create_list();
+	add_message(messages, "Subject: hello\r\n\r\n", 100, 0);
+	add_message(messages, "Subject: other\r\n\r\n", 200, 0);
+	add_message(messages, "Subject: Re: Hello\r\n\r\n", 300, 0);
+	struct message_view *view = message_view_create(SORT_NONE,
+			THREAD_ORDEREDSUBJECT, false);
+	message_view_build(view, messages);
+	const int expected[] = { 1, 0, 2 };
+	const int depths[] = { 0, 0, 1 };
+	assert_rows(view, 3, expected, depths);
+	message_view_free(view);
+	free_messages(messages);
+}
+
+int run_tests_message_view() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_message_view_identity),
+		cmocka_unit_test(test_message_view_sort),
+		cmocka_unit_test(test_message_view_thread),
+		cmocka_unit_test(test_message_view_subject),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
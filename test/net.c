@@ -0,0 +1,137 @@
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "tests.h"
+#include "net.h"
+
+/*
+ * Opens a socket on the loopback address of family and fills in addr with
+ * where it is. It only accepts connections if listening.
+ */
+static int loopback(int family, bool listening, struct net_address *addr) {
+	int fd = socket(family, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	memset(addr, 0, sizeof(struct net_address));
+	if (family == AF_INET6) {
+		struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&addr->addr;
+		in6->sin6_family = AF_INET6;
+		in6->sin6_addr = in6addr_loopback;
+		addr->length = sizeof(struct sockaddr_in6);
+	} else {
+		struct sockaddr_in *in = (struct sockaddr_in *)&addr->addr;
+		in->sin_family = AF_INET;
+		in->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		addr->length = sizeof(struct sockaddr_in);
+	}
+	if (bind(fd, (struct sockaddr *)&addr->addr, addr->length) != 0
+			|| getsockname(fd, (struct sockaddr *)&addr->addr,
+				&addr->length) != 0
+			|| (listening && listen(fd, 4) != 0)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int setup(void **state) {
+	real_poll = true;
+	return 0;
+}
+
+static int teardown(void **state) {
+	real_poll = false;
+	return 0;
+}
+
+static void test_falls_back_to_ipv4(void **state) {
+	struct net_address addrs[2];
+	int refused = loopback(AF_INET6, false, &addrs[0]);
+	if (refused < 0) {
+		// No IPv6 here, but it's the same without it
+		refused = loopback(AF_INET, false, &addrs[0]);
+	}
+	assert_true(refused >= 0);
+	int server = loopback(AF_INET, true, &addrs[1]);
+	assert_true(server >= 0);
+
+	int fd = net_connect_any(addrs, 2, 5000);
+	assert_true(fd >= 0);
+	int client = accept(server, NULL, NULL);
+	assert_true(client >= 0);
+
+	close(client);
+	close(fd);
+	close(server);
+	close(refused);
+}
+
+static void test_first_to_answer(void **state) {
+	struct net_address addrs[2];
+	int server6 = loopback(AF_INET6, true, &addrs[0]);
+	if (server6 < 0) {
+		return; // No IPv6 here
+	}
+	int server4 = loopback(AF_INET, true, &addrs[1]);
+	assert_true(server4 >= 0);
+
+	int fd = net_connect_any(addrs, 2, 5000);
+	assert_true(fd >= 0);
+	// It answered before the attempt delay, so IPv4 was never tried
+	struct sockaddr_storage peer;
+	socklen_t length = sizeof(peer);
+	assert_int_equal(getpeername(fd, (struct sockaddr *)&peer, &length), 0);
+	assert_int_equal(peer.ss_family, AF_INET6);
+
+	close(fd);
+	close(server4);
+	close(server6);
+}
+
+static void test_all_refused(void **state) {
+	struct net_address addrs[2];
+	int a = loopback(AF_INET, false, &addrs[0]);
+	int b = loopback(AF_INET, false, &addrs[1]);
+	assert_true(a >= 0 && b >= 0);
+
+	assert_int_equal(net_connect_any(addrs, 2, 5000), -1);
+	assert_int_equal(errno, ECONNREFUSED);
+
+	close(a);
+	close(b);
+}
+
+static void test_resolve_cached(void **state) {
+	size_t count;
+	const char *error = NULL;
+	struct net_address *addrs = net_resolve("127.0.0.1", "143", &count, &error);
+	assert_non_null(addrs);
+	assert_int_equal(count, 1);
+	assert_int_equal(addrs[0].addr.ss_family, AF_INET);
+	free(addrs);
+
+	addrs = net_resolve("127.0.0.1", "143", &count, &error);
+	assert_non_null(addrs);
+	assert_int_equal(count, 1);
+	free(addrs);
+	net_forget("127.0.0.1", "143");
+}
+
+int run_tests_net() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_falls_back_to_ipv4,
+				setup, teardown),
+		cmocka_unit_test_setup_teardown(test_first_to_answer,
+				setup, teardown),
+		cmocka_unit_test_setup_teardown(test_all_refused,
+				setup, teardown),
+		cmocka_unit_test(test_resolve_cached),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,123 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tests.h"
+#include "op_journal.h"
+
+static uint64_t append_move(struct op_journal *journal, uint32_t min,
+		uint32_t max) {
+	struct op op = {
+		.type = OP_MOVE,
+		.mailbox = "INBOX",
+		.uidvalidity = 42,
+		.uids = uid_set_create(),
+		.destination = "Archive",
+	};
+	uid_set_add_range(op.uids, min, max);
+	uint64_t id = op_journal_append(journal, &op);
+	uid_set_free(op.uids);
+	return id;
+}
+
+static void test_op_journal_reopen(void **state) {
+	char path[] = "/tmp/aerc-journal-XXXXXX";
+	int fd = mkstemp(path);
+	assert_true(fd >= 0);
+	close(fd);
+	struct op_journal *journal = op_journal_open(path);
+	uint64_t first = append_move(journal, 4, 19);
+	struct op flags = {
+		.type = OP_STORE_FLAGS,
+		.mailbox = "INBOX",
+		.uidvalidity = 42,
+		.uids = uid_set_create(),
+		.flags = 2,
+		.add = true,
+	};
+	uid_set_add(flags.uids, 21);
+	uint64_t second = op_journal_append(journal, &flags);
+	uid_set_free(flags.uids);
+	struct op create = { .type = OP_CREATE_MAILBOX, .mailbox = "Lists" };
+	uint64_t third = op_journal_append(journal, &create);
+	assert_true(first && second > first && third > second);
+	op_journal_done(journal, first);
+	op_journal_close(journal);
+
+	// A record cut short is dropped
+	fd = open(path, O_WRONLY | O_APPEND);
+	assert_int_equal(write(fd, "\x01\x00\x05", 3), 3);
+	close(fd);
+
+	journal = op_journal_open(path);
+	const list_t *pending = op_journal_pending(journal);
+	assert_int_equal(pending->length, 2);
+	const struct op *op = pending->items[0];
+	assert_int_equal(op->id, second);
+	assert_int_equal(op->type, OP_STORE_FLAGS);
+	assert_string_equal(op->mailbox, "INBOX");
+	assert_int_equal(op->uidvalidity, 42);
+	assert_int_equal(op->flags, 2);
+	assert_true(op->add);
+	assert_true(uid_set_contains(op->uids, 21));
+	assert_int_equal(uid_set_count(op->uids), 1);
+	assert_null(op->destination);
+	op = op_journal_get(journal, third);
+	assert_non_null(op);
+	assert_string_equal(op->mailbox, "Lists");
+	assert_null(op->uids);
+	assert_null(op_journal_get(journal, first));
+	// Ids carry on from where they were
+	uint64_t fourth = append_move(journal, 30, 31);
+	assert_true(fourth > third);
+	op_journal_close(journal);
+
+	journal = op_journal_open(path);
+	op = op_journal_get(journal, fourth);
+	assert_non_null(op);
+	assert_string_equal(op->destination, "Archive");
+	assert_int_equal(uid_set_count(op->uids), 2);
+	op_journal_close(journal);
+	unlink(path);
+}
+
+static void test_op_journal_compaction(void **state) {
+	char path[] = "/tmp/aerc-journal-XXXXXX";
+	int fd = mkstemp(path);
+	assert_true(fd >= 0);
+	close(fd);
+	struct op_journal *journal = op_journal_open(path);
+	uint64_t kept = append_move(journal, 1, 1);
+	assert_false(op_journal_maintain(journal));
+	for (uint32_t i = 0; i < 1000; ++i) {
+		op_journal_done(journal, append_move(journal, i + 2, i + 2));
+	}
+	struct stat before, after;
+	assert_int_equal(stat(path, &before), 0);
+	assert_true(op_journal_maintain(journal));
+	assert_false(op_journal_maintain(journal));
+	assert_int_equal(stat(path, &after), 0);
+	assert_true(after.st_size < before.st_size / 100);
+	// It's still appended to after it's been rewritten
+	uint64_t later = append_move(journal, 5000, 5000);
+	op_journal_close(journal);
+
+	journal = op_journal_open(path);
+	const list_t *pending = op_journal_pending(journal);
+	assert_int_equal(pending->length, 2);
+	assert_int_equal(((struct op *)pending->items[0])->id, kept);
+	assert_int_equal(((struct op *)pending->items[1])->id, later);
+	op_journal_close(journal);
+	unlink(path);
+}
+
+int run_tests_op_journal() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_op_journal_reopen),
+		cmocka_unit_test(test_op_journal_compaction),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
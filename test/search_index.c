@@ -0,0 +1,132 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "tests.h"
+#include "search_index.h"
+#include "util/intern.h"
+
+static void test_search_index_memory(void **state) {
+	struct search_index *index = search_index_open(NULL);
+	const char *body = "Hello, World! The quick brown fox.";
+	assert_true(search_index_add(index, "INBOX", 1, 1, 0,
+				"Lunch plans", 11, false));
+	assert_true(search_index_add(index, "INBOX", 1, 1, 1,
+				body, strlen(body), false));
+	assert_true(search_index_add(index, "INBOX", 1, 2, 1, "hello <b>fox</b>",
+				16, true));
+	assert_true(search_index_add(index, "Archive", 1, 7, 0, "hello", 5, false));
+	// Already indexed, INBOX is the same in any case
+	assert_false(search_index_add(index, "inbox", 1, 1, 0, "other", 5, false));
+	// But other mailbox names aren't
+	assert_true(search_index_add(index, "archive", 1, 7, 0, "other", 5, false));
+	// Nor is the same UID under another UIDVALIDITY
+	assert_true(search_index_add(index, "INBOX", 2, 1, 0, "hello", 5, false));
+
+	struct search_hit *hits;
+	assert_int_equal(4, search_index_query(index, "HELLO", &hits));
+	assert_ptr_equal(intern_mailbox("Archive"), hits[0].mailbox);
+	assert_int_equal(7, hits[0].uid);
+	assert_ptr_equal(intern_mailbox("INBOX"), hits[1].mailbox);
+	assert_int_equal(1, hits[1].uidvalidity);
+	assert_int_equal(1, hits[1].uid);
+	assert_int_equal(2, hits[2].uid);
+	assert_int_equal(2, hits[3].uidvalidity);
+	assert_int_equal(1, hits[3].uid);
+	free(hits);
+
+	// Terms may come from different parts of a message
+	assert_int_equal(1, search_index_query(index, "lunch fox", &hits));
+	assert_int_equal(1, hits[0].uid);
+	free(hits);
+
+	// Markup isn't indexed
+	assert_int_equal(0, search_index_query(index, "b", &hits));
+	assert_int_equal(0, search_index_query(index, "hello missing", &hits));
+	assert_null(hits);
+	search_index_close(index);
+}
+
+static void remove_dir(const char *path) {
+	DIR *dir = opendir(path);
+	struct dirent *ent;
+	while ((ent = readdir(dir))) {
+		if (ent->d_name[0] != '.' || strlen(ent->d_name) > 2) {
+			char *file = malloc(strlen(path) + strlen(ent->d_name) + 2);
+			sprintf(file, "%s/%s", path, ent->d_name);
+			unlink(file);
+			free(file);
+		}
+	}
+	closedir(dir);
+	rmdir(path);
+}
+
+static size_t count_segments(const char *path) {
+	DIR *dir = opendir(path);
+	struct dirent *ent;
+	size_t n = 0;
+	while ((ent = readdir(dir))) {
+		n += strstr(ent->d_name, ".seg") != NULL;
+	}
+	closedir(dir);
+	return n;
+}
+
+static void test_search_index_segments(void **state) {
+	char path[] = "/tmp/aerc-search-XXXXXX";
+	assert_non_null(mkdtemp(path));
+	struct search_index *index = search_index_open(path);
+	char text[64];
+	for (uint32_t uid = 1; uid <= 300; ++uid) {
+		snprintf(text, sizeof(text), "common word%u %s", uid,
+				uid % 3 == 0 ? "fizz" : "");
+		search_index_add(index, "INBOX", 1, uid, 1, text, strlen(text), false);
+		if (uid % 100 == 0) {
+			assert_true(search_index_flush(index));
+		}
+	}
+	assert_int_equal(3, count_segments(path));
+	// 100 + 100 merge, then the 200 is too large to merge with the last 100
+	assert_true(search_index_maintain(index));
+	assert_false(search_index_maintain(index));
+	assert_int_equal(2, count_segments(path));
+	search_index_close(index);
+
+	index = search_index_open(path);
+	struct search_hit *hits;
+	assert_int_equal(300, search_index_query(index, "common", &hits));
+	for (uint32_t i = 0; i < 300; ++i) {
+		assert_int_equal(i + 1, hits[i].uid);
+	}
+	free(hits);
+	assert_int_equal(1, search_index_query(index, "word250", &hits));
+	assert_int_equal(250, hits[0].uid);
+	free(hits);
+	assert_int_equal(100, search_index_query(index, "fizz common", &hits));
+	assert_int_equal(3, hits[0].uid);
+	assert_int_equal(300, hits[99].uid);
+	free(hits);
+	assert_false(search_index_add(index, "INBOX", 1, 42, 1, "x", 1, false));
+
+	// Documents added after reopening continue where we left off
+	search_index_add(index, "INBOX", 1, 301, 1, "fizz", 4, false);
+	assert_true(search_index_flush(index));
+	assert_false(search_index_maintain(index));
+	assert_int_equal(3, count_segments(path));
+	assert_int_equal(101, search_index_query(index, "fizz", &hits));
+	assert_int_equal(301, hits[100].uid);
+	free(hits);
+	search_index_close(index);
+	remove_dir(path);
+}
+
+int run_tests_search_index() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_search_index_memory),
+		cmocka_unit_test(test_search_index_segments),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
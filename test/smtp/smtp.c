@@ -0,0 +1,388 @@
+#define _POSIX_C_SOURCE 200809L
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "tests.h"
+#include "smtp/smtp.h"
+#include "util/list.h"
+#include "util/stringop.h"
+
+void __real_absocket_free(absocket_t *socket);
+
+/* Just enough of an SMTP server, on 127.0.0.1, run a step at a time */
+struct server {
+	int listen, fd;
+	bool pipelining, chunking;
+	bool starttls; // Offered, and answered with more than it should be
+	bool pipelined; // The client sent more than it was allowed to
+	int connections;
+	char buf[256 * 1024];
+	size_t len;
+	size_t chunk; // Of BDAT still to come
+	bool last, data;
+	size_t received; // Of the message
+	char body[1024]; // The start of it
+	char mail[256];
+	int recipients;
+};
+
+static struct server *server_new(bool pipelining, bool chunking, char *port) {
+	struct server *s = calloc(1, sizeof(struct server));
+	s->fd = -1;
+	s->pipelining = pipelining;
+	s->chunking = chunking;
+	s->listen = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t length = sizeof(addr);
+	assert_int_equal(bind(s->listen, (struct sockaddr *)&addr, length), 0);
+	assert_int_equal(getsockname(s->listen,
+				(struct sockaddr *)&addr, &length), 0);
+	assert_int_equal(listen(s->listen, 4), 0);
+	fcntl(s->listen, F_SETFL, O_NONBLOCK);
+	snprintf(port, 8, "%d", ntohs(addr.sin_port));
+	return s;
+}
+
+static void server_free(struct server *s) {
+	if (s->fd >= 0) {
+		close(s->fd);
+	}
+	close(s->listen);
+	free(s);
+}
+
+static void reply(struct server *s, const char *text) {
+	assert_int_equal(send(s->fd, text, strlen(text), 0), strlen(text));
+}
+
+static void keep(struct server *s, const char *data, size_t len) {
+	if (s->received < sizeof(s->body) - 1) {
+		size_t room = sizeof(s->body) - 1 - s->received;
+		memcpy(s->body + s->received, data, len < room ? len : room);
+	}
+	s->received += len;
+}
+
+static void command(struct server *s, const char *line) {
+	if (strncmp(line, "EHLO ", 5) == 0) {
+		reply(s, "250-localhost\r\n");
+		if (s->pipelining) {
+			reply(s, "250-PIPELINING\r\n");
+		}
+		if (s->chunking) {
+			reply(s, "250-CHUNKING\r\n");
+		}
+		if (s->starttls) {
+			reply(s, "250-STARTTLS\r\n");
+		}
+		reply(s, "250-8BITMIME\r\n250 SIZE 104857600\r\n");
+	} else if (strncmp(line, "MAIL FROM:", 10) == 0) {
+		snprintf(s->mail, sizeof(s->mail), "%s", line);
+		s->recipients = 0;
+		s->received = 0;
+		memset(s->body, 0, sizeof(s->body));
+		reply(s, "250 2.1.0 OK\r\n");
+	} else if (strncmp(line, "RCPT TO:<nobody", 15) == 0) {
+		reply(s, "550 5.1.1 No such user\r\n");
+	} else if (strncmp(line, "RCPT TO:", 8) == 0) {
+		++s->recipients;
+		reply(s, "250 2.1.5 OK\r\n");
+	} else if (strcmp(line, "DATA") == 0) {
+		s->data = true;
+		reply(s, "354 Go ahead\r\n");
+	} else if (strncmp(line, "BDAT ", 5) == 0) {
+		s->chunk = strtoul(line + 5, NULL, 10);
+		s->last = strstr(line, " LAST") != NULL;
+		if (!s->chunk) {
+			reply(s, s->last ? "250 2.0.0 Queued\r\n" : "250 2.0.0 OK\r\n");
+		}
+	} else if (strcmp(line, "RSET") == 0) {
+		reply(s, "250 2.0.0 OK\r\n");
+	} else if (strcmp(line, "STARTTLS") == 0) {
+		// In the same packet, as a man in the middle would have it
+		reply(s, "220 2.0.0 Ready\r\n250-localhost\r\n250 AUTH PLAIN\r\n");
+	} else if (strcmp(line, "QUIT") == 0) {
+		reply(s, "221 2.0.0 Bye\r\n");
+	} else {
+		reply(s, "500 5.5.2 What?\r\n");
+	}
+}
+
+static void serve(struct server *s) {
+	if (s->fd < 0) {
+		s->fd = accept(s->listen, NULL, NULL);
+		if (s->fd < 0) {
+			return;
+		}
+		++s->connections;
+		reply(s, "220 localhost ESMTP\r\n");
+	}
+	ssize_t amt = recv(s->fd, s->buf + s->len, sizeof(s->buf) - s->len,
+			MSG_DONTWAIT);
+	if (amt > 0) {
+		s->len += amt;
+	}
+	size_t pos = 0;
+	while (pos < s->len) {
+		if (s->chunk) {
+			size_t take = s->len - pos < s->chunk ? s->len - pos : s->chunk;
+			keep(s, s->buf + pos, take);
+			pos += take;
+			s->chunk -= take;
+			if (!s->chunk) {
+				reply(s, s->last ? "250 2.0.0 Queued\r\n" : "250 2.0.0 OK\r\n");
+			}
+			continue;
+		}
+		char *line = s->buf + pos;
+		char *nl = memchr(line, '\n', s->len - pos);
+		if (!nl) {
+			break;
+		}
+		pos = nl + 1 - s->buf;
+		*nl = '\0';
+		if (nl > line && nl[-1] == '\r') {
+			nl[-1] = '\0';
+		}
+		if (s->data) {
+			if (strcmp(line, ".") == 0) {
+				s->data = false;
+				reply(s, "250 2.0.0 Queued\r\n");
+			} else {
+				keep(s, line, strlen(line));
+				keep(s, "\r\n", 2);
+			}
+			continue;
+		}
+		command(s, line);
+		if (!s->pipelining && pos < s->len) {
+			s->pipelined = true;
+		}
+	}
+	memmove(s->buf, s->buf + pos, s->len - pos);
+	s->len -= pos;
+}
+
+static int sent_count;
+static bool sent_ok;
+static char *sent_reply;
+
+static void handle_sent(struct smtp_connection *smtp, struct smtp_message *msg,
+		bool ok, const char *reply) {
+	++sent_count;
+	sent_ok = ok;
+	free(sent_reply);
+	sent_reply = reply ? strdup(reply) : NULL;
+	smtp_message_free(msg);
+}
+
+/* The server has no TLS, so only smtp+insecure:// gets anywhere */
+static struct smtp_connection *connect_to(const char *port,
+		enum smtp_security security) {
+	struct uri *uri = calloc(1, sizeof(struct uri));
+	uri->scheme = strdup(security == SMTP_INSECURE ? "smtp+insecure" : "smtp");
+	uri->hostname = strdup("127.0.0.1");
+	uri->port = strdup(port);
+	return smtp_new(uri, security, handle_sent, NULL);
+}
+
+static char *write_message(const char *text) {
+	char *path = strdup("/tmp/aerc-smtp-XXXXXX");
+	int fd = mkstemp(path);
+	assert_true(fd >= 0);
+	assert_int_equal(write(fd, text, strlen(text)), strlen(text));
+	close(fd);
+	return path;
+}
+
+static struct smtp_message *open_message(const char *path, const char *to) {
+	list_t *recipients = create_list();
+	list_add(recipients, strdup(to));
+	struct smtp_message *msg = smtp_message_open(path,
+			"me@example.org", recipients);
+	free_flat_list(recipients);
+	assert_non_null(msg);
+	return msg;
+}
+
+/* Runs both ends until the message is done with, and returns the most queued */
+static size_t send_and_wait(struct smtp_connection *smtp, struct server *s,
+		struct smtp_message *msg) {
+	int count = sent_count;
+	size_t most = 0;
+	smtp_submit(smtp, msg);
+	for (int i = 0; sent_count == count && i < 1000000; ++i) {
+		smtp_receive(smtp);
+		serve(s);
+		if (smtp->socket && smtp->socket->out_size > most) {
+			most = smtp->socket->out_size;
+		}
+	}
+	assert_int_equal(sent_count, count + 1);
+	return most;
+}
+
+static void close_smtp(struct smtp_connection *smtp) {
+	absocket_t *socket = smtp->socket;
+	smtp_free(smtp);
+	if (socket) {
+		__real_absocket_free(socket);
+	}
+}
+
+static int setup(void **state) {
+	real_poll = true;
+	sent_count = 0;
+	return 0;
+}
+
+static int teardown(void **state) {
+	real_poll = false;
+	free(sent_reply);
+	sent_reply = NULL;
+	return 0;
+}
+
+static void test_send_big_chunked(void **state) {
+	char port[8];
+	struct server *s = server_new(true, true, port);
+	struct smtp_connection *smtp = connect_to(port, SMTP_INSECURE);
+
+	// 20 MiB, with bare LFs that go out as CRLF and a little 8-bit text
+	char *path = strdup("/tmp/aerc-smtp-XXXXXX");
+	FILE *f = fdopen(mkstemp(path), "w");
+	assert_non_null(f);
+	const char *header = "Subject: Big\n\n";
+	fputs(header, f);
+	char line[80];
+	memset(line, 'x', sizeof(line));
+	line[0] = (char)0xe9;
+	line[sizeof(line) - 1] = '\n';
+	size_t lines = 20 * 1024 * 1024 / sizeof(line);
+	for (size_t i = 0; i < lines; ++i) {
+		assert_int_equal(fwrite(line, 1, sizeof(line), f), sizeof(line));
+	}
+	fclose(f);
+
+	struct smtp_message *msg = open_message(path, "you@example.org");
+	long size = msg->size;
+	assert_int_equal(size, strlen(header) + 2 + lines * (sizeof(line) + 1));
+	assert_true(msg->eightbit);
+
+	size_t most = send_and_wait(smtp, s, msg);
+	assert_true(sent_ok);
+	assert_string_equal(sent_reply, "2.0.0 Queued");
+	assert_int_equal(s->received, size);
+	assert_memory_equal(s->body, "Subject: Big\r\n\r\n", 16);
+	char mail[64];
+	snprintf(mail, sizeof(mail),
+			"MAIL FROM:<me@example.org> BODY=8BITMIME SIZE=%ld", size);
+	assert_string_equal(s->mail, mail);
+	// Never more than a few chunks of it in memory at once
+	assert_true(most <= 512 * 1024);
+
+	// The next goes out on the same connection
+	char *small = write_message("Subject: Small\n\nHi\n");
+	msg = open_message(small, "you@example.org");
+	send_and_wait(smtp, s, msg);
+	assert_true(sent_ok);
+	assert_int_equal(s->received, 22);
+	assert_int_equal(s->connections, 1);
+
+	close_smtp(smtp);
+	server_free(s);
+	unlink(small);
+	free(small);
+	unlink(path);
+	free(path);
+}
+
+static void test_send_data_one_at_a_time(void **state) {
+	char port[8];
+	struct server *s = server_new(false, false, port);
+	struct smtp_connection *smtp = connect_to(port, SMTP_INSECURE);
+	char *path = write_message("Subject: Dots\n\n.\n.. two\nend");
+
+	// Turned down before any of it's sent
+	struct smtp_message *msg = open_message(path, "nobody@example.org");
+	send_and_wait(smtp, s, msg);
+	assert_false(sent_ok);
+	assert_non_null(strstr(sent_reply, "nobody@example.org"));
+	assert_int_equal(s->received, 0);
+
+	msg = open_message(path, "you@example.org");
+	send_and_wait(smtp, s, msg);
+	assert_true(sent_ok);
+	// Lines starting with a dot get another, and the last gets its CRLF
+	assert_string_equal(s->body, "Subject: Dots\r\n\r\n..\r\n... two\r\nend\r\n");
+	assert_string_equal(s->mail, "MAIL FROM:<me@example.org> SIZE=33");
+	assert_false(s->pipelined);
+	assert_int_equal(s->connections, 1);
+
+	close_smtp(smtp);
+	server_free(s);
+	unlink(path);
+	free(path);
+}
+
+static void test_starttls_injection(void **state) {
+	char port[8];
+	struct server *s = server_new(false, false, port);
+	s->starttls = true;
+	struct smtp_connection *smtp = connect_to(port, SMTP_STARTTLS);
+	char *path = write_message("Subject: Hi\n\nHi\n");
+
+	// Whatever came with the 220 would be taken as said over TLS
+	struct smtp_message *msg = open_message(path, "you@example.org");
+	send_and_wait(smtp, s, msg);
+	assert_false(sent_ok);
+	assert_non_null(strstr(sent_reply, "before the TLS handshake"));
+	assert_null(smtp->socket);
+	assert_int_equal(s->received, 0);
+
+	close_smtp(smtp);
+	server_free(s);
+	unlink(path);
+	free(path);
+}
+
+static void test_starttls_required(void **state) {
+	char port[8];
+	struct server *s = server_new(true, false, port);
+	struct smtp_connection *smtp = connect_to(port, SMTP_STARTTLS);
+	char *path = write_message("Subject: Hi\n\nHi\n");
+
+	// Not in plaintext unless asked to
+	struct smtp_message *msg = open_message(path, "you@example.org");
+	send_and_wait(smtp, s, msg);
+	assert_false(sent_ok);
+	assert_non_null(strstr(sent_reply, "does not offer STARTTLS"));
+	assert_string_equal(s->mail, "");
+	assert_null(smtp->socket);
+
+	close_smtp(smtp);
+	server_free(s);
+	unlink(path);
+	free(path);
+}
+
+int run_tests_smtp() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(test_send_big_chunked, setup, teardown),
+		cmocka_unit_test_setup_teardown(test_send_data_one_at_a_time,
+				setup, teardown),
+		cmocka_unit_test_setup_teardown(test_starttls_injection,
+				setup, teardown),
+		cmocka_unit_test_setup_teardown(test_starttls_required,
+				setup, teardown),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
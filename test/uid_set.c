@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "util/uid_set.h"
+
+static void assert_format(struct uid_set *set, const char *expected) {
+	char *str = uid_set_format(set, 0, set->length);
+	assert_string_equal(str, expected);
+	free(str);
+}
+
+static void test_uid_set_add(void **state) {
+	struct uid_set *set = uid_set_create();
+	for (uint32_t uid = 1; uid <= 5; ++uid) {
+		uid_set_add(set, uid);
+	}
+	uid_set_add(set, 10);
+	uid_set_add(set, 8);
+	uid_set_add(set, 12);
+	assert_format(set, "1:5,8,10,12");
+	uid_set_add(set, 11);
+	uid_set_add(set, 9);
+	assert_format(set, "1:5,8:12");
+	uid_set_add_range(set, 7, 3);
+	assert_format(set, "1:12");
+	assert_int_equal(uid_set_count(set), 12);
+	assert_true(uid_set_contains(set, 1));
+	assert_true(uid_set_contains(set, 12));
+	assert_false(uid_set_contains(set, 13));
+	assert_false(uid_set_contains(set, 0));
+	uid_set_free(set);
+}
+
+static void test_uid_set_parse(void **state) {
+	struct uid_set *set = uid_set_create();
+	assert_true(uid_set_parse(set, "4:19,21,30:25"));
+	assert_format(set, "4:19,21,25:30");
+	assert_int_equal(uid_set_count(set), 23);
+	assert_false(uid_set_contains(set, 20));
+	assert_true(uid_set_contains(set, 21));
+	assert_true(uid_set_contains(set, 27));
+
+	char *part = uid_set_format(set, 1, 2);
+	assert_string_equal(part, "21,25:30");
+	free(part);
+
+	assert_false(uid_set_parse(set, "1:*"));
+	assert_false(uid_set_parse(set, "1,,2"));
+	assert_false(uid_set_parse(set, "0"));
+	assert_false(uid_set_parse(set, ""));
+	uid_set_free(set);
+}
+
+static void test_uid_set_remove(void **state) {
+	struct uid_set *set = uid_set_create();
+	uid_set_add_range(set, 1, 10);
+	uid_set_add(set, 20);
+	uid_set_remove(set, 5);
+	assert_format(set, "1:4,6:10,20");
+	uid_set_remove(set, 1);
+	uid_set_remove(set, 10);
+	uid_set_remove(set, 20);
+	uid_set_remove(set, 15);
+	assert_format(set, "2:4,6:9");
+	assert_int_equal(uid_set_count(set), 7);
+	uid_set_free(set);
+}
+
+int run_tests_uid_set() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_uid_set_add),
+		cmocka_unit_test(test_uid_set_parse),
+		cmocka_unit_test(test_uid_set_remove),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,121 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdlib.h>
+#include <string.h>
+#include "tests.h"
+#include "worker.h"
+
+static enum worker_message_type next_type(struct worker_scheduler *sched,
+		enum worker_priority lowest) {
+	struct worker_message *message;
+	assert_true(worker_scheduler_next(sched, lowest, &message));
+	enum worker_message_type type = message->type;
+	free(message->data);
+	worker_message_free(message);
+	return type;
+}
+
+static void test_worker_scheduler_priority(void **state) {
+	struct worker_pipe *pipe = worker_pipe_new();
+	struct worker_scheduler *sched = worker_scheduler_new();
+	worker_post_action(pipe, WORKER_FETCH_MESSAGES, NULL,
+			calloc(1, sizeof(struct message_range)));
+	worker_post_action(pipe, WORKER_PREFETCH, NULL, NULL);
+	worker_post_action(pipe, WORKER_FETCH_MESSAGE_PART, NULL, NULL);
+	worker_post_action_priority(pipe, WORKER_SEARCH, NULL, NULL,
+			PRIORITY_BACKGROUND);
+	worker_post_action(pipe, WORKER_SORT, NULL, NULL);
+	struct worker_message *message;
+	while (worker_get_action(pipe, &message)) {
+		worker_scheduler_add(sched, message);
+	}
+	assert_int_equal(worker_scheduler_pending(sched, PRIORITY_INTERACTIVE), 2);
+	assert_int_equal(worker_scheduler_pending(sched, PRIORITY_BACKGROUND), 2);
+	// Interactive first, in the order they were posted
+	assert_int_equal(next_type(sched, PRIORITY_INTERACTIVE),
+			WORKER_FETCH_MESSAGE_PART);
+	assert_int_equal(next_type(sched, PRIORITY_INTERACTIVE), WORKER_SORT);
+	assert_false(worker_scheduler_next(sched, PRIORITY_INTERACTIVE, &message));
+	assert_int_equal(next_type(sched, PRIORITY_BACKGROUND), WORKER_PREFETCH);
+	assert_true(worker_scheduler_next(sched, PRIORITY_BACKGROUND, &message));
+	assert_int_equal(message->type, WORKER_FETCH_MESSAGES);
+	// Split, with the rest put back ahead of what came after it
+	worker_scheduler_requeue(sched, message);
+	assert_int_equal(next_type(sched, PRIORITY_BACKGROUND),
+			WORKER_FETCH_MESSAGES);
+	assert_int_equal(next_type(sched, PRIORITY_BACKGROUND), WORKER_SEARCH);
+	worker_scheduler_free(sched, NULL);
+	worker_pipe_free(pipe);
+}
+
+static void test_worker_scheduler_cancel(void **state) {
+	struct worker_pipe *pipe = worker_pipe_new();
+	struct worker_scheduler *sched = worker_scheduler_new();
+	worker_post_action(pipe, WORKER_FETCH_MESSAGES, NULL, malloc(1));
+	worker_post_action(pipe, WORKER_PREFETCH, NULL, malloc(1));
+	assert_int_equal(worker_pipe_advance(pipe), 1);
+	worker_post_action(pipe, WORKER_SELECT_MAILBOX, NULL, malloc(1));
+	worker_post_action(pipe, WORKER_FETCH_MESSAGES, NULL, malloc(1));
+	struct worker_message *message;
+	unsigned long id = 0;
+	while (worker_get_action(pipe, &message)) {
+		assert_true(message->id > id);
+		id = message->id;
+		worker_scheduler_add(sched, message);
+	}
+	// Only what was asked for before the user moved on
+	assert_int_equal(worker_scheduler_cancel(sched,
+				WORKER_FETCH_MESSAGES, 1, free), 1);
+	assert_int_equal(worker_scheduler_cancel(sched,
+				WORKER_FETCH_MESSAGES, 1, free), 0);
+	assert_int_equal(next_type(sched, PRIORITY_BACKGROUND),
+			WORKER_SELECT_MAILBOX);
+	assert_int_equal(next_type(sched, PRIORITY_BACKGROUND), WORKER_PREFETCH);
+	assert_true(worker_scheduler_next(sched, PRIORITY_BACKGROUND, &message));
+	assert_int_equal(message->type, WORKER_FETCH_MESSAGES);
+	assert_int_equal(message->generation, 1);
+	free(message->data);
+	worker_message_free(message);
+	worker_scheduler_free(sched, NULL);
+	worker_pipe_free(pipe);
+}
+
+static size_t freed;
+
+static void free_action(struct worker_message *message) {
+	if (message->type == WORKER_STORE_FLAGS) {
+		store_flags_request_free(message->data);
+	} else {
+		free(message->data);
+	}
+	++freed;
+}
+
+static void test_worker_scheduler_free(void **state) {
+	struct worker_pipe *pipe = worker_pipe_new();
+	struct worker_scheduler *sched = worker_scheduler_new();
+	struct store_flags_request *request =
+		calloc(1, sizeof(struct store_flags_request));
+	request->mailbox = strdup("INBOX");
+	worker_post_action(pipe, WORKER_STORE_FLAGS, NULL, request);
+	worker_post_action(pipe, WORKER_FETCH_MESSAGES, NULL,
+			calloc(1, sizeof(struct message_range)));
+	worker_post_action(pipe, WORKER_SEARCH, NULL, strdup("foo"));
+	struct worker_message *message;
+	while (worker_get_action(pipe, &message)) {
+		worker_scheduler_add(sched, message);
+	}
+	// Everything still queued goes, data and all
+	freed = 0;
+	worker_scheduler_free(sched, free_action);
+	assert_int_equal(freed, 3);
+	worker_pipe_free(pipe);
+}
+
+int run_tests_worker() {
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test(test_worker_scheduler_priority),
+		cmocka_unit_test(test_worker_scheduler_cancel),
+		cmocka_unit_test(test_worker_scheduler_free),
+	};
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
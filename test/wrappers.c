@@ -8,7 +8,13 @@ void *__wrap_hashtable_get(hashtable_t *table, const void *key) {
 	return mock_type(void *);
 }
 
+bool real_poll;
+int __real_poll(struct pollfd fds[], nfds_t nfds, int timeout);
+
 int __wrap_poll(struct pollfd fds[], nfds_t nfds, int timeout) {
+	if (real_poll) {
+		return __real_poll(fds, nfds, timeout);
+	}
 	return mock_type(int);
 }
 
@@ -20,7 +26,12 @@ void set_ab_recv_result(void *buffer, size_t size) {
 	ab_buffer_size = size;
 }
 
+ssize_t __real_ab_recv(absocket_t *socket, void *buffer, size_t len);
+
 int __wrap_ab_recv(absocket_t *socket, void *buffer, size_t len) {
+	if (real_poll) {
+		return __real_ab_recv(socket, buffer, len);
+	}
 	assert_true(ab_buffer_size <= len);
 	if (ab_buffer) {
 		memcpy(buffer, ab_buffer, ab_buffer_size);